@@ -0,0 +1,48 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/**
+ * bench.h - utilidades comunes de los microbenchmarks de bench/
+ *
+ * Cada benchmark reporta una línea por caso con el formato
+ *
+ *     <nombre>\t<operaciones>\t<ns por operación>
+ *
+ * (con una cuarta columna opcional, ver `bench_report_value') para que la
+ * salida sea fácil de procesar.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+static inline uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline void
+bench_report(const char* name, const uint64_t ops, const uint64_t elapsed_ns)
+{
+	printf("%s\t%llu\t%.1f\n", name, (unsigned long long)ops, ops == 0 ? 0.0 : (double)elapsed_ns / (double)ops);
+	fflush(stdout);
+}
+
+/** como `bench_report', con un valor más propio del caso (p. ej. un porcentaje) */
+static inline void
+bench_report_value(const char* name, const uint64_t ops, const uint64_t elapsed_ns, const double value)
+{
+	printf("%s\t%llu\t%.1f\t%.2f\n",
+	       name,
+	       (unsigned long long)ops,
+	       ops == 0 ? 0.0 : (double)elapsed_ns / (double)ops,
+	       value);
+	fflush(stdout);
+}
+
+/** evita que el compilador descarte un resultado */
+static volatile uint64_t bench_sink;
+
+#endif
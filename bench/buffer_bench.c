@@ -0,0 +1,92 @@
+/**
+ * buffer_bench.c - compactación del buffer de lectura
+ *
+ * Simula un par que manda comandos en pipeline: cada "recv" agrega CHUNK
+ * bytes de líneas terminadas en CRLF y el consumidor procesa a lo sumo CHUNK
+ * bytes de líneas completas, así que en el buffer queda siempre un atraso de
+ * BACKLOG bytes más una línea a medias. Con el buffer lineal hay que
+ * compactar antes de cada lectura (como `read_replies' en relay.c), lo que
+ * mueve el atraso con memmove; con el buffer circular no se copia nada.
+ */
+#define _GNU_SOURCE
+#include "bench.h"
+#include "buffer.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SIZE    4096
+#define CHUNK   1460
+#define BACKLOG 2048
+#define ROUNDS  2000000
+
+static uint8_t input[2 * CHUNK];
+
+/** consume líneas completas por hasta `max' bytes; retorna cuántas */
+static unsigned
+consume(buffer* b, const size_t max)
+{
+	unsigned lines = 0;
+	size_t n;
+	uint8_t* ptr = buffer_read_ptr(b, &n);
+	const uint8_t* end = ptr + n;
+	for (uint8_t* p = ptr; p < end && (size_t)(p - ptr) < max;) {
+		uint8_t* nl = memchr(p, '\n', end - p);
+		if (nl == NULL) {
+			break;
+		}
+		lines++;
+		buffer_read_adv(b, nl + 1 - p);
+		p = nl + 1;
+	}
+	return lines;
+}
+
+static void
+run(const char* name, buffer* b, const unsigned rounds)
+{
+	uint64_t lines = 0;
+	size_t offset = 0;
+	const uint64_t start = bench_now();
+	for (unsigned i = 0; i < rounds; i++) {
+		buffer_compact(b);
+		size_t n;
+		uint8_t* ptr = buffer_write_ptr(b, &n);
+		if (n > CHUNK) {
+			n = CHUNK;
+		}
+		memcpy(ptr, input + offset, n);
+		offset = (offset + n) % CHUNK;
+		buffer_write_adv(b, n);
+		buffer_read_ptr(b, &n);
+		lines += consume(b, n > BACKLOG ? n - BACKLOG : 0);
+	}
+	const uint64_t elapsed = bench_now() - start;
+	bench_sink += lines;
+	bench_report(name, rounds, elapsed);
+}
+
+int
+main(void)
+{
+	// líneas de 37 bytes: nunca coinciden con el final de un recv
+	for (size_t i = 0; i < sizeof(input); i++) {
+		input[i] = i % 37 == 35 ? '\r' : i % 37 == 36 ? '\n' : 'a' + i % 26;
+	}
+	const char* env = getenv("BUFFER_BENCH_ROUNDS");
+	const unsigned rounds = env != NULL ? (unsigned)atoi(env) : ROUNDS;
+
+	static uint8_t storage[SIZE];
+	buffer linear;
+	buffer_init(&linear, sizeof(storage), storage);
+	run("buffer_linear_compact", &linear, rounds);
+
+	buffer mirrored;
+	if (!buffer_init_mirrored(&mirrored, SIZE)) {
+		perror("buffer_init_mirrored");
+		return 1;
+	}
+	run("buffer_mirrored", &mirrored, rounds);
+	buffer_free_mirrored(&mirrored);
+	return 0;
+}
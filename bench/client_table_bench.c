@@ -0,0 +1,133 @@
+/**
+ * client_table_bench.c - búsqueda de sesiones de supervisión
+ *
+ * Simula 100k orígenes distintos (como un scanner que cambia de puerto de
+ * origen) y mide el costo de `client_table_get' con la tabla holgada y con la
+ * tabla saturada (desalojando por LRU). Como referencia se mide la lista
+ * enlazada que se usaba antes, con menos orígenes porque es O(n).
+ */
+#include "bench.h"
+#include "client_table.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SOURCES 100000
+
+struct list_node
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	struct list_node* next;
+};
+
+static struct list_node* list = NULL;
+
+static struct list_node*
+list_get(const struct sockaddr_storage* addr, const socklen_t len)
+{
+	for (struct list_node* n = list; n != NULL; n = n->next) {
+		if (n->addr_len == len && memcmp(&n->addr, addr, len) == 0) {
+			return n;
+		}
+	}
+	struct list_node* n = calloc(1, sizeof(*n));
+	memcpy(&n->addr, addr, len);
+	n->addr_len = len;
+	n->next = list;
+	list = n;
+	return n;
+}
+
+static void
+source(struct sockaddr_storage* ss, const unsigned i)
+{
+	struct sockaddr_in6* addr = (struct sockaddr_in6*)ss;
+	memset(ss, 0, sizeof(*ss));
+	addr->sin6_family = AF_INET6;
+	addr->sin6_port = htons(1024 + i % 60000);
+	addr->sin6_addr.s6_addr[10] = 0xff;
+	addr->sin6_addr.s6_addr[11] = 0xff;
+	addr->sin6_addr.s6_addr[12] = 10;
+	addr->sin6_addr.s6_addr[13] = (i / 60000) & 0xff;
+	addr->sin6_addr.s6_addr[15] = 1;
+}
+
+static void
+bench_table(const char* name, const size_t capacity, struct sockaddr_storage* sources, const unsigned* order)
+{
+	struct client_table* t = client_table_new(capacity, 300);
+	if (t == NULL) {
+		abort();
+	}
+
+	// primer pasada: todas las inserciones
+	uint64_t start = bench_now();
+	for (unsigned i = 0; i < SOURCES; i++) {
+		bench_sink += client_table_get(t, &sources[i], sizeof(struct sockaddr_in6), 1)->state;
+	}
+	uint64_t end = bench_now();
+
+	char label[64];
+	snprintf(label, sizeof(label), "%s_insert", name);
+	bench_report(label, SOURCES, end - start);
+
+	// segunda pasada: búsquedas en orden aleatorio
+	start = bench_now();
+	for (unsigned i = 0; i < SOURCES; i++) {
+		bench_sink += client_table_get(t, &sources[order[i]], sizeof(struct sockaddr_in6), 2)->state;
+	}
+	end = bench_now();
+
+	snprintf(label, sizeof(label), "%s_lookup", name);
+	bench_report(label, SOURCES, end - start);
+
+	client_table_destroy(t);
+}
+
+int
+main(void)
+{
+	struct sockaddr_storage* sources = malloc(SOURCES * sizeof(*sources));
+	unsigned* order = malloc(SOURCES * sizeof(*order));
+	if (sources == NULL || order == NULL) {
+		abort();
+	}
+
+	for (unsigned i = 0; i < SOURCES; i++) {
+		source(&sources[i], i);
+		order[i] = i;
+	}
+	srand(42);
+	for (unsigned i = SOURCES - 1; i > 0; i--) {
+		const unsigned j = rand() % (i + 1);
+		const unsigned tmp = order[i];
+		order[i] = order[j];
+		order[j] = tmp;
+	}
+
+	bench_table("client_table_100k", SOURCES, sources, order);
+	bench_table("client_table_1k_cap", 1024, sources, order);
+
+	// la lista enlazada original, con 10k orígenes
+	const unsigned list_sources = SOURCES / 10;
+	uint64_t start = bench_now();
+	for (unsigned i = 0; i < list_sources; i++) {
+		bench_sink += list_get(&sources[i], sizeof(struct sockaddr_in6))->addr_len;
+	}
+	for (unsigned i = 0; i < list_sources; i++) {
+		bench_sink += list_get(&sources[order[i] % list_sources], sizeof(struct sockaddr_in6))->addr_len;
+	}
+	bench_report("linked_list_10k_lookup", 2 * list_sources, bench_now() - start);
+
+	while (list != NULL) {
+		struct list_node* next = list->next;
+		free(list);
+		list = next;
+	}
+	free(sources);
+	free(order);
+	return 0;
+}
@@ -0,0 +1,148 @@
+/**
+ * commit_bench.c - mails durables por segundo
+ *
+ * Simula CLIENTS conexiones que entregan mails sin pausa: cada una escribe un
+ * mail de BODY_SIZE bytes, lo encola en la etapa de commit y, cuando el
+ * selector le avisa que quedó en disco, empieza el siguiente. Se compara un
+ * fsync por mail (sin hilo de commit) contra el group commit con distintas
+ * ventanas.
+ *
+ * Los mails se escriben en un directorio temporal dentro de build/, porque en
+ * /tmp suele haber un tmpfs donde fsync no cuesta nada.
+ */
+#define _GNU_SOURCE
+#include "bench.h"
+#include "commit.h"
+#include "rcpt_to_list.h"
+#include "selector.h"
+#include "store.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define CLIENTS   32
+#define MAILBOXES 8
+#define MAILS     2000
+#define BODY_SIZE 4096
+
+struct client
+{
+	int fds[2];
+	struct commit_job job;
+	struct rcpt_set rcpts;
+};
+
+static struct client clients[CLIENTS];
+static unsigned started, done, failed;
+static char body[BODY_SIZE];
+
+static fd_selector selector;
+
+static void
+start_mail(struct client* c)
+{
+	char email[MAX_EMAIL_LENGTH];
+	snprintf(email, sizeof(email), "user%u@smtpd.com", started++ % MAILBOXES);
+	rcpt_set_add(&c->rcpts, email);
+
+	c->job.rcpts = &c->rcpts;
+	store_open(&c->job, "bench@smtpd.com", NULL);
+	store_write(&c->job, (const uint8_t*)body, sizeof(body));
+	store_close(&c->job);
+
+	c->job.selector = selector;
+	c->job.fd = c->fds[0];
+	commit_submit(&c->job);
+}
+
+static void
+committed(struct selector_key* key)
+{
+	struct client* c = key->data;
+	done++;
+	failed += !c->job.ok;
+	store_discard(&c->job);
+	rcpt_set_clear(&c->rcpts);
+
+	if (started < MAILS) {
+		start_mail(c);
+	}
+}
+
+static const struct fd_handler handler = {
+	.handle_block = committed,
+};
+
+static void
+run(const char* name, const bool group, const unsigned window_us)
+{
+	started = done = failed = 0;
+	if (group && !commit_init(window_us)) {
+		perror("commit_init");
+		exit(1);
+	}
+
+	const uint64_t start = bench_now();
+	for (unsigned i = 0; i < CLIENTS; i++) {
+		start_mail(clients + i);
+	}
+	while (done < MAILS) {
+		if (selector_select(selector) != SELECTOR_SUCCESS) {
+			perror("selector_select");
+			exit(1);
+		}
+	}
+	const uint64_t elapsed = bench_now() - start;
+
+	commit_close();
+	bench_report(name, MAILS, elapsed);
+	if (failed > 0) {
+		fprintf(stderr, "%s: %u mails failed\n", name, failed);
+	}
+}
+
+int
+main(void)
+{
+	char dir[] = "build/commit_bench.XXXXXX";
+	if (mkdtemp(dir) == NULL || chdir(dir) == -1) {
+		perror(dir);
+		return 1;
+	}
+	memset(body, 'x', sizeof(body));
+
+	const struct selector_init conf = {
+		.signal = SIGALRM,
+		.select_timeout = { .tv_sec = 1 },
+	};
+	if (selector_init(&conf) != SELECTOR_SUCCESS) {
+		perror("selector_init");
+		return 1;
+	}
+	selector = selector_new(CLIENTS * 2 + 8);
+
+	for (unsigned i = 0; i < CLIENTS; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, clients[i].fds) == -1 ||
+		    selector_register(selector, clients[i].fds[0], &handler, OP_NOOP, clients + i) != SELECTOR_SUCCESS) {
+			perror("socketpair");
+			return 1;
+		}
+	}
+
+	run("commit_fsync_per_mail", false, 0);
+	run("commit_group_window_0us", true, 0);
+	run("commit_group_window_1000us", true, 1000);
+
+	selector_destroy(selector);
+	selector_close();
+
+	if (chdir("../..") == 0) {
+		char cmd[64];
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		system(cmd);
+	}
+	return 0;
+}
@@ -0,0 +1,47 @@
+# compare.awk - compara la salida de `make bench' contra una línea base
+#
+#     awk -v threshold=10 -f bench/compare.awk <línea base> <actual>
+#
+# Ambos archivos tienen el formato de bench.h. Por cada caso imprime los ns
+# por operación de antes y de ahora y la diferencia, y marca REGRESSION si
+# creció más de `threshold' por ciento (10 por defecto). Termina con 1 si
+# hubo alguna regresión, así se puede usar desde make o desde un script.
+
+BEGIN {
+	FS = "\t"
+	if (threshold == "")
+		threshold = 10
+}
+
+FNR == NR {
+	if (NF >= 3)
+		base[$1] = $3
+	next
+}
+
+NF >= 3 {
+	seen[$1] = 1
+	if (!($1 in base)) {
+		printf "%-36s %12s %12.1f %8s  new\n", $1, "-", $3, ""
+		next
+	}
+	delta = base[$1] > 0 ? ($3 - base[$1]) * 100 / base[$1] : 0
+	mark = ""
+	if (delta > threshold) {
+		mark = "REGRESSION"
+		regressions++
+	} else if (delta < -threshold) {
+		mark = "improved"
+	}
+	printf "%-36s %12.1f %12.1f %+7.1f%%  %s\n", $1, base[$1], $3, delta, mark
+}
+
+END {
+	for (name in base)
+		if (!(name in seen))
+			printf "%-36s %12.1f %12s %8s  missing\n", name, base[name], "-", ""
+	if (regressions > 0) {
+		printf "%d regression(s) over %s%%\n", regressions, threshold
+		exit 1
+	}
+}
@@ -0,0 +1,130 @@
+/**
+ * compress_bench.c - costo de comprimir los mails contra lo que se ahorra
+ *
+ * Comprime MESSAGES mails de texto (headers y un cuerpo de palabras al azar,
+ * entre 2 y 64 KB) con cada formato y nivel, reutilizando el compresor como
+ * lo hace una conexión. Reporta los ns de CPU por mail y, en la cuarta
+ * columna, el porcentaje de bytes que no se escriben a disco.
+ *
+ * La cantidad de mails se puede cambiar con la variable de entorno
+ * COMPRESS_BENCH_MESSAGES.
+ */
+#include "bench.h"
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MESSAGES  5000
+#define CORPUS    64
+#define MIN_SIZE  2048
+#define MAX_SIZE  (64 * 1024)
+
+static const char* words[] = {
+	"the",     "of",     "and",     "mail",     "server",  "message", "delivery", "queue",   "please", "find",
+	"attached", "report", "meeting", "tomorrow", "regards", "thanks",  "invoice",  "account", "update", "status",
+	"de",      "la",     "que",     "el",       "en",      "los",     "correo",   "envio",   "saludos", "gracias",
+};
+
+static struct
+{
+	uint8_t data[MAX_SIZE];
+	size_t len;
+} corpus[CORPUS];
+
+static uint64_t out_bytes;
+
+static bool
+count_sink(void* arg, const uint8_t* data, size_t len)
+{
+	out_bytes += len;
+	bench_sink += data[len - 1];
+	return true;
+}
+
+static void
+build_corpus(void)
+{
+	srand(1);
+	for (unsigned i = 0; i < CORPUS; i++) {
+		const size_t size = MIN_SIZE + rand() % (MAX_SIZE - MIN_SIZE);
+		char* p = (char*)corpus[i].data;
+		int n = snprintf(p,
+		                 size,
+		                 "From: sender%u@smtpd.com\r\nTo: rcpt%u@smtpd.com\r\nSubject: report %u\r\n"
+		                 "Message-ID: <%u.%u@smtpd.com>\r\n\r\n",
+		                 rand() % 100,
+		                 rand() % 100,
+		                 i,
+		                 rand(),
+		                 i);
+		size_t len = n;
+		unsigned line = 0;
+		while (true) {
+			const char* w = words[rand() % (sizeof(words) / sizeof(words[0]))];
+			const size_t wlen = strlen(w);
+			if (len + wlen + 3 > size) {
+				break;
+			}
+			memcpy(p + len, w, wlen);
+			len += wlen;
+			line += wlen + 1;
+			if (line > 70) {
+				memcpy(p + len, "\r\n", 2);
+				len += 2;
+				line = 0;
+			} else {
+				p[len++] = ' ';
+			}
+		}
+		corpus[i].len = len;
+	}
+}
+
+static void
+run(const enum compress_format format, const int level, const unsigned messages)
+{
+	struct compressor* c = compressor_new(format, level);
+	if (c == NULL) {
+		fprintf(stderr, "%s:%d not available\n", compress_format_name(format), level);
+		return;
+	}
+
+	uint64_t in_bytes = 0;
+	out_bytes = 0;
+	const uint64_t start = bench_now();
+	for (unsigned i = 0; i < messages; i++) {
+		const size_t len = corpus[i % CORPUS].len;
+		compressor_begin(c, count_sink, NULL);
+		compressor_write(c, corpus[i % CORPUS].data, len, count_sink, NULL);
+		compressor_finish(c, count_sink, NULL);
+		in_bytes += len;
+	}
+	const uint64_t elapsed = bench_now() - start;
+
+	char name[64];
+	snprintf(name, sizeof(name), "compress_%s_%d", compress_format_name(format), level);
+	bench_report_value(name, messages, elapsed, 100.0 * (1.0 - (double)out_bytes / (double)in_bytes));
+	compressor_free(c);
+}
+
+int
+main(void)
+{
+	const char* env = getenv("COMPRESS_BENCH_MESSAGES");
+	const unsigned messages = env != NULL ? strtoul(env, NULL, 10) : MESSAGES;
+
+	build_corpus();
+
+	const int zlib_levels[] = { 1, 3, 6, 9 };
+	for (unsigned i = 0; i < sizeof(zlib_levels) / sizeof(zlib_levels[0]); i++) {
+		run(COMPRESS_ZLIB, zlib_levels[i], messages);
+	}
+	if (compress_available(COMPRESS_ZSTD)) {
+		const int zstd_levels[] = { 1, 3, 9, 15 };
+		for (unsigned i = 0; i < sizeof(zstd_levels) / sizeof(zstd_levels[0]); i++) {
+			run(COMPRESS_ZSTD, zstd_levels[i], messages);
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,395 @@
+/**
+ * core_bench.c - primitivas del camino de cada sesión
+ *
+ * Mide las piezas que corren por cada byte o por cada evento: las
+ * operaciones de `buffer', `request_consume' sobre los comandos de una
+ * sesión típica, `data_consume' y `data_consume_inplace' sobre cuerpos con
+ * distinta densidad de CR/LF y de líneas con punto, `parser_feed', el
+ * despacho de `stm' y `selector_select' con N socketpairs registrados.
+ *
+ * Cada caso corre una vez para calentar y REPEAT veces más, de al menos
+ * MIN_RUN_NS cada una, y se reporta la corrida más rápida, que es la más
+ * estable entre ejecuciones (ver bench/compare.awk).
+ */
+#define _GNU_SOURCE
+#include "bench.h"
+#include "buffer.h"
+#include "data.h"
+#include "parser.h"
+#include "parser_utils.h"
+#include "request.h"
+#include "selector.h"
+#include "stm.h"
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define N(x) (sizeof(x) / sizeof((x)[0]))
+
+#define REPEAT 5
+
+/** tamaño de los cuerpos de `data_consume' */
+#define BODY_SIZE (1024 * 1024)
+#define BLOCK     (16 * 1024)
+
+/** duración mínima de cada corrida: los casos cortos se repiten hasta llegar */
+#define MIN_RUN_NS (50 * 1000000ULL)
+
+typedef uint64_t (*bench_case)(void);
+
+/** corre `fn' y reporta la corrida con menos ns por operación; con `kb' agrega MB/s */
+static void
+run(const char* name, const bench_case fn, const bool kb)
+{
+	uint64_t best_ops = 0, best_ns = 0;
+	fn();
+	for (unsigned i = 0; i < REPEAT; i++) {
+		uint64_t ops = 0, elapsed;
+		const uint64_t start = bench_now();
+		do {
+			ops += fn();
+		} while ((elapsed = bench_now() - start) < MIN_RUN_NS);
+		if (best_ops == 0 || (double)elapsed / ops < (double)best_ns / best_ops) {
+			best_ops = ops;
+			best_ns = elapsed;
+		}
+	}
+	if (kb) {
+		bench_report_value(name, best_ops, best_ns, (double)best_ops * 1024.0 / 1048576.0 / ((double)best_ns / 1e9));
+	} else {
+		bench_report(name, best_ops, best_ns);
+	}
+}
+
+/* buffer ---------------------------------------------------------------- */
+
+#define BUFFER_SIZE 4096
+static uint8_t buffer_data[BUFFER_SIZE];
+
+/** buffer_write y buffer_read de a un byte; ops en KB */
+static uint64_t
+buffer_bytes(void)
+{
+	buffer b;
+	buffer_init(&b, sizeof(buffer_data), buffer_data);
+	uint64_t sum = 0;
+	for (unsigned round = 0; round < 4096; round++) {
+		for (unsigned i = 0; i < 1024; i++) {
+			buffer_write(&b, (uint8_t)i);
+		}
+		while (buffer_can_read(&b)) {
+			sum += buffer_read(&b);
+		}
+	}
+	bench_sink = sum;
+	return 4096;
+}
+
+/** el par write_ptr/write_adv y read_ptr/read_adv que hace cada recv y send */
+static uint64_t
+buffer_ptr_adv(void)
+{
+	buffer b;
+	buffer_init(&b, sizeof(buffer_data), buffer_data);
+	const unsigned rounds = 2000000;
+	size_t n, sum = 0;
+	for (unsigned i = 0; i < rounds; i++) {
+		uint8_t* w = buffer_write_ptr(&b, &n);
+		w[0] = (uint8_t)i;
+		buffer_write_adv(&b, n < 300 ? n : 300);
+		const uint8_t* r = buffer_read_ptr(&b, &n);
+		sum += r[0];
+		buffer_read_adv(&b, n);
+	}
+	bench_sink = sum;
+	return rounds;
+}
+
+/* request_consume ------------------------------------------------------- */
+
+static const char session[] = "EHLO client.example.com\r\n"
+                              "MAIL FROM:<sender@example.com>\r\n"
+                              "RCPT TO:<juan@smtpd.com>\r\n"
+                              "RCPT TO:<ana@smtpd.com>\r\n"
+                              "RCPT TO:<pedro@smtpd.com>\r\n"
+                              "DATA\r\n"
+                              "RSET\r\n"
+                              "QUIT\r\n";
+
+/** comandos de una sesión, uno tras otro como los recibe la sesión; ops en comandos */
+static uint64_t
+request_session(void)
+{
+	struct request request;
+	struct request_parser parser = {
+		.request = &request,
+	};
+	uint64_t commands = 0;
+	for (unsigned round = 0; round < 50000; round++) {
+		buffer b;
+		buffer_init(&b, sizeof(session) - 1, (uint8_t*)session);
+		buffer_write_adv(&b, sizeof(session) - 1);
+		while (buffer_can_read(&b)) {
+			bool errored = false;
+			request_parser_init(&parser);
+			const enum request_state st = request_consume(&b, &parser, &errored);
+			commands += st == request_done && !errored;
+		}
+	}
+	return commands;
+}
+
+/* data_consume ---------------------------------------------------------- */
+
+static uint8_t body[BODY_SIZE];
+
+/**
+ * llena el cuerpo con líneas de `line' bytes (sin el CRLF); 0 es un cuerpo
+ * sin CR. Con `dots' cada línea empieza con ".." (dot-stuffing)
+ */
+static void
+body_fill(const size_t line, const bool dots)
+{
+	memset(body, 'x', sizeof(body));
+	if (line == 0) {
+		return;
+	}
+	for (size_t i = 0; i + line + 2 <= sizeof(body); i += line + 2) {
+		if (dots) {
+			body[i] = body[i + 1] = '.';
+		}
+		body[i + line] = '\r';
+		body[i + line + 1] = '\n';
+	}
+}
+
+/** el parser de a un byte, de a 512 bytes como el buffer de comandos; ops en KB */
+static uint64_t
+data_bytes(void)
+{
+	struct data_parser p;
+	data_parser_init(&p);
+	uint64_t out = 0;
+	for (size_t off = 0; off < sizeof(body); off += 512) {
+		buffer b;
+		buffer_init(&b, 512, body + off);
+		buffer_write_adv(&b, 512);
+		data_consume(&b, &p);
+		size_t n;
+		buffer_read_ptr(&p.data_buffer, &n);
+		out += n;
+		buffer_reset(&p.data_buffer);
+	}
+	bench_sink = out;
+	return sizeof(body) / 1024;
+}
+
+static uint8_t block[DATA_HEADROOM + BLOCK];
+
+/**
+ * el filtro en el lugar de a bloques de 16 KB. Cada bloque se copia antes
+ * desde el cuerpo, como lo copia readv en la sesión; ops en KB
+ */
+static uint64_t
+data_inplace(void)
+{
+	struct data_parser p;
+	data_parser_init(&p);
+	uint64_t out = 0;
+	for (size_t off = 0; off < sizeof(body); off += BLOCK) {
+		memcpy(block + DATA_HEADROOM, body + off, BLOCK);
+		size_t len = BLOCK, out_len;
+		uint8_t* ptr;
+		data_consume_inplace(&p, block + DATA_HEADROOM, &len, &ptr, &out_len);
+		out += out_len;
+	}
+	bench_sink = out;
+	return sizeof(body) / 1024;
+}
+
+static const struct
+{
+	const char* name;
+	size_t line;
+	bool dots;
+} densities[] = {
+	{ "nocr", 0, false },
+	{ "text", 76, false },
+	{ "short", 6, false },
+	{ "dots", 76, true },
+};
+
+/* parser_feed ----------------------------------------------------------- */
+
+static const char* words[] = { "STARTTLS", "starttls", "StartTLS", "STARTTXS", "START", "QUIT" };
+
+/** parser_utils_strcmpi contra palabras que coinciden y que no; ops en bytes */
+static uint64_t
+parser_strcmpi(void)
+{
+	const struct parser_definition def = parser_utils_strcmpi("starttls");
+	struct parser* p = parser_init(parser_no_classes(), &def);
+	uint64_t bytes = 0, eq = 0;
+	for (unsigned round = 0; round < 100000; round++) {
+		for (unsigned w = 0; w < N(words); w++) {
+			parser_reset(p);
+			const struct parser_event* e = NULL;
+			for (const char* c = words[w]; *c; c++, bytes++) {
+				e = parser_feed(p, (uint8_t)*c);
+			}
+			eq += e != NULL && e->type == STRING_CMP_EQ;
+		}
+	}
+	parser_destroy(p);
+	parser_utils_strcmpi_destroy(&def);
+	bench_sink = eq;
+	return bytes;
+}
+
+/* stm ------------------------------------------------------------------- */
+
+static void
+noop_transition(const unsigned state, struct selector_key* key)
+{
+}
+
+static unsigned
+next_state(struct selector_key* key)
+{
+	struct state_machine* stm = key->data;
+	return (stm_state(stm) + 1) % 4;
+}
+
+static const struct state_definition states[] = {
+	{ .state = 0, .on_arrival = noop_transition, .on_departure = noop_transition, .on_read_ready = next_state },
+	{ .state = 1, .on_arrival = noop_transition, .on_departure = noop_transition, .on_read_ready = next_state },
+	{ .state = 2, .on_arrival = noop_transition, .on_departure = noop_transition, .on_read_ready = next_state },
+	{ .state = 3, .on_arrival = noop_transition, .on_departure = noop_transition, .on_read_ready = next_state },
+};
+
+static struct stm_profile profile[N(states)];
+
+/**
+ * stm_handler_read con un cambio de estado en cada evento; ops en eventos.
+ * Con la contabilidad por estado prendida (ver stm.h) se mide su costo.
+ */
+static uint64_t
+stm_dispatch(void)
+{
+	struct state_machine stm = {
+		.initial = 0,
+		.states = states,
+		.max_state = N(states) - 1,
+	};
+	stm_init(&stm);
+	stm_profile_attach(&stm, profile);
+	struct selector_key key = { .data = &stm };
+	const unsigned events = 10000000;
+	uint64_t sum = 0;
+	for (unsigned i = 0; i < events; i++) {
+		sum += stm_handler_read(&stm, &key);
+	}
+	bench_sink = sum;
+	return events;
+}
+
+/* selector_select ------------------------------------------------------- */
+
+static fd_selector selector;
+static int (*pairs)[2];
+static unsigned npairs;
+
+static void
+pair_read(struct selector_key* key)
+{
+	uint8_t c;
+	bench_sink += read(key->fd, &c, 1);
+}
+
+static const struct fd_handler pair_handler = {
+	.handle_read = pair_read,
+};
+
+/** un byte por vuelta a un par distinto; ops en llamadas a selector_select */
+static uint64_t
+selector_rounds(void)
+{
+	const unsigned rounds = 20000;
+	for (unsigned i = 0; i < rounds; i++) {
+		if (write(pairs[i % npairs][1], "x", 1) != 1 || selector_select(selector) != SELECTOR_SUCCESS) {
+			perror("selector");
+			exit(1);
+		}
+	}
+	return rounds;
+}
+
+static void
+selector_case(const unsigned n)
+{
+	npairs = n;
+	pairs = calloc(n, sizeof(*pairs));
+	selector = selector_new(n + 8);
+	for (unsigned i = 0; i < n; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, pairs[i]) == -1 ||
+		    selector_register(selector, pairs[i][0], &pair_handler, OP_READ, NULL) != SELECTOR_SUCCESS) {
+			perror("socketpair");
+			exit(1);
+		}
+	}
+	char name[64];
+	snprintf(name, sizeof(name), "selector_select_%u_fds", n);
+	run(name, selector_rounds, false);
+
+	for (unsigned i = 0; i < n; i++) {
+		selector_unregister_fd(selector, pairs[i][0]);
+		close(pairs[i][0]);
+		close(pairs[i][1]);
+	}
+	selector_destroy(selector);
+	free(pairs);
+}
+
+int
+main(void)
+{
+	run("buffer_byte_write_read_kb", buffer_bytes, true);
+	run("buffer_ptr_adv", buffer_ptr_adv, false);
+
+	run("request_consume_command", request_session, false);
+
+	char name[64];
+	for (unsigned i = 0; i < N(densities); i++) {
+		body_fill(densities[i].line, densities[i].dots);
+		snprintf(name, sizeof(name), "data_consume_%s_kb", densities[i].name);
+		run(name, data_bytes, true);
+		snprintf(name, sizeof(name), "data_inplace_%s_kb", densities[i].name);
+		run(name, data_inplace, true);
+	}
+
+	run("parser_feed_strcmpi_byte", parser_strcmpi, false);
+	run("stm_dispatch", stm_dispatch, false);
+	if (stm_profile_enable(true)) {
+		run("stm_dispatch_profiled", stm_dispatch, false);
+		stm_profile_enable(false);
+	}
+
+	const struct selector_init conf = {
+		.signal = SIGALRM,
+		.select_timeout = { .tv_sec = 1 },
+	};
+	if (selector_init(&conf) != SELECTOR_SUCCESS) {
+		perror("selector_init");
+		return 1;
+	}
+	// select(2) recorre todos los fds hasta el mayor: el costo crece con N
+	const unsigned sizes[] = { 8, 64, 500 };
+	for (unsigned i = 0; i < N(sizes); i++) {
+		selector_case(sizes[i]);
+	}
+	selector_close();
+	return 0;
+}
@@ -0,0 +1,105 @@
+/**
+ * logger_bench.c - costo de registrar una conexión en el hilo del selector
+ *
+ * Cada operación equivale a una conexión: un evento de accept y uno de close.
+ * Se compara el logger asincrónico (con el nivel que los descarta y con el
+ * que los registra) contra las líneas que se escribían antes con fprintf,
+ * con stdout line-buffered como cuando es una terminal. La salida va a
+ * /dev/null, así que el costo del fprintf es sólo el de las syscalls: con un
+ * pipe a un colector lento sería peor.
+ *
+ * El logger se carga en ráfagas de medio ring y entre ráfagas se espera a que
+ * el hilo de fondo las escriba, como pasa con el ritmo real de conexiones: se
+ * mide lo que paga el hilo del selector por encolar eventos que efectivamente
+ * se registran. La espera no se cuenta (el hilo de fondo puede tardar hasta
+ * FLUSH_INTERVAL_NS en despertarse si el ring no llegó a la mitad). Si se
+ * descarta algún evento el caso no reporta un número, porque estaría midiendo
+ * el descarte.
+ */
+#include "bench.h"
+#include "logger.h"
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CONNECTIONS 200000
+
+/** conexiones por ráfaga: dos eventos cada una, medio ring */
+#define BURST (LOG_RING_SIZE / 4)
+
+static struct sockaddr_storage client;
+
+static bool
+bench_logger(const char* name, const enum log_level level, const int fd)
+{
+	logger_init(level, fd);
+
+	uint64_t elapsed = 0;
+	for (unsigned i = 0; i < CONNECTIONS;) {
+		const uint64_t start = bench_now();
+		for (const unsigned end = i + BURST < CONNECTIONS ? i + BURST : CONNECTIONS; i < end; i++) {
+			log_event(LOG_INFO, LOG_EVENT_ACCEPT, &client, 7, 1, i);
+			log_event(LOG_INFO, LOG_EVENT_CLOSE, &client, 7, 0, 12);
+		}
+		elapsed += bench_now() - start;
+
+		while (logger_pending() > 0) {
+			sched_yield();
+		}
+	}
+	const uint64_t dropped = logger_dropped();
+
+	logger_close();
+	if (dropped > 0) {
+		fprintf(stderr, "%s: %llu events dropped, no result\n", name, (unsigned long long)dropped);
+		return false;
+	}
+	bench_report(name, CONNECTIONS, elapsed);
+	return true;
+}
+
+static void
+bench_stdio(const char* name, FILE* out)
+{
+	const uint64_t start = bench_now();
+	for (unsigned i = 0; i < CONNECTIONS; i++) {
+		fprintf(out, "New user connected\n");
+		fprintf(out, "Current users: %lld\n", 1LL);
+		fprintf(out, "Historic users: %llu\n\n", (unsigned long long)i);
+		fprintf(out, "User diconnected\n");
+		fprintf(out, "Current users: %lld\n", 0LL);
+		fprintf(out, "Historic users: %llu\n\n", (unsigned long long)i);
+	}
+	fflush(out);
+	bench_report(name, CONNECTIONS, bench_now() - start);
+}
+
+int
+main(void)
+{
+	struct sockaddr_in6* addr = (struct sockaddr_in6*)&client;
+	addr->sin6_family = AF_INET6;
+	addr->sin6_addr = in6addr_loopback;
+	addr->sin6_port = htons(40000);
+
+	const int devnull = open("/dev/null", O_WRONLY);
+	FILE* out = fdopen(dup(devnull), "w");
+	if (devnull < 0 || out == NULL) {
+		perror("/dev/null");
+		return 1;
+	}
+	setvbuf(out, NULL, _IOLBF, 0);
+
+	bench_stdio("logger_stdio_linebuf", out);
+	bool ok = bench_logger("logger_async_off", LOG_OFF, devnull);
+	ok = bench_logger("logger_async_info", LOG_INFO, devnull) && ok;
+
+	fclose(out);
+	close(devnull);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+/**
+ * maildir_name_bench.c - costo por destinatario del nombre y la fecha de un mail
+ *
+ * Compara lo que se hacía antes (un UUID aleatorio, que sale de getrandom, más
+ * time + localtime + strftime para la línea "From ") contra el nombre Maildir
+ * con la hora cacheada. El caso `_per_iteration' invalida la hora en cada
+ * destinatario, como si cada uno llegara en otra iteración del loop.
+ */
+#define _GNU_SOURCE
+#include "bench.h"
+#include "rcpt_to_list.h"
+#include "timecache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#define RECIPIENTS 200000
+
+static char name[MAILDIR_NAME_LENGTH];
+static char from[512];
+
+static void
+old_name(void)
+{
+	uint8_t uuid[16];
+	if (getrandom(uuid, sizeof(uuid), 0) != sizeof(uuid)) {
+		abort();
+	}
+	char* p = name;
+	for (unsigned i = 0; i < sizeof(uuid); i++) {
+		p += sprintf(p, (i == 4 || i == 6 || i == 8 || i == 10) ? "-%02x" : "%02x", uuid[i]);
+	}
+	strcpy(p, ".txt");
+
+	time_t now = time(NULL);
+	struct tm* t = localtime(&now);
+	char time_str[100];
+	strftime(time_str, sizeof(time_str), "%a %b %d %H:%M:%S %Y", t);
+	snprintf(from, sizeof(from), "From %s  %s\n", "bench@smtpd.com", time_str);
+}
+
+static void
+new_name(void)
+{
+	maildir_unique_name(name, sizeof(name));
+	snprintf(from, sizeof(from), "From %s  %s\n", "bench@smtpd.com", timecache_date());
+}
+
+int
+main(void)
+{
+	uint64_t start = bench_now();
+	for (unsigned i = 0; i < RECIPIENTS; i++) {
+		old_name();
+	}
+	bench_report("maildir_name_uuid_localtime", RECIPIENTS, bench_now() - start);
+
+	start = bench_now();
+	for (unsigned i = 0; i < RECIPIENTS; i++) {
+		timecache_invalidate();
+		new_name();
+	}
+	bench_report("maildir_name_cached_per_iteration", RECIPIENTS, bench_now() - start);
+
+	start = bench_now();
+	for (unsigned i = 0; i < RECIPIENTS; i++) {
+		new_name();
+	}
+	bench_report("maildir_name_cached", RECIPIENTS, bench_now() - start);
+
+	bench_sink = name[0] + from[0];
+	return 0;
+}
@@ -0,0 +1,241 @@
+/**
+ * relay_bench.c - mails por segundo que el relay entrega a otro servidor
+ *
+ * Encola MAILS mails de BODY_SIZE bytes en la cola del relay y mide cuánto
+ * tarda el cliente en entregarlos a un sumidero SMTP local (un hilo por
+ * conexión que acepta todo y anuncia PIPELINING). Se compara el pool de
+ * conexiones contra una conexión (connect + EHLO) por mail. La cuarta columna
+ * es la cantidad de mails por segundo.
+ */
+#define _GNU_SOURCE
+#include "bench.h"
+#include "metrics.h"
+#include "rcpt_to_list.h"
+#include "relay.h"
+#include "selector.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAILS     2000
+#define RCPTS     3
+#define BODY_SIZE 2048
+
+static char body[BODY_SIZE];
+
+/* sumidero */
+
+static bool
+reply(const int fd, const char* s)
+{
+	return send(fd, s, strlen(s), MSG_NOSIGNAL) == (ssize_t)strlen(s);
+}
+
+static void*
+sink_session(void* arg)
+{
+	const int fd = (int)(intptr_t)arg;
+	const int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	char buff[8192];
+	size_t len = 0;
+	bool data = false;
+
+	reply(fd, "220 sink\r\n");
+	while (true) {
+		const ssize_t n = recv(fd, buff + len, sizeof(buff) - len, 0);
+		if (n <= 0) {
+			break;
+		}
+		len += n;
+
+		size_t start = 0;
+		while (true) {
+			char* line = buff + start;
+			char* nl = memchr(line, '\n', len - start);
+			if (nl == NULL) {
+				break;
+			}
+			const size_t line_len = nl - line + 1;
+			start += line_len;
+			if (data) {
+				if (line_len == 3 && line[0] == '.') {
+					data = false;
+					reply(fd, "250 queued\r\n");
+				}
+			} else if (strncasecmp(line, "EHLO", 4) == 0) {
+				reply(fd, "250-sink\r\n250 PIPELINING\r\n");
+			} else if (strncasecmp(line, "DATA", 4) == 0) {
+				data = true;
+				reply(fd, "354 go ahead\r\n");
+			} else if (strncasecmp(line, "QUIT", 4) == 0) {
+				reply(fd, "221 bye\r\n");
+				goto finally;
+			} else {
+				reply(fd, "250 ok\r\n");
+			}
+		}
+		memmove(buff, buff + start, len - start);
+		len -= start;
+		if (len == sizeof(buff)) {
+			// una línea del cuerpo más larga que el buffer
+			len = 0;
+		}
+	}
+
+finally:
+	close(fd);
+	return NULL;
+}
+
+static void*
+sink(void* arg)
+{
+	const int server = (int)(intptr_t)arg;
+	while (true) {
+		const int fd = accept(server, NULL, NULL);
+		if (fd == -1) {
+			continue;
+		}
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, sink_session, (void*)(intptr_t)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+/** levanta el sumidero y retorna su puerto */
+static int
+sink_start(void)
+{
+	const int server = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (server == -1 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(server, 128) == -1 ||
+	    getsockname(server, (struct sockaddr*)&addr, &len) == -1) {
+		perror("sink");
+		exit(1);
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, sink, (void*)(intptr_t)server) != 0) {
+		perror("sink");
+		exit(1);
+	}
+	pthread_detach(thread);
+	return ntohs(addr.sin_port);
+}
+
+/* relay */
+
+static void
+enqueue(void)
+{
+	for (unsigned i = 0; i < MAILS; i++) {
+		struct commit_job job;
+		memset(&job, 0, sizeof(job));
+		struct rcpt_set set = { 0 };
+		for (unsigned r = 0; r < RCPTS; r++) {
+			char email[MAX_EMAIL_LENGTH];
+			snprintf(email, sizeof(email), "user%u@remote%u.com", r, i % 4);
+			rcpt_set_add(&set, email);
+		}
+		job.relay_rcpts = &set;
+
+		job.ok = true;
+		relay_queue_open(&job, "bench@smtpd.com");
+		relay_queue_write(&job, (const uint8_t*)body, sizeof(body));
+		relay_queue_commit(&job);
+		if (!job.ok) {
+			perror("relay_queue_commit");
+			exit(1);
+		}
+		relay_queue_discard(&job);
+		rcpt_set_free(&set);
+	}
+}
+
+static void
+run(const char* name, const char* host, const unsigned connections, const unsigned idle_ms)
+{
+	enqueue();
+	metrics_init();
+	fd_selector selector = selector_new(connections + 8);
+	relay_set_pool(connections, idle_ms);
+
+	const uint64_t start = bench_now();
+	if (selector == NULL || !relay_init(selector, host)) {
+		perror("relay_init");
+		exit(1);
+	}
+	while (metrics_gauge(METRIC_RELAY_QUEUE) > 0) {
+		if (selector_select(selector) != SELECTOR_SUCCESS) {
+			perror("selector_select");
+			exit(1);
+		}
+	}
+	const uint64_t elapsed = bench_now() - start;
+
+	selector_destroy(selector);
+	relay_close();
+	bench_report_value(name, MAILS, elapsed, MAILS / ((double)elapsed / 1e9));
+
+	const uint64_t delivered = metrics_counter(METRIC_RELAY_DELIVERED);
+	if (delivered != MAILS * RCPTS) {
+		fprintf(stderr, "%s: %llu of %u recipients delivered\n", name, (unsigned long long)delivered, MAILS * RCPTS);
+	}
+}
+
+int
+main(void)
+{
+	char dir[] = "build/relay_bench.XXXXXX";
+	if (mkdtemp(dir) == NULL || chdir(dir) == -1) {
+		perror(dir);
+		return 1;
+	}
+	memset(body, 'x', sizeof(body));
+	for (unsigned i = 76; i < sizeof(body); i += 78) {
+		body[i] = '\r';
+		body[i + 1] = '\n';
+	}
+
+	const struct selector_init conf = {
+		.signal = SIGALRM,
+		.select_timeout = { .tv_sec = 1 },
+	};
+	if (selector_init(&conf) != SELECTOR_SUCCESS) {
+		perror("selector_init");
+		return 1;
+	}
+
+	char host[32];
+	snprintf(host, sizeof(host), "127.0.0.1:%d", sink_start());
+
+	run("relay_connection_per_mail", host, RELAY_MAX_CONNECTIONS, 0);
+	run("relay_pool", host, RELAY_MAX_CONNECTIONS, RELAY_IDLE_MS);
+	run("relay_pool_1_connection", host, 1, RELAY_IDLE_MS);
+
+	selector_close();
+
+	if (chdir("../..") == 0) {
+		char cmd[64];
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		system(cmd);
+	}
+	return 0;
+}
@@ -0,0 +1,98 @@
+/**
+ * store_bench.c - costo por mail de cada backend de almacenamiento
+ *
+ * Entrega MESSAGES mails chicos (entre 2 y 5 KB, un destinatario cada uno,
+ * repartidos en MAILBOXES casillas) con cada backend, en lotes de BATCH mails
+ * como los que arma el hilo de commit. Se mide todo el camino del mail en el
+ * servidor: open, write, close y commit (con sus fsync).
+ *
+ * La cantidad de mails se puede cambiar con la variable de entorno
+ * STORE_BENCH_MESSAGES. Los mails se escriben en un directorio temporal
+ * dentro de build/ que se borra al terminar.
+ */
+#define _GNU_SOURCE
+#include "bench.h"
+#include "store.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MESSAGES  1000000
+#define MAILBOXES 1000
+#define BATCH     64
+#define MIN_SIZE  2048
+#define MAX_SIZE  5120
+
+static struct commit_job jobs[BATCH];
+static struct rcpt_set rcpts[BATCH];
+static char body[MAX_SIZE];
+
+static void
+run(const char* backend, const unsigned messages)
+{
+	if (!store_init(backend)) {
+		perror(backend);
+		exit(1);
+	}
+
+	srand(1);
+	unsigned failed = 0;
+	const uint64_t start = bench_now();
+	for (unsigned sent = 0; sent < messages;) {
+		const unsigned n = messages - sent < BATCH ? messages - sent : BATCH;
+		for (unsigned i = 0; i < n; i++) {
+			char email[MAX_EMAIL_LENGTH];
+			snprintf(email, sizeof(email), "user%u@smtpd.com", (sent + i) % MAILBOXES);
+
+			struct commit_job* job = jobs + i;
+			rcpt_set_add(rcpts + i, email);
+			job->rcpts = rcpts + i;
+			job->next = i + 1 < n ? jobs + i + 1 : NULL;
+			store_open(job, "bench@smtpd.com", NULL);
+			store_write(job, (const uint8_t*)body, MIN_SIZE + rand() % (MAX_SIZE - MIN_SIZE));
+			store_close(job);
+		}
+
+		store_commit(jobs);
+
+		for (unsigned i = 0; i < n; i++) {
+			failed += !jobs[i].ok;
+			store_discard(jobs + i);
+			rcpt_set_clear(rcpts + i);
+		}
+		sent += n;
+	}
+	const uint64_t elapsed = bench_now() - start;
+
+	char name[64];
+	snprintf(name, sizeof(name), "store_%s", backend);
+	bench_report(name, messages, elapsed);
+	if (failed > 0) {
+		fprintf(stderr, "%s: %u mails failed\n", name, failed);
+	}
+}
+
+int
+main(void)
+{
+	const char* env = getenv("STORE_BENCH_MESSAGES");
+	const unsigned messages = env != NULL ? strtoul(env, NULL, 10) : MESSAGES;
+
+	char dir[] = "build/store_bench.XXXXXX";
+	if (mkdtemp(dir) == NULL || chdir(dir) == -1) {
+		perror(dir);
+		return 1;
+	}
+	memset(body, 'x', sizeof(body));
+
+	run("maildir", messages);
+	run("segment", messages);
+
+	if (chdir("../..") == 0) {
+		char cmd[64];
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		system(cmd);
+	}
+	return 0;
+}
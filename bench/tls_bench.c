@@ -0,0 +1,248 @@
+/**
+ * tls_bench.c - costo de STARTTLS
+ *
+ * Con un cliente OpenSSL en otro hilo sobre TCP por loopback, mide los
+ * handshakes por segundo del lado servidor (tls.c, sin bloquear, como en el
+ * selector) y la velocidad a la que el servidor recibe un DATA grande cifrado.
+ * Cada caso corre sin kTLS y pidiendo kTLS; si el kernel no tiene el ULP
+ * "tls" el segundo cae en OpenSSL y se avisa por stderr.
+ *
+ * El certificado (EC P-256, autofirmado) se genera en un directorio temporal
+ * dentro de build/.
+ */
+#define _GNU_SOURCE
+#include "bench.h"
+#include "tls.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define HANDSHAKES 500
+#define CHUNK      (16 * 1024)
+#define TOTAL      (256 * 1024 * 1024)
+
+static struct sockaddr_in addr;
+static int server;
+static SSL_CTX* client_ctx;
+
+enum mode
+{
+	MODE_HANDSHAKE,
+	MODE_BULK,
+};
+
+static bool
+write_credentials(const char* cert_path, const char* key_path)
+{
+	bool ok = false;
+	EVP_PKEY* key = EVP_EC_gen("P-256");
+	X509* x = X509_new();
+	if (key == NULL || x == NULL) {
+		goto fail;
+	}
+	ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+	X509_gmtime_adj(X509_getm_notBefore(x), 0);
+	X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+	X509_set_pubkey(x, key);
+	X509_NAME* name = X509_get_subject_name(x);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char*)"localhost", -1, -1, 0);
+	X509_set_issuer_name(x, name);
+	if (X509_sign(x, key, EVP_sha256()) == 0) {
+		goto fail;
+	}
+
+	FILE* f = fopen(cert_path, "w");
+	if (f == NULL) {
+		goto fail;
+	}
+	ok = PEM_write_X509(f, x) == 1;
+	fclose(f);
+	if ((f = fopen(key_path, "w")) == NULL) {
+		ok = false;
+		goto fail;
+	}
+	ok = ok && PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL) == 1;
+	fclose(f);
+
+fail:
+	X509_free(x);
+	EVP_PKEY_free(key);
+	return ok;
+}
+
+/** el cliente: handshakes, o un handshake y TOTAL bytes */
+static void*
+client(void* arg)
+{
+	const enum mode mode = *(enum mode*)arg;
+	static uint8_t data[CHUNK];
+	const unsigned connections = mode == MODE_HANDSHAKE ? HANDSHAKES : 1;
+
+	for (unsigned i = 0; i < connections; i++) {
+		const int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+			perror("connect");
+			exit(1);
+		}
+		SSL* ssl = SSL_new(client_ctx);
+		SSL_set_fd(ssl, fd);
+		if (SSL_connect(ssl) != 1) {
+			fprintf(stderr, "client handshake failed\n");
+			exit(1);
+		}
+		if (mode == MODE_BULK) {
+			for (size_t sent = 0; sent < TOTAL; sent += CHUNK) {
+				if (SSL_write(ssl, data, sizeof(data)) <= 0) {
+					fprintf(stderr, "client write failed\n");
+					exit(1);
+				}
+			}
+		}
+		// espera a que el servidor cierre, así no se mezclan las conexiones
+		char c;
+		SSL_read(ssl, &c, 1);
+		SSL_free(ssl);
+		close(fd);
+	}
+	return NULL;
+}
+
+static void
+wait_fd(const int fd, const short events)
+{
+	struct pollfd p = { .fd = fd, .events = events };
+	poll(&p, 1, -1);
+}
+
+/** acepta una conexión y hace el handshake como lo hace la sesión */
+static struct tls*
+accept_tls(int* fd)
+{
+	*fd = accept(server, NULL, NULL);
+	if (*fd == -1 || fcntl(*fd, F_SETFL, O_NONBLOCK) == -1) {
+		perror("accept");
+		exit(1);
+	}
+	struct tls* t = tls_new(*fd);
+	for (enum tls_result r; t != NULL && (r = tls_handshake(t)) != TLS_DONE;) {
+		if (r == TLS_ERROR) {
+			fprintf(stderr, "server handshake failed\n");
+			exit(1);
+		}
+		wait_fd(*fd, r == TLS_WANT_READ ? POLLIN : POLLOUT);
+	}
+	if (t == NULL) {
+		fprintf(stderr, "tls_new failed\n");
+		exit(1);
+	}
+	return t;
+}
+
+static void
+run(const char* name, const enum mode mode, const bool ktls)
+{
+	if (!tls_init("cert.pem", "key.pem", ktls)) {
+		perror("tls_init");
+		exit(1);
+	}
+	pthread_t thread;
+	enum mode arg = mode;
+	pthread_create(&thread, NULL, client, &arg);
+
+	static uint8_t data[CHUNK];
+	bool offloaded = true;
+	uint64_t ops = 0;
+	const uint64_t start = bench_now();
+
+	if (mode == MODE_HANDSHAKE) {
+		for (; ops < HANDSHAKES; ops++) {
+			int fd;
+			struct tls* t = accept_tls(&fd);
+			offloaded = offloaded && tls_ktls_send(t) && tls_ktls_recv(t);
+			tls_free(t);
+			close(fd);
+		}
+	} else {
+		int fd;
+		struct tls* t = accept_tls(&fd);
+		offloaded = tls_ktls_recv(t);
+		for (size_t received = 0; received < TOTAL; ops++) {
+			const ssize_t n =
+			    offloaded ? recv(fd, data, sizeof(data), MSG_DONTWAIT) : tls_recv(t, data, sizeof(data));
+			if (n > 0) {
+				received += n;
+			} else if (n == -1 && errno == EAGAIN) {
+				wait_fd(fd, POLLIN);
+			} else {
+				fprintf(stderr, "server read failed\n");
+				exit(1);
+			}
+		}
+		tls_free(t);
+		close(fd);
+	}
+	const uint64_t elapsed = bench_now() - start;
+	pthread_join(thread, NULL);
+	tls_close();
+
+	if (mode == MODE_HANDSHAKE) {
+		bench_report(name, ops, elapsed);
+	} else {
+		bench_report_value(name, ops, elapsed, (double)TOTAL / 1048576.0 / ((double)elapsed / 1e9));
+	}
+	if (ktls && !offloaded) {
+		fprintf(stderr, "%s: kernel TLS not available, measured the OpenSSL fallback\n", name);
+	}
+}
+
+int
+main(void)
+{
+	char dir[] = "build/tls_bench.XXXXXX";
+	if (mkdtemp(dir) == NULL || chdir(dir) == -1) {
+		perror(dir);
+		return 1;
+	}
+	if (!write_credentials("cert.pem", "key.pem")) {
+		fprintf(stderr, "unable to create a certificate\n");
+		return 1;
+	}
+
+	server = socket(AF_INET, SOCK_STREAM, 0);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(addr);
+	if (server == -1 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(server, 16) == -1 ||
+	    getsockname(server, (struct sockaddr*)&addr, &len) == -1) {
+		perror("listen");
+		return 1;
+	}
+	client_ctx = SSL_CTX_new(TLS_client_method());
+
+	run("tls_handshake", MODE_HANDSHAKE, false);
+	run("tls_handshake_ktls", MODE_HANDSHAKE, true);
+	run("tls_recv_16k_mbps", MODE_BULK, false);
+	run("tls_recv_16k_ktls_mbps", MODE_BULK, true);
+
+	SSL_CTX_free(client_ctx);
+	close(server);
+
+	if (chdir("../..") == 0) {
+		char cmd[64];
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		system(cmd);
+	}
+	return 0;
+}
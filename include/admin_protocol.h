@@ -0,0 +1,142 @@
+#ifndef __ADMIN_PROTOCOL_H__
+#define __ADMIN_PROTOCOL_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * admin_protocol.c - protocolo binario de supervisión
+ *
+ * Convive con el protocolo de texto en el mismo puerto UDP: un datagrama que
+ * comienza con `ADMIN_SIGNATURE' (que nunca es el primer byte de un comando
+ * de texto) es binario. No tiene sesión: cada pedido lleva el token de
+ * autenticación (la contraseña de administración, ver `-u').
+ *
+ * Todos los enteros viajan en network byte order.
+ *
+ * Pedido:
+ *     +-----+-----+------------+------------+-----+---------------+
+ *     | SIG | VER | TOKEN (8)  | REQ ID (4) |  N  | N * METRIC (2)|
+ *     +-----+-----+------------+------------+-----+---------------+
+ *
+ * Respuesta:
+ *     +-----+-----+--------+------------+-----+-----------------------------------+
+ *     | SIG | VER | STATUS | REQ ID (4) |  N  | N * (METRIC (2), ST (1), VAL (8)) |
+ *     +-----+-----+--------+------------+-----+-----------------------------------+
+ *
+ * Cada valor se responde con el mismo identificador pedido y su propio estado:
+ * un identificador desconocido no invalida al resto.
+ */
+
+#define ADMIN_SIGNATURE   0xFF
+#define ADMIN_VERSION     1
+#define ADMIN_TOKEN_SIZE  8
+#define ADMIN_MAX_METRICS 64
+
+#define ADMIN_REQUEST_HEADER  (1 + 1 + ADMIN_TOKEN_SIZE + 4 + 1)
+#define ADMIN_RESPONSE_HEADER (1 + 1 + 1 + 4 + 1)
+#define ADMIN_ENTRY_SIZE      (2 + 1 + 8)
+#define ADMIN_REQUEST_MAX     (ADMIN_REQUEST_HEADER + ADMIN_MAX_METRICS * 2)
+#define ADMIN_RESPONSE_MAX    (ADMIN_RESPONSE_HEADER + ADMIN_MAX_METRICS * ADMIN_ENTRY_SIZE)
+
+/**
+ * Identificadores de métricas: el byte alto es la clase y el bajo el índice
+ * dentro del registro de métricas (ver metrics.h).
+ *
+ * Para los histogramas el índice se compone como
+ * (histograma << 3) | estadístico, con los estadísticos de `enum admin_stat'.
+ */
+#define ADMIN_CLASS_COUNTER   0x01
+#define ADMIN_CLASS_GAUGE     0x02
+#define ADMIN_CLASS_HISTOGRAM 0x03
+#define ADMIN_CLASS_CONFIG    0x04
+
+#define ADMIN_METRIC(class, index) ((uint16_t)(((class) << 8) | ((index) & 0xFF)))
+#define ADMIN_HISTOGRAM_METRIC(h, stat) \
+	((uint16_t)((ADMIN_CLASS_HISTOGRAM << 12) | (((h) & 0x1FF) << 3) | ((stat) & 0x7)))
+#define ADMIN_IS_HISTOGRAM(id) (((id) >> 12) == ADMIN_CLASS_HISTOGRAM)
+
+enum admin_stat
+{
+	ADMIN_STAT_COUNT,
+	ADMIN_STAT_P50,
+	ADMIN_STAT_P90,
+	ADMIN_STAT_P99,
+	ADMIN_STAT_P999,
+	ADMIN_STAT_MAX,
+	ADMIN_STATS,
+};
+
+/** valores de configuración (clase `ADMIN_CLASS_CONFIG') */
+enum admin_config
+{
+	ADMIN_CONFIG_MAX_USERS,
+	ADMIN_CONFIG_TRANSFORMATIONS,
+	ADMIN_CONFIGS,
+};
+
+enum admin_status
+{
+	ADMIN_OK = 0,
+	ADMIN_AUTH_FAILED = 1,
+	ADMIN_BAD_REQUEST = 2,
+	ADMIN_BAD_VERSION = 3,
+	ADMIN_UNKNOWN_METRIC = 4,
+};
+
+struct admin_request
+{
+	uint8_t version;
+	uint8_t token[ADMIN_TOKEN_SIZE];
+	uint32_t id;
+	uint8_t count;
+	uint16_t metrics[ADMIN_MAX_METRICS];
+};
+
+struct admin_value
+{
+	uint16_t metric;
+	uint8_t status;
+	uint64_t value;
+};
+
+struct admin_response
+{
+	uint8_t version;
+	uint8_t status;
+	uint32_t id;
+	uint8_t count;
+	struct admin_value values[ADMIN_MAX_METRICS];
+};
+
+/** indica si el datagrama corresponde al protocolo binario */
+bool admin_is_binary(const uint8_t* data, const size_t len);
+
+/**
+ * interpreta un pedido. Retorna ADMIN_OK, ADMIN_BAD_VERSION (en ese caso
+ * `req->id' es válido si el datagrama era lo suficientemente largo) o
+ * ADMIN_BAD_REQUEST.
+ */
+enum admin_status admin_request_parse(const uint8_t* data, const size_t len, struct admin_request* req);
+
+/** serializa un pedido. Retorna la cantidad de bytes escritos o 0 si no entra */
+size_t admin_request_build(const struct admin_request* req, uint8_t* out, const size_t outlen);
+
+/** serializa una respuesta. Retorna la cantidad de bytes escritos o 0 si no entra */
+size_t admin_response_build(const struct admin_response* res, uint8_t* out, const size_t outlen);
+
+/** interpreta una respuesta. Retorna false si está mal formada */
+bool admin_response_parse(const uint8_t* data, const size_t len, struct admin_response* res);
+
+/**
+ * traduce un nombre de métrica (el mismo que usa el comando `metrics', con
+ * sufijo `:p99', `:count', etc. para los histogramas) a su identificador.
+ * Retorna false si no existe.
+ */
+bool admin_metric_id(const char* name, uint16_t* id);
+
+/** nombre de la métrica `id' en `buff'. Retorna false si no existe */
+bool admin_metric_name(const uint16_t id, char* buff, const size_t buffsize);
+
+#endif
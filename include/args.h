@@ -3,6 +3,9 @@
 
 #define MAX_USERS 10
 
+#include "compress.h"
+#include "logger.h"
+
 #include <stdbool.h>
 
 struct smtpargs
@@ -12,6 +15,40 @@ struct smtpargs
 	unsigned short mng_port;
 	char* transformations;
 	char* pass;
+	/** nombre del segmento de memoria compartida con las métricas */
+	char* stats_shm;
+	/** máximo de sesiones simultáneas del protocolo de supervisión */
+	unsigned mng_max_clients;
+	/** segundos de inactividad luego de los cuales expira una sesión de supervisión */
+	unsigned mng_idle_timeout;
+	/** nivel mínimo de los eventos que se registran */
+	enum log_level log_level;
+	/** microsegundos que se espera para juntar mails en un mismo commit a disco */
+	unsigned commit_window;
+	/** backend de almacenamiento de los mails (ver store.h) */
+	char* store;
+	/** compresión de los mails guardados y su nivel */
+	enum compress_format store_compress;
+	int store_compress_level;
+	/** servidor al cual reenviar los mails de otros dominios, o NULL */
+	char* relay_host;
+	/** pool de conexiones al relay (ver `relay_set_pool') */
+	unsigned relay_connections;
+	unsigned relay_idle;
+	char* local_domain;
+	/** archivo con las casillas locales (ver directory.h), o NULL */
+	char* directory;
+	/** destinatarios por transacción (ver `set_max_rcpts') */
+	unsigned max_rcpts;
+	/** bytes que una sesión lee por vez durante el DATA (ver `set_data_high_water') */
+	unsigned data_buffer;
+	/** tamaño máximo de un mail en el socket SMTP (ver `struct smtp_listener'), 0 sin límite */
+	unsigned max_size;
+	/** certificado y clave para STARTTLS (ver tls.h); sin certificado no se ofrece */
+	const char* tls_cert;
+	const char* tls_key;
+	/** segundos que el proceso viejo espera a sus sesiones en un upgrade (ver upgrade.h) */
+	unsigned upgrade_timeout;
 };
 
 /**
@@ -0,0 +1,99 @@
+#ifndef __BUFCHAIN_H__
+#define __BUFCHAIN_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * bufchain.c - cadena de bloques para lecturas y escrituras grandes
+ *
+ * A diferencia de `buffer', la cadena no tiene un tamaño fijo: es una lista
+ * de bloques de BUFCHAIN_BLOCK_SIZE bytes que se toman de un pool común a
+ * medida que hacen falta y se devuelven cuando se consumen. Con `readv' se
+ * llenan varios bloques en una sola llamada, y con `bufchain_iov' los
+ * bloques llenos se pasan tal cual a `writev'.
+ *
+ * Lo que una cadena tiene (leído o por leer) nunca supera su high-water
+ * mark, así que la memoria por conexión está acotada. Dentro de ese límite,
+ * cada readv ofrece una ventana de bloques que se adapta a lo que llega: se
+ * duplica cuando una lectura la llena y se reduce a la mitad cuando llega
+ * menos de un cuarto, así un cliente lento no toma bloques que no usa.
+ *
+ * Cada bloque deja BUFCHAIN_HEADROOM bytes libres antes de sus datos, para
+ * que un filtro que transforma el contenido en el lugar pueda agregar unos
+ * pocos bytes al principio (ver `data_consume_inplace').
+ *
+ * El pool no es thread-safe: sólo se usa desde el hilo del selector.
+ */
+
+#define BUFCHAIN_BLOCK_SIZE (16 * 1024)
+#define BUFCHAIN_HEADROOM   8
+
+/** high-water mark por defecto */
+#define BUFCHAIN_HIGH_WATER (256 * 1024)
+
+/** bloques libres que conserva el pool; el resto se devuelve al sistema */
+#define BUFCHAIN_POOL_MAX 256
+
+struct bufchain_block
+{
+	struct bufchain_block* next;
+	/** datos en [start, end) de `data' */
+	uint32_t start, end;
+	uint8_t data[BUFCHAIN_BLOCK_SIZE];
+};
+
+struct bufchain
+{
+	struct bufchain_block *head, *tail;
+	/** bytes por consumir */
+	size_t length;
+	/** bloques que tiene la cadena y máximo permitido por el high-water mark */
+	unsigned blocks;
+	unsigned max_blocks;
+	/** bloques nuevos que ofrece el próximo readv */
+	unsigned window;
+};
+
+/** inicializa una cadena vacía que tendrá a lo sumo `high_water' bytes */
+void bufchain_init(struct bufchain* c, const size_t high_water);
+
+/**
+ * lee de `fd' con un único readv, en el espacio libre del último bloque y en
+ * tantos bloques nuevos como diga la ventana, sin pasar el high-water mark.
+ * Retorna lo mismo que readv; si la cadena está llena retorna -1 con errno
+ * ENOBUFS.
+ */
+ssize_t bufchain_readv(struct bufchain* c, int fd);
+
+/** lee como readv; `arg' es el de `bufchain_fill' */
+typedef ssize_t (*bufchain_reader)(void* arg, const struct iovec* iov, const int iovcnt);
+
+/** como `bufchain_readv', pero lee con `reader' (p. ej. `tls_readv') */
+ssize_t bufchain_fill(struct bufchain* c, const bufchain_reader reader, void* arg);
+
+/**
+ * describe en `iov' (de a lo sumo `n' elementos) los datos por consumir, en
+ * orden. Retorna cuántos elementos usó.
+ */
+int bufchain_iov(const struct bufchain* c, struct iovec* iov, const int n);
+
+/** escribe en `fd' con un único writev y consume lo escrito. Retorna lo mismo que writev */
+ssize_t bufchain_writev(struct bufchain* c, const int fd);
+
+/** copia hasta `n' bytes a `dst' y los consume. Retorna cuántos copió */
+size_t bufchain_read(struct bufchain* c, uint8_t* dst, const size_t n);
+
+/** descarta los primeros `n' bytes; los bloques que se vacían vuelven al pool */
+void bufchain_consume(struct bufchain* c, size_t n);
+
+/** devuelve todos los bloques al pool */
+void bufchain_free(struct bufchain* c);
+
+/** bloques alocados por el pool, en uso o libres */
+size_t bufchain_pool_blocks(void);
+
+#endif
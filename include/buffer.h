@@ -81,6 +81,26 @@
  * +---+---+---+---+---+---+
  * ↑                       ↑
  * W=0                     limit=6
+ *
+ * Buffer circular (ver `buffer_init_mirrored')
+ *
+ * El almacenamiento de N bytes se mapea dos veces seguidas, así que lo que
+ * se escribe en data[N + i] aparece en data[i]. Los datos entre R y W son
+ * siempre contiguos aunque den la vuelta, y `buffer_write_ptr' retorna todo
+ * el espacio libre sin compactar: limit se mueve con R (limit = R + N) y
+ * cuando R pasa N ambos punteros se corren N hacia atrás.
+ *
+ *             R=3
+ *              ↓
+ * +---+---+---+---+---+---+---+---+
+ * | B | C |   | A | B | C |   | A |
+ * +---+---+---+---+---+---+---+---+
+ * |<--- N=4 ----->|<--- copia --->|
+ *                         ↑   ↑
+ *                       W=6   limit=7
+ *
+ * Invariantes:
+ *    data <= R < data + N, R <= W <= limit = R + N
  */
 typedef struct buffer buffer;
 struct buffer
@@ -95,6 +115,9 @@ struct buffer
 
 	/** puntero de escritura */
 	uint8_t* write;
+
+	/** tamaño del almacenamiento si es circular, o 0 si es lineal */
+	size_t mirror;
 };
 
 /**
@@ -102,6 +125,16 @@ struct buffer
  */
 void buffer_init(buffer* b, const size_t n, uint8_t* data);
 
+/**
+ * inicializa un buffer circular de al menos `n' bytes (se redondea a
+ * páginas), con el almacenamiento mapeado dos veces (memfd y mmap). Retorna
+ * false si no se pudo; se libera con `buffer_free_mirrored'.
+ */
+bool buffer_init_mirrored(buffer* b, const size_t n);
+
+/** libera el almacenamiento de un buffer circular. No hace nada si es lineal */
+void buffer_free_mirrored(buffer* b);
+
 /**
  * Retorna un puntero donde se pueden escribir hasta `*nbytes`.
  * Se debe notificar mediante la función `buffer_write_adv'
@@ -121,7 +154,8 @@ uint8_t buffer_read(buffer* b);
 void buffer_write(buffer* b, uint8_t c);
 
 /**
- * compacta el buffer
+ * compacta el buffer. Si es circular no copia nada: los datos ya son
+ * contiguos
  */
 void buffer_compact(buffer* b);
 
@@ -0,0 +1,64 @@
+#ifndef __CLIENT_TABLE_H__
+#define __CLIENT_TABLE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * client_table.c - sesiones de los clientes del protocolo de supervisión
+ *
+ * Tabla de hash de capacidad fija indexada por la dirección de origen del
+ * datagrama. Todas las entradas se reservan al crear la tabla, por lo que
+ * buscar o agregar un cliente nunca aloca.
+ *
+ * Las entradas se mantienen en orden LRU: si la tabla está llena, agregar un
+ * cliente nuevo desaloja al que hace más tiempo que no se usa. Además las
+ * entradas que superan `idle_timeout' segundos sin actividad se descartan.
+ */
+
+struct client_table;
+
+/** una sesión. `state' es del usuario de la tabla y arranca en 0 */
+struct client_entry
+{
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	unsigned state;
+	uint64_t last_seen;
+};
+
+/**
+ * crea una tabla para `capacity' clientes. `idle_timeout' en segundos (0 para
+ * no expirar). Retorna NULL si no hay memoria.
+ */
+struct client_table* client_table_new(const size_t capacity, const uint64_t idle_timeout);
+
+/** destruye la tabla. Tolera NULLs */
+void client_table_destroy(struct client_table* t);
+
+/**
+ * obtiene la sesión del cliente `addr', creándola si no existe (o si expiró).
+ * `now' es el tiempo actual en segundos de un reloj monotónico.
+ *
+ * El puntero retornado es válido hasta la próxima llamada.
+ */
+struct client_entry* client_table_get(struct client_table* t,
+                                      const struct sockaddr_storage* addr,
+                                      const socklen_t addr_len,
+                                      const uint64_t now);
+
+/** busca la sesión sin crearla. Retorna NULL si no existe o expiró */
+struct client_entry* client_table_find(struct client_table* t,
+                                       const struct sockaddr_storage* addr,
+                                       const socklen_t addr_len,
+                                       const uint64_t now);
+
+/** cantidad de sesiones vivas */
+size_t client_table_size(const struct client_table* t);
+
+/** cantidad de sesiones desalojadas (por LRU o por expiración) */
+uint64_t client_table_evictions(const struct client_table* t);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef __COMMIT_H__
+#define __COMMIT_H__
+
+#include "rcpt_to_list.h"
+#include "selector.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * commit.c - entrega durable de mails con group commit
+ *
+ * Un mail recién recibido sólo se confirma ("250 Ok: queued") cuando su
+ * contenido y su entrada en new/ llegaron a disco. Sincronizar cada mail por
+ * separado es carísimo, así que un hilo aparte junta los mails que terminan
+ * dentro de una ventana de tiempo (de todas las conexiones) y los sincroniza
+ * juntos (ver `store_commit'): con Maildir, un fdatasync por archivo y un
+ * único fsync por cada directorio new/ afectado en el lote.
+ *
+ * Al terminar el lote se notifica a cada sesión con `selector_notify_block'
+ * sobre el selector y el descriptor indicados en el trabajo; hasta entonces
+ * la sesión no debe tocar el trabajo ni su lista de destinatarios.
+ */
+
+struct commit_job
+{
+	/** descriptor a notificar, registrado en `selector' */
+	fd_selector selector;
+	int fd;
+	/** destinatarios del mail, o NULL si no hay */
+	struct rcpt_set* rcpts;
+	/** destinatarios de otros dominios (o NULL), y su mail en la cola del relay (ver relay.h) */
+	struct rcpt_set* relay_rcpts;
+	void* relay_data;
+	/** estado del mail en el backend de almacenamiento (ver store.h) */
+	void* store_data;
+	/** bytes recibidos del mail (lo que se pasó a `store_write') */
+	uint64_t size;
+	/** bytes que llegaron al backend: `size', o menos si se comprimió */
+	uint64_t written;
+	/** compresor de la conexión, o NULL (ver store.h) */
+	struct compressor* compressor;
+	/** si store.c comprime lo que le pasa al backend */
+	bool compress_inline;
+	/** resultado: si todos los mails quedaron entregados */
+	bool ok;
+	/** resultado: bytes que se escribieron y que se evitó escribir compartiendo contenido */
+	uint64_t stored;
+	uint64_t saved;
+
+	struct commit_job* next;
+};
+
+/**
+ * inicializa el hilo de commit. `window_us' es cuánto se espera, luego de
+ * recibir el primer mail de un lote, a que lleguen otros.
+ */
+bool commit_init(const unsigned window_us);
+
+/**
+ * encola un trabajo. Si el hilo de commit no está corriendo, el trabajo se
+ * procesa en el momento (bloqueando) y la notificación llega igual por el
+ * selector.
+ */
+void commit_submit(struct commit_job* job);
+
+/** procesa los trabajos pendientes y detiene el hilo */
+void commit_close(void);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * compress.c - compresión de los mails que se guardan
+ *
+ * Un mail comprimido empieza con un header de COMPRESS_HEADER_LENGTH bytes:
+ *
+ *     0x89 'S' 'M' 'Z' <versión> <formato> <nivel> 0
+ *
+ * seguido del contenido comprimido: un stream gzip (que se puede leer con
+ * `tail -c +9 <mail> | zcat') o un frame zstd. Un archivo que no empieza
+ * con el header no está comprimido.
+ *
+ * Un `struct compressor' se crea una vez por conexión y se reutiliza (sin
+ * volver a alocar) para cada mail.
+ */
+
+#define COMPRESS_HEADER_LENGTH 8
+#define COMPRESS_VERSION       1
+
+enum compress_format
+{
+	COMPRESS_NONE,
+	COMPRESS_ZLIB,
+	COMPRESS_ZSTD,
+};
+
+/** recibe la salida del compresor. Retorna false si no pudo escribirla */
+typedef bool (*compress_sink)(void* arg, const uint8_t* data, size_t len);
+
+struct compressor;
+
+/**
+ * interpreta "zlib", "zstd", "zlib:<nivel>" o "none". Si no se indica el
+ * nivel, `level' queda en el nivel por defecto del formato.
+ */
+bool compress_parse(const char* s, enum compress_format* format, int* level);
+
+/** si el formato está disponible en este binario (zstd es opcional) */
+bool compress_available(const enum compress_format format);
+
+const char* compress_format_name(const enum compress_format format);
+
+/** NULL si no hay memoria o el formato no está disponible */
+struct compressor* compressor_new(const enum compress_format format, const int level);
+
+void compressor_free(struct compressor* c);
+
+/** empieza un mail nuevo: descarta el estado anterior y emite el header */
+bool compressor_begin(struct compressor* c, compress_sink sink, void* arg);
+
+bool compressor_write(struct compressor* c, const uint8_t* data, size_t len, compress_sink sink, void* arg);
+
+/** termina el mail, emitiendo lo que quede */
+bool compressor_finish(struct compressor* c, compress_sink sink, void* arg);
+
+/**
+ * lee el header de un mail. Retorna false si `data' no empieza con un header
+ * (el mail no está comprimido).
+ */
+bool compress_header_parse(const uint8_t* data, const size_t len, enum compress_format* format, int* level);
+
+#endif
@@ -39,10 +39,19 @@ enum data_state
 	data_done,  // Lei un LF, termine
 };
 
+/** bytes que el parser puede retener entre llamadas: un prefijo de "\r\n.\r" */
+#define DATA_HEADROOM 4
+
+/**
+ * tamaño de `data_buffer': `data_consume' escribe a lo sumo lo que lee más
+ * lo retenido, y se usa con el buffer de comandos de la sesión (512 bytes)
+ */
+#define DATA_BUFFER_SIZE (512 + DATA_HEADROOM)
+
 struct data_parser
 {
 	buffer data_buffer;
-	uint8_t raw_data_buffer[2048];
+	uint8_t raw_data_buffer[DATA_BUFFER_SIZE];
 	enum data_state state;
 };
 
@@ -61,6 +70,16 @@ enum data_state data_parser_feed(struct data_parser* p, uint8_t c);
  */
 enum data_state data_consume(buffer* b, struct data_parser* p);
 
+/**
+ * como `data_consume', pero sin copiar a `data_buffer': filtra en el lugar
+ * los `*len' bytes de `data'. El contenido queda en [*out, *out + *out_len),
+ * donde `*out' puede estar hasta DATA_HEADROOM bytes antes de `data' (para
+ * lo que quedó retenido de la llamada anterior), así que esos bytes deben
+ * poder escribirse. En `*len' deja cuántos bytes consumió, que son menos que
+ * los recibidos si se llegó al final.
+ */
+enum data_state data_consume_inplace(struct data_parser* p, uint8_t* data, size_t* len, uint8_t** out, size_t* out_len);
+
 /**
  * Permite distinguir a quien usa socks_hello_parser_feed si debe seguir
  * enviando caracters o no.
@@ -0,0 +1,85 @@
+#ifndef __DIRECTORY_H__
+#define __DIRECTORY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * directory.c - directorio de destinatarios locales
+ *
+ * Las casillas se leen de un archivo de texto con una dirección por línea
+ * (las líneas vacías y las que empiezan con '#' se ignoran):
+ *
+ *     juan@smtpd.com
+ *     ana@otro-dominio.com
+ *
+ * Los dominios locales son los que aparecen en el archivo: un destinatario
+ * de uno de ellos que no está en el directorio se rechaza, y uno de otro
+ * dominio va al relay. Las direcciones no distinguen mayúsculas.
+ *
+ * El directorio es una tabla de hash abierta (sondeo lineal) de offsets a
+ * un único arreglo con las direcciones, por lo que una búsqueda es O(1) y
+ * no aloca. Cada dominio se guarda como una entrada "@dominio" más, y se
+ * busca con el sufijo del destinatario que empieza en el '@'.
+ *
+ * `directory_reload' arma la tabla nueva en otro hilo; el hilo del selector
+ * la adopta en `directory_poll' cambiando un puntero, así que las búsquedas
+ * nunca esperan a una recarga.
+ */
+
+struct directory;
+
+/** resultado de buscar un destinatario */
+enum directory_result
+{
+	/** casilla del directorio */
+	DIRECTORY_LOCAL,
+	/** dominio local pero casilla inexistente */
+	DIRECTORY_UNKNOWN,
+	/** dominio que no es local */
+	DIRECTORY_FOREIGN,
+};
+
+/**
+ * lee el directorio de `path'. Retorna NULL (con errno) si no se pudo leer o
+ * no hay memoria. Las líneas que no son una dirección se descartan.
+ */
+struct directory* directory_load(const char* path);
+
+/** libera un directorio. Tolera NULLs */
+void directory_free(struct directory* d);
+
+/** busca el destinatario `email' */
+enum directory_result directory_find(const struct directory* d, const char* email);
+
+/** cantidad de casillas */
+size_t directory_size(const struct directory* d);
+
+/**
+ * carga el directorio de `path', que pasa a ser el directorio del servidor.
+ * Se llama una vez, al iniciar.
+ */
+bool directory_init(const char* path);
+
+/** si se configuró un directorio */
+bool directory_enabled(void);
+
+/** busca `email' en el directorio del servidor */
+enum directory_result directory_lookup(const char* email);
+
+/**
+ * vuelve a leer el archivo del directorio en otro hilo. Retorna false si no
+ * hay directorio, si ya hay una recarga en curso o no se pudo lanzar el hilo.
+ */
+bool directory_reload(void);
+
+/**
+ * adopta el directorio que haya terminado de cargar una recarga. Se llama
+ * desde el hilo del selector.
+ */
+void directory_poll(void);
+
+/** espera una recarga en curso y libera el directorio */
+void directory_close(void);
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdint.h>
+
+/**
+ * histogram.c - histograma log-lineal (estilo HDR) de valores de 64 bits
+ *
+ * Cada potencia de dos se divide en `HISTOGRAM_SUB_COUNT' sub-buckets
+ * lineales, por lo que el error relativo de un percentil queda acotado a
+ * 1 / HISTOGRAM_SUB_COUNT sin importar la magnitud del valor. Los valores
+ * menores a `HISTOGRAM_SUB_COUNT' se guardan de forma exacta.
+ *
+ * El almacenamiento es de tamaño fijo: registrar un valor nunca aloca
+ * memoria, por lo que se puede usar desde el hilo del selector.
+ */
+
+#define HISTOGRAM_SUB_BITS  3
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS   ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+/** deja el histograma vacío */
+void histogram_reset(struct histogram* h);
+
+/** registra una observación */
+void histogram_record(struct histogram* h, const uint64_t value);
+
+/** acumula las observaciones de `src' en `dst' */
+void histogram_merge(struct histogram* dst, const struct histogram* src);
+
+/**
+ * retorna el valor por debajo del cual se encuentra la fracción `q'
+ * (0 <= q <= 1) de las observaciones. Retorna 0 si no hay observaciones.
+ */
+uint64_t histogram_quantile(const struct histogram* h, const double q);
+
+/** índice del bucket en el que cae `value' */
+unsigned histogram_bucket(const uint64_t value);
+
+/** mayor valor que cae en el bucket `i' */
+uint64_t histogram_bucket_upper(const unsigned i);
+
+#endif
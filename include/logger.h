@@ -0,0 +1,98 @@
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * logger.c - registro asincrónico de eventos
+ *
+ * El hilo del selector nunca escribe logs: cada evento se guarda como un
+ * registro binario de tamaño fijo en un ring buffer single-producer /
+ * single-consumer sin locks. Un hilo de fondo lo vacía periódicamente,
+ * formatea los registros como texto y los escribe en lotes.
+ *
+ * Si el ring está lleno el evento se descarta y se cuenta en la métrica
+ * `log_dropped': el hilo del selector jamás espera al de logging.
+ *
+ * `log_event' sólo puede llamarse desde un único hilo (el del selector).
+ */
+
+enum log_level
+{
+	LOG_DEBUG,
+	LOG_INFO,
+	LOG_WARN,
+	LOG_ERROR,
+	LOG_OFF,
+};
+
+enum log_event
+{
+	/** conexión aceptada. args: usuarios actuales, históricos */
+	LOG_EVENT_ACCEPT,
+	/** conexión rechazada por exceder el máximo. args: usuarios actuales, máximo */
+	LOG_EVENT_REJECT,
+	/** conexión cerrada. args: usuarios actuales, duración en ms */
+	LOG_EVENT_CLOSE,
+	/** mail reenviado. args: destinatarios aceptados, número de intento */
+	LOG_EVENT_RELAY_SENT,
+	/** envío postergado. args: última respuesta del servidor, segundos hasta el reintento */
+	LOG_EVENT_RELAY_DEFER,
+	/** destinatarios rechazados o sin más reintentos. args: última respuesta, destinatarios */
+	LOG_EVENT_RELAY_FAIL,
+	/** directorio de destinatarios recargado. args: casillas, dominios */
+	LOG_EVENT_DIRECTORY_LOAD,
+	/** no se pudo recargar el directorio. args: errno */
+	LOG_EVENT_DIRECTORY_FAIL,
+	/** se lanzó el binario nuevo (SIGUSR2). args: pid del proceso nuevo */
+	LOG_EVENT_UPGRADE_START,
+	/** el proceso nuevo atiende: se deja de aceptar. args: sesiones, segundos de plazo */
+	LOG_EVENT_UPGRADE_DRAIN,
+	/** el proceso nuevo no llegó a atender. args: pid del proceso nuevo */
+	LOG_EVENT_UPGRADE_FAIL,
+	/** el proceso viejo sale. args: sesiones que no terminaron, duración del drenaje en ms */
+	LOG_EVENT_UPGRADE_EXIT,
+	LOG_EVENTS,
+};
+
+/** cantidad máxima de argumentos numéricos de un evento */
+#define LOG_ARGS 2
+
+/** registros del ring (potencia de 2) */
+#define LOG_RING_SIZE 4096
+
+/**
+ * inicializa el logger, escribiendo en `fd' los eventos de nivel `level' o
+ * superior, y lanza el hilo de fondo. Con LOG_OFF no se lanza ningún hilo.
+ */
+bool logger_init(const enum log_level level, const int fd);
+
+/** vacía los eventos pendientes y detiene el hilo de fondo */
+void logger_close(void);
+
+/** interpreta un nombre de nivel ("debug", "info", ...). Retorna false si no existe */
+bool logger_level_parse(const char* name, enum log_level* level);
+
+/** indica si se registran los eventos de nivel `level' */
+bool log_enabled(const enum log_level level);
+
+/**
+ * registra un evento. `addr' es la dirección del cliente (puede ser NULL) y
+ * `arg0', `arg1' los valores numéricos del evento (ver `enum log_event').
+ */
+void log_event(const enum log_level level,
+               const enum log_event event,
+               const struct sockaddr_storage* addr,
+               const int fd,
+               const int64_t arg0,
+               const int64_t arg1);
+
+/** cantidad de eventos descartados por tener el ring lleno */
+uint64_t logger_dropped(void);
+
+/** cantidad de eventos en el ring que el hilo de fondo todavía no escribió */
+uint64_t logger_pending(void);
+
+#endif
@@ -0,0 +1,118 @@
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include "histogram.h"
+#include "request.h"
+#include "smtpnio.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * metrics.c - registro de métricas del servidor
+ *
+ * Mantiene contadores (monótonos) y gauges de 64 bits, e histogramas
+ * log-lineales. Todas las métricas tienen un identificador fijo y su
+ * almacenamiento es estático, por lo que actualizarlas nunca aloca ni
+ * bloquea. Se actualizan únicamente desde el hilo del selector.
+ *
+ * Las latencias se registran en nanosegundos (ver `metrics_now').
+ */
+
+enum metric_counter
+{
+	METRIC_HISTORIC_USERS,
+	METRIC_BYTES_IN,
+	METRIC_BYTES_OUT,
+	METRIC_MAILS,
+	METRIC_REJECTED_USERS,
+	/** eventos descartados por tener el ring del logger lleno */
+	METRIC_LOG_DROPPED,
+	/** bytes de mails entregados que el almacenamiento escribió en disco */
+	METRIC_STORE_BYTES,
+	/** bytes que no se escribieron por compartir contenido (ver store.h) */
+	METRIC_STORE_BYTES_SAVED,
+	/** mails que quedaron en la cola del relay */
+	METRIC_RELAY_QUEUED,
+	/** destinatarios remotos entregados, postergados y rechazados */
+	METRIC_RELAY_DELIVERED,
+	METRIC_RELAY_DEFERRED,
+	METRIC_RELAY_FAILED,
+	/** mails enviados por una conexión del pool que ya había enviado otro */
+	METRIC_RELAY_REUSED,
+	/** recargas del directorio de destinatarios (ver directory.h) */
+	METRIC_DIRECTORY_RELOADS,
+	/** destinatarios rechazados por no estar en el directorio */
+	METRIC_RCPT_UNKNOWN,
+	/** handshakes TLS completos y fallidos, y sesiones con kTLS en ambos sentidos */
+	METRIC_TLS_HANDSHAKES,
+	METRIC_TLS_FAILED,
+	METRIC_TLS_KTLS,
+	/** mails rechazados por superar el tamaño máximo, declarado con SIZE o al recibirlos */
+	METRIC_SIZE_REJECTED,
+	METRIC_COUNTERS,
+};
+
+enum metric_gauge
+{
+	METRIC_CURRENT_USERS,
+	/** sesiones en cada estado, indexado por `enum smtp_state' */
+	METRIC_SESSIONS_IN_STATE,
+	/** mails en la cola del relay y conexiones abiertas para enviarlos */
+	METRIC_RELAY_QUEUE = METRIC_SESSIONS_IN_STATE + SMTP_STATES,
+	METRIC_RELAY_CONNECTIONS,
+	/** casillas del directorio de destinatarios */
+	METRIC_DIRECTORY_MAILBOXES,
+	/** bloques alocados por el pool de bufchain.h, en uso o libres */
+	METRIC_BUFCHAIN_BLOCKS,
+	/** memoria de las sesiones abiertas, sin los bloques de bufchain.h */
+	METRIC_SESSION_BYTES,
+	METRIC_GAUGES,
+};
+
+enum metric_histogram
+{
+	/** desde el accept hasta que terminamos de enviar el saludo */
+	METRIC_GREETING_LATENCY,
+	/** tamaño del cuerpo de cada mail recibido */
+	METRIC_DATA_SIZE,
+	/** desde el <CRLF>.<CRLF> hasta que terminamos de enviar "250 queued" */
+	METRIC_QUEUED_LATENCY,
+	/** tiempo de despacho de cada iteración del selector */
+	METRIC_SELECTOR_LOOP,
+	/** bytes de cada lectura del contenido de un mail */
+	METRIC_DATA_READ,
+	/** bytes por segundo de cada mail, desde el "354" hasta el <CRLF>.<CRLF> */
+	METRIC_DATA_RATE,
+	/** latencia por comando, indexado por `enum request_command' */
+	METRIC_COMMAND_LATENCY,
+	METRIC_HISTOGRAMS = METRIC_COMMAND_LATENCY + request_command_unknown + 1,
+};
+
+/** inicializa el registro. Debe llamarse antes de registrar valores */
+void metrics_init(void);
+
+/** reloj monotónico en nanosegundos */
+uint64_t metrics_now(void);
+
+void metrics_counter_add(const enum metric_counter c, const uint64_t n);
+uint64_t metrics_counter(const enum metric_counter c);
+
+void metrics_gauge_add(const enum metric_gauge g, const int64_t delta);
+void metrics_gauge_set(const enum metric_gauge g, const int64_t value);
+int64_t metrics_gauge(const enum metric_gauge g);
+
+void metrics_histogram_record(const enum metric_histogram h, const uint64_t value);
+const struct histogram* metrics_histogram(const enum metric_histogram h);
+
+const char* metrics_counter_name(const enum metric_counter c);
+const char* metrics_gauge_name(const enum metric_gauge g);
+const char* metrics_histogram_name(const enum metric_histogram h);
+
+/**
+ * Describe de forma humana todo el registro en `buff' (una métrica por
+ * línea). Retorna la cantidad de bytes escritos sin contar el '\0'.
+ */
+size_t metrics_dump(char* buff, const size_t buffsize);
+
+#endif
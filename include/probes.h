@@ -0,0 +1,44 @@
+#ifndef __PROBES_H__
+#define __PROBES_H__
+
+/**
+ * probes.h - tracepoints estáticos (USDT) del proveedor "smtpd"
+ *
+ * Con `make USDT=1' cada PROBEn es un DTRACE_PROBEn de <sys/sdt.h>: un nop en
+ * el código y una nota .note.stapsdt en el ELF que bpftrace o perf usan para
+ * engancharse sin reiniciar el servidor. No agrega dependencias en tiempo de
+ * ejecución. Sin USDT=1 los probes no existen y sus argumentos no se evalúan.
+ *
+ * Probes (argumentos entre paréntesis):
+ *   selector_wakeup (fds listos, mayor fd)       pselect volvió
+ *   selector_dispatch (fd, interés)              antes de un handler
+ *   selector_dispatch_done (fd, interés)         después del handler
+ *   stm_jump (fd, estado anterior, estado nuevo) cambio de estado de una máquina
+ *   smtp_accept (fd, sesiones)                   sesión nueva registrada
+ *   data_start (fd)                              empieza el cuerpo del DATA
+ *   data_end (fd, bytes, ok)                     terminó el DATA
+ *   maildir_publish (fd)                         antes del fdatasync de una copia
+ *   maildir_publish_done (fd, ruta, ok)          la copia quedó (o no) en new/
+ *
+ * Ver tools/bpftrace/ para ejemplos.
+ */
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define PROBE(name)                  DTRACE_PROBE(smtpd, name)
+#define PROBE1(name, a1)             DTRACE_PROBE1(smtpd, name, a1)
+#define PROBE2(name, a1, a2)         DTRACE_PROBE2(smtpd, name, a1, a2)
+#define PROBE3(name, a1, a2, a3)     DTRACE_PROBE3(smtpd, name, a1, a2, a3)
+#define PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4(smtpd, name, a1, a2, a3, a4)
+#else
+#define PROBE(name)                  \
+	do {                             \
+	} while (0)
+#define PROBE1(name, a1)             PROBE(name)
+#define PROBE2(name, a1, a2)         PROBE(name)
+#define PROBE3(name, a1, a2, a3)     PROBE(name)
+#define PROBE4(name, a1, a2, a3, a4) PROBE(name)
+#endif
+
+#endif
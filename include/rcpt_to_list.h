@@ -1,23 +1,139 @@
 #ifndef __LIST_H__
 #define __LIST_H__
 
-#include "data.h"
+#include "compress.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define MAX_EMAIL_LENGTH 40
 
+/** tamaño máximo de un nombre generado por `maildir_unique_name' */
+#define MAILDIR_NAME_LENGTH 96
+
+/** destinatarios por transacción que acepta el servidor (RFC 5321 4.5.3.1.8) */
+#define RCPT_MAX 100
+
 struct rcpt_node
 {
-	char email[MAX_EMAIL_LENGTH];
-	struct rcpt_node* next;
+	/** en la arena del set */
+	const char* email;
+	/** donde se escribe el mail: el archivo o el pipe a la transformación */
 	int file_fd;
-	char filename[MAX_EMAIL_LENGTH + 5];  // 5 = strlen(".txt") + 1
+	/** el archivo del mail, abierto hasta que se sincroniza */
+	int sync_fd;
+	/** si `sync_fd' se abrió con O_TMPFILE (no tiene nombre hasta entregarlo) */
+	bool tmpfile;
+	/** proceso de la transformación, o -1 */
+	pid_t pid;
+	char filename[MAILDIR_NAME_LENGTH];
+};
+
+struct rcpt_chunk;
+
+/**
+ * destinatarios de una transacción, sin repetidos. Los nodos están en un
+ * arreglo contiguo, en el orden en que se agregaron, y las direcciones en
+ * una arena de bloques que se libera de una vez. Una tabla de hash abierta
+ * con índices al arreglo detecta los repetidos en O(1).
+ *
+ * Un set en cero está vacío. Se recorre con
+ *
+ *     for (struct rcpt_node* r = set->nodes; r < set->nodes + set->count; r++)
+ */
+struct rcpt_set
+{
+	struct rcpt_node* nodes;
+	size_t count;
+	size_t capacity;
+	/** índice + 1 de un nodo, o 0 si está libre. Hay 2 * `capacity' slots */
+	uint32_t* slots;
+	struct rcpt_chunk* arena;
+};
+
+enum rcpt_add
+{
+	RCPT_ADDED,
+	/** ya estaba en el set */
+	RCPT_DUPLICATE,
+	/** no es más corta que MAX_EMAIL_LENGTH */
+	RCPT_TOO_LONG,
+	RCPT_NO_MEMORY,
 };
 
-struct rcpt_node* create_rcpt_node(const char* email);
-void add_rcpt_to_list(struct rcpt_node** head, const char* email);
-void free_rcpt_list(struct rcpt_node* head);
-void close_fds(struct rcpt_node* head);
-void write_to_files(struct rcpt_node* head, struct data_parser* p);
-void create_mails_files(struct rcpt_node* head, char* mailfrom, char* program, bool transformations);
+/** agrega `email' al set si no estaba */
+enum rcpt_add rcpt_set_add(struct rcpt_set* set, const char* email);
+/** vacía el set para otra transacción, conservando la memoria */
+void rcpt_set_clear(struct rcpt_set* set);
+/** libera la memoria del set y lo deja vacío */
+void rcpt_set_free(struct rcpt_set* set);
+
+/** descarta los archivos de los mails que no se llegaron a entregar */
+void discard_files(struct rcpt_set* set);
+/** cierra los descriptores de escritura; los archivos quedan abiertos para sync_files */
+void close_fds(struct rcpt_set* set);
+
+/**
+ * espera a las transformaciones, sincroniza (fdatasync) cada archivo y lo
+ * publica en new/ (con linkat si se creó con O_TMPFILE, si no moviéndolo
+ * desde tmp/). Es bloqueante. Retorna false si algún mail no quedó
+ * entregado.
+ */
+bool sync_files(struct rcpt_set* set);
+
+/** crea (si no existen) mails/<email> y sus directorios new/, cur/ y tmp/ */
+void create_maildir(const char* email);
+
+/**
+ * le da a un archivo abierto con O_TMPFILE el nombre `path' (ver
+ * linkat(2)).
+ */
+bool publish_tmpfile(const int fd, const char* path);
+
+/** sincroniza el directorio new/ del destinatario, para que el rename sea durable */
+bool sync_new_dir(const char* email);
+/**
+ * genera un nombre único al estilo Maildir:
+ * <segundos>.M<microsegundos>P<pid>Q<entrega>W<worker>.<host>. Usa la hora
+ * cacheada (ver timecache.h) y un contador por proceso, así que no hace
+ * syscalls (salvo la primera vez).
+ */
+void maildir_unique_name(char* buff, const size_t size);
+
+/** identificador del proceso que entrega, cuando hay más de uno */
+void maildir_set_worker(const unsigned id);
+
+/**
+ * lanza `program' con la salida en `out_fd', precedida por `from_line' (si no
+ * es NULL). Deja en `in_fd' el extremo de escritura del pipe de su entrada
+ * estándar. Con `compressor', lo que llega a `out_fd' está comprimido (ver
+ * compress.h): el pid es el del proceso que comprime, que espera al
+ * programa.
+ */
+pid_t spawn_transformation(const char* program,
+                           const int out_fd,
+                           int* in_fd,
+                           const char* from_line,
+                           struct compressor* compressor);
+
+/** termina y espera a un proceso de `spawn_transformation' cuya salida se descarta */
+void stop_transformation(const pid_t pid);
+
+void write_to_files(struct rcpt_set* set, const uint8_t* data, const size_t len);
+
+/** como `write_to_files', con un writev por destinatario */
+void writev_to_files(struct rcpt_set* set, const struct iovec* iov, const int iovcnt);
+/**
+ * crea el archivo del mail de cada destinatario, empezando con `from_line'
+ * (si no es NULL). Con `program', el mail pasa por la transformación (ver
+ * `spawn_transformation').
+ */
+void create_mails_files(struct rcpt_set* set,
+                        const char* from_line,
+                        const char* program,
+                        struct compressor* compressor);
 
 #endif
@@ -0,0 +1,166 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include "commit.h"
+#include "selector.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+ * relay.c - reenvío de mails a otro servidor SMTP
+ *
+ * Los destinatarios de otros dominios se aceptan sólo si se configuró un
+ * servidor al cual reenviarlos (ver `relay_init'). Su mail se guarda en una
+ * cola en disco (RELAY_QUEUE_DIR) durante el mismo group commit que los
+ * mails locales (ver `relay_queue_commit'), así que el "250 queued" sólo se
+ * envía cuando el mail ya no se puede perder.
+ *
+ * Un cliente SMTP no bloqueante, sobre el mismo selector y motor de estados
+ * que las sesiones entrantes, entrega la cola: conecta sin bloquear, envía
+ * MAIL, RCPT y DATA juntos si el servidor anuncia PIPELINING y reintenta lo
+ * que no se pudo entregar con un backoff exponencial, programado con un
+ * timerfd. Todos los destinatarios de un mail van en una única transacción.
+ *
+ * Las conexiones forman un pool: al terminar un mail la conexión sigue con
+ * el próximo de la cola (luego de un RSET) o queda ociosa hasta
+ * RELAY_IDLE_MS, así que una ráfaga de mails no paga un connect y un EHLO
+ * por mail.
+ *
+ * Cada mail de la cola es un archivo con el sobre y el cuerpo tal como se
+ * recibió, sin el "\r\n.\r\n" final:
+ *
+ *     F <remitente>\n
+ *     + <destinatario>\n     (uno por línea; '-' si ya se resolvió)
+ *     \n
+ *     <cuerpo>
+ *
+ * Al resolver un destinatario (entregado o rechazado en forma permanente) se
+ * cambia su '+' por '-' en el lugar. Esas marcas y el borrado del archivo no
+ * se sincronizan: si se pierden, el mail se vuelve a enviar.
+ */
+
+#define RELAY_QUEUE_DIR  "mails/.relay"
+/** mails que agotaron los reintentos */
+#define RELAY_FAILED_DIR RELAY_QUEUE_DIR "/failed"
+
+/** primer reintento; cada uno espera el doble que el anterior */
+#define RELAY_RETRY_MIN_MS 1000
+#define RELAY_RETRY_MAX_MS (60 * 60 * 1000)
+/** intentos antes de mover el mail a RELAY_FAILED_DIR */
+#define RELAY_MAX_ATTEMPTS 24
+
+/** conexiones simultáneas al servidor, por defecto (ver `relay_set_pool') */
+#define RELAY_MAX_CONNECTIONS 8
+/** tiempo que una conexión ociosa espera otro mail, por defecto */
+#define RELAY_IDLE_MS 10000
+/** tiempo máximo sin progreso de una conexión */
+#define RELAY_TIMEOUT_MS 30000
+
+/* cola en disco. Corren en el hilo del selector, salvo `relay_queue_commit' */
+
+/** empieza el mail de la cola para `job->relay_rcpts' (al recibir DATA) */
+void relay_queue_open(struct commit_job* job, const char* mailfrom);
+
+void relay_queue_write(struct commit_job* job, const uint8_t* data, const size_t len);
+
+/**
+ * indica si el cuerpo escrito tiene un CR o un LF que no son parte de un
+ * CRLF. El cuerpo se reenvía tal cual, y el servidor siguiente podría tomar
+ * una secuencia como "\n.\n" por el final del DATA: esos mails se rechazan.
+ */
+bool relay_queue_bare_newline(const struct commit_job* job);
+
+/**
+ * hace durables los mails del lote que tienen destinatarios remotos. Un
+ * trabajo cuyo mail no quedó en la cola deja `ok' en false. Corre en el
+ * hilo de commit, después de `store_commit'.
+ */
+void relay_queue_commit(struct commit_job* batch);
+
+void relay_queue_discard(struct commit_job* job);
+
+/** nombre del mail de `job' en la cola, una vez que se hizo commit */
+const char* relay_queue_name(const struct commit_job* job);
+
+enum relay_rcpt_status
+{
+	/** sin entregar: se intenta en la próxima conexión */
+	RELAY_RCPT_PENDING,
+	/** el servidor aceptó el RCPT en esta conexión */
+	RELAY_RCPT_ACCEPTED,
+	RELAY_RCPT_DONE,
+	/** rechazado en forma permanente */
+	RELAY_RCPT_FAILED,
+};
+
+struct relay_rcpt
+{
+	char email[MAX_EMAIL_LENGTH];
+	enum relay_rcpt_status status;
+	/** posición de su marca ('+' o '-') en el archivo */
+	off_t mark;
+};
+
+/** un mail de la cola, leído para enviarlo */
+struct relay_envelope
+{
+	int fd;
+	char mailfrom[256];
+	struct relay_rcpt* rcpts;
+	unsigned nrcpts;
+	/** dónde empieza el cuerpo y dónde termina el archivo */
+	off_t body;
+	off_t size;
+};
+
+/** lee el sobre del mail `name' de la cola */
+bool relay_queue_load(const char* name, struct relay_envelope* env);
+
+/** marca como resueltos los destinatarios entregados o rechazados */
+void relay_queue_mark(struct relay_envelope* env);
+
+void relay_queue_release(struct relay_envelope* env);
+
+/* cliente */
+
+/**
+ * configura el servidor al cual reenviar, "host" o "host:puerto" (25 por
+ * defecto; una IPv6 entre corchetes), y programa el envío de lo que quedó
+ * en la cola.
+ */
+bool relay_init(fd_selector s, const char* host);
+
+/**
+ * máximo de conexiones al servidor y cuánto se mantiene abierta una conexión
+ * ociosa. Con `idle_ms' en 0 no hay pool: cada conexión envía un único mail.
+ * Se llama antes de `relay_init'.
+ */
+void relay_set_pool(const unsigned connections, const unsigned idle_ms);
+
+/** si hay un servidor configurado */
+bool relay_enabled(void);
+
+/** el mail de `job' quedó en la cola: se programa su envío */
+void relay_submit(struct commit_job* job);
+
+/**
+ * deja de programar envíos, para que otro proceso se haga cargo de la cola
+ * (ver upgrade.h): los mails en curso terminan, y lo pendiente y lo que
+ * llegue queda sólo en disco. Antes de `relay_init' evita que se cargue la
+ * cola.
+ */
+void relay_hold(void);
+
+/** vuelve a cargar la cola desde el disco y a programar envíos */
+void relay_release(void);
+
+/** si alguna conexión está enviando un mail */
+bool relay_busy(void);
+
+/** libera la cola en memoria, luego de destruir el selector */
+void relay_close(void);
+
+#endif
@@ -20,6 +20,7 @@ enum request_command
 	request_command_vrfy,
 	request_command_expn,
 	request_command_help,
+	request_command_starttls,
 	request_command_unknown,
 };
 
@@ -55,6 +56,10 @@ enum request_state
 	request_verb_rcpt_t,
 	request_verb_rcpt_to,
 
+	request_verb_rs,
+	request_verb_rse,
+	request_verb_rset,
+
 	request_verb_d,
 	request_verb_da,
 	request_verb_dat,
@@ -65,6 +70,15 @@ enum request_state
 	request_verb_qui,
 	request_verb_quit,
 
+	request_verb_s,
+	request_verb_st,
+	request_verb_sta,
+	request_verb_star,
+	request_verb_start,
+	request_verb_startt,
+	request_verb_starttl,
+	request_verb_starttls,
+
 	request_helo_sep,
 	request_helo_domain,
 
@@ -75,6 +89,16 @@ enum request_state
 	request_mail_from,
 	request_mail_from_sender,
 
+	// parámetros ESMTP del MAIL FROM (RFC 5321 4.1.2); sólo se interpreta SIZE
+	request_mail_param,
+	request_mail_param_s,
+	request_mail_param_si,
+	request_mail_param_siz,
+	request_mail_param_size,
+	request_mail_param_size_eq,
+	request_mail_param_size_value,
+	request_mail_param_other,
+
 	request_rcpt_to_sep,
 	request_rcpt_to,
 	request_rcpt_to_recipient,
@@ -92,6 +116,8 @@ struct request
 {
 	char arg[32];
 	char domain[32];
+	/** SIZE= del MAIL FROM (RFC 1870), o 0 si no se declaró */
+	uint64_t size;
 };
 
 struct request_parser
@@ -2,6 +2,7 @@
 #define __SELECTOR_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/time.h>
 #include <time.h>
 
@@ -171,6 +172,12 @@ selector_status selector_set_interest_key(struct selector_key* key, fd_interest
  */
 selector_status selector_select(fd_selector s);
 
+/**
+ * retorna cuánto tardó (en nanosegundos) el despacho de eventos de la última
+ * llamada a `selector_select', sin contar el tiempo bloqueado esperando.
+ */
+uint64_t selector_dispatch_time(fd_selector s);
+
 /**
  * Método de utilidad que activa O_NONBLOCK en un fd.
  *
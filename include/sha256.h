@@ -0,0 +1,30 @@
+#ifndef __SHA256_H__
+#define __SHA256_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * sha256.c - SHA-256 (FIPS 180-4) incremental
+ *
+ * Para confirmar que dos mensajes son iguales sin compararlos byte a byte
+ * (ver store_dedup.c). No pretende ser rápido.
+ */
+
+#define SHA256_DIGEST_LENGTH 32
+
+struct sha256
+{
+	uint32_t state[8];
+	uint64_t length;
+	uint8_t block[64];
+	size_t used;
+};
+
+void sha256_init(struct sha256* ctx);
+
+void sha256_update(struct sha256* ctx, const void* data, size_t len);
+
+void sha256_final(struct sha256* ctx, uint8_t digest[SHA256_DIGEST_LENGTH]);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef __SHMSTATS_H__
+#define __SHMSTATS_H__
+
+#include "metrics.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * shmstats.c - publica las métricas del servidor en memoria compartida
+ *
+ * El servidor crea un segmento (shm_open(3) + mmap(2)) y al final de cada
+ * iteración del selector copia en él los contadores y gauges del registro de
+ * métricas. La copia no realiza syscalls.
+ *
+ * Los lectores (ver `build/smtpstat') mapean el segmento en modo lectura y
+ * obtienen una foto consistente usando un seqlock: `seq' es impar mientras el
+ * servidor está escribiendo, y cambia en cada publicación.
+ *
+ * El layout es versionado: un lector debe verificar `magic', `version' y
+ * `size' antes de interpretar el resto del segmento. Si el layout cambia de
+ * forma incompatible se debe incrementar `SHMSTATS_VERSION'.
+ */
+
+#define SHMSTATS_MAGIC   0x534d5450u  // "SMTP"
+#define SHMSTATS_VERSION 1
+
+/** nombre por defecto del segmento, se completa con el puerto SMTP */
+#define SHMSTATS_NAME_FMT "/smtpd-%u"
+
+struct shmstats
+{
+	uint32_t magic;
+	uint32_t version;
+	/** sizeof(struct shmstats) del escritor */
+	uint32_t size;
+	uint32_t pid;
+
+	/** contador de secuencia del seqlock */
+	volatile uint64_t seq;
+
+	/** CLOCK_MONOTONIC de la última publicación, en nanosegundos */
+	uint64_t published_at;
+	uint64_t counters[METRIC_COUNTERS];
+	int64_t gauges[METRIC_GAUGES];
+};
+
+/**
+ * crea (o recrea) el segmento `name' y lo deja listo para publicar.
+ * Retorna false ante error y deja los detalles en errno.
+ */
+bool shmstats_open(const char* name);
+
+/** copia el estado actual del registro de métricas al segmento */
+void shmstats_publish(void);
+
+/** desmapea y elimina el segmento */
+void shmstats_close(void);
+
+/** desmapea el segmento sin eliminarlo: el nombre ya es de otro proceso (ver upgrade.h) */
+void shmstats_release(void);
+
+/**
+ * mapea en modo lectura el segmento `name'. Retorna NULL ante error o si el
+ * layout no es compatible con el de este binario.
+ */
+const struct shmstats* shmstats_attach(const char* name);
+
+/**
+ * obtiene una copia consistente del segmento. Retorna false si no se pudo
+ * leer una foto estable luego de varios reintentos.
+ */
+bool shmstats_read(const struct shmstats* shm, struct shmstats* out);
+
+#endif
@@ -3,15 +3,59 @@
 
 #include "selector.h"
 
+#include <stddef.h>
+#include <stdint.h>
+
+/** estados de una sesión SMTP */
+enum smtp_state
+{
+	GREETING_WRITE,
+	FAILED_CONNECTION_READ,
+	FAILED_CONNECTION_WRITE,
+	EHLO_READ,
+	EHLO_WRITE,
+	/** respuesta al STARTTLS y handshake (ver tls.h) */
+	STARTTLS_WRITE,
+	TLS_HANDSHAKE,
+	MAIL_FROM_READ,
+	MAIL_FROM_WRITE,
+	RCPT_TO_READ,
+	RCPT_TO_WRITE,
+	DATA_READ,
+	DATA_WRITE,
+	MAIL_INFO_READ,
+	/** esperando que el mail llegue a disco (ver commit.h) */
+	MAIL_COMMIT,
+	MAIL_INFO_WRITE,
+	DONE,
+	ERROR
+};
+
+/** cantidad de estados de una sesión SMTP */
+#define SMTP_STATES (ERROR + 1)
+
+/**
+ * configuración de un socket SMTP: es el dato con el que se registra en el
+ * selector, y cada sesión toma la suya al aceptarse
+ */
+struct smtp_listener
+{
+	/** transformación de los mails (ver `set_new_status'), o NULL */
+	const char* program;
+	/** bytes de un mail (SIZE, RFC 1870); lo que se pasa se responde con 552. 0 es sin límite */
+	uint64_t max_size;
+};
+
+/** acepta una conexión en el socket de `key', cuyo dato es un `struct smtp_listener' */
 void smtp_passive_accept(struct selector_key* key);
 
-int get_historic_users();
+uint64_t get_historic_users();
 
-int get_current_users();
+uint64_t get_current_users();
 
-int get_current_bytes();
+uint64_t get_current_bytes();
 
-int get_current_mails();
+uint64_t get_current_mails();
 
 bool get_current_status();
 
@@ -19,6 +63,15 @@ void set_new_status(bool new_status);
 
 void set_max_users(int n);
 
+/** destinatarios por transacción; el resto se responde con 452 */
+void set_max_rcpts(const unsigned n);
+
+/** bytes que una sesión lee por vez durante el DATA (ver bufchain.h) */
+void set_data_high_water(const size_t bytes);
+
+/** dominio de los destinatarios locales; el resto sólo se acepta para el relay */
+void set_local_domain(const char* domain);
+
 int get_cant_max_users();
 
 #endif
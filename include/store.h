@@ -0,0 +1,140 @@
+#ifndef __STORE_H__
+#define __STORE_H__
+
+#include "commit.h"
+#include "compress.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * store.c - almacenamiento de los mails recibidos
+ *
+ * El almacenamiento es intercambiable: cada backend implementa las
+ * operaciones de `struct store' y se elige uno al iniciar el servidor (ver
+ * `store_init'). El mail en curso es el `struct commit_job' de la sesión:
+ * `rcpts' tiene sus destinatarios y `store_data' el estado del backend.
+ *
+ * Las operaciones open, write, close y discard corren en el hilo del
+ * selector; commit corre en el hilo de commit (ver commit.h), que entre
+ * submit y la notificación es el dueño del trabajo.
+ *
+ * Si se configuró compresión (ver `store_set_compression'), store.c comprime
+ * el contenido antes de pasarlo a write, con un compresor por conexión que
+ * se reutiliza entre mails. Con una transformación, su salida se comprime en
+ * un proceso aparte (ver `spawn_transformation').
+ */
+struct store
+{
+	const char* name;
+
+	/** si los mails empiezan con la línea "From <remitente>  <fecha>" */
+	bool from_line;
+
+	/**
+	 * si lo que tiene en memoria supone que es el único proceso que escribe:
+	 * no admite un upgrade en caliente (ver upgrade.h)
+	 */
+	bool single_writer;
+
+	/** prepara el almacenamiento. Se llama una vez, al iniciar */
+	bool (*init)(void);
+
+	/**
+	 * empieza un mail para los destinatarios de `job' (al recibir DATA).
+	 * `from_line' es lo que se escribe antes del contenido, o NULL.
+	 * `program' es la transformación a aplicar, o NULL; su salida se
+	 * comprime con `job->compressor' si no es NULL. Si algo falla, el mail
+	 * se descarta y commit lo informa.
+	 */
+	void (*open)(struct commit_job* job, const char* from_line, const char* program);
+
+	/** agrega contenido al mail */
+	void (*write)(struct commit_job* job, const uint8_t* data, const size_t len);
+
+	/** como write, con varios fragmentos. Opcional: sin él se llama a write por cada uno */
+	void (*writev)(struct commit_job* job, const struct iovec* iov, const int iovcnt);
+
+	/** terminó el DATA: no habrá más escrituras */
+	void (*close)(struct commit_job* job);
+
+	/**
+	 * hace durables los mails del lote (encadenados por `next') y deja el
+	 * resultado de cada uno en `ok', `stored' y `saved'. Puede bloquear.
+	 */
+	void (*commit)(struct commit_job* batch);
+
+	/** libera lo que quede de un mail, entregado o no */
+	void (*discard)(struct commit_job* job);
+};
+
+/** directorio de los segmentos y del índice */
+#define SEGMENT_STORE_DIR "mails/.store"
+
+/** tamaño con el que se preasigna cada segmento */
+#define SEGMENT_SIZE (64 * 1024 * 1024)
+
+/** el mensaje no fue leído todavía */
+#define SEGMENT_FLAG_NEW 0x1
+
+/**
+ * entrada del índice (SEGMENT_STORE_DIR "/index"), una por mensaje y
+ * destinatario. Los destinatarios de un mismo mail comparten el mensaje. El
+ * índice sólo crece; una entrada incompleta al final se descarta al iniciar.
+ */
+struct segment_index_entry
+{
+	char mailbox[MAX_EMAIL_LENGTH];
+	/** el mensaje está en SEGMENT_STORE_DIR "/segment.<segment>" */
+	uint32_t segment;
+	uint32_t length;
+	uint64_t offset;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+/** un archivo por mail y destinatario en mails/<destinatario>/new (por defecto) */
+extern const struct store maildir_store;
+
+/** segmentos preasignados en mails/.store con un índice de mensajes */
+extern const struct store segment_store;
+
+/** Maildir con los cuerpos guardados una única vez en mails/.blobs */
+extern const struct store dedup_store;
+
+/**
+ * sincroniza los directorios new/ de los destinatarios del lote, una vez por
+ * directorio, y marca como fallidos los trabajos afectados por un error.
+ * Para los backends que entregan en Maildir.
+ */
+void maildir_sync_new_dirs(struct commit_job* batch);
+
+/** escribe todo `data' en `fd', en `offset' o (si es negativo) donde esté */
+bool store_write_all(const int fd, const void* data, size_t len, off_t offset);
+
+/** elige el backend por nombre ("maildir", "segment", "dedup") y lo inicializa */
+bool store_init(const char* name);
+
+/** backend elegido */
+const struct store* store_get(void);
+
+/**
+ * comprime los mails que se guarden a partir de ahora. Retorna false si el
+ * formato no está disponible en este binario.
+ */
+bool store_set_compression(const enum compress_format format, const int level);
+
+void store_open(struct commit_job* job, const char* mailfrom, const char* program);
+void store_write(struct commit_job* job, const uint8_t* data, const size_t len);
+void store_writev(struct commit_job* job, const struct iovec* iov, const int iovcnt);
+void store_close(struct commit_job* job);
+void store_commit(struct commit_job* batch);
+void store_discard(struct commit_job* job);
+
+/** libera lo que el trabajo conserva entre mails (el compresor), al cerrar la conexión */
+void store_job_free(struct commit_job* job);
+
+#endif
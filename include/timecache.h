@@ -0,0 +1,32 @@
+#ifndef __TIMECACHE_H__
+#define __TIMECACHE_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * timecache.c - hora actual cacheada por el event loop
+ *
+ * El reloj se lee a lo sumo una vez por iteración del loop: la primera
+ * lectura luego de `timecache_invalidate' lo consulta y las siguientes usan
+ * ese valor. Como el loop invalida al terminar cada iteración, la primera
+ * lectura de la siguiente ocurre después de que el select retorna, y nunca
+ * queda la hora de antes de un select largo. La fecha formateada se
+ * recalcula a lo sumo una vez por segundo.
+ *
+ * Sólo debe usarse desde el hilo del selector.
+ */
+
+/** hace que la próxima lectura vuelva a consultar el reloj */
+void timecache_invalidate(void);
+
+/** segundos desde epoch */
+time_t timecache_sec(void);
+
+/** microsegundos dentro del segundo actual */
+long timecache_usec(void);
+
+/** fecha local con el formato de la línea "From " de mbox: "Mon Oct 19 06:30:22 2026" */
+const char* timecache_date(void);
+
+#endif
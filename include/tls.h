@@ -0,0 +1,73 @@
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/**
+ * tls.c - STARTTLS (RFC 3207)
+ *
+ * Se compila con OpenSSL sólo con `make TLS=1'; sin eso `tls_init' falla y
+ * el servidor no anuncia STARTTLS.
+ *
+ * El handshake se hace en el hilo del selector sin bloquear: `tls_handshake'
+ * dice qué evento esperar antes de volver a llamarla. Al terminar, OpenSSL
+ * intenta pasar el cifrado al kernel (kTLS, TCP_ULP "tls") en cada sentido.
+ * En el sentido en que lo logra, el socket se usa con recv/send/readv como
+ * si fuera texto plano; en el otro, las lecturas y escrituras pasan por
+ * `tls_recv' y `tls_send' (o `tls_readv' en el DATA).
+ */
+
+struct tls;
+
+enum tls_result
+{
+	TLS_DONE,
+	TLS_WANT_READ,
+	TLS_WANT_WRITE,
+	TLS_ERROR,
+};
+
+/**
+ * carga el certificado y la clave (PEM). Con `ktls' en false nunca se
+ * intenta kTLS. Retorna false si no se pudo o si no se compiló con TLS=1.
+ */
+bool tls_init(const char* cert, const char* key, const bool ktls);
+
+/** si se puede ofrecer STARTTLS */
+bool tls_enabled(void);
+
+/** empieza el lado servidor de un handshake sobre `fd', que no bloquea */
+struct tls* tls_new(const int fd);
+
+enum tls_result tls_handshake(struct tls* t);
+
+/** si el kernel cifra lo que se envía / descifra lo que se recibe */
+bool tls_ktls_send(const struct tls* t);
+bool tls_ktls_recv(const struct tls* t);
+
+/**
+ * como recv y send sobre la sesión. Si OpenSSL necesita esperar al socket
+ * retornan -1 con errno EAGAIN.
+ */
+ssize_t tls_recv(struct tls* t, void* buf, const size_t n);
+ssize_t tls_send(struct tls* t, const void* buf, const size_t n);
+
+/**
+ * como readv: llena `iov' en orden con `tls_recv' hasta que no haya más
+ * descifrado ni en el socket. `t' es un `struct tls*' (ver `bufchain_fill').
+ */
+ssize_t tls_readv(void* t, const struct iovec* iov, const int iovcnt);
+
+/** bytes ya descifrados que OpenSSL tiene para `tls_recv'; el socket no avisa de ellos */
+size_t tls_pending(const struct tls* t);
+
+/** libera la sesión (NULL no hace nada). No cierra el socket */
+void tls_free(struct tls* t);
+
+/** libera el certificado y la clave */
+void tls_close(void);
+
+#endif
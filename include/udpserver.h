@@ -3,6 +3,20 @@
 
 #include "selector.h"
 
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * prepara las sesiones del protocolo de supervisión: como mucho
+ * `max_clients' simultáneas, que expiran luego de `idle_timeout' segundos
+ * sin actividad. `pass' es el token del protocolo binario: si es más largo
+ * que ADMIN_TOKEN_SIZE retorna false.
+ */
+bool udp_server_init(const size_t max_clients, const unsigned idle_timeout, const char* pass);
+
+/** libera los recursos de `udp_server_init' */
+void udp_server_close(void);
+
 void udp_read_handler(struct selector_key* key);
 
 #endif
@@ -0,0 +1,80 @@
+#ifndef __UPGRADE_H__
+#define __UPGRADE_H__
+
+#include "selector.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * upgrade.c - reemplazo del binario sin dejar de atender (SIGUSR2)
+ *
+ * El proceso viejo hace fork+exec del binario (el mismo argv[0], que ya puede
+ * ser otro archivo) y le pasa por un socketpair, con SCM_RIGHTS, el socket
+ * SMTP y el de supervisión junto con un blob con sus contadores. El nuevo
+ * los usa en lugar de crear los suyos y, cuando terminó de iniciar, avisa por
+ * el mismo socket. Recién entonces el viejo deja de aceptar conexiones,
+ * espera (con un plazo) a que terminen las sesiones en curso y sale; al salir
+ * manda sus contadores finales para que el nuevo sume lo que pasó durante el
+ * drenaje. El cierre del socket le indica al nuevo que el viejo terminó.
+ *
+ * Si el nuevo no llega a avisar (no se pudo ejecutar, o falló al iniciar) el
+ * viejo sigue atendiendo como si nada.
+ */
+
+/** variable de entorno con el fd del socketpair en el proceso nuevo */
+#define UPGRADE_ENV "SMTPD_UPGRADE_FD"
+
+/** resultado de `upgrade_poll' en el proceso viejo */
+enum upgrade_status
+{
+	/** no hay un upgrade en curso */
+	UPGRADE_IDLE,
+	/** se lanzó el proceso nuevo y todavía no avisó */
+	UPGRADE_STARTING,
+	/** el proceso nuevo atiende: hay que dejar de aceptar y drenar */
+	UPGRADE_READY,
+	/** el proceso nuevo murió o falló al iniciar */
+	UPGRADE_FAILED,
+};
+
+/**
+ * en el proceso nuevo: si lo lanzó un upgrade, recibe el socket SMTP en
+ * `server' y el de supervisión en `mng_server', y suma los contadores del
+ * proceso viejo. Retorna false si no lo lanzó un upgrade o si no se pudo
+ * recibir el handoff, en cuyo caso `*server' y `*mng_server' quedan en -1.
+ */
+bool upgrade_inherit(int* server, int* mng_server);
+
+/**
+ * en el proceso nuevo: avisa al viejo que ya atiende y vigila (registrando
+ * el socket en `s') su salida. No hace nada si no lo lanzó un upgrade.
+ */
+bool upgrade_ready(fd_selector s);
+
+/** en el proceso nuevo: indica si el proceso viejo todavía está drenando */
+bool upgrade_parent_running(void);
+
+/**
+ * en el proceso viejo: lanza `argv' con los sockets `server' y `mng_server'.
+ * El resultado se consulta con `upgrade_poll'. Retorna false si no se pudo
+ * lanzar (o si ya hay un upgrade en curso).
+ */
+bool upgrade_start(fd_selector s, char** argv, const int server, const int mng_server);
+
+/**
+ * en el proceso viejo: estado del upgrade. UPGRADE_READY y UPGRADE_FAILED se
+ * informan una única vez; después de un fallo se puede volver a intentar.
+ */
+enum upgrade_status upgrade_poll(void);
+
+/** pid del proceso nuevo, o -1 */
+pid_t upgrade_child(void);
+
+/**
+ * en el proceso viejo, al salir: manda los contadores finales al proceso
+ * nuevo y cierra el socket.
+ */
+void upgrade_finish(void);
+
+#endif
@@ -0,0 +1,261 @@
+/**
+ * admin_protocol.c - protocolo binario de supervisión
+ */
+#include "admin_protocol.h"
+
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+static const char* stat_names[] = {
+	[ADMIN_STAT_COUNT] = "count",
+	[ADMIN_STAT_P50] = "p50",
+	[ADMIN_STAT_P90] = "p90",
+	[ADMIN_STAT_P99] = "p99",
+	[ADMIN_STAT_P999] = "p999",
+	[ADMIN_STAT_MAX] = "max",
+};
+
+static const char* config_names[] = {
+	[ADMIN_CONFIG_MAX_USERS] = "max_users",
+	[ADMIN_CONFIG_TRANSFORMATIONS] = "transformations",
+};
+
+static void
+put16(uint8_t* p, const uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void
+put32(uint8_t* p, const uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+put64(uint8_t* p, const uint64_t v)
+{
+	put32(p, v >> 32);
+	put32(p + 4, v);
+}
+
+static uint16_t
+get16(const uint8_t* p)
+{
+	return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t
+get32(const uint8_t* p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static uint64_t
+get64(const uint8_t* p)
+{
+	return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+bool
+admin_is_binary(const uint8_t* data, const size_t len)
+{
+	return len > 0 && data[0] == ADMIN_SIGNATURE;
+}
+
+enum admin_status
+admin_request_parse(const uint8_t* data, const size_t len, struct admin_request* req)
+{
+	memset(req, 0, sizeof(*req));
+
+	if (len < ADMIN_REQUEST_HEADER || data[0] != ADMIN_SIGNATURE) {
+		return ADMIN_BAD_REQUEST;
+	}
+
+	const uint8_t* p = data + 1;
+	req->version = *p++;
+	memcpy(req->token, p, ADMIN_TOKEN_SIZE);
+	p += ADMIN_TOKEN_SIZE;
+	req->id = get32(p);
+	p += 4;
+
+	if (req->version != ADMIN_VERSION) {
+		return ADMIN_BAD_VERSION;
+	}
+
+	req->count = *p++;
+	if (req->count > ADMIN_MAX_METRICS || len != ADMIN_REQUEST_HEADER + (size_t)req->count * 2) {
+		req->count = 0;
+		return ADMIN_BAD_REQUEST;
+	}
+
+	for (unsigned i = 0; i < req->count; i++, p += 2) {
+		req->metrics[i] = get16(p);
+	}
+
+	return ADMIN_OK;
+}
+
+size_t
+admin_request_build(const struct admin_request* req, uint8_t* out, const size_t outlen)
+{
+	const size_t len = ADMIN_REQUEST_HEADER + (size_t)req->count * 2;
+	if (req->count > ADMIN_MAX_METRICS || len > outlen) {
+		return 0;
+	}
+
+	uint8_t* p = out;
+	*p++ = ADMIN_SIGNATURE;
+	*p++ = req->version;
+	memcpy(p, req->token, ADMIN_TOKEN_SIZE);
+	p += ADMIN_TOKEN_SIZE;
+	put32(p, req->id);
+	p += 4;
+	*p++ = req->count;
+	for (unsigned i = 0; i < req->count; i++, p += 2) {
+		put16(p, req->metrics[i]);
+	}
+
+	return len;
+}
+
+size_t
+admin_response_build(const struct admin_response* res, uint8_t* out, const size_t outlen)
+{
+	const size_t len = ADMIN_RESPONSE_HEADER + (size_t)res->count * ADMIN_ENTRY_SIZE;
+	if (res->count > ADMIN_MAX_METRICS || len > outlen) {
+		return 0;
+	}
+
+	uint8_t* p = out;
+	*p++ = ADMIN_SIGNATURE;
+	*p++ = res->version;
+	*p++ = res->status;
+	put32(p, res->id);
+	p += 4;
+	*p++ = res->count;
+	for (unsigned i = 0; i < res->count; i++) {
+		put16(p, res->values[i].metric);
+		p[2] = res->values[i].status;
+		put64(p + 3, res->values[i].value);
+		p += ADMIN_ENTRY_SIZE;
+	}
+
+	return len;
+}
+
+bool
+admin_response_parse(const uint8_t* data, const size_t len, struct admin_response* res)
+{
+	memset(res, 0, sizeof(*res));
+
+	if (len < ADMIN_RESPONSE_HEADER || data[0] != ADMIN_SIGNATURE) {
+		return false;
+	}
+
+	const uint8_t* p = data + 1;
+	res->version = *p++;
+	res->status = *p++;
+	res->id = get32(p);
+	p += 4;
+	res->count = *p++;
+
+	if (res->count > ADMIN_MAX_METRICS || len != ADMIN_RESPONSE_HEADER + (size_t)res->count * ADMIN_ENTRY_SIZE) {
+		res->count = 0;
+		return false;
+	}
+
+	for (unsigned i = 0; i < res->count; i++) {
+		res->values[i].metric = get16(p);
+		res->values[i].status = p[2];
+		res->values[i].value = get64(p + 3);
+		p += ADMIN_ENTRY_SIZE;
+	}
+
+	return true;
+}
+
+bool
+admin_metric_id(const char* name, uint16_t* id)
+{
+	for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+		if (strcasecmp(name, metrics_counter_name(i)) == 0) {
+			*id = ADMIN_METRIC(ADMIN_CLASS_COUNTER, i);
+			return true;
+		}
+	}
+	for (unsigned i = 0; i < METRIC_GAUGES; i++) {
+		if (strcasecmp(name, metrics_gauge_name(i)) == 0) {
+			*id = ADMIN_METRIC(ADMIN_CLASS_GAUGE, i);
+			return true;
+		}
+	}
+	for (unsigned i = 0; i < ADMIN_CONFIGS; i++) {
+		if (strcasecmp(name, config_names[i]) == 0) {
+			*id = ADMIN_METRIC(ADMIN_CLASS_CONFIG, i);
+			return true;
+		}
+	}
+
+	// histogramas: <nombre>:<estadístico>
+	const char* sep = strchr(name, ':');
+	if (sep == NULL) {
+		return false;
+	}
+	const size_t n = sep - name;
+	for (unsigned i = 0; i < METRIC_HISTOGRAMS; i++) {
+		const char* h = metrics_histogram_name(i);
+		if (strlen(h) != n || strncasecmp(name, h, n) != 0) {
+			continue;
+		}
+		for (unsigned st = 0; st < ADMIN_STATS; st++) {
+			if (strcasecmp(sep + 1, stat_names[st]) == 0) {
+				*id = ADMIN_HISTOGRAM_METRIC(i, st);
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool
+admin_metric_name(const uint16_t id, char* buff, const size_t buffsize)
+{
+	const char* name = NULL;
+
+	if (ADMIN_IS_HISTOGRAM(id)) {
+		const unsigned h = (id >> 3) & 0x1FF, st = id & 0x7;
+		if (h < METRIC_HISTOGRAMS && st < ADMIN_STATS) {
+			snprintf(buff, buffsize, "%s:%s", metrics_histogram_name(h), stat_names[st]);
+			return true;
+		}
+		return false;
+	}
+
+	const unsigned index = id & 0xFF;
+	switch (id >> 8) {
+		case ADMIN_CLASS_COUNTER:
+			name = index < METRIC_COUNTERS ? metrics_counter_name(index) : NULL;
+			break;
+		case ADMIN_CLASS_GAUGE:
+			name = index < METRIC_GAUGES ? metrics_gauge_name(index) : NULL;
+			break;
+		case ADMIN_CLASS_CONFIG:
+			name = index < ADMIN_CONFIGS ? config_names[index] : NULL;
+			break;
+	}
+
+	if (name == NULL) {
+		return false;
+	}
+	snprintf(buff, buffsize, "%s", name);
+	return true;
+}
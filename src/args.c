@@ -1,5 +1,10 @@
 #include "args.h"
 
+#include "admin_protocol.h"
+#include "bufchain.h"
+#include "rcpt_to_list.h"
+#include "relay.h"
+
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h> /* LONG_MIN et al */
@@ -7,7 +12,8 @@
 #include <stdlib.h> /* for exit */
 #include <string.h> /* memset */
 
-#define PASS_LENGTH 8
+/** la contraseña es el token del protocolo binario: más larga se truncaría */
+#define PASS_LENGTH ADMIN_TOKEN_SIZE
 
 static unsigned short
 port(const char* s)
@@ -23,11 +29,31 @@ port(const char* s)
 	return sl;
 }
 
+static unsigned
+number(const char* s, const long min)
+{
+	char* end = 0;
+	const long sl = strtol(s, &end, 10);
+
+	if (end == s || '\0' != *end || ((LONG_MIN == sl || LONG_MAX == sl) && ERANGE == errno) || sl < min ||
+	    sl > UINT_MAX) {
+		fprintf(stderr, "expected a number >= %ld: %s\n", min, s);
+		exit(1);
+	}
+	return sl;
+}
+
+static unsigned
+positive(const char* s)
+{
+	return number(s, 1);
+}
+
 static const char*
 pass(const char* s)
 {
 	if (strlen(s) != PASS_LENGTH) {
-		fprintf(stderr, "password should have 8 characters\n");
+		fprintf(stderr, "password should have %d characters\n", PASS_LENGTH);
 		exit(1);
 	}
 	return s;
@@ -64,9 +90,37 @@ usage(const char* progname)
 	        "   -h               Imprime la ayuda y termina.\n"
 	        "   -p <SMTP port>  Puerto entrante conexiones SMTP.\n"
 	        "   -P <conf port>   Puerto entrante conexiones configuracion\n"
-	        "   -u <pass>		 Contraseña de admin. Hasta 10.\n"
+	        "   -u <pass>		 Contraseña de admin, de 8 caracteres.\n"
 	        "   -T <program>     Prende las transformaciones.\n"
 	        "   -v               Imprime información sobre la versión versión y termina.\n"
+	        "\n"
+	        "   --stats-shm <name>  Segmento de memoria compartida donde se publican las metricas.\n"
+	        "                       Por defecto /smtpd-<SMTP port>; \"none\" lo desactiva.\n"
+	        "   --mng-max-clients <n>   Maximo de sesiones de supervision simultaneas (1024).\n"
+	        "   --mng-idle-timeout <s>  Segundos de inactividad para expirar una sesion de supervision (300).\n"
+	        "   --log-level <level>     Nivel minimo de los eventos registrados: debug, info, warn, error u off (info).\n"
+	        "   --commit-window <us>    Microsegundos que se espera para sincronizar a disco varios mails juntos (1000).\n"
+	        "   --store <backend>       Almacenamiento de los mails: maildir, segment o dedup (maildir).\n"
+	        "   --store-compress <fmt>  Compresion de los mails guardados: none, zlib o zstd, con un nivel\n"
+	        "                           opcional (zlib:9). zstd requiere compilar con ZSTD=1 (none).\n"
+	        "   --local-domain <domain> Dominio de los destinatarios locales (smtpd.com).\n"
+	        "   --relay-host <host[:port]>  Servidor al cual reenviar los mails de otros dominios. Sin\n"
+	        "                           el, esos destinatarios se rechazan.\n"
+	        "   --relay-connections <n> Maximo de conexiones simultaneas al relay (8).\n"
+	        "   --relay-idle <ms>       Milisegundos que una conexion al relay espera otro mail; 0 cierra\n"
+	        "                           la conexion despues de cada mail (10000).\n"
+	        "   --directory <file>      Casillas locales, una direccion por linea. Los dominios que aparecen\n"
+	        "                           son locales y se rechazan sus casillas desconocidas. Se recarga con\n"
+	        "                           SIGHUP o el comando 'reload'. Sin el, se acepta todo --local-domain.\n"
+	        "   --max-rcpts <n>         Maximo de destinatarios por mail (100).\n"
+	        "   --data-buffer <KB>      Maximo de KB que una sesion lee por vez durante el DATA (256).\n"
+	        "   --max-size <bytes>      Maximo de bytes de un mail, anunciado con SIZE; los mas grandes se\n"
+	        "                           rechazan con 552. 0 es sin limite (10240000).\n"
+	        "   --tls-cert <file>       Certificado (con su cadena) en PEM; ofrece STARTTLS. Requiere\n"
+	        "                           compilar con TLS=1.\n"
+	        "   --tls-key <file>        Clave privada en PEM (la del --tls-cert).\n"
+	        "   --upgrade-timeout <s>   Segundos que, luego de un SIGUSR2, el proceso viejo espera a que\n"
+	        "                           terminen sus sesiones antes de cerrarlas (30).\n"
 	        "\n\n",
 	        progname);
 	exit(1);
@@ -81,12 +135,43 @@ parse_args(const int argc, char** argv, struct smtpargs* args)
 	args->mng_port = 6969;
 	args->pass = "secretpa";
 	args->transformations = "tac";
+	args->mng_max_clients = 1024;
+	args->mng_idle_timeout = 300;
+	args->log_level = LOG_INFO;
+	args->commit_window = 1000;
+	args->store = "maildir";
+	args->store_compress = COMPRESS_NONE;
+	args->local_domain = "smtpd.com";
+	args->relay_connections = RELAY_MAX_CONNECTIONS;
+	args->relay_idle = RELAY_IDLE_MS;
+	args->max_rcpts = RCPT_MAX;
+	args->data_buffer = BUFCHAIN_HIGH_WATER / 1024;
+	args->max_size = 10240000;
+	args->upgrade_timeout = 30;
 
 	int c;
 
 	while (true) {
 		int option_index = 0;
-		static struct option long_options[] = { /* { "doh-ip",    required_argument, 0, 0xD001 },
+		static struct option long_options[] = { { "stats-shm", required_argument, 0, 0xD101 },
+			                                    { "mng-max-clients", required_argument, 0, 0xD102 },
+			                                    { "mng-idle-timeout", required_argument, 0, 0xD103 },
+			                                    { "log-level", required_argument, 0, 0xD104 },
+			                                    { "commit-window", required_argument, 0, 0xD105 },
+			                                    { "store", required_argument, 0, 0xD106 },
+			                                    { "store-compress", required_argument, 0, 0xD107 },
+			                                    { "relay-host", required_argument, 0, 0xD108 },
+			                                    { "local-domain", required_argument, 0, 0xD109 },
+			                                    { "relay-connections", required_argument, 0, 0xD10A },
+			                                    { "relay-idle", required_argument, 0, 0xD10B },
+			                                    { "directory", required_argument, 0, 0xD10C },
+			                                    { "max-rcpts", required_argument, 0, 0xD10D },
+			                                    { "data-buffer", required_argument, 0, 0xD10E },
+			                                    { "tls-cert", required_argument, 0, 0xD10F },
+			                                    { "tls-key", required_argument, 0, 0xD110 },
+			                                    { "upgrade-timeout", required_argument, 0, 0xD111 },
+			                                    { "max-size", required_argument, 0, 0xD112 },
+			                                    /* { "doh-ip",    required_argument, 0, 0xD001 },
 			                                    { "doh-port",  required_argument, 0, 0xD002 },
 			                                    { "doh-host",  required_argument, 0, 0xD003 },
 			                                    { "doh-path",  required_argument, 0, 0xD004 },
@@ -118,6 +203,66 @@ parse_args(const int argc, char** argv, struct smtpargs* args)
 				version();
 				exit(0);
 				break;
+			case 0xD101:
+				args->stats_shm = optarg;
+				break;
+			case 0xD102:
+				args->mng_max_clients = positive(optarg);
+				break;
+			case 0xD103:
+				args->mng_idle_timeout = positive(optarg);
+				break;
+			case 0xD104:
+				if (!logger_level_parse(optarg, &args->log_level)) {
+					fprintf(stderr, "unknown log level: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 0xD105:
+				args->commit_window = number(optarg, 0);
+				break;
+			case 0xD106:
+				args->store = optarg;
+				break;
+			case 0xD107:
+				if (!compress_parse(optarg, &args->store_compress, &args->store_compress_level)) {
+					fprintf(stderr, "unknown compression: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 0xD108:
+				args->relay_host = optarg;
+				break;
+			case 0xD109:
+				args->local_domain = optarg;
+				break;
+			case 0xD10A:
+				args->relay_connections = positive(optarg);
+				break;
+			case 0xD10B:
+				args->relay_idle = number(optarg, 0);
+				break;
+			case 0xD10C:
+				args->directory = optarg;
+				break;
+			case 0xD10D:
+				args->max_rcpts = positive(optarg);
+				break;
+			case 0xD10E:
+				args->data_buffer = positive(optarg);
+				break;
+			case 0xD10F:
+				args->tls_cert = optarg;
+				break;
+			case 0xD110:
+				args->tls_key = optarg;
+				break;
+			case 0xD111:
+				args->upgrade_timeout = number(optarg, 0);
+				break;
+			case 0xD112:
+				args->max_size = number(optarg, 0);
+				break;
 			/*case 0xD001:
 				args->doh.ip = optarg;
 				break;
@@ -0,0 +1,225 @@
+/**
+ * bufchain.c - cadena de bloques para lecturas y escrituras grandes
+ */
+#include "bufchain.h"
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/** bloques por readv/writev: con el tamaño por defecto alcanza para 1MB */
+#define MAX_IOV 64
+
+static struct bufchain_block* pool = NULL;
+static unsigned pool_free = 0;
+static size_t pool_blocks = 0;
+
+static struct bufchain_block*
+block_get(void)
+{
+	struct bufchain_block* b = pool;
+	if (b != NULL) {
+		pool = b->next;
+		pool_free--;
+	} else {
+		b = malloc(sizeof(*b));
+		if (b == NULL) {
+			return NULL;
+		}
+		pool_blocks++;
+		metrics_gauge_set(METRIC_BUFCHAIN_BLOCKS, pool_blocks);
+	}
+	b->next = NULL;
+	b->start = b->end = BUFCHAIN_HEADROOM;
+	return b;
+}
+
+static void
+block_put(struct bufchain_block* b)
+{
+	if (pool_free < BUFCHAIN_POOL_MAX) {
+		b->next = pool;
+		pool = b;
+		pool_free++;
+	} else {
+		free(b);
+		pool_blocks--;
+		metrics_gauge_set(METRIC_BUFCHAIN_BLOCKS, pool_blocks);
+	}
+}
+
+void
+bufchain_init(struct bufchain* c, const size_t high_water)
+{
+	memset(c, 0, sizeof(*c));
+	c->max_blocks = (high_water + BUFCHAIN_BLOCK_SIZE - 1) / BUFCHAIN_BLOCK_SIZE;
+	if (c->max_blocks == 0) {
+		c->max_blocks = 1;
+	}
+	c->window = 1;
+}
+
+static void
+append(struct bufchain* c, struct bufchain_block* b)
+{
+	if (c->tail == NULL) {
+		c->head = b;
+	} else {
+		c->tail->next = b;
+	}
+	c->tail = b;
+	c->blocks++;
+}
+
+static ssize_t
+readv_fd(void* fd, const struct iovec* iov, const int iovcnt)
+{
+	return readv(*(const int*)fd, iov, iovcnt);
+}
+
+ssize_t
+bufchain_readv(struct bufchain* c, int fd)
+{
+	return bufchain_fill(c, readv_fd, &fd);
+}
+
+ssize_t
+bufchain_fill(struct bufchain* c, const bufchain_reader reader, void* arg)
+{
+	struct iovec iov[MAX_IOV];
+	int n = 0;
+	size_t offered = 0;
+
+	// el espacio libre del último bloque y bloques nuevos a continuación
+	struct bufchain_block* last = c->tail;
+	if (last != NULL && last->end < BUFCHAIN_BLOCK_SIZE) {
+		iov[n].iov_base = last->data + last->end;
+		iov[n++].iov_len = BUFCHAIN_BLOCK_SIZE - last->end;
+		offered += BUFCHAIN_BLOCK_SIZE - last->end;
+	}
+	struct bufchain_block *added = NULL, **next = &added;
+	for (unsigned blocks = c->blocks, i = 0; blocks < c->max_blocks && i < c->window && n < MAX_IOV; blocks++, i++) {
+		struct bufchain_block* b = block_get();
+		if (b == NULL) {
+			break;
+		}
+		*next = b;
+		next = &b->next;
+		iov[n].iov_base = b->data + b->start;
+		iov[n++].iov_len = BUFCHAIN_BLOCK_SIZE - b->start;
+		offered += BUFCHAIN_BLOCK_SIZE - b->start;
+	}
+	if (n == 0) {
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	const ssize_t ret = reader(arg, iov, n);
+
+	// la ventana sigue a lo que entrega el socket
+	if (ret > 0 && (size_t)ret == offered && c->window < c->max_blocks) {
+		c->window = 2 * c->window < c->max_blocks ? 2 * c->window : c->max_blocks;
+	} else if (ret > 0 && (size_t)ret < offered / 4 && c->window > 1) {
+		c->window /= 2;
+	}
+
+	size_t left = ret > 0 ? ret : 0;
+	c->length += left;
+	if (last != NULL && last->end < BUFCHAIN_BLOCK_SIZE) {
+		const size_t m = left < BUFCHAIN_BLOCK_SIZE - last->end ? left : BUFCHAIN_BLOCK_SIZE - last->end;
+		last->end += m;
+		left -= m;
+	}
+	// los bloques nuevos que no recibieron nada vuelven al pool
+	while (added != NULL) {
+		struct bufchain_block* b = added;
+		added = b->next;
+		b->next = NULL;
+		if (left == 0) {
+			block_put(b);
+			continue;
+		}
+		const size_t m = left < BUFCHAIN_BLOCK_SIZE - b->start ? left : BUFCHAIN_BLOCK_SIZE - b->start;
+		b->end += m;
+		left -= m;
+		append(c, b);
+	}
+	return ret;
+}
+
+int
+bufchain_iov(const struct bufchain* c, struct iovec* iov, const int n)
+{
+	int i = 0;
+	for (const struct bufchain_block* b = c->head; b != NULL && i < n; b = b->next) {
+		if (b->end > b->start) {
+			iov[i].iov_base = (void*)(b->data + b->start);
+			iov[i++].iov_len = b->end - b->start;
+		}
+	}
+	return i;
+}
+
+ssize_t
+bufchain_writev(struct bufchain* c, const int fd)
+{
+	struct iovec iov[MAX_IOV];
+	const int n = bufchain_iov(c, iov, MAX_IOV);
+	const ssize_t ret = writev(fd, iov, n);
+	if (ret > 0) {
+		bufchain_consume(c, ret);
+	}
+	return ret;
+}
+
+size_t
+bufchain_read(struct bufchain* c, uint8_t* dst, const size_t n)
+{
+	size_t copied = 0;
+	for (const struct bufchain_block* b = c->head; b != NULL && copied < n; b = b->next) {
+		size_t m = b->end - b->start;
+		if (m > n - copied) {
+			m = n - copied;
+		}
+		memcpy(dst + copied, b->data + b->start, m);
+		copied += m;
+	}
+	bufchain_consume(c, copied);
+	return copied;
+}
+
+void
+bufchain_consume(struct bufchain* c, size_t n)
+{
+	c->length -= n < c->length ? n : c->length;
+	while (c->head != NULL) {
+		struct bufchain_block* b = c->head;
+		const size_t m = n < b->end - b->start ? n : b->end - b->start;
+		b->start += m;
+		n -= m;
+		if (b->start < b->end) {
+			break;
+		}
+		c->head = b->next;
+		if (c->head == NULL) {
+			c->tail = NULL;
+		}
+		c->blocks--;
+		block_put(b);
+	}
+}
+
+void
+bufchain_free(struct bufchain* c)
+{
+	bufchain_consume(c, c->length);
+}
+
+size_t
+bufchain_pool_blocks(void)
+{
+	return pool_blocks;
+}
@@ -2,27 +2,78 @@
  * buffer.c - buffer con acceso directo (útil para I/O) que mantiene
  *            mantiene puntero de lectura y de escritura.
  */
+#define _GNU_SOURCE
 #include "buffer.h"
 
 #include <assert.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
 
 inline void
 buffer_reset(buffer* b)
 {
 	b->read = b->data;
 	b->write = b->data;
+	if (b->mirror != 0) {
+		b->limit = b->data + b->mirror;
+	}
 }
 
 void
 buffer_init(buffer* b, const size_t n, uint8_t* data)
 {
 	b->data = data;
+	b->mirror = 0;
 	buffer_reset(b);
 	b->limit = b->data + n;
 }
 
+bool
+buffer_init_mirrored(buffer* b, const size_t n)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t size = (n + page - 1) / page * page;
+	uint8_t* area = MAP_FAILED;
+
+	const int fd = memfd_create("buffer", MFD_CLOEXEC);
+	if (fd == -1 || ftruncate(fd, size) == -1) {
+		goto fail;
+	}
+
+	// se reserva el doble y se mapea el mismo archivo en cada mitad
+	area = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (area == MAP_FAILED || mmap(area, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+	    mmap(area + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		goto fail;
+	}
+	close(fd);
+
+	b->data = area;
+	b->mirror = size;
+	buffer_reset(b);
+	return true;
+
+fail:
+	if (area != MAP_FAILED) {
+		munmap(area, 2 * size);
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	return false;
+}
+
+void
+buffer_free_mirrored(buffer* b)
+{
+	if (b->mirror != 0) {
+		munmap(b->data, 2 * b->mirror);
+		b->mirror = 0;
+		b->data = b->limit = b->read = b->write = NULL;
+	}
+}
+
 inline bool
 buffer_can_write(buffer* b)
 {
@@ -67,8 +118,8 @@ buffer_read_adv(buffer* b, const ssize_t bytes)
 		b->read += (size_t)bytes;
 		assert(b->read <= b->write);
 
-		if (b->read == b->write) {
-			// compactacion poco costosa
+		if (b->read == b->write || b->mirror != 0) {
+			// compactacion poco costosa: si es circular nunca copia
 			buffer_compact(b);
 		}
 	}
@@ -99,7 +150,15 @@ buffer_write(buffer* b, uint8_t c)
 void
 buffer_compact(buffer* b)
 {
-	if (b->data == b->read) {
+	if (b->mirror != 0) {
+		if (b->read == b->write) {
+			b->read = b->write = b->data;
+		} else if (b->read >= b->data + b->mirror) {
+			b->read -= b->mirror;
+			b->write -= b->mirror;
+		}
+		b->limit = b->read + b->mirror;
+	} else if (b->data == b->read) {
 		// nada por hacer
 	} else if (b->read == b->write) {
 		b->read = b->data;
@@ -0,0 +1,244 @@
+/**
+ * client_table.c - sesiones de los clientes del protocolo de supervisión
+ */
+#include "client_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/** marca de fin de lista en los índices */
+#define NIL UINT32_MAX
+
+struct node
+{
+	struct client_entry entry;
+	uint32_t hash;
+	/** siguiente en la cadena del bucket (o en la lista de libres) */
+	uint32_t chain;
+	/** vecinos en la lista LRU */
+	uint32_t prev, next;
+};
+
+struct client_table
+{
+	struct node* nodes;
+	size_t capacity;
+
+	uint32_t* buckets;
+	uint32_t bucket_mask;
+
+	/** lista LRU: `head' es el más reciente, `tail' el más viejo */
+	uint32_t head, tail;
+	uint32_t free;
+
+	size_t size;
+	uint64_t evictions;
+	uint64_t idle_timeout;
+};
+
+static uint32_t
+hash_addr(const struct sockaddr_storage* addr, const socklen_t len)
+{
+	// FNV-1a
+	const uint8_t* p = (const uint8_t*)addr;
+	uint32_t h = 2166136261u;
+	for (socklen_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+struct client_table*
+client_table_new(const size_t capacity, const uint64_t idle_timeout)
+{
+	if (capacity == 0 || capacity >= NIL / 2) {
+		return NULL;
+	}
+
+	struct client_table* t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		return NULL;
+	}
+
+	size_t buckets = 1;
+	while (buckets < capacity * 2) {
+		buckets <<= 1;
+	}
+
+	t->nodes = calloc(capacity, sizeof(*t->nodes));
+	t->buckets = malloc(buckets * sizeof(*t->buckets));
+	if (t->nodes == NULL || t->buckets == NULL) {
+		client_table_destroy(t);
+		return NULL;
+	}
+
+	t->capacity = capacity;
+	t->bucket_mask = buckets - 1;
+	t->idle_timeout = idle_timeout;
+	t->head = t->tail = NIL;
+	for (size_t i = 0; i < buckets; i++) {
+		t->buckets[i] = NIL;
+	}
+	for (size_t i = 0; i < capacity; i++) {
+		t->nodes[i].chain = (i + 1 < capacity) ? i + 1 : NIL;
+	}
+	t->free = 0;
+
+	return t;
+}
+
+void
+client_table_destroy(struct client_table* t)
+{
+	if (t != NULL) {
+		free(t->nodes);
+		free(t->buckets);
+		free(t);
+	}
+}
+
+static void
+lru_unlink(struct client_table* t, const uint32_t i)
+{
+	struct node* n = t->nodes + i;
+	if (n->prev != NIL) {
+		t->nodes[n->prev].next = n->next;
+	} else {
+		t->head = n->next;
+	}
+	if (n->next != NIL) {
+		t->nodes[n->next].prev = n->prev;
+	} else {
+		t->tail = n->prev;
+	}
+}
+
+static void
+lru_push_front(struct client_table* t, const uint32_t i)
+{
+	struct node* n = t->nodes + i;
+	n->prev = NIL;
+	n->next = t->head;
+	if (t->head != NIL) {
+		t->nodes[t->head].prev = i;
+	}
+	t->head = i;
+	if (t->tail == NIL) {
+		t->tail = i;
+	}
+}
+
+/** quita el nodo `i' de la tabla y lo devuelve a la lista de libres */
+static void
+remove_node(struct client_table* t, const uint32_t i)
+{
+	struct node* n = t->nodes + i;
+
+	uint32_t* link = &t->buckets[n->hash & t->bucket_mask];
+	while (*link != i) {
+		link = &t->nodes[*link].chain;
+	}
+	*link = n->chain;
+
+	lru_unlink(t, i);
+
+	n->chain = t->free;
+	t->free = i;
+	t->size--;
+	t->evictions++;
+}
+
+static bool
+expired(const struct client_table* t, const struct node* n, const uint64_t now)
+{
+	return t->idle_timeout != 0 && now - n->entry.last_seen >= t->idle_timeout;
+}
+
+/** descarta las sesiones inactivas empezando por la más vieja */
+static void
+expire_idle(struct client_table* t, const uint64_t now)
+{
+	while (t->tail != NIL && expired(t, t->nodes + t->tail, now)) {
+		remove_node(t, t->tail);
+	}
+}
+
+static uint32_t
+lookup(struct client_table* t, const struct sockaddr_storage* addr, const socklen_t len, const uint32_t hash)
+{
+	for (uint32_t i = t->buckets[hash & t->bucket_mask]; i != NIL; i = t->nodes[i].chain) {
+		const struct node* n = t->nodes + i;
+		if (n->hash == hash && n->entry.addr_len == len && memcmp(&n->entry.addr, addr, len) == 0) {
+			return i;
+		}
+	}
+	return NIL;
+}
+
+struct client_entry*
+client_table_find(struct client_table* t,
+                  const struct sockaddr_storage* addr,
+                  const socklen_t addr_len,
+                  const uint64_t now)
+{
+	expire_idle(t, now);
+	const uint32_t i = lookup(t, addr, addr_len, hash_addr(addr, addr_len));
+	return i == NIL ? NULL : &t->nodes[i].entry;
+}
+
+struct client_entry*
+client_table_get(struct client_table* t,
+                 const struct sockaddr_storage* addr,
+                 const socklen_t addr_len,
+                 const uint64_t now)
+{
+	if (addr_len > sizeof(*addr)) {
+		return NULL;
+	}
+
+	expire_idle(t, now);
+
+	const uint32_t hash = hash_addr(addr, addr_len);
+	uint32_t i = lookup(t, addr, addr_len, hash);
+
+	if (i != NIL) {
+		lru_unlink(t, i);
+		lru_push_front(t, i);
+	} else {
+		if (t->free == NIL) {
+			// llena: desalojamos la sesión que hace más tiempo no se usa
+			remove_node(t, t->tail);
+		}
+		i = t->free;
+		struct node* n = t->nodes + i;
+		t->free = n->chain;
+
+		memset(&n->entry, 0, sizeof(n->entry));
+		memcpy(&n->entry.addr, addr, addr_len);
+		n->entry.addr_len = addr_len;
+		n->hash = hash;
+
+		uint32_t* bucket = &t->buckets[hash & t->bucket_mask];
+		n->chain = *bucket;
+		*bucket = i;
+
+		lru_push_front(t, i);
+		t->size++;
+	}
+
+	t->nodes[i].entry.last_seen = now;
+	return &t->nodes[i].entry;
+}
+
+size_t
+client_table_size(const struct client_table* t)
+{
+	return t->size;
+}
+
+uint64_t
+client_table_evictions(const struct client_table* t)
+{
+	return t->evictions;
+}
@@ -0,0 +1,147 @@
+/**
+ * commit.c - entrega durable de mails con group commit
+ */
+#include "commit.h"
+
+#include "relay.h"
+#include "store.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+/** con esta cantidad de trabajos encolados no se sigue esperando la ventana */
+#define COMMIT_MAX_BATCH 256
+
+static unsigned window_us;
+
+static pthread_t thread;
+static bool running = false;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static struct commit_job *head = NULL, *tail = NULL;
+static unsigned pending = 0;
+static bool stopping = false;
+
+static void
+commit_batch(struct commit_job* batch)
+{
+	store_commit(batch);
+	relay_queue_commit(batch);
+
+	struct commit_job* job = batch;
+	while (job != NULL) {
+		// una vez notificada, la sesión puede reutilizar el trabajo
+		struct commit_job* next = job->next;
+		selector_notify_block(job->selector, job->fd);
+		job = next;
+	}
+}
+
+static void
+deadline_after(struct timespec* ts, const unsigned us)
+{
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (long)(us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000L) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000L;
+	}
+}
+
+static void*
+committer(void* arg)
+{
+	pthread_mutex_lock(&mutex);
+	while (true) {
+		while (head == NULL && !stopping) {
+			pthread_cond_wait(&cond, &mutex);
+		}
+		if (head == NULL) {
+			break;
+		}
+
+		// le damos tiempo a otras conexiones para sumarse al lote
+		if (window_us > 0) {
+			struct timespec deadline;
+			deadline_after(&deadline, window_us);
+			while (!stopping && pending < COMMIT_MAX_BATCH) {
+				if (pthread_cond_timedwait(&cond, &mutex, &deadline) == ETIMEDOUT) {
+					break;
+				}
+			}
+		}
+
+		struct commit_job* batch = head;
+		head = tail = NULL;
+		pending = 0;
+		pthread_mutex_unlock(&mutex);
+
+		commit_batch(batch);
+
+		pthread_mutex_lock(&mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+
+	return NULL;
+}
+
+bool
+commit_init(const unsigned window)
+{
+	window_us = window;
+	stopping = false;
+
+	// las señales son para el hilo del selector (ver logger_init)
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	running = pthread_create(&thread, NULL, committer, NULL) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return running;
+}
+
+void
+commit_submit(struct commit_job* job)
+{
+	job->next = NULL;
+	job->ok = false;
+
+	if (!running) {
+		// sin hilo de commit: un lote por mail, en el hilo que llama
+		commit_batch(job);
+		return;
+	}
+
+	pthread_mutex_lock(&mutex);
+	if (tail == NULL) {
+		head = job;
+	} else {
+		tail->next = job;
+	}
+	tail = job;
+	pending++;
+	// mientras junta un lote el hilo sólo necesita enterarse si se llenó
+	if (pending == 1 || pending == COMMIT_MAX_BATCH) {
+		pthread_cond_signal(&cond);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void
+commit_close(void)
+{
+	if (running) {
+		pthread_mutex_lock(&mutex);
+		stopping = true;
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&mutex);
+
+		pthread_join(thread, NULL);
+		running = false;
+	}
+}
@@ -0,0 +1,259 @@
+/**
+ * compress.c - compresión de los mails que se guardan
+ */
+#include "compress.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ZLIB_DEFAULT_LEVEL 6
+#define ZSTD_DEFAULT_LEVEL 3
+
+/** el stream de zlib se escribe con el formato gzip */
+#define ZLIB_GZIP_WINDOW (15 + 16)
+
+static const uint8_t magic[] = { 0x89, 'S', 'M', 'Z' };
+
+struct compressor
+{
+	enum compress_format format;
+	int level;
+	z_stream zlib;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx* zstd;
+#endif
+	uint8_t out[16 * 1024];
+};
+
+bool
+compress_available(const enum compress_format format)
+{
+	switch (format) {
+		case COMPRESS_NONE:
+		case COMPRESS_ZLIB:
+			return true;
+		case COMPRESS_ZSTD:
+#ifdef HAVE_ZSTD
+			return true;
+#else
+			return false;
+#endif
+	}
+	return false;
+}
+
+const char*
+compress_format_name(const enum compress_format format)
+{
+	switch (format) {
+		case COMPRESS_NONE:
+			return "none";
+		case COMPRESS_ZLIB:
+			return "zlib";
+		case COMPRESS_ZSTD:
+			return "zstd";
+	}
+	return "unknown";
+}
+
+bool
+compress_parse(const char* s, enum compress_format* format, int* level)
+{
+	const char* colon = strchr(s, ':');
+	const size_t name_len = colon == NULL ? strlen(s) : (size_t)(colon - s);
+
+	int min, max;
+	if (name_len == 4 && strncmp(s, "none", 4) == 0 && colon == NULL) {
+		*format = COMPRESS_NONE;
+		*level = 0;
+		return true;
+	} else if (name_len == 4 && strncmp(s, "zlib", 4) == 0) {
+		*format = COMPRESS_ZLIB;
+		*level = ZLIB_DEFAULT_LEVEL;
+		min = 0;
+		max = 9;
+	} else if (name_len == 4 && strncmp(s, "zstd", 4) == 0) {
+		*format = COMPRESS_ZSTD;
+		*level = ZSTD_DEFAULT_LEVEL;
+		min = 1;
+		max = 22;
+	} else {
+		return false;
+	}
+
+	if (colon != NULL) {
+		char* end;
+		const long n = strtol(colon + 1, &end, 10);
+		if (colon[1] == 0 || *end != 0 || n < min || n > max) {
+			return false;
+		}
+		*level = n;
+	}
+	return true;
+}
+
+struct compressor*
+compressor_new(const enum compress_format format, const int level)
+{
+	if (format == COMPRESS_NONE || !compress_available(format)) {
+		return NULL;
+	}
+
+	struct compressor* c = malloc(sizeof(*c));
+	if (c == NULL) {
+		return NULL;
+	}
+	memset(c, 0, sizeof(*c));
+	c->format = format;
+	c->level = level;
+
+	if (format == COMPRESS_ZLIB) {
+		if (deflateInit2(&c->zlib, level, Z_DEFLATED, ZLIB_GZIP_WINDOW, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			free(c);
+			return NULL;
+		}
+	}
+#ifdef HAVE_ZSTD
+	if (format == COMPRESS_ZSTD) {
+		c->zstd = ZSTD_createCCtx();
+		if (c->zstd == NULL || ZSTD_isError(ZSTD_CCtx_setParameter(c->zstd, ZSTD_c_compressionLevel, level))) {
+			ZSTD_freeCCtx(c->zstd);
+			free(c);
+			return NULL;
+		}
+		// zstd aloca su espacio de trabajo con el primer frame: lo hacemos
+		// ahora para que después no aloque (ver spawn_transformation)
+		ZSTD_inBuffer in = { NULL, 0, 0 };
+		ZSTD_outBuffer out = { c->out, sizeof(c->out), 0 };
+		ZSTD_compressStream2(c->zstd, &out, &in, ZSTD_e_end);
+	}
+#endif
+	return c;
+}
+
+void
+compressor_free(struct compressor* c)
+{
+	if (c == NULL) {
+		return;
+	}
+	if (c->format == COMPRESS_ZLIB) {
+		deflateEnd(&c->zlib);
+	}
+#ifdef HAVE_ZSTD
+	if (c->format == COMPRESS_ZSTD) {
+		ZSTD_freeCCtx(c->zstd);
+	}
+#endif
+	free(c);
+}
+
+bool
+compressor_begin(struct compressor* c, compress_sink sink, void* arg)
+{
+	if (c->format == COMPRESS_ZLIB && deflateReset(&c->zlib) != Z_OK) {
+		return false;
+	}
+#ifdef HAVE_ZSTD
+	if (c->format == COMPRESS_ZSTD && ZSTD_isError(ZSTD_CCtx_reset(c->zstd, ZSTD_reset_session_only))) {
+		return false;
+	}
+#endif
+
+	uint8_t header[COMPRESS_HEADER_LENGTH];
+	memcpy(header, magic, sizeof(magic));
+	header[4] = COMPRESS_VERSION;
+	header[5] = c->format;
+	header[6] = c->level;
+	header[7] = 0;
+	return sink(arg, header, sizeof(header));
+}
+
+static bool
+zlib_run(struct compressor* c, const uint8_t* data, size_t len, const int flush, compress_sink sink, void* arg)
+{
+	c->zlib.next_in = (Bytef*)data;
+	c->zlib.avail_in = len;
+
+	int ret;
+	do {
+		c->zlib.next_out = c->out;
+		c->zlib.avail_out = sizeof(c->out);
+		ret = deflate(&c->zlib, flush);
+		if (ret == Z_STREAM_ERROR) {
+			return false;
+		}
+		const size_t produced = sizeof(c->out) - c->zlib.avail_out;
+		if (produced > 0 && !sink(arg, c->out, produced)) {
+			return false;
+		}
+	} while (c->zlib.avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+	return true;
+}
+
+#ifdef HAVE_ZSTD
+static bool
+zstd_run(struct compressor* c, const uint8_t* data, size_t len, const ZSTD_EndDirective end, compress_sink sink, void* arg)
+{
+	ZSTD_inBuffer in = { data, len, 0 };
+	size_t remaining;
+	do {
+		ZSTD_outBuffer out = { c->out, sizeof(c->out), 0 };
+		remaining = ZSTD_compressStream2(c->zstd, &out, &in, end);
+		if (ZSTD_isError(remaining)) {
+			return false;
+		}
+		if (out.pos > 0 && !sink(arg, c->out, out.pos)) {
+			return false;
+		}
+	} while (in.pos < in.size || (end == ZSTD_e_end && remaining != 0));
+
+	return true;
+}
+#endif
+
+bool
+compressor_write(struct compressor* c, const uint8_t* data, size_t len, compress_sink sink, void* arg)
+{
+	switch (c->format) {
+		case COMPRESS_ZLIB:
+			return zlib_run(c, data, len, Z_NO_FLUSH, sink, arg);
+#ifdef HAVE_ZSTD
+		case COMPRESS_ZSTD:
+			return zstd_run(c, data, len, ZSTD_e_continue, sink, arg);
+#endif
+		default:
+			return false;
+	}
+}
+
+bool
+compressor_finish(struct compressor* c, compress_sink sink, void* arg)
+{
+	switch (c->format) {
+		case COMPRESS_ZLIB:
+			return zlib_run(c, NULL, 0, Z_FINISH, sink, arg);
+#ifdef HAVE_ZSTD
+		case COMPRESS_ZSTD:
+			return zstd_run(c, NULL, 0, ZSTD_e_end, sink, arg);
+#endif
+		default:
+			return false;
+	}
+}
+
+bool
+compress_header_parse(const uint8_t* data, const size_t len, enum compress_format* format, int* level)
+{
+	if (len < COMPRESS_HEADER_LENGTH || memcmp(data, magic, sizeof(magic)) != 0 || data[4] != COMPRESS_VERSION) {
+		return false;
+	}
+	*format = data[5];
+	*level = (int8_t)data[6];
+	return true;
+}
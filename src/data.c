@@ -4,6 +4,7 @@
 #include "data.h"
 
 #include <arpa/inet.h>
+#include <string.h>
 
 #define N(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -105,6 +106,75 @@ data_consume(buffer* b, struct data_parser* p)
 	return st;
 }
 
+/** lo que retiene el parser en cada estado es un prefijo de esto */
+static const uint8_t held[DATA_HEADROOM] = { '\r', '\n', '.', '\r' };
+
+static size_t
+held_length(const enum data_state st)
+{
+	switch (st) {
+		case data_cr:
+			return 1;
+		case data_crlf:
+			return 2;
+		case data_crlfdot:
+			return 3;
+		case data_crlfdotcr:
+			return 4;
+		default:
+			return 0;
+	}
+}
+
+enum data_state
+data_consume_inplace(struct data_parser* p, uint8_t* data, size_t* len, uint8_t** out, size_t* out_len)
+{
+	enum data_state st = p->state;
+	const uint8_t* in = data;
+	const uint8_t* end = data + *len;
+
+	// lo retenido se escribe justo antes de `data' si hace falta: la salida
+	// nunca alcanza a la entrada, y sin dot-stuffing suelen coincidir
+	uint8_t* start = data - held_length(st);
+	uint8_t* w = start;
+
+	while (in < end && !data_is_done(st)) {
+		if (st == data_data) {
+			const uint8_t* cr = memchr(in, '\r', end - in);
+			const size_t n = (cr == NULL ? end : cr) - in;
+			if (w != in) {
+				memmove(w, in, n);
+			}
+			w += n;
+			in += n;
+			if (cr != NULL) {
+				in++;
+				st = data_cr;
+			}
+			continue;
+		}
+
+		// igual que `data_parser_feed'
+		const uint8_t c = *in++;
+		if ((st == data_cr && c == '\n') || (st == data_crlf && c == '.') || (st == data_crlfdot && c == '\r') ||
+		    (st == data_crlfdotcr && c == '\n')) {
+			st++;
+		} else {
+			const size_t k = held_length(st);
+			memcpy(w, held, k);
+			w += k;
+			*w++ = c;
+			st = data_data;
+		}
+	}
+
+	p->state = st;
+	*len = in - data;
+	*out = start;
+	*out_len = w - start;
+	return st;
+}
+
 void
 data_close(struct data_parser* p)
 {
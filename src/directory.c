@@ -0,0 +1,357 @@
+/**
+ * directory.c - directorio de destinatarios locales
+ */
+#define _GNU_SOURCE
+#include "directory.h"
+
+#include "logger.h"
+#include "metrics.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** offset de un slot vacío; el arreglo de direcciones empieza con un byte de relleno */
+#define EMPTY 0
+
+struct slot
+{
+	uint32_t hash;
+	/** offset de la dirección en `strings', o EMPTY */
+	uint32_t offset;
+};
+
+struct directory
+{
+	struct slot* slots;
+	uint32_t mask;
+	/** direcciones en minúsculas, terminadas en 0 */
+	char* strings;
+	size_t mailboxes;
+	size_t domains;
+};
+
+static uint32_t
+hash_email(const char* s)
+{
+	// FNV-1a, sin distinguir mayúsculas
+	uint32_t h = 2166136261u;
+	for (; *s; s++) {
+		h ^= (uint8_t)tolower((unsigned char)*s);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/** busca `key' (en cualquier caso). Retorna el slot donde está o el vacío donde iría */
+static struct slot*
+probe(const struct directory* d, const char* key, const uint32_t hash)
+{
+	for (uint32_t i = hash & d->mask;; i = (i + 1) & d->mask) {
+		struct slot* s = &d->slots[i];
+		if (s->offset == EMPTY || (s->hash == hash && strcasecmp(d->strings + s->offset, key) == 0)) {
+			return s;
+		}
+	}
+}
+
+/** agrega la dirección en `offset'. Retorna false si ya estaba */
+static bool
+insert(struct directory* d, const uint32_t offset)
+{
+	const char* key = d->strings + offset;
+	const uint32_t hash = hash_email(key);
+	struct slot* s = probe(d, key, hash);
+	if (s->offset != EMPTY) {
+		return false;
+	}
+	s->hash = hash;
+	s->offset = offset;
+	return true;
+}
+
+/**
+ * copia la dirección de la línea `line' (sin espacios alrededor) a `out', en
+ * minúsculas. Retorna su longitud, o 0 si la línea no es una dirección.
+ */
+static size_t
+parse_line(const char* line, const size_t len, char* out)
+{
+	size_t start = 0, end = len;
+	while (start < end && isspace((unsigned char)line[start])) {
+		start++;
+	}
+	while (end > start && isspace((unsigned char)line[end - 1])) {
+		end--;
+	}
+	if (start == end || line[start] == '#') {
+		return 0;
+	}
+
+	const char* at = memchr(line + start, '@', end - start);
+	if (at == NULL || at == line + start || at == line + end - 1) {
+		return 0;
+	}
+	for (size_t i = start; i < end; i++) {
+		if (isspace((unsigned char)line[i])) {
+			return 0;
+		}
+		out[i - start] = tolower((unsigned char)line[i]);
+	}
+	out[end - start] = 0;
+	return end - start;
+}
+
+/** lee todo el archivo `path' en memoria, terminado en 0 */
+static char*
+read_file(const char* path, size_t* len)
+{
+	char* buff = NULL;
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		goto fail;
+	}
+	if (st.st_size >= UINT32_MAX / 4) {
+		errno = EFBIG;
+		goto fail;
+	}
+
+	buff = malloc(st.st_size + 1);
+	if (buff == NULL) {
+		goto fail;
+	}
+	*len = 0;
+	while (*len < (size_t)st.st_size) {
+		const ssize_t n = read(fd, buff + *len, st.st_size - *len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			goto fail;
+		}
+		if (n == 0) {
+			break;
+		}
+		*len += n;
+	}
+	buff[*len] = 0;
+	close(fd);
+	return buff;
+
+fail:
+	if (fd != -1) {
+		const int e = errno;
+		close(fd);
+		errno = e;
+	}
+	free(buff);
+	return NULL;
+}
+
+struct directory*
+directory_load(const char* path)
+{
+	size_t len;
+	struct directory* d = NULL;
+	char* file = read_file(path, &len);
+	if (file == NULL) {
+		goto fail;
+	}
+
+	// cada línea ocupa a lo sumo lo mismo como dirección y otro tanto como dominio
+	size_t lines = 1;
+	for (size_t i = 0; i < len; i++) {
+		lines += file[i] == '\n';
+	}
+	size_t capacity = 16;
+	while (capacity < 4 * lines) {
+		capacity *= 2;
+	}
+
+	d = calloc(1, sizeof(*d));
+	if (d == NULL) {
+		goto fail;
+	}
+	d->mask = capacity - 1;
+	d->slots = calloc(capacity, sizeof(*d->slots));
+	d->strings = malloc(2 * len + 3);
+	if (d->slots == NULL || d->strings == NULL) {
+		goto fail;
+	}
+
+	uint32_t used = 1;
+	for (size_t start = 0; start < len;) {
+		const char* nl = memchr(file + start, '\n', len - start);
+		const size_t line_len = (nl == NULL ? len : (size_t)(nl - file)) - start;
+
+		char* email = d->strings + used;
+		const size_t n = parse_line(file + start, line_len, email);
+		start += line_len + 1;
+		if (n == 0 || !insert(d, used)) {
+			continue;
+		}
+		used += n + 1;
+		d->mailboxes++;
+
+		// el dominio se agrega a continuación, como "@dominio"
+		const char* at = strchr(email, '@');
+		const size_t domain_len = email + n - at;
+		memcpy(d->strings + used, at, domain_len + 1);
+		if (insert(d, used)) {
+			used += domain_len + 1;
+			d->domains++;
+		}
+	}
+
+	free(file);
+	return d;
+
+fail:;
+	const int e = errno;
+	free(file);
+	directory_free(d);
+	errno = e;
+	return NULL;
+}
+
+void
+directory_free(struct directory* d)
+{
+	if (d != NULL) {
+		free(d->slots);
+		free(d->strings);
+		free(d);
+	}
+}
+
+enum directory_result
+directory_find(const struct directory* d, const char* email)
+{
+	const char* at = strchr(email, '@');
+	if (at == NULL) {
+		return DIRECTORY_FOREIGN;
+	}
+	if (probe(d, email, hash_email(email))->offset != EMPTY) {
+		return DIRECTORY_LOCAL;
+	}
+	return probe(d, at, hash_email(at))->offset != EMPTY ? DIRECTORY_UNKNOWN : DIRECTORY_FOREIGN;
+}
+
+size_t
+directory_size(const struct directory* d)
+{
+	return d->mailboxes;
+}
+
+/* directorio del servidor */
+
+static char* path = NULL;
+/** directorio en uso; sólo lo toca el hilo del selector */
+static struct directory* current = NULL;
+
+/** directorio que terminó de cargar una recarga, a la espera de `directory_poll' */
+static _Atomic(struct directory*) pending = NULL;
+/** errno de la última recarga que falló, o 0 */
+static atomic_int failed = 0;
+static atomic_bool loading = false;
+static pthread_t loader;
+static bool loader_started = false;
+
+bool
+directory_init(const char* p)
+{
+	path = strdup(p);
+	if (path == NULL) {
+		return false;
+	}
+	current = directory_load(path);
+	if (current == NULL) {
+		return false;
+	}
+	metrics_gauge_set(METRIC_DIRECTORY_MAILBOXES, current->mailboxes);
+	return true;
+}
+
+bool
+directory_enabled(void)
+{
+	return current != NULL;
+}
+
+enum directory_result
+directory_lookup(const char* email)
+{
+	return directory_find(current, email);
+}
+
+static void*
+load(void* arg)
+{
+	struct directory* d = directory_load(path);
+	if (d == NULL) {
+		atomic_store(&failed, errno == 0 ? EINVAL : errno);
+	} else {
+		// si nadie adoptó la recarga anterior, ésta la reemplaza
+		directory_free(atomic_exchange(&pending, d));
+	}
+	atomic_store(&loading, false);
+	return NULL;
+}
+
+bool
+directory_reload(void)
+{
+	if (path == NULL || atomic_exchange(&loading, true)) {
+		return false;
+	}
+	if (loader_started) {
+		// ya terminó: `loading' estaba en false
+		pthread_join(loader, NULL);
+		loader_started = false;
+	}
+	if (pthread_create(&loader, NULL, load, NULL) != 0) {
+		atomic_store(&loading, false);
+		return false;
+	}
+	loader_started = true;
+	return true;
+}
+
+void
+directory_poll(void)
+{
+	if (atomic_load_explicit(&pending, memory_order_relaxed) != NULL) {
+		struct directory* d = atomic_exchange(&pending, NULL);
+		directory_free(current);
+		current = d;
+		metrics_counter_add(METRIC_DIRECTORY_RELOADS, 1);
+		metrics_gauge_set(METRIC_DIRECTORY_MAILBOXES, d->mailboxes);
+		log_event(LOG_INFO, LOG_EVENT_DIRECTORY_LOAD, NULL, -1, d->mailboxes, d->domains);
+	}
+	if (atomic_load_explicit(&failed, memory_order_relaxed) != 0) {
+		log_event(LOG_WARN, LOG_EVENT_DIRECTORY_FAIL, NULL, -1, atomic_exchange(&failed, 0), 0);
+	}
+}
+
+void
+directory_close(void)
+{
+	if (loader_started) {
+		pthread_join(loader, NULL);
+		loader_started = false;
+	}
+	directory_free(atomic_exchange(&pending, NULL));
+	directory_free(current);
+	current = NULL;
+	free(path);
+	path = NULL;
+}
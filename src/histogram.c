@@ -0,0 +1,108 @@
+/**
+ * histogram.c - histograma log-lineal (estilo HDR) de valores de 64 bits
+ */
+#include "histogram.h"
+
+#include <string.h>
+
+void
+histogram_reset(struct histogram* h)
+{
+	memset(h, 0, sizeof(*h));
+	h->min = UINT64_MAX;
+}
+
+unsigned
+histogram_bucket(const uint64_t value)
+{
+	if (value < HISTOGRAM_SUB_COUNT) {
+		return (unsigned)value;
+	}
+
+	// posición del bit más significativo: el "exponente" del valor
+	const unsigned msb = 63 - __builtin_clzll(value);
+	const unsigned shift = msb - HISTOGRAM_SUB_BITS;
+	const unsigned mantissa = (unsigned)(value >> shift) - HISTOGRAM_SUB_COUNT;
+
+	return (shift + 1) * HISTOGRAM_SUB_COUNT + mantissa;
+}
+
+uint64_t
+histogram_bucket_upper(const unsigned i)
+{
+	if (i < HISTOGRAM_SUB_COUNT) {
+		return i;
+	}
+
+	const unsigned shift = i / HISTOGRAM_SUB_COUNT - 1;
+	const uint64_t mantissa = (i % HISTOGRAM_SUB_COUNT) + HISTOGRAM_SUB_COUNT;
+
+	// el último bucket llega hasta UINT64_MAX, cuidado con el overflow
+	if (shift + HISTOGRAM_SUB_BITS + 1 >= 64 && mantissa == 2 * HISTOGRAM_SUB_COUNT - 1) {
+		return UINT64_MAX;
+	}
+	return ((mantissa + 1) << shift) - 1;
+}
+
+void
+histogram_record(struct histogram* h, const uint64_t value)
+{
+	h->buckets[histogram_bucket(value)]++;
+	h->count++;
+	h->sum += value;
+	if (value < h->min) {
+		h->min = value;
+	}
+	if (value > h->max) {
+		h->max = value;
+	}
+}
+
+void
+histogram_merge(struct histogram* dst, const struct histogram* src)
+{
+	for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->count != 0 && src->min < dst->min) {
+		dst->min = src->min;
+	}
+	if (src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+uint64_t
+histogram_quantile(const struct histogram* h, const double q)
+{
+	if (h->count == 0) {
+		return 0;
+	}
+
+	uint64_t rank = (uint64_t)(q * (double)h->count + 0.5);
+	if (rank == 0) {
+		rank = 1;
+	} else if (rank > h->count) {
+		rank = h->count;
+	}
+
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			// el bucket es una aproximación; nunca reportamos fuera del rango visto
+			uint64_t ret = histogram_bucket_upper(i);
+			if (ret > h->max) {
+				ret = h->max;
+			}
+			if (ret < h->min) {
+				ret = h->min;
+			}
+			return ret;
+		}
+	}
+
+	return h->max;
+}
@@ -0,0 +1,338 @@
+/**
+ * logger.c - registro asincrónico de eventos
+ */
+#include "logger.h"
+
+#include "metrics.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_MASK (LOG_RING_SIZE - 1)
+
+/** período con el que el hilo de fondo revisa el ring cuando está vacío */
+#define FLUSH_INTERVAL_NS (10 * 1000 * 1000)
+
+/** tamaño del buffer de salida; se escribe cuando no entra otra línea */
+#define OUT_SIZE  (64 * 1024)
+#define LINE_SIZE 256
+
+#define CACHE_LINE 64
+
+struct log_record
+{
+	/** CLOCK_REALTIME en nanosegundos */
+	uint64_t timestamp;
+	int64_t args[LOG_ARGS];
+	uint8_t addr[16];
+	int32_t fd;
+	uint16_t port;
+	uint8_t level;
+	uint8_t event;
+	/** AF_INET, AF_INET6 o 0 si el evento no tiene dirección */
+	uint8_t family;
+};
+
+static struct
+{
+	/** próximo registro a escribir; sólo lo modifica el productor */
+	_Alignas(CACHE_LINE) atomic_uint_fast64_t head;
+	/** copia local del productor de `tail', para no leerla en cada evento */
+	uint64_t cached_tail;
+	uint64_t dropped;
+
+	/** próximo registro a leer; sólo lo modifica el consumidor */
+	_Alignas(CACHE_LINE) atomic_uint_fast64_t tail;
+
+	_Alignas(CACHE_LINE) struct log_record records[LOG_RING_SIZE];
+} ring;
+
+static enum log_level min_level = LOG_OFF;
+static int out_fd = -1;
+static pthread_t thread;
+static bool running = false;
+static atomic_bool stopping;
+
+/**
+ * el hilo de fondo duerme en `wakeup' hasta FLUSH_INTERVAL_NS; el productor
+ * lo despierta antes sólo cuando el ring está por lo menos a la mitad, así que
+ * en el caso normal producir un evento no hace ninguna syscall
+ */
+static pthread_mutex_t wakeup_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+
+static const char* level_names[] = {
+	[LOG_DEBUG] = "DEBUG",
+	[LOG_INFO] = "INFO",
+	[LOG_WARN] = "WARN",
+	[LOG_ERROR] = "ERROR",
+	[LOG_OFF] = "OFF",
+};
+
+static const struct
+{
+	const char* name;
+	const char* args[LOG_ARGS];
+} events[] = {
+	[LOG_EVENT_ACCEPT] = { "accept", { "current", "historic" } },
+	[LOG_EVENT_REJECT] = { "reject", { "current", "max" } },
+	[LOG_EVENT_CLOSE] = { "close", { "current", "duration_ms" } },
+	[LOG_EVENT_RELAY_SENT] = { "relay_sent", { "rcpts", "attempt" } },
+	[LOG_EVENT_RELAY_DEFER] = { "relay_defer", { "code", "retry_s" } },
+	[LOG_EVENT_RELAY_FAIL] = { "relay_fail", { "code", "rcpts" } },
+	[LOG_EVENT_DIRECTORY_LOAD] = { "directory_load", { "mailboxes", "domains" } },
+	[LOG_EVENT_DIRECTORY_FAIL] = { "directory_fail", { "errno", NULL } },
+	[LOG_EVENT_UPGRADE_START] = { "upgrade_start", { "pid", NULL } },
+	[LOG_EVENT_UPGRADE_DRAIN] = { "upgrade_drain", { "sessions", "timeout_s" } },
+	[LOG_EVENT_UPGRADE_FAIL] = { "upgrade_fail", { "pid", NULL } },
+	[LOG_EVENT_UPGRADE_EXIT] = { "upgrade_exit", { "sessions", "drain_ms" } },
+};
+
+bool
+logger_level_parse(const char* name, enum log_level* level)
+{
+	for (unsigned i = 0; i <= LOG_OFF; i++) {
+		if (strcasecmp(name, level_names[i]) == 0) {
+			*level = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+bool
+log_enabled(const enum log_level level)
+{
+	return level >= min_level;
+}
+
+void
+log_event(const enum log_level level,
+          const enum log_event event,
+          const struct sockaddr_storage* addr,
+          const int fd,
+          const int64_t arg0,
+          const int64_t arg1)
+{
+	if (level < min_level) {
+		return;
+	}
+
+	const uint64_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+	if (head - ring.cached_tail == LOG_RING_SIZE) {
+		ring.cached_tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+		if (head - ring.cached_tail == LOG_RING_SIZE) {
+			ring.dropped++;
+			metrics_counter_add(METRIC_LOG_DROPPED, 1);
+			return;
+		}
+	}
+
+	struct log_record* r = ring.records + (head & RING_MASK);
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->timestamp = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+	r->level = level;
+	r->event = event;
+	r->fd = fd;
+	r->args[0] = arg0;
+	r->args[1] = arg1;
+	r->family = 0;
+
+	// sólo se copia la dirección; el formateo queda para el hilo de fondo
+	if (addr != NULL && addr->ss_family == AF_INET6) {
+		const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+		memcpy(r->addr, &in6->sin6_addr, 16);
+		r->port = ntohs(in6->sin6_port);
+		r->family = AF_INET6;
+	} else if (addr != NULL && addr->ss_family == AF_INET) {
+		const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+		memcpy(r->addr, &in->sin_addr, 4);
+		r->port = ntohs(in->sin_port);
+		r->family = AF_INET;
+	}
+
+	atomic_store_explicit(&ring.head, head + 1, memory_order_release);
+
+	// `cached_tail' puede estar muy atrasada: se compara con >= y se refresca,
+	// si no la mitad exacta casi nunca coincide y el consumidor sólo se
+	// despierta por timeout
+	if (head + 1 - ring.cached_tail >= LOG_RING_SIZE / 2) {
+		ring.cached_tail = atomic_load_explicit(&ring.tail, memory_order_acquire);
+		if (head + 1 - ring.cached_tail >= LOG_RING_SIZE / 2) {
+			pthread_cond_signal(&wakeup);
+		}
+	}
+}
+
+uint64_t
+logger_dropped(void)
+{
+	return ring.dropped;
+}
+
+uint64_t
+logger_pending(void)
+{
+	return atomic_load_explicit(&ring.head, memory_order_relaxed) -
+	       atomic_load_explicit(&ring.tail, memory_order_acquire);
+}
+
+static void
+write_all(const char* buff, size_t len)
+{
+	while (len > 0) {
+		const ssize_t n = write(out_fd, buff, len);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// no hay a quién avisarle: se pierde el lote
+			return;
+		}
+		buff += n;
+		len -= n;
+	}
+}
+
+/** formatea un registro en `out'. Retorna la cantidad de bytes escritos */
+static size_t
+format_record(const struct log_record* r, char* out, const size_t size)
+{
+	// la fecha se formatea a lo sumo una vez por segundo
+	static time_t cached_sec = -1;
+	static char cached_date[32];
+
+	const time_t sec = r->timestamp / 1000000000ULL;
+	if (sec != cached_sec) {
+		struct tm tm;
+		gmtime_r(&sec, &tm);
+		strftime(cached_date, sizeof(cached_date), "%Y-%m-%dT%H:%M:%S", &tm);
+		cached_sec = sec;
+	}
+
+	char addr[INET6_ADDRSTRLEN + 8] = "-";
+	if (r->family == AF_INET6 && IN6_IS_ADDR_V4MAPPED((const struct in6_addr*)r->addr)) {
+		inet_ntop(AF_INET, r->addr + 12, addr, sizeof(addr));
+		snprintf(addr + strlen(addr), sizeof(addr) - strlen(addr), ":%u", r->port);
+	} else if (r->family == AF_INET6) {
+		addr[0] = '[';
+		inet_ntop(AF_INET6, r->addr, addr + 1, sizeof(addr) - 1);
+		snprintf(addr + strlen(addr), sizeof(addr) - strlen(addr), "]:%u", r->port);
+	} else if (r->family == AF_INET) {
+		inet_ntop(AF_INET, r->addr, addr, sizeof(addr));
+		snprintf(addr + strlen(addr), sizeof(addr) - strlen(addr), ":%u", r->port);
+	}
+
+	const char* name = r->event < LOG_EVENTS ? events[r->event].name : "unknown";
+	int n = snprintf(out,
+	                 size,
+	                 "%s.%06uZ %s %s client=%s fd=%d",
+	                 cached_date,
+	                 (unsigned)(r->timestamp % 1000000000ULL / 1000),
+	                 level_names[r->level],
+	                 name,
+	                 addr,
+	                 (int)r->fd);
+	for (unsigned i = 0; r->event < LOG_EVENTS && i < LOG_ARGS; i++) {
+		if (events[r->event].args[i] != NULL) {
+			n += snprintf(out + n, size - n, " %s=%lld", events[r->event].args[i], (long long)r->args[i]);
+		}
+	}
+	n += snprintf(out + n, size - n, "\n");
+
+	return (size_t)n < size ? (size_t)n : size - 1;
+}
+
+static void*
+consumer(void* arg)
+{
+	static char out[OUT_SIZE];
+
+	while (true) {
+		// se lee `stopping' antes que `head': todo lo producido antes de
+		// logger_close queda visible en esta misma pasada
+		const bool stop = atomic_load_explicit(&stopping, memory_order_acquire);
+		const uint64_t head = atomic_load_explicit(&ring.head, memory_order_acquire);
+		uint64_t tail = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+		const bool empty = tail == head;
+
+		size_t used = 0;
+		for (; tail != head; tail++) {
+			if (OUT_SIZE - used < LINE_SIZE) {
+				write_all(out, used);
+				used = 0;
+			}
+			used += format_record(ring.records + (tail & RING_MASK), out + used, LINE_SIZE);
+			atomic_store_explicit(&ring.tail, tail + 1, memory_order_release);
+		}
+		write_all(out, used);
+
+		if (stop) {
+			break;
+		}
+		if (empty) {
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += FLUSH_INTERVAL_NS;
+			if (deadline.tv_nsec >= 1000000000L) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000L;
+			}
+			pthread_mutex_lock(&wakeup_mutex);
+			pthread_cond_timedwait(&wakeup, &wakeup_mutex, &deadline);
+			pthread_mutex_unlock(&wakeup_mutex);
+		}
+	}
+
+	return NULL;
+}
+
+bool
+logger_init(const enum log_level level, const int fd)
+{
+	min_level = level;
+	out_fd = fd;
+	atomic_store(&ring.head, 0);
+	atomic_store(&ring.tail, 0);
+	atomic_store(&stopping, false);
+	ring.cached_tail = 0;
+	ring.dropped = 0;
+
+	if (level == LOG_OFF) {
+		return true;
+	}
+
+	// el hilo de fondo no debe recibir señales: el selector depende de que
+	// lleguen a su hilo para interrumpir el pselect
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	running = pthread_create(&thread, NULL, consumer, NULL) == 0;
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (!running) {
+		min_level = LOG_OFF;
+	}
+	return running;
+}
+
+void
+logger_close(void)
+{
+	if (running) {
+		atomic_store_explicit(&stopping, true, memory_order_release);
+		pthread_join(thread, NULL);
+		running = false;
+	}
+	min_level = LOG_OFF;
+}
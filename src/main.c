@@ -11,9 +11,19 @@
  * el selector.
  */
 #include "args.h"
+#include "commit.h"
+#include "directory.h"
+#include "logger.h"
+#include "metrics.h"
+#include "relay.h"
 #include "selector.h"
+#include "shmstats.h"
 #include "smtpnio.h"
+#include "store.h"
+#include "timecache.h"
+#include "tls.h"
 #include "udpserver.h"
+#include "upgrade.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
@@ -25,12 +35,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>  // socket
-#include <sys/types.h>   // socket
+#include <sys/timerfd.h>
+#include <sys/types.h>  // socket
 #include <unistd.h>
 
 #define RESPONSE_SIZE 16
 
 static bool done = false;
+static volatile sig_atomic_t reload = false;
+static volatile sig_atomic_t upgrade = false;
 
 static void
 sigterm_handler(const int signal)
@@ -39,6 +52,46 @@ sigterm_handler(const int signal)
 	done = true;
 }
 
+static void
+sighup_handler(const int signal)
+{
+	reload = true;
+}
+
+static void
+sigusr2_handler(const int signal)
+{
+	upgrade = true;
+}
+
+/** sólo despierta al selector: el plazo del drenaje se revisa en el loop */
+static void
+drain_timer_read(struct selector_key* key)
+{
+	uint64_t expirations;
+	if (read(key->fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+		perror("Error reading drain timer");
+	}
+}
+
+static const struct fd_handler drain_timer_handler = {
+	.handle_read = drain_timer_read,
+};
+
+/**
+ * con _POSIX_C_SOURCE, signal() restaura SIG_DFL al entregar la señal: la
+ * segunda recarga o el segundo upgrade matarían al proceso
+ */
+static void
+persistent_signal(const int signum, void (*handler)(int))
+{
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = handler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(signum, &sa, NULL);
+}
+
 int
 main(int argc, char** argv)
 {
@@ -46,10 +99,23 @@ main(int argc, char** argv)
 	parse_args(argc, argv, &args);
 
 	close(0);
+	metrics_init();
+
+	char stats_shm[64];
+	if (args.stats_shm == NULL) {
+		snprintf(stats_shm, sizeof(stats_shm), SHMSTATS_NAME_FMT, args.smtp_port);
+	} else {
+		snprintf(stats_shm, sizeof(stats_shm), "%s", args.stats_shm);
+	}
+	if (strcmp(stats_shm, "none") != 0 && !shmstats_open(stats_shm)) {
+		// no es fatal: las métricas siguen disponibles por el puerto de administración
+		perror("unable to create stats segment");
+	}
 
 	const char* err_msg = NULL;
 	selector_status ss = SELECTOR_SUCCESS;
 	fd_selector selector = NULL;
+	int drain_timer = -1;
 
 	struct sockaddr_in6 addr;
 	memset(&addr, 0, sizeof(addr));
@@ -57,15 +123,20 @@ main(int argc, char** argv)
 	addr.sin6_addr = in6addr_any;
 	addr.sin6_port = htons(args.smtp_port);
 
-	const int server = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-	const int server_6969 = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	// lanzado por un upgrade (ver upgrade.h): los sockets vienen del proceso viejo
+	int server, mng_server;
+	const bool inherited = upgrade_inherit(&server, &mng_server);
+	if (!inherited) {
+		server = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
+		mng_server = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	}
 	if (server < 0) {
 		err_msg = "unable to create socket";
 		goto finally_tcp;
 	}
 
-	if (server_6969 < 0) {
-		err_msg = "unable to create socket for port 6969";
+	if (mng_server < 0) {
+		err_msg = "unable to create management socket";
 		goto finally_udp;
 	}
 
@@ -74,42 +145,51 @@ main(int argc, char** argv)
 	setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
 	setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, &(int){ 0 }, sizeof(int));
 
-	if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+	if (!inherited && bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
 		err_msg = "unable to bind socket";
 		goto finally;
 	}
 
-	if (listen(server, 20) < 0) {
+	// con una cola chica, las conexiones que llegan en ráfaga y no entran se
+	// pierden sin que el cliente se entere (con syncookies queda esperando)
+	if (!inherited && listen(server, SOMAXCONN) < 0) {
 		err_msg = "unable to listen";
 		goto finally;
 	}
 
-	// Socket en el puerto 6969 con UDP
-	struct sockaddr_in6 addr_6969;
-	memset(&addr_6969, 0, sizeof(addr_6969));
-	addr_6969.sin6_family = AF_INET6;
-	addr_6969.sin6_addr = in6addr_any;
-	addr_6969.sin6_port = htons(6969);
+	// Socket UDP para el protocolo de supervisión
+	struct sockaddr_in6 mng_addr;
+	memset(&mng_addr, 0, sizeof(mng_addr));
+	mng_addr.sin6_family = AF_INET6;
+	mng_addr.sin6_addr = in6addr_any;
+	mng_addr.sin6_port = htons(args.mng_port);
 
-	fprintf(stdout, "Listening on UDP port 6969\n");
+	fprintf(stdout, "Listening on UDP port %d\n", args.mng_port);
 
-	setsockopt(server_6969, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
+	setsockopt(mng_server, SOL_SOCKET, SO_REUSEADDR, &(int){ 1 }, sizeof(int));
 
-	if (bind(server_6969, (struct sockaddr*)&addr_6969, sizeof(addr_6969)) < 0) {
-		err_msg = "unable to bind socket for port 6969";
+	if (!inherited && bind(mng_server, (struct sockaddr*)&mng_addr, sizeof(mng_addr)) < 0) {
+		err_msg = "unable to bind management socket";
 		goto finally;
 	}
 
 	signal(SIGTERM, sigterm_handler);
 	signal(SIGINT, sigterm_handler);
+	persistent_signal(SIGHUP, sighup_handler);
+	persistent_signal(SIGUSR2, sigusr2_handler);
 
 	if (selector_fd_set_nio(server) == -1) {
 		err_msg = "getting server socket flags";
 		goto finally;
 	}
 
-	if (selector_fd_set_nio(server_6969) == -1) {
-		err_msg = "getting server_6969 socket flags";
+	if (selector_fd_set_nio(mng_server) == -1) {
+		err_msg = "getting management socket flags";
+		goto finally;
+	}
+
+	if (!udp_server_init(args.mng_max_clients, args.mng_idle_timeout, args.pass)) {
+		err_msg = "unable to initialize management sessions";
 		goto finally;
 	}
 
@@ -145,21 +225,78 @@ main(int argc, char** argv)
 		.handle_close = NULL,
 	};
 
-	ss = selector_register(selector, server, &smtp, OP_READ, args.transformations);
+	struct smtp_listener listener = {
+		.program = args.transformations,
+		.max_size = args.max_size,
+	};
+	ss = selector_register(selector, server, &smtp, OP_READ, &listener);
 	set_new_status(args.transformations != NULL);
+	set_local_domain(args.local_domain);
+	set_max_rcpts(args.max_rcpts);
+	set_data_high_water((size_t)args.data_buffer * 1024);
 
 	if (ss != SELECTOR_SUCCESS) {
 		err_msg = "registering fd";
 		goto finally;
 	}
 
-	ss = selector_register(selector, server_6969, &udp, OP_READ, NULL);
+	ss = selector_register(selector, mng_server, &udp, OP_READ, NULL);
 
 	if (ss != SELECTOR_SUCCESS) {
-		err_msg = "registering fd for port 6969";
+		err_msg = "registering management fd";
 		goto finally;
 	}
 
+	if (!store_set_compression(args.store_compress, args.store_compress_level)) {
+		err_msg = "compression format not available in this build";
+		goto finally;
+	}
+
+	if (!store_init(args.store)) {
+		err_msg = "unable to initialize mail store";
+		goto finally;
+	}
+
+	if (args.directory != NULL && !directory_init(args.directory)) {
+		err_msg = "unable to load recipient directory";
+		goto finally;
+	}
+
+	relay_set_pool(args.relay_connections, args.relay_idle);
+	// la cola la envía el proceso viejo hasta que sale
+	if (inherited) {
+		relay_hold();
+	}
+	if (args.relay_host != NULL && !relay_init(selector, args.relay_host)) {
+		err_msg = "unable to start relay";
+		goto finally;
+	}
+
+	// sin --tls-key, la clave está en el mismo PEM que el certificado
+	if (args.tls_cert != NULL && !tls_init(args.tls_cert, args.tls_key != NULL ? args.tls_key : args.tls_cert, true)) {
+		err_msg = "unable to load TLS certificate";
+		goto finally;
+	}
+
+	if (!commit_init(args.commit_window)) {
+		err_msg = "unable to start commit thread";
+		goto finally;
+	}
+
+	// lo que se escribió por stdio debe salir antes que los eventos del logger
+	fflush(stdout);
+	if (!logger_init(args.log_level, STDOUT_FILENO)) {
+		err_msg = "unable to start logger";
+		goto finally;
+	}
+
+	if (!upgrade_ready(selector)) {
+		perror("unable to notify the previous process");
+	}
+	bool relay_held = inherited;
+	bool draining = false;
+	uint64_t drain_start = 0;
+
 	while (!done) {
 		err_msg = NULL;
 		ss = selector_select(selector);
@@ -167,6 +304,81 @@ main(int argc, char** argv)
 			err_msg = "serving";
 			goto finally;
 		}
+		timecache_invalidate();
+		if (reload) {
+			reload = false;
+			directory_reload();
+		}
+		directory_poll();
+
+		if (upgrade) {
+			upgrade = false;
+			if (draining || upgrade_parent_running()) {
+				fprintf(stderr, "upgrade already in progress\n");
+			} else if (store_get()->single_writer) {
+				fprintf(stderr, "the %s store does not support upgrades\n", store_get()->name);
+			} else if (!upgrade_start(selector, argv, server, mng_server)) {
+				perror("unable to start upgrade");
+			} else {
+				log_event(LOG_INFO, LOG_EVENT_UPGRADE_START, NULL, -1, upgrade_child(), 0);
+			}
+		}
+		switch (upgrade_poll()) {
+			case UPGRADE_READY:
+				if (!draining) {
+					// el proceso nuevo atiende: se deja de aceptar y se espera a las sesiones
+					selector_unregister_fd(selector, server);
+					close(server);
+					server = -1;
+					selector_unregister_fd(selector, mng_server);
+					close(mng_server);
+					mng_server = -1;
+					relay_hold();
+					shmstats_release();
+					draining = true;
+					drain_start = metrics_now();
+					// sin sesiones que despierten al selector, el plazo se pasaría hasta en
+					// select_timeout
+					struct itimerspec its;
+					memset(&its, 0, sizeof(its));
+					its.it_value.tv_sec = args.upgrade_timeout;
+					drain_timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+					if (drain_timer == -1 || timerfd_settime(drain_timer, 0, &its, NULL) == -1 ||
+					    selector_register(selector, drain_timer, &drain_timer_handler, OP_READ, NULL) !=
+					        SELECTOR_SUCCESS) {
+						perror("unable to arm the drain timer");
+					}
+					log_event(LOG_INFO,
+					          LOG_EVENT_UPGRADE_DRAIN,
+					          NULL,
+					          -1,
+					          metrics_gauge(METRIC_CURRENT_USERS),
+					          args.upgrade_timeout);
+				}
+				break;
+			case UPGRADE_FAILED:
+				log_event(LOG_WARN, LOG_EVENT_UPGRADE_FAIL, NULL, -1, upgrade_child(), 0);
+				break;
+			default:
+				break;
+		}
+		if (draining && ((metrics_gauge(METRIC_CURRENT_USERS) == 0 && !relay_busy()) ||
+		                 metrics_now() - drain_start >= (uint64_t)args.upgrade_timeout * 1000000000ULL)) {
+			log_event(LOG_INFO,
+			          LOG_EVENT_UPGRADE_EXIT,
+			          NULL,
+			          -1,
+			          metrics_gauge(METRIC_CURRENT_USERS),
+			          (metrics_now() - drain_start) / 1000000);
+			done = true;
+		}
+		if (relay_held && !upgrade_parent_running()) {
+			relay_held = false;
+			relay_release();
+		}
+
+		metrics_histogram_record(METRIC_SELECTOR_LOOP, selector_dispatch_time(selector));
+		shmstats_publish();
 	}
 
 	if (err_msg == NULL) {
@@ -176,8 +388,8 @@ main(int argc, char** argv)
 	int ret = 0;
 
 finally_udp:
-	if (server_6969 >= 0) {
-		close(server_6969);
+	if (mng_server >= 0) {
+		close(mng_server);
 	}
 
 finally_tcp:
@@ -197,10 +409,23 @@ finally:
 		ret = 1;
 	}
 
+	// las sesiones que esperan un commit se liberan con el selector
+	commit_close();
 	if (selector != NULL) {
 		selector_destroy(selector);
 	}
+	if (drain_timer >= 0) {
+		close(drain_timer);
+	}
+	relay_close();
+	directory_close();
+	tls_close();
+	// los contadores finales, después de los últimos commits
+	upgrade_finish();
 
 	selector_close();
+	logger_close();
+	udp_server_close();
+	shmstats_close();
 	return ret;
 }
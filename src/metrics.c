@@ -0,0 +1,207 @@
+/**
+ * metrics.c - registro de métricas del servidor
+ */
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define N(x) (sizeof(x) / sizeof((x)[0]))
+
+static uint64_t counters[METRIC_COUNTERS];
+static int64_t gauges[METRIC_GAUGES];
+static struct histogram histograms[METRIC_HISTOGRAMS];
+
+static const char* counter_names[] = {
+	[METRIC_HISTORIC_USERS] = "historic_users",
+	[METRIC_BYTES_IN] = "bytes_in",
+	[METRIC_BYTES_OUT] = "bytes_out",
+	[METRIC_MAILS] = "mails",
+	[METRIC_REJECTED_USERS] = "rejected_users",
+	[METRIC_LOG_DROPPED] = "log_dropped",
+	[METRIC_STORE_BYTES] = "store_bytes",
+	[METRIC_STORE_BYTES_SAVED] = "store_bytes_saved",
+	[METRIC_RELAY_QUEUED] = "relay_queued",
+	[METRIC_RELAY_DELIVERED] = "relay_delivered",
+	[METRIC_RELAY_DEFERRED] = "relay_deferred",
+	[METRIC_RELAY_FAILED] = "relay_failed",
+	[METRIC_RELAY_REUSED] = "relay_reused",
+	[METRIC_DIRECTORY_RELOADS] = "directory_reloads",
+	[METRIC_RCPT_UNKNOWN] = "rcpt_unknown",
+	[METRIC_TLS_HANDSHAKES] = "tls_handshakes",
+	[METRIC_TLS_FAILED] = "tls_failed",
+	[METRIC_TLS_KTLS] = "tls_ktls",
+	[METRIC_SIZE_REJECTED] = "size_rejected",
+};
+
+static const char* gauge_names[] = {
+	[METRIC_CURRENT_USERS] = "current_users",
+	[METRIC_SESSIONS_IN_STATE + GREETING_WRITE] = "sessions_greeting_write",
+	[METRIC_SESSIONS_IN_STATE + FAILED_CONNECTION_READ] = "sessions_failed_connection_read",
+	[METRIC_SESSIONS_IN_STATE + FAILED_CONNECTION_WRITE] = "sessions_failed_connection_write",
+	[METRIC_SESSIONS_IN_STATE + EHLO_READ] = "sessions_ehlo_read",
+	[METRIC_SESSIONS_IN_STATE + EHLO_WRITE] = "sessions_ehlo_write",
+	[METRIC_SESSIONS_IN_STATE + STARTTLS_WRITE] = "sessions_starttls_write",
+	[METRIC_SESSIONS_IN_STATE + TLS_HANDSHAKE] = "sessions_tls_handshake",
+	[METRIC_SESSIONS_IN_STATE + MAIL_FROM_READ] = "sessions_mail_from_read",
+	[METRIC_SESSIONS_IN_STATE + MAIL_FROM_WRITE] = "sessions_mail_from_write",
+	[METRIC_SESSIONS_IN_STATE + RCPT_TO_READ] = "sessions_rcpt_to_read",
+	[METRIC_SESSIONS_IN_STATE + RCPT_TO_WRITE] = "sessions_rcpt_to_write",
+	[METRIC_SESSIONS_IN_STATE + DATA_READ] = "sessions_data_read",
+	[METRIC_SESSIONS_IN_STATE + DATA_WRITE] = "sessions_data_write",
+	[METRIC_SESSIONS_IN_STATE + MAIL_INFO_READ] = "sessions_mail_info_read",
+	[METRIC_SESSIONS_IN_STATE + MAIL_COMMIT] = "sessions_mail_commit",
+	[METRIC_SESSIONS_IN_STATE + MAIL_INFO_WRITE] = "sessions_mail_info_write",
+	[METRIC_SESSIONS_IN_STATE + DONE] = "sessions_done",
+	[METRIC_SESSIONS_IN_STATE + ERROR] = "sessions_error",
+	[METRIC_RELAY_QUEUE] = "relay_queue",
+	[METRIC_RELAY_CONNECTIONS] = "relay_connections",
+	[METRIC_DIRECTORY_MAILBOXES] = "directory_mailboxes",
+	[METRIC_BUFCHAIN_BLOCKS] = "bufchain_blocks",
+	[METRIC_SESSION_BYTES] = "session_bytes",
+};
+
+static const char* histogram_names[] = {
+	[METRIC_GREETING_LATENCY] = "greeting_latency_ns",
+	[METRIC_DATA_SIZE] = "data_size_bytes",
+	[METRIC_QUEUED_LATENCY] = "queued_latency_ns",
+	[METRIC_SELECTOR_LOOP] = "selector_loop_ns",
+	[METRIC_DATA_READ] = "data_read_bytes",
+	[METRIC_DATA_RATE] = "data_rate_bytes_per_s",
+	[METRIC_COMMAND_LATENCY + request_command_ehlo] = "command_ehlo_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_helo] = "command_helo_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_mail] = "command_mail_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_rcpt] = "command_rcpt_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_data] = "command_data_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_rset] = "command_rset_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_quit] = "command_quit_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_noop] = "command_noop_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_vrfy] = "command_vrfy_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_expn] = "command_expn_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_help] = "command_help_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_starttls] = "command_starttls_latency_ns",
+	[METRIC_COMMAND_LATENCY + request_command_unknown] = "command_unknown_latency_ns",
+};
+
+void
+metrics_init(void)
+{
+	memset(counters, 0, sizeof(counters));
+	memset(gauges, 0, sizeof(gauges));
+	for (unsigned i = 0; i < N(histograms); i++) {
+		histogram_reset(&histograms[i]);
+	}
+}
+
+uint64_t
+metrics_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+void
+metrics_counter_add(const enum metric_counter c, const uint64_t n)
+{
+	counters[c] += n;
+}
+
+uint64_t
+metrics_counter(const enum metric_counter c)
+{
+	return counters[c];
+}
+
+void
+metrics_gauge_add(const enum metric_gauge g, const int64_t delta)
+{
+	gauges[g] += delta;
+}
+
+void
+metrics_gauge_set(const enum metric_gauge g, const int64_t value)
+{
+	gauges[g] = value;
+}
+
+int64_t
+metrics_gauge(const enum metric_gauge g)
+{
+	return gauges[g];
+}
+
+void
+metrics_histogram_record(const enum metric_histogram h, const uint64_t value)
+{
+	histogram_record(&histograms[h], value);
+}
+
+const struct histogram*
+metrics_histogram(const enum metric_histogram h)
+{
+	return &histograms[h];
+}
+
+const char*
+metrics_counter_name(const enum metric_counter c)
+{
+	return counter_names[c];
+}
+
+const char*
+metrics_gauge_name(const enum metric_gauge g)
+{
+	return gauge_names[g];
+}
+
+const char*
+metrics_histogram_name(const enum metric_histogram h)
+{
+	return histogram_names[h];
+}
+
+size_t
+metrics_dump(char* buff, const size_t buffsize)
+{
+	size_t len = 0;
+	int n;
+
+	if (buffsize == 0) {
+		return 0;
+	}
+	buff[0] = '\0';
+
+#define APPEND(...)                                               \
+	do {                                                          \
+		n = snprintf(buff + len, buffsize - len, __VA_ARGS__);    \
+		if (n < 0 || (size_t)n >= buffsize - len) {               \
+			return len;                                           \
+		}                                                         \
+		len += n;                                                 \
+	} while (0)
+
+	for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+		APPEND("counter %s %llu\n", counter_names[i], (unsigned long long)counters[i]);
+	}
+	for (unsigned i = 0; i < METRIC_GAUGES; i++) {
+		APPEND("gauge %s %lld\n", gauge_names[i], (long long)gauges[i]);
+	}
+	for (unsigned i = 0; i < METRIC_HISTOGRAMS; i++) {
+		const struct histogram* h = &histograms[i];
+		APPEND("histogram %s count=%llu min=%llu p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n",
+		       histogram_names[i],
+		       (unsigned long long)h->count,
+		       (unsigned long long)(h->count == 0 ? 0 : h->min),
+		       (unsigned long long)histogram_quantile(h, 0.50),
+		       (unsigned long long)histogram_quantile(h, 0.90),
+		       (unsigned long long)histogram_quantile(h, 0.99),
+		       (unsigned long long)histogram_quantile(h, 0.999),
+		       (unsigned long long)h->max);
+	}
+
+#undef APPEND
+
+	return len;
+}
@@ -1,98 +1,499 @@
+#define _GNU_SOURCE
 #include "rcpt_to_list.h"
 
+#include "probes.h"
+#include "timecache.h"
+
+#include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
-#include <uuid/uuid.h>
 
-struct rcpt_node*
-create_rcpt_node(const char* email)
+/** tamaño de cada bloque de la arena de direcciones */
+#define RCPT_CHUNK_SIZE 1024
+
+struct rcpt_chunk
+{
+	struct rcpt_chunk* next;
+	size_t used;
+	char data[RCPT_CHUNK_SIZE];
+};
+
+static uint32_t
+hash_email(const char* s)
+{
+	// FNV-1a
+	uint32_t h = 2166136261u;
+	for (; *s; s++) {
+		h ^= (uint8_t)*s;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+/** slot de `email' en la tabla: el que lo tiene o el libre donde iría */
+static uint32_t*
+find_slot(const struct rcpt_set* set, const char* email)
+{
+	const size_t mask = 2 * set->capacity - 1;
+	for (size_t i = hash_email(email) & mask;; i = (i + 1) & mask) {
+		uint32_t* slot = &set->slots[i];
+		if (*slot == 0 || strcmp(set->nodes[*slot - 1].email, email) == 0) {
+			return slot;
+		}
+	}
+}
+
+/** duplica la capacidad del arreglo de nodos y rearma la tabla */
+static bool
+grow(struct rcpt_set* set)
+{
+	const size_t capacity = set->capacity == 0 ? 8 : 2 * set->capacity;
+	struct rcpt_node* nodes = realloc(set->nodes, capacity * sizeof(*nodes));
+	if (nodes == NULL) {
+		return false;
+	}
+	set->nodes = nodes;
+
+	uint32_t* slots = calloc(2 * capacity, sizeof(*slots));
+	if (slots == NULL) {
+		return false;
+	}
+	free(set->slots);
+	set->slots = slots;
+	set->capacity = capacity;
+	for (size_t i = 0; i < set->count; i++) {
+		*find_slot(set, set->nodes[i].email) = i + 1;
+	}
+	return true;
+}
+
+/** copia `email' (de longitud `len') a la arena */
+static const char*
+arena_copy(struct rcpt_set* set, const char* email, const size_t len)
 {
-	struct rcpt_node* new_node = (struct rcpt_node*)malloc(sizeof(struct rcpt_node));
-	if (new_node == NULL) {
-		perror("Failed to allocate memory for new recipient node");
-		exit(EXIT_FAILURE);
+	if (set->arena == NULL || set->arena->used + len + 1 > RCPT_CHUNK_SIZE) {
+		struct rcpt_chunk* chunk = malloc(sizeof(*chunk));
+		if (chunk == NULL) {
+			return NULL;
+		}
+		chunk->next = set->arena;
+		chunk->used = 0;
+		set->arena = chunk;
+	}
+	char* copy = set->arena->data + set->arena->used;
+	memcpy(copy, email, len + 1);
+	set->arena->used += len + 1;
+	return copy;
+}
+
+enum rcpt_add
+rcpt_set_add(struct rcpt_set* set, const char* email)
+{
+	const size_t len = strlen(email);
+	if (len >= MAX_EMAIL_LENGTH) {
+		return RCPT_TOO_LONG;
 	}
-	strncpy(new_node->email, email, MAX_EMAIL_LENGTH);
-	new_node->email[MAX_EMAIL_LENGTH - 1] = '\0';  // Ensure null-termination
-	new_node->next = NULL;
-	return new_node;
+	if (set->count > 0 && *find_slot(set, email) != 0) {
+		return RCPT_DUPLICATE;
+	}
+	if (set->count == set->capacity && !grow(set)) {
+		return RCPT_NO_MEMORY;
+	}
+
+	struct rcpt_node* node = &set->nodes[set->count];
+	node->email = arena_copy(set, email, len);
+	if (node->email == NULL) {
+		return RCPT_NO_MEMORY;
+	}
+	node->file_fd = -1;
+	node->sync_fd = -1;
+	node->pid = -1;
+	node->tmpfile = false;
+	*find_slot(set, email) = ++set->count;
+	return RCPT_ADDED;
 }
 
 void
-add_rcpt_to_list(struct rcpt_node** head, const char* email)
+rcpt_set_clear(struct rcpt_set* set)
 {
-	struct rcpt_node* new_node = create_rcpt_node(email);
-	new_node->next = *head;
-	*head = new_node;
+	if (set->count == 0) {
+		return;
+	}
+	set->count = 0;
+	memset(set->slots, 0, 2 * set->capacity * sizeof(*set->slots));
+
+	// se conserva un único bloque de la arena
+	struct rcpt_chunk* chunk = set->arena->next;
+	while (chunk != NULL) {
+		struct rcpt_chunk* next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	set->arena->next = NULL;
+	set->arena->used = 0;
 }
 
 void
-free_rcpt_list(struct rcpt_node* head)
+rcpt_set_free(struct rcpt_set* set)
 {
-	struct rcpt_node* current = head;
-	struct rcpt_node* next;
+	rcpt_set_clear(set);
+	free(set->arena);
+	free(set->nodes);
+	free(set->slots);
+	memset(set, 0, sizeof(*set));
+}
 
-	while (current != NULL) {
-		next = current->next;
-		free(current);
-		current = next;
+void
+discard_files(struct rcpt_set* set)
+{
+	for (struct rcpt_node* current = set->nodes; current < set->nodes + set->count; current++) {
+		// un mail que no llegó a sync_files (la sesión se cortó a mitad del
+		// DATA): con O_TMPFILE alcanza con cerrarlo
+		if (current->file_fd != -1 && current->file_fd != current->sync_fd) {
+			close(current->file_fd);
+		}
+		if (current->pid > 0) {
+			stop_transformation(current->pid);
+			current->pid = -1;
+		}
+		if (current->sync_fd != -1) {
+			close(current->sync_fd);
+			if (!current->tmpfile) {
+				char file_path[400];
+				snprintf(file_path, sizeof(file_path), "mails/%s/tmp/%s", current->email, current->filename);
+				unlink(file_path);
+			}
+		}
+		current->file_fd = -1;
+		current->sync_fd = -1;
 	}
 }
 
 void
-close_fds(struct rcpt_node* head)
+close_fds(struct rcpt_set* set)
 {
-	struct rcpt_node* current = head;
-	while (current != NULL) {
-		close(current->file_fd);
+	for (struct rcpt_node* current = set->nodes; current < set->nodes + set->count; current++) {
+		if (current->file_fd != current->sync_fd) {
+			// el pipe a la transformación: al cerrarlo termina de escribir
+			close(current->file_fd);
+		}
+		current->file_fd = -1;
+	}
+}
 
-		char file_path[MAX_EMAIL_LENGTH * 3];
-		snprintf(file_path, sizeof(file_path), "mails/%s/tmp/%s", current->email, current->filename);
+/**
+ * le da a un archivo abierto con O_TMPFILE el nombre `path'. linkat con
+ * AT_EMPTY_PATH requiere CAP_DAC_READ_SEARCH, así que sin ese permiso se
+ * usa el enlace mágico de /proc (ver open(2)).
+ */
+bool
+publish_tmpfile(const int fd, const char* path)
+{
+	if (linkat(fd, "", AT_FDCWD, path, AT_EMPTY_PATH) == 0) {
+		return true;
+	}
+	if (errno != ENOENT && errno != EPERM) {
+		return false;
+	}
 
-		struct stat st;
-		if (stat(file_path, &st) == -1) {
-			fprintf(stderr, "Error getting file status for %s\n", file_path);
-			abort();
+	char proc_path[64];
+	snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+	return linkat(AT_FDCWD, proc_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0;
+}
+
+/**
+ * crea el archivo del mail. Con O_TMPFILE el archivo no tiene nombre hasta
+ * que se publica en new/ (ver sync_files), así que si el servidor se cae no
+ * queda nada que limpiar. Si el sistema de archivos no lo soporta se usa
+ * tmp/ y rename.
+ */
+static int
+open_mail_file(struct rcpt_node* rcpt, const char* dir_name_new, const char* file_path)
+{
+	static bool tmpfile_supported = true;
+
+	if (tmpfile_supported) {
+		const int fd = open(dir_name_new, O_TMPFILE | O_WRONLY, 0666);
+		if (fd != -1) {
+			rcpt->tmpfile = true;
+			return fd;
 		}
+		// EISDIR: el kernel no conoce O_TMPFILE; EOPNOTSUPP: el sistema de archivos
+		if (errno == EISDIR || errno == EOPNOTSUPP) {
+			tmpfile_supported = false;
+		}
+	}
+
+	rcpt->tmpfile = false;
+	return open(file_path, O_CREAT | O_WRONLY, 0777);
+}
+
+bool
+sync_files(struct rcpt_set* set)
+{
+	bool ok = true;
 
+	for (struct rcpt_node* current = set->nodes; current < set->nodes + set->count; current++) {
+		if (current->pid > 0) {
+			int status;
+			while (waitpid(current->pid, &status, 0) == -1 && errno == EINTR) {
+			}
+			current->pid = -1;
+		}
+
+		char file_path[400];
+		snprintf(file_path, sizeof(file_path), "mails/%s/tmp/%s", current->email, current->filename);
 		char file_path_new[400];
 		snprintf(file_path_new, sizeof(file_path_new), "mails/%s/new/%s", current->email, current->filename);
 
-		if (rename(file_path, file_path_new) == -1) {
+		PROBE1(maildir_publish, current->sync_fd);
+		bool delivered = fdatasync(current->sync_fd) == 0;
+		if (!delivered) {
+			fprintf(stderr, "Error syncing file %s\n", file_path_new);
+		} else if (current->tmpfile) {
+			delivered = publish_tmpfile(current->sync_fd, file_path_new);
+			if (!delivered) {
+				fprintf(stderr, "Error linking file %s\n", file_path_new);
+			}
+		} else if (rename(file_path, file_path_new) == -1) {
 			fprintf(stderr, "Error renaming file %s to %s\n", file_path, file_path_new);
-			abort();
+			delivered = false;
 		}
 
-		current = current->next;
+		PROBE3(maildir_publish_done, current->sync_fd, file_path_new, delivered);
+
+		// un O_TMPFILE sin nombre desaparece al cerrarlo
+		close(current->sync_fd);
+		current->sync_fd = -1;
+		if (!delivered && !current->tmpfile) {
+			unlink(file_path);
+		}
+		ok &= delivered;
 	}
+
+	return ok;
+}
+
+bool
+sync_new_dir(const char* email)
+{
+	char dir_name[MAX_EMAIL_LENGTH + 16];
+	snprintf(dir_name, sizeof(dir_name), "mails/%s/new", email);
+
+	const int fd = open(dir_name, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	const bool ok = fsync(fd) == 0;
+	close(fd);
+	return ok;
 }
 
 void
-write_to_files(struct rcpt_node* head, struct data_parser* p)
+write_to_files(struct rcpt_set* set, const uint8_t* data, const size_t len)
 {
-	struct rcpt_node* current = head;
-	while (current != NULL) {
+	for (struct rcpt_node* current = set->nodes; current < set->nodes + set->count; current++) {
 		// TODO ????
-		int n = write(current->file_fd, p->data_buffer.data, p->data_buffer.write - p->data_buffer.data);
-		current = current->next;
+		int n = write(current->file_fd, data, len);
+	}
+}
+
+void
+writev_to_files(struct rcpt_set* set, const struct iovec* iov, const int iovcnt)
+{
+	for (struct rcpt_node* current = set->nodes; current < set->nodes + set->count; current++) {
+		ssize_t n = writev(current->file_fd, iov, iovcnt);
+	}
+}
+
+static unsigned worker_id = 0;
+
+void
+maildir_set_worker(const unsigned id)
+{
+	worker_id = id;
+}
+
+void
+maildir_unique_name(char* buff, const size_t size)
+{
+	// lo que no cambia durante la vida del proceso se consulta una sola vez
+	static pid_t pid = -1;
+	static char host[32];
+	static uint64_t deliveries = 0;
+
+	if (pid == -1) {
+		pid = getpid();
+		if (gethostname(host, sizeof(host)) == -1) {
+			strcpy(host, "localhost");
+		}
+		host[sizeof(host) - 1] = 0;
+		// '/' y ':' no pueden aparecer en un nombre de Maildir
+		for (char* c = host; *c; c++) {
+			if (*c == '/' || *c == ':') {
+				*c = '_';
+			}
+		}
+	}
+
+	snprintf(buff,
+	         size,
+	         "%lld.M%06ldP%dQ%lluW%u.%s",
+	         (long long)timecache_sec(),
+	         timecache_usec(),
+	         (int)pid,
+	         (unsigned long long)++deliveries,
+	         worker_id,
+	         host);
+}
+
+static bool
+write_all(const int fd, const uint8_t* data, size_t len)
+{
+	while (len > 0) {
+		const ssize_t n = write(fd, data, len);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool
+stdout_sink(void* arg, const uint8_t* data, size_t len)
+{
+	return write_all(STDOUT_FILENO, data, len);
+}
+
+/**
+ * el proceso que comprime la salida de la transformación: lanza `program'
+ * (que hereda la entrada estándar) con la salida en un pipe, y comprime lo
+ * que lee de ahí hacia la salida estándar. No vuelve.
+ */
+static void
+run_compressed(const char* program, const char* from_line, struct compressor* compressor)
+{
+	// no exec-uta nada, así que FD_CLOEXEC no alcanza: si se quedara con
+	// el pipe de otra transformación, aquella no vería EOF
+	close_range(3, ~0U, 0);
+
+	int fds[2];
+	if (pipe(fds) == -1) {
+		_exit(EXIT_FAILURE);
+	}
+	const pid_t pid = fork();
+	if (pid == -1) {
+		_exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		dup2(fds[1], STDOUT_FILENO);
+		close(fds[0]);
+		close(fds[1]);
+
+		char* args[] = { (char*)program, NULL };
+		execvp(program, args);
+		fprintf(stderr, "Error executing program %s\n", program);
+		_exit(EXIT_FAILURE);
+	}
+	close(fds[1]);
+	close(STDIN_FILENO);
+
+	bool ok = compressor_begin(compressor, stdout_sink, NULL);
+	if (ok && from_line != NULL) {
+		ok = compressor_write(compressor, (const uint8_t*)from_line, strlen(from_line), stdout_sink, NULL);
+	}
+	uint8_t buff[16 * 1024];
+	ssize_t n = 0;
+	while (ok && ((n = read(fds[0], buff, sizeof(buff))) > 0 || (n == -1 && errno == EINTR))) {
+		ok = n <= 0 || compressor_write(compressor, buff, n, stdout_sink, NULL);
 	}
+	ok = ok && n == 0 && compressor_finish(compressor, stdout_sink, NULL);
+
+	int status;
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+	}
+	_exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+pid_t
+spawn_transformation(const char* program,
+                     const int out_fd,
+                     int* in_fd,
+                     const char* from_line,
+                     struct compressor* compressor)
+{
+	if (from_line != NULL && compressor == NULL) {
+		write_all(out_fd, (const uint8_t*)from_line, strlen(from_line));
+	}
+
+	int fds[2];
+	if (pipe(fds) == -1) {
+		fprintf(stderr, "Error creating pipe\n");
+		abort();
+	}
+	// si otra transformación heredara este extremo, la nuestra no
+	// vería EOF hasta que termine aquella
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(out_fd, F_SETFD, FD_CLOEXEC);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		fprintf(stderr, "Error forking\n");
+		abort();
+	}
+
+	if (pid == 0) {
+		// dup2 y no close+dup: si el fd 0 está libre (el socket SMTP se
+		// cierra durante un upgrade, ver upgrade.h) el pipe o `out_fd'
+		// pueden ser justamente la entrada estándar
+		const int out = out_fd == STDIN_FILENO ? dup(out_fd) : out_fd;
+		dup2(fds[0], STDIN_FILENO);  // read end of where app writes
+		dup2(out, STDOUT_FILENO);    // write end of where app reads
+
+		if (fds[0] != STDIN_FILENO) {
+			close(fds[0]);
+		}
+		close(fds[1]);
+		close(out);
+
+		if (compressor != NULL) {
+			run_compressed(program, from_line, compressor);
+		}
+
+		char* args[] = { (char*)program, NULL };
+		execvp(program, args);
+		fprintf(stderr, "Error executing program %s\n", program);
+		abort();
+	}
+
+	close(fds[0]);
+	*in_fd = fds[1];
+	return pid;
 }
 
 void
-create_uuid(char* uuid_str)
+stop_transformation(const pid_t pid)
 {
-	uuid_t uuid;
-	uuid_generate(uuid);
-	uuid_unparse(uuid, uuid_str);
+	// no hace falta que termine de escribir: su salida se tira
+	kill(pid, SIGKILL);
+	while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+	}
 }
 
 void
-create_mails_files(struct rcpt_node* head, char* mailfrom, char* program, bool transformations)
+create_maildir(const char* email)
 {
 	struct stat st;
 	if (stat("mails", &st) == -1) {
@@ -102,104 +503,61 @@ create_mails_files(struct rcpt_node* head, char* mailfrom, char* program, bool t
 		}
 	}
 
-	struct rcpt_node* current = head;
-	while (current != NULL) {
-		char dir_name[6 + MAX_EMAIL_LENGTH];
-		snprintf(dir_name, sizeof(dir_name), "mails/%s", current->email);
-
-		struct stat st;
-		if (stat(dir_name, &st) == -1) {
-			if (mkdir(dir_name, 0777) == -1) {
-				fprintf(stderr, "Error creating directory %s\n", dir_name);
-				abort();
-			}
+	char dir_name[6 + MAX_EMAIL_LENGTH];
+	snprintf(dir_name, sizeof(dir_name), "mails/%s", email);
+	if (stat(dir_name, &st) == -1) {
+		if (mkdir(dir_name, 0777) == -1) {
+			fprintf(stderr, "Error creating directory %s\n", dir_name);
+			abort();
 		}
+	}
 
-		char dir_name_new[sizeof(dir_name) + 4];
-		snprintf(dir_name_new, sizeof(dir_name_new), "%s/new", dir_name);
-		if (stat(dir_name_new, &st) == -1) {
-			if (mkdir(dir_name_new, 0777) == -1) {
-				fprintf(stderr, "Error creating directory %s\n", dir_name);
+	const char* subdirs[] = { "new", "cur", "tmp" };
+	for (unsigned i = 0; i < sizeof(subdirs) / sizeof(subdirs[0]); i++) {
+		char subdir[sizeof(dir_name) + 4];
+		snprintf(subdir, sizeof(subdir), "%s/%s", dir_name, subdirs[i]);
+		if (stat(subdir, &st) == -1) {
+			if (mkdir(subdir, 0777) == -1) {
+				fprintf(stderr, "Error creating directory %s\n", subdir);
 				abort();
 			}
 		}
+	}
+}
 
-		char dir_name_cur[sizeof(dir_name) + 4];
-		snprintf(dir_name_cur, sizeof(dir_name_cur), "%s/cur", dir_name);
-		if (stat(dir_name_cur, &st) == -1) {
-			if (mkdir(dir_name_cur, 0777) == -1) {
-				fprintf(stderr, "Error creating directory %s\n", dir_name);
-				abort();
-			}
-		}
+void
+create_mails_files(struct rcpt_set* set,
+                   const char* from_line,
+                   const char* program,
+                   struct compressor* compressor)
+{
+	for (struct rcpt_node* current = set->nodes; current < set->nodes + set->count; current++) {
+		create_maildir(current->email);
 
-		char dir_name_tmp[sizeof(dir_name) + 4];
-		snprintf(dir_name_tmp, sizeof(dir_name_tmp), "%s/tmp", dir_name);
-		if (stat(dir_name_tmp, &st) == -1) {
-			if (mkdir(dir_name_tmp, 0777) == -1) {
-				fprintf(stderr, "Error creating directory %s\n", dir_name);
-				abort();
-			}
-		}
+		char dir_name_new[6 + MAX_EMAIL_LENGTH + 4];
+		snprintf(dir_name_new, sizeof(dir_name_new), "mails/%s/new", current->email);
+		char dir_name_tmp[sizeof(dir_name_new)];
+		snprintf(dir_name_tmp, sizeof(dir_name_tmp), "mails/%s/tmp", current->email);
 
-		char uuid_str[37];
-		create_uuid(uuid_str);
-		snprintf(current->filename, sizeof(current->filename), "%s.txt", uuid_str);
+		maildir_unique_name(current->filename, sizeof(current->filename));
 
 		char file_path[400];
 		snprintf(file_path, sizeof(file_path), "%s/%s", dir_name_tmp, current->filename);
 
-		int fd = open(file_path, O_CREAT | O_WRONLY, 0777);
+		int fd = open_mail_file(current, dir_name_new, file_path);
 		if (fd == -1) {
 			fprintf(stderr, "Error creating file %s\n", file_path);
 			abort();
 		}
 
-		time_t now = time(NULL);
-		struct tm* t = localtime(&now);
-
-		char time_str[100];
-		strftime(time_str, sizeof(time_str), "%a %b %d %H:%M:%S %Y", t);
-		char from_header[512];
-		snprintf(from_header, sizeof(from_header), "From %s  %s\n", mailfrom, time_str);
-		write(fd, from_header, strlen(from_header));
-
 		current->file_fd = fd;
+		current->sync_fd = fd;
+		current->pid = -1;
 
-		if (transformations) {
-			int fds[2];
-			if (pipe(fds) == -1) {
-				fprintf(stderr, "Error creating pipe\n");
-				abort();
-			}
-
-			pid_t pid = fork();
-			if (pid == -1) {
-				fprintf(stderr, "Error forking\n");
-				abort();
-			}
-
-			if (pid == 0) {
-				close(STDIN_FILENO);
-				dup(fds[0]);  // read end of where app writes
-				close(STDOUT_FILENO);
-				dup(fd);  // write end of where app reads
-
-				close(fds[0]);
-				close(fds[1]);
-				close(fd);
-
-				char* args[] = { program, NULL };
-				execvp(program, args);
-				fprintf(stderr, "Error executing program %s\n", program);
-				abort();
-			}
-
-			close(fds[0]);
-			close(fd);
-			current->file_fd = fds[1];
+		if (program != NULL) {
+			current->pid = spawn_transformation(program, fd, &current->file_fd, from_line, compressor);
+		} else if (from_line != NULL) {
+			write_all(fd, (const uint8_t*)from_line, strlen(from_line));
 		}
-
-		current = current->next;
 	}
 }
@@ -0,0 +1,1200 @@
+/**
+ * relay.c - cliente SMTP que entrega la cola del relay (ver relay.h)
+ */
+#define _GNU_SOURCE
+#include "relay.h"
+
+#include "buffer.h"
+#include "logger.h"
+#include "metrics.h"
+#include "rcpt_to_list.h"
+#include "stm.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <netdb.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#define N(x)            (sizeof(x) / sizeof((x)[0]))
+#define ATTACHMENT(key) ((struct relay_conn*)(key)->data)
+
+/** buffer de lectura: una línea de respuesta más larga se considera inválida */
+#define RELAY_READ_SIZE 4096
+
+#define NS_PER_MS (1000ULL * 1000)
+#define NS_PER_S  (1000ULL * NS_PER_MS)
+
+/** un mail de la cola */
+struct relay_entry
+{
+	char name[MAILDIR_NAME_LENGTH];
+	unsigned attempts;
+	/** cuándo se puede intentar enviarlo (ver `metrics_now') */
+	uint64_t due;
+	struct relay_entry* next;
+};
+
+enum relay_state
+{
+	/** esperando que termine el connect */
+	RELAY_CONNECT,
+	RELAY_GREETING_READ,
+	RELAY_EHLO_WRITE,
+	RELAY_EHLO_READ,
+	/** MAIL, RCPT y DATA: todos juntos con PIPELINING, si no de a uno */
+	RELAY_ENVELOPE_WRITE,
+	RELAY_ENVELOPE_READ,
+	RELAY_BODY_WRITE,
+	RELAY_BODY_READ,
+	/** antes de reutilizar la conexión para otro mail */
+	RELAY_RSET_WRITE,
+	RELAY_RSET_READ,
+	/** en el pool, sin mail asignado */
+	RELAY_IDLE,
+	/** no se espera el 221: el resultado ya se conoce */
+	RELAY_QUIT_WRITE,
+	RELAY_DONE,
+	RELAY_ERROR,
+};
+
+struct relay_conn
+{
+	struct state_machine stm;
+	int fd;
+	/** mail que se está enviando; NULL si la conexión está ociosa */
+	struct relay_entry* entry;
+	struct relay_envelope env;
+
+	/** las respuestas se leen en un buffer circular; `raw_read' si no se pudo crear */
+	uint8_t raw_read[RELAY_READ_SIZE], raw_write[4096];
+	buffer read_buffer, write_buffer;
+
+	bool pipelining;
+	/**
+	 * próximo comando del sobre a escribir y próxima respuesta a leer: 0 es
+	 * el MAIL, 1..nrcpts los RCPT (de los destinatarios pendientes) y
+	 * nrcpts + 1 el DATA
+	 */
+	unsigned next_command, next_reply;
+	bool mail_accepted;
+	unsigned accepted;
+	/** código de la última respuesta */
+	int code;
+	/** próximo byte del cuerpo a enviar */
+	off_t body_offset;
+	bool body_end;
+	/** si no hay progreso (o si está ociosa, si no se usa) hasta entonces se cierra */
+	uint64_t deadline;
+
+	struct relay_conn* next;
+};
+
+static fd_selector selector;
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+static bool enabled = false;
+/** la cola es de otro proceso (ver `relay_hold') */
+static bool held = false;
+static int timer_fd = -1;
+static char helo[256] = "localhost";
+/** vencimiento del timer programado; 0 si no está armado */
+static uint64_t armed;
+
+/** mails a enviar, ordenados por `due'. No incluye los que se están enviando */
+static struct relay_entry* queue;
+
+/** pool de conexiones al servidor, activas y ociosas */
+static struct relay_conn* conns;
+static unsigned nconns;
+static unsigned max_connections = RELAY_MAX_CONNECTIONS;
+static unsigned idle_ms = RELAY_IDLE_MS;
+
+/** contabilidad por estado de las conexiones (ver stm.h) */
+static struct stm_profile relay_profile[RELAY_ERROR + 1];
+static const char* const relay_state_names[] = {
+	[RELAY_CONNECT] = "connect",
+	[RELAY_GREETING_READ] = "greeting_read",
+	[RELAY_EHLO_WRITE] = "ehlo_write",
+	[RELAY_EHLO_READ] = "ehlo_read",
+	[RELAY_ENVELOPE_WRITE] = "envelope_write",
+	[RELAY_ENVELOPE_READ] = "envelope_read",
+	[RELAY_BODY_WRITE] = "body_write",
+	[RELAY_BODY_READ] = "body_read",
+	[RELAY_RSET_WRITE] = "rset_write",
+	[RELAY_RSET_READ] = "rset_read",
+	[RELAY_IDLE] = "idle",
+	[RELAY_QUIT_WRITE] = "quit_write",
+	[RELAY_DONE] = "done",
+	[RELAY_ERROR] = "error",
+};
+
+static void relay_read(struct selector_key* key);
+static void relay_write(struct selector_key* key);
+static void relay_conn_close(struct selector_key* key);
+
+static const struct fd_handler relay_handler = {
+	.handle_read = relay_read,
+	.handle_write = relay_write,
+	.handle_close = relay_conn_close,
+};
+
+static void schedule(void);
+
+static void
+entry_free(struct relay_entry* e)
+{
+	metrics_gauge_add(METRIC_RELAY_QUEUE, -1);
+	free(e);
+}
+
+static void
+queue_insert(struct relay_entry* e)
+{
+	if (held) {
+		// sigue en disco: lo envía quien tenga la cola
+		entry_free(e);
+		return;
+	}
+	struct relay_entry** p = &queue;
+	while (*p != NULL && (*p)->due <= e->due) {
+		p = &(*p)->next;
+	}
+	e->next = *p;
+	*p = e;
+}
+
+static void
+entry_path(char* path, const size_t size, const char* dir, const struct relay_entry* e)
+{
+	snprintf(path, size, "%s/%s", dir, e->name);
+}
+
+/** espera antes del intento `attempts' + 1 */
+static uint64_t
+backoff_ms(const unsigned attempts)
+{
+	uint64_t ms = RELAY_RETRY_MIN_MS;
+	for (unsigned i = 1; i < attempts && ms < RELAY_RETRY_MAX_MS; i++) {
+		ms *= 2;
+	}
+	return ms < RELAY_RETRY_MAX_MS ? ms : RELAY_RETRY_MAX_MS;
+}
+
+static void
+touch(struct relay_conn* c)
+{
+	c->deadline = metrics_now() + RELAY_TIMEOUT_MS * NS_PER_MS;
+}
+
+/**
+ * termina el intento de enviar el mail de la conexión: marca los
+ * destinatarios resueltos y borra el mail, o lo vuelve a programar si quedan
+ * pendientes
+ */
+static void
+resolve(struct relay_conn* c)
+{
+	struct relay_entry* e = c->entry;
+	c->entry = NULL;
+	unsigned pending = 0;
+	for (unsigned i = 0; i < c->env.nrcpts; i++) {
+		// aceptado pero sin un 250 después del cuerpo: no se entregó
+		if (c->env.rcpts[i].status == RELAY_RCPT_ACCEPTED) {
+			c->env.rcpts[i].status = RELAY_RCPT_PENDING;
+		}
+		pending += c->env.rcpts[i].status == RELAY_RCPT_PENDING;
+	}
+	relay_queue_mark(&c->env);
+	relay_queue_release(&c->env);
+
+	char path[sizeof(RELAY_FAILED_DIR) + MAILDIR_NAME_LENGTH + 1];
+	entry_path(path, sizeof(path), RELAY_QUEUE_DIR, e);
+	if (pending == 0) {
+		unlink(path);
+		entry_free(e);
+	} else if (++e->attempts >= RELAY_MAX_ATTEMPTS) {
+		char failed[sizeof(path)];
+		entry_path(failed, sizeof(failed), RELAY_FAILED_DIR, e);
+		if ((mkdir(RELAY_FAILED_DIR, 0777) == -1 && errno != EEXIST) || rename(path, failed) == -1) {
+			perror("Error moving relay mail to " RELAY_FAILED_DIR);
+		}
+		metrics_counter_add(METRIC_RELAY_FAILED, pending);
+		log_event(LOG_WARN, LOG_EVENT_RELAY_FAIL, &server_addr, c->fd, c->code, pending);
+		entry_free(e);
+	} else {
+		const uint64_t ms = backoff_ms(e->attempts);
+		e->due = metrics_now() + ms * NS_PER_MS;
+		queue_insert(e);
+		metrics_counter_add(METRIC_RELAY_DEFERRED, pending);
+		log_event(LOG_INFO, LOG_EVENT_RELAY_DEFER, &server_addr, c->fd, c->code, ms / 1000);
+	}
+}
+
+/**
+ * asigna el mail `e' a la conexión. Retorna false si no se pudo leer de la
+ * cola, en cuyo caso se descarta.
+ */
+static bool
+assign(struct relay_conn* c, struct relay_entry* e)
+{
+	if (!relay_queue_load(e->name, &c->env)) {
+		// se borró o está dañado: no hay nada que reintentar
+		fprintf(stderr, "Error loading relay mail %s\n", e->name);
+		entry_free(e);
+		return false;
+	}
+	c->entry = e;
+	c->next_command = c->next_reply = 0;
+	c->mail_accepted = false;
+	c->accepted = 0;
+	c->code = 0;
+	return true;
+}
+
+/** toma el próximo mail que ya se puede enviar */
+static bool
+assign_due(struct relay_conn* c)
+{
+	const uint64_t now = metrics_now();
+	while (queue != NULL && queue->due <= now) {
+		struct relay_entry* e = queue;
+		queue = e->next;
+		if (assign(c, e)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/** cierra la conexión; `relay_conn_close' resuelve el intento */
+static void
+relay_done(struct selector_key* key)
+{
+	const int fd = key->fd;
+	if (selector_unregister_fd(key->s, fd) != SELECTOR_SUCCESS) {
+		abort();
+	}
+	close(fd);
+}
+
+/* protocolo */
+
+/** resultado de buscar una respuesta en el buffer de lectura */
+enum reply_status
+{
+	REPLY_MORE,
+	REPLY_READY,
+	REPLY_BAD,
+};
+
+/**
+ * consume del buffer de lectura la próxima respuesta completa (que puede
+ * tener varias líneas) y deja su código en `c->code'. Con `ehlo' busca
+ * PIPELINING entre las extensiones anunciadas.
+ */
+static enum reply_status
+next_reply(struct relay_conn* c, const bool ehlo)
+{
+	while (true) {
+		size_t count;
+		const uint8_t* ptr = buffer_read_ptr(&c->read_buffer, &count);
+		const uint8_t* nl = memchr(ptr, '\n', count);
+		if (nl == NULL) {
+			return count < RELAY_READ_SIZE ? REPLY_MORE : REPLY_BAD;
+		}
+
+		const size_t len = nl - ptr + 1;
+		if (len < 4 || ptr[0] < '1' || ptr[0] > '5' || ptr[1] < '0' || ptr[1] > '9' || ptr[2] < '0' ||
+		    ptr[2] > '9') {
+			return REPLY_BAD;
+		}
+		const int code = (ptr[0] - '0') * 100 + (ptr[1] - '0') * 10 + (ptr[2] - '0');
+		const bool last = ptr[3] != '-';
+
+		if (ehlo && len > 4) {
+			size_t text_len = len - 4;
+			while (text_len > 0 && (ptr[4 + text_len - 1] == '\r' || ptr[4 + text_len - 1] == '\n')) {
+				text_len--;
+			}
+			if (text_len == 10 && strncasecmp((const char*)ptr + 4, "PIPELINING", 10) == 0) {
+				c->pipelining = true;
+			}
+		}
+
+		buffer_read_adv(&c->read_buffer, len);
+		if (last) {
+			c->code = code;
+			return REPLY_READY;
+		}
+	}
+}
+
+/**
+ * lee del servidor y procesa las respuestas completas con `process', que
+ * retorna el próximo estado
+ */
+static unsigned
+read_replies(struct selector_key* key,
+             const unsigned current,
+             unsigned (*process)(struct selector_key* key, struct relay_conn* c))
+{
+	struct relay_conn* c = ATTACHMENT(key);
+	buffer_compact(&c->read_buffer);
+	size_t count;
+	uint8_t* ptr = buffer_write_ptr(&c->read_buffer, &count);
+	const ssize_t n = recv(key->fd, ptr, count, MSG_DONTWAIT);
+	if (n <= 0) {
+		return RELAY_ERROR;
+	}
+	buffer_write_adv(&c->read_buffer, n);
+	touch(c);
+
+	unsigned ret = current;
+	while (ret == current) {
+		const enum reply_status st = next_reply(c, current == RELAY_EHLO_READ);
+		if (st == REPLY_BAD) {
+			return RELAY_ERROR;
+		} else if (st == REPLY_MORE) {
+			break;
+		}
+		ret = process(key, c);
+	}
+	return ret;
+}
+
+/** envía el buffer de escritura; al vaciarlo pasa a esperar respuestas en `next' */
+static unsigned
+flush(struct selector_key* key, const unsigned current, const unsigned next)
+{
+	struct relay_conn* c = ATTACHMENT(key);
+	size_t count;
+	const uint8_t* ptr = buffer_read_ptr(&c->write_buffer, &count);
+	const ssize_t n = send(key->fd, ptr, count, MSG_NOSIGNAL);
+	if (n <= 0) {
+		return RELAY_ERROR;
+	}
+	buffer_read_adv(&c->write_buffer, n);
+	touch(c);
+
+	if (buffer_can_read(&c->write_buffer)) {
+		return current;
+	}
+	return selector_set_interest_key(key, OP_READ) == SELECTOR_SUCCESS ? next : RELAY_ERROR;
+}
+
+/** agrega un comando al buffer de escritura. Retorna false si no entra */
+static bool
+append(struct relay_conn* c, const char* fmt, ...)
+{
+	size_t count;
+	char* ptr = (char*)buffer_write_ptr(&c->write_buffer, &count);
+	va_list ap;
+	va_start(ap, fmt);
+	const int n = vsnprintf(ptr, count, fmt, ap);
+	va_end(ap);
+	if (n < 0 || (size_t)n >= count) {
+		return false;
+	}
+	buffer_write_adv(&c->write_buffer, n);
+	return true;
+}
+
+static void
+want_write(const unsigned state, struct selector_key* key)
+{
+	selector_set_interest_key(key, OP_WRITE);
+}
+
+static unsigned
+connect_write(struct selector_key* key)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+	if (getsockopt(key->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+		return RELAY_ERROR;
+	}
+	touch(ATTACHMENT(key));
+	return selector_set_interest_key(key, OP_READ) == SELECTOR_SUCCESS ? RELAY_GREETING_READ : RELAY_ERROR;
+}
+
+static unsigned
+greeting_reply(struct selector_key* key, struct relay_conn* c)
+{
+	return c->code == 220 ? RELAY_EHLO_WRITE : RELAY_ERROR;
+}
+
+static unsigned
+greeting_read(struct selector_key* key)
+{
+	return read_replies(key, RELAY_GREETING_READ, greeting_reply);
+}
+
+static void
+ehlo_write_init(const unsigned state, struct selector_key* key)
+{
+	append(ATTACHMENT(key), "EHLO %s\r\n", helo);
+	want_write(state, key);
+}
+
+static unsigned
+ehlo_write(struct selector_key* key)
+{
+	return flush(key, RELAY_EHLO_WRITE, RELAY_EHLO_READ);
+}
+
+static unsigned
+ehlo_reply(struct selector_key* key, struct relay_conn* c)
+{
+	return c->code / 100 == 2 ? RELAY_ENVELOPE_WRITE : RELAY_ERROR;
+}
+
+static unsigned
+ehlo_read(struct selector_key* key)
+{
+	return read_replies(key, RELAY_EHLO_READ, ehlo_reply);
+}
+
+/** el comando del sobre que sigue a `slot', salteando los destinatarios resueltos */
+static unsigned
+next_slot(const struct relay_conn* c, unsigned slot)
+{
+	if (slot > c->env.nrcpts) {
+		return slot + 1;
+	}
+	slot++;
+	while (slot <= c->env.nrcpts && c->env.rcpts[slot - 1].status != RELAY_RCPT_PENDING) {
+		slot++;
+	}
+	return slot;
+}
+
+/** agrega al buffer los comandos del sobre que se pueden enviar ahora */
+static void
+fill_envelope(struct relay_conn* c)
+{
+	const unsigned data_slot = c->env.nrcpts + 1;
+	while (c->next_command <= data_slot) {
+		// sin PIPELINING se espera la respuesta de cada comando
+		if (!c->pipelining && c->next_command != c->next_reply) {
+			break;
+		}
+
+		bool ok;
+		if (c->next_command == 0) {
+			ok = append(c, "MAIL FROM:<%s>\r\n", c->env.mailfrom);
+		} else if (c->next_command == data_slot) {
+			ok = append(c, "DATA\r\n");
+		} else {
+			ok = append(c, "RCPT TO:<%s>\r\n", c->env.rcpts[c->next_command - 1].email);
+		}
+		if (!ok) {
+			break;
+		}
+		c->next_command = next_slot(c, c->next_command);
+	}
+}
+
+static void
+envelope_write_init(const unsigned state, struct selector_key* key)
+{
+	fill_envelope(ATTACHMENT(key));
+	want_write(state, key);
+}
+
+static unsigned
+envelope_write(struct selector_key* key)
+{
+	struct relay_conn* c = ATTACHMENT(key);
+	fill_envelope(c);
+	const unsigned ret = flush(key, RELAY_ENVELOPE_WRITE, RELAY_ENVELOPE_READ);
+	if (ret == RELAY_ENVELOPE_READ && c->pipelining && c->next_command <= c->env.nrcpts + 1) {
+		// quedan comandos que no entraron en el buffer
+		return selector_set_interest_key(key, OP_WRITE) == SELECTOR_SUCCESS ? RELAY_ENVELOPE_WRITE : RELAY_ERROR;
+	}
+	return ret;
+}
+
+/**
+ * termina el mail actual. La conexión sigue con el próximo mail de la cola o
+ * queda ociosa en el pool; si el servidor la va a cerrar o no hay pool, se
+ * cierra.
+ */
+static unsigned
+end_transaction(struct selector_key* key, struct relay_conn* c)
+{
+	const bool closing = c->code == 421;
+	resolve(c);
+	if (closing || idle_ms == 0) {
+		return RELAY_QUIT_WRITE;
+	}
+	if (assign_due(c)) {
+		metrics_counter_add(METRIC_RELAY_REUSED, 1);
+		return RELAY_RSET_WRITE;
+	}
+	return RELAY_IDLE;
+}
+
+/** rechaza o posterga todos los destinatarios pendientes */
+static void
+resolve_pending(struct relay_conn* c, const enum relay_rcpt_status status)
+{
+	unsigned n = 0;
+	for (unsigned i = 0; i < c->env.nrcpts; i++) {
+		if (c->env.rcpts[i].status == RELAY_RCPT_PENDING || c->env.rcpts[i].status == RELAY_RCPT_ACCEPTED) {
+			c->env.rcpts[i].status = status;
+			n++;
+		}
+	}
+	if (status == RELAY_RCPT_FAILED && n > 0) {
+		metrics_counter_add(METRIC_RELAY_FAILED, n);
+		log_event(LOG_WARN, LOG_EVENT_RELAY_FAIL, &server_addr, c->fd, c->code, n);
+	}
+}
+
+static unsigned
+envelope_reply(struct selector_key* key, struct relay_conn* c)
+{
+	const unsigned data_slot = c->env.nrcpts + 1;
+	const unsigned slot = c->next_reply;
+	const int class = c->code / 100;
+
+	if (slot == 0) {
+		c->mail_accepted = class == 2;
+		if (class == 5) {
+			resolve_pending(c, RELAY_RCPT_FAILED);
+		}
+	} else if (slot < data_slot) {
+		// si se rechazó el MAIL, las respuestas a los RCPT no dicen nada
+		struct relay_rcpt* r = &c->env.rcpts[slot - 1];
+		if (c->mail_accepted && class == 2) {
+			r->status = RELAY_RCPT_ACCEPTED;
+			c->accepted++;
+		} else if (c->mail_accepted && class == 5) {
+			r->status = RELAY_RCPT_FAILED;
+			metrics_counter_add(METRIC_RELAY_FAILED, 1);
+			log_event(LOG_WARN, LOG_EVENT_RELAY_FAIL, &server_addr, c->fd, c->code, 1);
+		}
+	} else {
+		return c->code == 354 ? RELAY_BODY_WRITE : end_transaction(key, c);
+	}
+	c->next_reply = next_slot(c, slot);
+
+	if (c->pipelining) {
+		return RELAY_ENVELOPE_READ;
+	}
+	if (!c->mail_accepted || (c->next_reply == data_slot && c->accepted == 0)) {
+		return end_transaction(key, c);
+	}
+	return RELAY_ENVELOPE_WRITE;
+}
+
+static unsigned
+envelope_read(struct selector_key* key)
+{
+	return read_replies(key, RELAY_ENVELOPE_READ, envelope_reply);
+}
+
+static void
+body_write_init(const unsigned state, struct selector_key* key)
+{
+	struct relay_conn* c = ATTACHMENT(key);
+	// con PIPELINING el DATA se envía aunque no se haya aceptado ningún
+	// destinatario: se termina con un mail vacío
+	c->body_offset = c->accepted > 0 ? c->env.body : c->env.size;
+	c->body_end = false;
+	want_write(state, key);
+}
+
+static unsigned
+body_write(struct selector_key* key)
+{
+	struct relay_conn* c = ATTACHMENT(key);
+	size_t count;
+	uint8_t* ptr = buffer_write_ptr(&c->write_buffer, &count);
+	if (c->body_offset < c->env.size && count > 0) {
+		const off_t left = c->env.size - c->body_offset;
+		const ssize_t n = pread(c->env.fd, ptr, (off_t)count < left ? (off_t)count : left, c->body_offset);
+		if (n <= 0) {
+			return RELAY_ERROR;
+		}
+		buffer_write_adv(&c->write_buffer, n);
+		c->body_offset += n;
+	}
+	// el cuerpo se guardó sin el <CRLF>.<CRLF> que lo terminaba
+	if (c->body_offset >= c->env.size && !c->body_end) {
+		c->body_end = append(c, "\r\n.\r\n");
+	}
+
+	const unsigned ret = flush(key, RELAY_BODY_WRITE, RELAY_BODY_READ);
+	if (ret == RELAY_BODY_READ && !c->body_end) {
+		return selector_set_interest_key(key, OP_WRITE) == SELECTOR_SUCCESS ? RELAY_BODY_WRITE : RELAY_ERROR;
+	}
+	return ret;
+}
+
+static unsigned
+body_reply(struct selector_key* key, struct relay_conn* c)
+{
+	const int class = c->code / 100;
+	if (class == 2 && c->accepted > 0) {
+		for (unsigned i = 0; i < c->env.nrcpts; i++) {
+			if (c->env.rcpts[i].status == RELAY_RCPT_ACCEPTED) {
+				c->env.rcpts[i].status = RELAY_RCPT_DONE;
+			}
+		}
+		metrics_counter_add(METRIC_RELAY_DELIVERED, c->accepted);
+		log_event(LOG_INFO, LOG_EVENT_RELAY_SENT, &server_addr, c->fd, c->accepted, c->entry->attempts + 1);
+	} else if (class == 5) {
+		for (unsigned i = 0; i < c->env.nrcpts; i++) {
+			if (c->env.rcpts[i].status == RELAY_RCPT_ACCEPTED) {
+				c->env.rcpts[i].status = RELAY_RCPT_FAILED;
+			}
+		}
+		metrics_counter_add(METRIC_RELAY_FAILED, c->accepted);
+		log_event(LOG_WARN, LOG_EVENT_RELAY_FAIL, &server_addr, c->fd, c->code, c->accepted);
+	}
+	// con un 4xx los aceptados vuelven a quedar pendientes (ver `resolve')
+	return end_transaction(key, c);
+}
+
+static unsigned
+body_read(struct selector_key* key)
+{
+	return read_replies(key, RELAY_BODY_READ, body_reply);
+}
+
+static void
+rset_write_init(const unsigned state, struct selector_key* key)
+{
+	struct relay_conn* c = ATTACHMENT(key);
+	buffer_reset(&c->read_buffer);
+	buffer_reset(&c->write_buffer);
+	append(c, "RSET\r\n");
+	want_write(state, key);
+}
+
+static unsigned
+rset_write(struct selector_key* key)
+{
+	return flush(key, RELAY_RSET_WRITE, RELAY_RSET_READ);
+}
+
+static unsigned
+rset_reply(struct selector_key* key, struct relay_conn* c)
+{
+	return c->code / 100 == 2 ? RELAY_ENVELOPE_WRITE : RELAY_ERROR;
+}
+
+static unsigned
+rset_read(struct selector_key* key)
+{
+	return read_replies(key, RELAY_RSET_READ, rset_reply);
+}
+
+static void
+idle_init(const unsigned state, struct selector_key* key)
+{
+	struct relay_conn* c = ATTACHMENT(key);
+	c->deadline = metrics_now() + idle_ms * NS_PER_MS;
+	selector_set_interest_key(key, OP_READ);
+}
+
+/** estando ociosa, el servidor sólo puede cerrar la conexión (o avisar que la cierra) */
+static unsigned
+idle_read(struct selector_key* key)
+{
+	return RELAY_ERROR;
+}
+
+/** `schedule' le asignó un mail */
+static unsigned
+idle_write(struct selector_key* key)
+{
+	struct relay_conn* c = ATTACHMENT(key);
+	touch(c);
+	return c->entry != NULL ? RELAY_RSET_WRITE : RELAY_IDLE;
+}
+
+static void
+quit_write_init(const unsigned state, struct selector_key* key)
+{
+	struct relay_conn* c = ATTACHMENT(key);
+	buffer_reset(&c->write_buffer);
+	append(c, "QUIT\r\n");
+	want_write(state, key);
+}
+
+static unsigned
+quit_write(struct selector_key* key)
+{
+	const unsigned ret = flush(key, RELAY_QUIT_WRITE, RELAY_DONE);
+	return ret == RELAY_ERROR ? RELAY_DONE : ret;
+}
+
+static const struct state_definition relay_states[] = {
+	{
+	    .state = RELAY_CONNECT,
+	    .on_write_ready = connect_write,
+	},
+	{
+	    .state = RELAY_GREETING_READ,
+	    .on_read_ready = greeting_read,
+	},
+	{
+	    .state = RELAY_EHLO_WRITE,
+	    .on_arrival = ehlo_write_init,
+	    .on_write_ready = ehlo_write,
+	},
+	{
+	    .state = RELAY_EHLO_READ,
+	    .on_read_ready = ehlo_read,
+	},
+	{
+	    .state = RELAY_ENVELOPE_WRITE,
+	    .on_arrival = envelope_write_init,
+	    .on_write_ready = envelope_write,
+	},
+	{
+	    .state = RELAY_ENVELOPE_READ,
+	    .on_read_ready = envelope_read,
+	},
+	{
+	    .state = RELAY_BODY_WRITE,
+	    .on_arrival = body_write_init,
+	    .on_write_ready = body_write,
+	},
+	{
+	    .state = RELAY_BODY_READ,
+	    .on_read_ready = body_read,
+	},
+	{
+	    .state = RELAY_RSET_WRITE,
+	    .on_arrival = rset_write_init,
+	    .on_write_ready = rset_write,
+	},
+	{
+	    .state = RELAY_RSET_READ,
+	    .on_read_ready = rset_read,
+	},
+	{
+	    .state = RELAY_IDLE,
+	    .on_arrival = idle_init,
+	    .on_read_ready = idle_read,
+	    .on_write_ready = idle_write,
+	},
+	{
+	    .state = RELAY_QUIT_WRITE,
+	    .on_arrival = quit_write_init,
+	    .on_write_ready = quit_write,
+	},
+	{
+	    .state = RELAY_DONE,
+	},
+	{
+	    .state = RELAY_ERROR,
+	},
+};
+
+static void
+relay_read(struct selector_key* key)
+{
+	const unsigned st = stm_handler_read(&ATTACHMENT(key)->stm, key);
+	if (st == RELAY_ERROR || st == RELAY_DONE) {
+		relay_done(key);
+	}
+	schedule();
+}
+
+static void
+relay_write(struct selector_key* key)
+{
+	const unsigned st = stm_handler_write(&ATTACHMENT(key)->stm, key);
+	if (st == RELAY_ERROR || st == RELAY_DONE) {
+		relay_done(key);
+	}
+	schedule();
+}
+
+static void
+relay_conn_close(struct selector_key* key)
+{
+	struct relay_conn* c = ATTACHMENT(key);
+	for (struct relay_conn** p = &conns; *p != NULL; p = &(*p)->next) {
+		if (*p == c) {
+			*p = c->next;
+			break;
+		}
+	}
+	nconns--;
+	metrics_gauge_add(METRIC_RELAY_CONNECTIONS, -1);
+	stm_handler_close(&c->stm, key);
+
+	const unsigned st = stm_state(&c->stm);
+	if (c->entry != NULL && (st == RELAY_IDLE || st == RELAY_RSET_WRITE || st == RELAY_RSET_READ)) {
+		// el servidor cerró una conexión del pool antes de empezar el mail:
+		// no cuenta como intento
+		relay_queue_release(&c->env);
+		c->entry->due = metrics_now();
+		queue_insert(c->entry);
+	} else if (c->entry != NULL) {
+		resolve(c);
+	}
+	buffer_free_mirrored(&c->read_buffer);
+	free(c);
+}
+
+/** abre una conexión para enviar `e' */
+static void
+start(struct relay_entry* e)
+{
+	struct relay_conn* c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		e->due = metrics_now() + RELAY_RETRY_MIN_MS * NS_PER_MS;
+		queue_insert(e);
+		return;
+	}
+	c->fd = -1;
+	if (!assign(c, e)) {
+		free(c);
+		return;
+	}
+
+	c->fd = socket(server_addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (c->fd == -1 || selector_fd_set_nio(c->fd) == -1) {
+		goto fail;
+	}
+	if (connect(c->fd, (struct sockaddr*)&server_addr, server_addr_len) == -1 && errno != EINPROGRESS) {
+		goto fail;
+	}
+
+	c->stm.initial = RELAY_CONNECT;
+	c->stm.max_state = RELAY_ERROR;
+	c->stm.states = relay_states;
+	stm_init(&c->stm);
+	stm_profile_attach(&c->stm, relay_profile);
+	if (!buffer_init_mirrored(&c->read_buffer, RELAY_READ_SIZE)) {
+		buffer_init(&c->read_buffer, N(c->raw_read), c->raw_read);
+	}
+	buffer_init(&c->write_buffer, N(c->raw_write), c->raw_write);
+	touch(c);
+
+	if (selector_register(selector, c->fd, &relay_handler, OP_WRITE, c) != SELECTOR_SUCCESS) {
+		goto fail;
+	}
+	c->next = conns;
+	conns = c;
+	nconns++;
+	metrics_gauge_add(METRIC_RELAY_CONNECTIONS, 1);
+	return;
+
+fail:
+	if (c->fd != -1) {
+		close(c->fd);
+		c->fd = -1;
+	}
+	resolve(c);
+	buffer_free_mirrored(&c->read_buffer);
+	free(c);
+}
+
+static struct relay_conn*
+find_idle(void)
+{
+	for (struct relay_conn* c = conns; c != NULL; c = c->next) {
+		if (c->entry == NULL && stm_state(&c->stm) == RELAY_IDLE) {
+			return c;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * programa el timer para el próximo evento: un mail que se puede enviar o
+ * una conexión que vence. Como los vencimientos se corren con cada evento de
+ * las conexiones, sólo se reprograma si hay que adelantarlo o si ya venció;
+ * a lo sumo despierta una vez de más.
+ */
+static void
+arm_timer(const uint64_t now)
+{
+	uint64_t next = UINT64_MAX;
+	if (queue != NULL && nconns < max_connections) {
+		next = queue->due;
+	}
+	for (struct relay_conn* c = conns; c != NULL; c = c->next) {
+		if (c->deadline < next) {
+			next = c->deadline;
+		}
+	}
+	if (armed > now && next >= armed) {
+		return;
+	}
+	armed = next == UINT64_MAX ? 0 : next;
+
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (next != UINT64_MAX) {
+		// un tiempo en cero desarmaría el timer
+		next = next == 0 ? 1 : next;
+		its.it_value.tv_sec = next / NS_PER_S;
+		its.it_value.tv_nsec = next % NS_PER_S;
+	}
+	timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/**
+ * cierra las conexiones sin progreso, abre conexiones para los mails que ya
+ * se pueden enviar y programa el timer para el próximo evento
+ */
+static void
+schedule(void)
+{
+	const uint64_t now = metrics_now();
+	struct relay_conn* next;
+	for (struct relay_conn* c = conns; c != NULL; c = next) {
+		next = c->next;
+		if (c->deadline <= now) {
+			const int fd = c->fd;
+			selector_unregister_fd(selector, fd);
+			close(fd);
+		}
+	}
+
+	while (queue != NULL && queue->due <= now) {
+		// primero las conexiones del pool
+		struct relay_conn* idle = find_idle();
+		if (idle == NULL && nconns >= max_connections) {
+			break;
+		}
+		struct relay_entry* e = queue;
+		queue = e->next;
+		if (idle == NULL) {
+			start(e);
+		} else if (assign(idle, e)) {
+			metrics_counter_add(METRIC_RELAY_REUSED, 1);
+			touch(idle);
+			selector_set_interest(selector, idle->fd, OP_WRITE);
+		}
+	}
+	arm_timer(now);
+}
+
+static void
+timer_read(struct selector_key* key)
+{
+	uint64_t expirations;
+	if (read(key->fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN) {
+		perror("Error reading relay timer");
+	}
+	schedule();
+}
+
+static const struct fd_handler timer_handler = {
+	.handle_read = timer_read,
+};
+
+/* API */
+
+/** separa "host", "host:puerto" o "[ipv6]:puerto" */
+static bool
+parse_host(const char* s, char* host, const size_t size, const char** port)
+{
+	const char* end;
+	*port = "25";
+	if (s[0] == '[') {
+		end = strchr(s, ']');
+		if (end == NULL || (end[1] != 0 && end[1] != ':')) {
+			return false;
+		}
+		if (end[1] == ':') {
+			*port = end + 2;
+		}
+		s++;
+	} else {
+		end = strchr(s, ':');
+		if (end != NULL) {
+			*port = end + 1;
+		} else {
+			end = s + strlen(s);
+		}
+	}
+	const size_t len = end - s;
+	if (len == 0 || len >= size || **port == 0) {
+		return false;
+	}
+	memcpy(host, s, len);
+	host[len] = 0;
+	return true;
+}
+
+/** programa los mails que quedaron en la cola de una ejecución anterior */
+static void
+load_queue(void)
+{
+	DIR* dir = opendir(RELAY_QUEUE_DIR);
+	if (dir == NULL) {
+		return;
+	}
+	const uint64_t now = metrics_now();
+	struct dirent* d;
+	while ((d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.' || strcmp(d->d_name, "failed") == 0 || strlen(d->d_name) >= MAILDIR_NAME_LENGTH) {
+			continue;
+		}
+		// restos de un mail que nunca se publicó (ver `relay_queue_open')
+		if (strncmp(d->d_name, "tmp.", 4) == 0) {
+			unlinkat(dirfd(dir), d->d_name, 0);
+			continue;
+		}
+		struct relay_entry* e = calloc(1, sizeof(*e));
+		if (e == NULL) {
+			break;
+		}
+		strcpy(e->name, d->d_name);
+		e->due = now;
+		queue_insert(e);
+		metrics_gauge_add(METRIC_RELAY_QUEUE, 1);
+	}
+	closedir(dir);
+}
+
+static const char*
+relay_state_name(const unsigned state)
+{
+	return relay_state_names[state];
+}
+
+bool
+relay_init(fd_selector s, const char* host)
+{
+	char name[256];
+	const char* port;
+	if (!parse_host(host, name, sizeof(name), &port)) {
+		return false;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* res;
+	if (getaddrinfo(name, port, &hints, &res) != 0) {
+		return false;
+	}
+	memcpy(&server_addr, res->ai_addr, res->ai_addrlen);
+	server_addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	if (gethostname(helo, sizeof(helo)) == -1) {
+		strcpy(helo, "localhost");
+	}
+	helo[sizeof(helo) - 1] = 0;
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd == -1) {
+		return false;
+	}
+	if (selector_register(s, timer_fd, &timer_handler, OP_READ, NULL) != SELECTOR_SUCCESS) {
+		close(timer_fd);
+		timer_fd = -1;
+		return false;
+	}
+	selector = s;
+	enabled = true;
+	stm_profile_register("relay", relay_profile, N(relay_profile), relay_state_name);
+
+	if (!held) {
+		load_queue();
+		schedule();
+	}
+	return true;
+}
+
+void
+relay_set_pool(const unsigned connections, const unsigned idle)
+{
+	max_connections = connections;
+	idle_ms = idle;
+}
+
+bool
+relay_enabled(void)
+{
+	return enabled;
+}
+
+void
+relay_submit(struct commit_job* job)
+{
+	const char* name = relay_queue_name(job);
+	if (!enabled || held || name == NULL) {
+		return;
+	}
+	struct relay_entry* e = calloc(1, sizeof(*e));
+	if (e == NULL) {
+		// queda en disco: se envía al reiniciar
+		return;
+	}
+	strcpy(e->name, name);
+	e->due = metrics_now();
+	queue_insert(e);
+	metrics_counter_add(METRIC_RELAY_QUEUED, 1);
+	metrics_gauge_add(METRIC_RELAY_QUEUE, 1);
+	schedule();
+}
+
+void
+relay_hold(void)
+{
+	held = true;
+	while (queue != NULL) {
+		struct relay_entry* e = queue;
+		queue = e->next;
+		entry_free(e);
+	}
+}
+
+void
+relay_release(void)
+{
+	held = false;
+	if (enabled) {
+		load_queue();
+		schedule();
+	}
+}
+
+bool
+relay_busy(void)
+{
+	for (const struct relay_conn* c = conns; c != NULL; c = c->next) {
+		if (c->entry != NULL) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+relay_close(void)
+{
+	while (queue != NULL) {
+		struct relay_entry* e = queue;
+		queue = e->next;
+		free(e);
+	}
+	if (timer_fd != -1) {
+		close(timer_fd);
+		timer_fd = -1;
+	}
+	armed = 0;
+	enabled = false;
+}
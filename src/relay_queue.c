@@ -0,0 +1,293 @@
+/**
+ * relay_queue.c - cola en disco de los mails a reenviar (ver relay.h)
+ */
+#define _GNU_SOURCE
+#include "relay.h"
+
+#include "store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/** mail en curso */
+struct relay_mail
+{
+	int fd;
+	/** si el archivo no se pudo crear con O_TMPFILE, su nombre temporal */
+	char tmp_path[64];
+	bool failed;
+	/** el cuerpo tiene un CR o un LF sueltos (ver `relay_queue_bare_newline') */
+	bool bare_newline;
+	/** el último byte escrito fue un CR */
+	bool cr;
+	char name[MAILDIR_NAME_LENGTH];
+};
+
+/** indica si `data' tiene un CR o un LF que no forman un CRLF. `cr' es el estado entre llamadas */
+static bool
+has_bare_newline(const uint8_t* data, const size_t len, bool* cr)
+{
+	if (len == 0) {
+		return false;
+	}
+	if (*cr && data[0] != '\n') {
+		return true;
+	}
+	const uint8_t* end = data + len;
+	for (const uint8_t* p = data; (p = memchr(p, '\n', end - p)) != NULL; p++) {
+		if (p == data ? !*cr : p[-1] != '\r') {
+			return true;
+		}
+	}
+	for (const uint8_t* p = data; (p = memchr(p, '\r', end - p)) != NULL; p++) {
+		if (p + 1 < end && p[1] != '\n') {
+			return true;
+		}
+	}
+	*cr = end[-1] == '\r';
+	return false;
+}
+
+void
+relay_queue_open(struct commit_job* job, const char* mailfrom)
+{
+	struct relay_mail* mail = calloc(1, sizeof(*mail));
+	if (mail == NULL) {
+		return;
+	}
+	job->relay_data = mail;
+
+	if ((mkdir("mails", 0777) == -1 && errno != EEXIST) || (mkdir(RELAY_QUEUE_DIR, 0777) == -1 && errno != EEXIST)) {
+		mail->fd = -1;
+		mail->failed = true;
+		return;
+	}
+
+	mail->fd = open(RELAY_QUEUE_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+	if (mail->fd == -1) {
+		snprintf(mail->tmp_path, sizeof(mail->tmp_path), RELAY_QUEUE_DIR "/tmp.XXXXXX");
+		mail->fd = mkostemp(mail->tmp_path, O_CLOEXEC);
+		if (mail->fd == -1) {
+			mail->tmp_path[0] = 0;
+			mail->failed = true;
+			return;
+		}
+	}
+
+	char line[300];
+	int n = snprintf(line, sizeof(line), "F %s\n", mailfrom);
+	mail->failed = !store_write_all(mail->fd, line, n, -1);
+	const struct rcpt_set* rcpts = job->relay_rcpts;
+	for (const struct rcpt_node* r = rcpts->nodes; r < rcpts->nodes + rcpts->count && !mail->failed; r++) {
+		n = snprintf(line, sizeof(line), "+ %s\n", r->email);
+		mail->failed = !store_write_all(mail->fd, line, n, -1);
+	}
+	mail->failed = mail->failed || !store_write_all(mail->fd, "\n", 1, -1);
+}
+
+void
+relay_queue_write(struct commit_job* job, const uint8_t* data, const size_t len)
+{
+	struct relay_mail* mail = job->relay_data;
+	if (mail == NULL || mail->failed) {
+		return;
+	}
+	// el servidor siguiente podría tomar "\n.\n" como el final del DATA
+	if (has_bare_newline(data, len, &mail->cr)) {
+		mail->bare_newline = true;
+		mail->failed = true;
+		return;
+	}
+	mail->failed = !store_write_all(mail->fd, data, len, -1);
+}
+
+bool
+relay_queue_bare_newline(const struct commit_job* job)
+{
+	const struct relay_mail* mail = job->relay_data;
+	return mail != NULL && (mail->bare_newline || mail->cr);
+}
+
+/** deja el mail en la cola con un nombre único. El directorio se sincroniza aparte */
+static bool
+publish(struct relay_mail* mail)
+{
+	// un CR al final también queda suelto
+	if (mail == NULL || mail->failed || mail->cr || fdatasync(mail->fd) == -1) {
+		return false;
+	}
+
+	maildir_unique_name(mail->name, sizeof(mail->name));
+	char path[sizeof(RELAY_QUEUE_DIR) + MAILDIR_NAME_LENGTH + 1];
+	snprintf(path, sizeof(path), RELAY_QUEUE_DIR "/%s", mail->name);
+
+	if (mail->tmp_path[0] == 0) {
+		return publish_tmpfile(mail->fd, path);
+	}
+	if (rename(mail->tmp_path, path) == -1) {
+		return false;
+	}
+	mail->tmp_path[0] = 0;
+	return true;
+}
+
+void
+relay_queue_commit(struct commit_job* batch)
+{
+	bool queued = false;
+	for (struct commit_job* job = batch; job != NULL; job = job->next) {
+		if (job->relay_rcpts != NULL) {
+			const bool ok = publish(job->relay_data);
+			job->ok &= ok;
+			queued |= ok;
+		}
+	}
+
+	// un único fsync del directorio para todo el lote
+	if (queued) {
+		const int fd = open(RELAY_QUEUE_DIR, O_RDONLY | O_CLOEXEC);
+		const bool ok = fd != -1 && fsync(fd) == 0;
+		if (fd != -1) {
+			close(fd);
+		}
+		for (struct commit_job* job = batch; job != NULL && !ok; job = job->next) {
+			if (job->relay_rcpts != NULL) {
+				job->ok = false;
+			}
+		}
+	}
+}
+
+const char*
+relay_queue_name(const struct commit_job* job)
+{
+	const struct relay_mail* mail = job->relay_data;
+	return mail == NULL || mail->name[0] == 0 ? NULL : mail->name;
+}
+
+void
+relay_queue_discard(struct commit_job* job)
+{
+	struct relay_mail* mail = job->relay_data;
+	if (mail == NULL) {
+		return;
+	}
+	if (mail->fd != -1) {
+		close(mail->fd);
+	}
+	if (mail->tmp_path[0] != 0) {
+		unlink(mail->tmp_path);
+	}
+	free(mail);
+	job->relay_data = NULL;
+}
+
+/** agrega un destinatario leído de la cola */
+static bool
+add_rcpt(struct relay_envelope* env, const char* line, const size_t len, const off_t mark)
+{
+	if (len < 3 || len - 2 >= MAX_EMAIL_LENGTH) {
+		return false;
+	}
+	struct relay_rcpt* rcpts = realloc(env->rcpts, (env->nrcpts + 1) * sizeof(*rcpts));
+	if (rcpts == NULL) {
+		return false;
+	}
+	env->rcpts = rcpts;
+
+	struct relay_rcpt* r = rcpts + env->nrcpts++;
+	memcpy(r->email, line + 2, len - 2);
+	r->email[len - 2] = 0;
+	r->status = line[0] == '+' ? RELAY_RCPT_PENDING : RELAY_RCPT_DONE;
+	r->mark = mark;
+	return true;
+}
+
+bool
+relay_queue_load(const char* name, struct relay_envelope* env)
+{
+	memset(env, 0, sizeof(*env));
+
+	char path[sizeof(RELAY_QUEUE_DIR) + MAILDIR_NAME_LENGTH + 1];
+	snprintf(path, sizeof(path), RELAY_QUEUE_DIR "/%s", name);
+	env->fd = open(path, O_RDWR | O_CLOEXEC);
+	struct stat st;
+	if (env->fd == -1 || fstat(env->fd, &st) == -1) {
+		goto fail;
+	}
+	env->size = st.st_size;
+
+	// el sobre se lee de a pedazos, línea por línea, hasta la línea vacía
+	char buff[4096];
+	size_t len = 0;
+	off_t offset = 0;
+	bool from = false;
+	while (true) {
+		char* nl = memchr(buff, '\n', len);
+		if (nl == NULL) {
+			if (len == sizeof(buff)) {
+				goto fail;
+			}
+			const ssize_t n = pread(env->fd, buff + len, sizeof(buff) - len, offset + len);
+			if (n <= 0) {
+				goto fail;
+			}
+			len += n;
+			continue;
+		}
+
+		const size_t line_len = nl - buff;
+		if (line_len == 0) {
+			env->body = offset + 1;
+			break;
+		}
+		if (buff[0] == 'F' && line_len >= 2 && line_len - 2 < sizeof(env->mailfrom) && !from) {
+			memcpy(env->mailfrom, buff + 2, line_len - 2);
+			env->mailfrom[line_len - 2] = 0;
+			from = true;
+		} else if (!(buff[0] == '+' || buff[0] == '-') || !add_rcpt(env, buff, line_len, offset)) {
+			goto fail;
+		}
+
+		offset += line_len + 1;
+		len -= line_len + 1;
+		memmove(buff, nl + 1, len);
+	}
+
+	if (from && env->nrcpts > 0) {
+		return true;
+	}
+
+fail:
+	relay_queue_release(env);
+	return false;
+}
+
+void
+relay_queue_mark(struct relay_envelope* env)
+{
+	for (unsigned i = 0; i < env->nrcpts; i++) {
+		const enum relay_rcpt_status st = env->rcpts[i].status;
+		if ((st == RELAY_RCPT_DONE || st == RELAY_RCPT_FAILED) && pwrite(env->fd, "-", 1, env->rcpts[i].mark) != 1) {
+			// no es grave: el destinatario recibirá el mail otra vez
+			perror("Error marking relay recipient");
+		}
+	}
+}
+
+void
+relay_queue_release(struct relay_envelope* env)
+{
+	if (env->fd != -1) {
+		close(env->fd);
+	}
+	free(env->rcpts);
+	env->rcpts = NULL;
+	env->nrcpts = 0;
+	env->fd = -1;
+}
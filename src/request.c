@@ -4,8 +4,32 @@
 #include "request.h"
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <string.h>
 
+/** terminó la línea del MAIL FROM */
+static enum request_state
+mail_from_done(struct request_parser* p)
+{
+	p->command = request_command_mail;
+	return request_cr;
+}
+
+/** siguiente estado después de `c' dentro del nombre de un parámetro del MAIL FROM */
+static enum request_state
+mail_param_next(struct request_parser* p, const uint8_t c, const char expected, const enum request_state match)
+{
+	switch (c) {
+		case ' ':
+		case '\t':
+			return request_mail_param;
+		case '\r':
+			return mail_from_done(p);
+		default:
+			return tolower(c) == expected ? match : request_mail_param_other;
+	}
+}
+
 void
 request_parser_init(struct request_parser* p)
 {
@@ -53,6 +77,11 @@ request_parser_feed(struct request_parser* p, const uint8_t c)
 					next = request_verb_q;
 				} break;
 
+				case 's':
+				case 'S': {
+					next = request_verb_s;
+				} break;
+
 				case ' ':
 				case '\t': {
 					next = request_verb;
@@ -326,6 +355,11 @@ request_parser_feed(struct request_parser* p, const uint8_t c)
 					next = request_verb_rc;
 				} break;
 
+				case 's':
+				case 'S': {
+					next = request_verb_rs;
+				} break;
+
 				default: {
 					next = request_error;
 					p->state = next;
@@ -422,6 +456,49 @@ request_parser_feed(struct request_parser* p, const uint8_t c)
 			}
 		} break;
 
+		case request_verb_rs: {
+			switch (c) {
+				case 'e':
+				case 'E': {
+					next = request_verb_rse;
+				} break;
+
+				default: {
+					next = request_error;
+					p->state = next;
+					return request_parser_feed(p, c);
+				} break;
+			}
+		} break;
+
+		case request_verb_rse: {
+			switch (c) {
+				case 't':
+				case 'T': {
+					next = request_verb_rset;
+				} break;
+
+				default: {
+					next = request_error;
+					p->state = next;
+					return request_parser_feed(p, c);
+				} break;
+			}
+		} break;
+
+		case request_verb_rset: {
+			switch (c) {
+				case '\r': {
+					next = request_cr;
+					p->command = request_command_rset;
+				} break;
+
+				default: {
+					next = request_error;
+				} break;
+			}
+		} break;
+
 		case request_verb_d: {
 			switch (c) {
 				case 'a':
@@ -538,6 +615,124 @@ request_parser_feed(struct request_parser* p, const uint8_t c)
 			}
 		} break;
 
+		case request_verb_s: {
+			switch (c) {
+				case 't':
+				case 'T': {
+					next = request_verb_st;
+				} break;
+
+				default: {
+					next = request_error;
+					p->state = next;
+					return request_parser_feed(p, c);
+				} break;
+			}
+		} break;
+
+		case request_verb_st: {
+			switch (c) {
+				case 'a':
+				case 'A': {
+					next = request_verb_sta;
+				} break;
+
+				default: {
+					next = request_error;
+					p->state = next;
+					return request_parser_feed(p, c);
+				} break;
+			}
+		} break;
+
+		case request_verb_sta: {
+			switch (c) {
+				case 'r':
+				case 'R': {
+					next = request_verb_star;
+				} break;
+
+				default: {
+					next = request_error;
+					p->state = next;
+					return request_parser_feed(p, c);
+				} break;
+			}
+		} break;
+
+		case request_verb_star: {
+			switch (c) {
+				case 't':
+				case 'T': {
+					next = request_verb_start;
+				} break;
+
+				default: {
+					next = request_error;
+					p->state = next;
+					return request_parser_feed(p, c);
+				} break;
+			}
+		} break;
+
+		case request_verb_start: {
+			switch (c) {
+				case 't':
+				case 'T': {
+					next = request_verb_startt;
+				} break;
+
+				default: {
+					next = request_error;
+					p->state = next;
+					return request_parser_feed(p, c);
+				} break;
+			}
+		} break;
+
+		case request_verb_startt: {
+			switch (c) {
+				case 'l':
+				case 'L': {
+					next = request_verb_starttl;
+				} break;
+
+				default: {
+					next = request_error;
+					p->state = next;
+					return request_parser_feed(p, c);
+				} break;
+			}
+		} break;
+
+		case request_verb_starttl: {
+			switch (c) {
+				case 's':
+				case 'S': {
+					next = request_verb_starttls;
+				} break;
+
+				default: {
+					next = request_error;
+					p->state = next;
+					return request_parser_feed(p, c);
+				} break;
+			}
+		} break;
+
+		case request_verb_starttls: {
+			switch (c) {
+				case '\r': {
+					next = request_cr;
+					p->command = request_command_starttls;
+				} break;
+
+				default: {
+					next = request_error;
+				} break;
+			}
+		} break;
+
 		case request_helo_sep: {
 			switch (c) {
 				case ' ':
@@ -643,8 +838,12 @@ request_parser_feed(struct request_parser* p, const uint8_t c)
 		case request_mail_from_sender: {
 			switch (c) {
 				case '\r': {
-					next = request_cr;
-					p->command = request_command_mail;
+					next = mail_from_done(p);
+				} break;
+
+				case ' ':
+				case '\t': {
+					next = request_mail_param;
 				} break;
 
 				default: {
@@ -653,6 +852,62 @@ request_parser_feed(struct request_parser* p, const uint8_t c)
 			}
 		} break;
 
+		case request_mail_param: {
+			next = mail_param_next(p, c, 's', request_mail_param_s);
+		} break;
+
+		case request_mail_param_s: {
+			next = mail_param_next(p, c, 'i', request_mail_param_si);
+		} break;
+
+		case request_mail_param_si: {
+			next = mail_param_next(p, c, 'z', request_mail_param_siz);
+		} break;
+
+		case request_mail_param_siz: {
+			next = mail_param_next(p, c, 'e', request_mail_param_size);
+		} break;
+
+		case request_mail_param_size: {
+			next = mail_param_next(p, c, '=', request_mail_param_size_eq);
+		} break;
+
+		case request_mail_param_size_eq:
+		case request_mail_param_size_value: {
+			if (c >= '0' && c <= '9') {
+				// un valor que no entra en 64 bits se toma como el máximo: igual se rechaza
+				const uint64_t digit = c - '0';
+				const uint64_t size = p->state == request_mail_param_size_eq ? 0 : p->request->size;
+				p->request->size = size > (UINT64_MAX - digit) / 10 ? UINT64_MAX : size * 10 + digit;
+				next = request_mail_param_size_value;
+			} else if (p->state == request_mail_param_size_value && (c == ' ' || c == '\t')) {
+				next = request_mail_param;
+			} else if (p->state == request_mail_param_size_value && c == '\r') {
+				next = mail_from_done(p);
+			} else {
+				next = request_error;
+				p->state = next;
+				return request_parser_feed(p, c);
+			}
+		} break;
+
+		case request_mail_param_other: {
+			switch (c) {
+				case ' ':
+				case '\t': {
+					next = request_mail_param;
+				} break;
+
+				case '\r': {
+					next = mail_from_done(p);
+				} break;
+
+				default: {
+					next = request_mail_param_other;
+				} break;
+			}
+		} break;
+
 		case request_rcpt_to_sep: {
 			switch (c) {
 				case ' ':
@@ -3,6 +3,8 @@
  */
 #include "selector.h"
 
+#include "probes.h"
+
 #include <assert.h>  // :)
 #include <errno.h>   // :)
 #include <fcntl.h>
@@ -163,6 +165,9 @@ struct fdselector
 	 * notificados.
 	 */
 	struct blocking_job* resolution_jobs;
+
+	/** duración del último despacho de eventos, en nanosegundos */
+	uint64_t dispatch_ns;
 };
 
 /** cantidad máxima de file descriptors que la plataforma puede manejar */
@@ -309,6 +314,8 @@ selector_new(const size_t initial_elements)
 		assert(ret->max_fd == 0);
 		ret->resolution_jobs = 0;
 		pthread_mutex_init(&ret->resolution_mutex, 0);
+		// se actualiza en cada select; hasta entonces, quien lo creó
+		ret->selector_thread = pthread_self();
 		if (0 != ensure_capacity(ret, initial_elements)) {
 			selector_destroy(ret);
 			ret = NULL;
@@ -356,7 +363,7 @@ selector_register(fd_selector s, const int fd, const fd_handler* handler, const
 	}
 	// 1. tenemos espacio?
 	size_t ufd = (size_t)fd;
-	if (ufd > s->fd_size) {
+	if (ufd >= s->fd_size) {
 		ret = ensure_capacity(s, ufd);
 		if (SELECTOR_SUCCESS != ret) {
 			goto finally;
@@ -477,7 +484,9 @@ handle_iteration(fd_selector s)
 					if (0 == item->handler->handle_read) {
 						assert(("OP_READ arrived but no handler. bug!" == 0));
 					} else {
+						PROBE2(selector_dispatch, item->fd, OP_READ);
 						item->handler->handle_read(&key);
+						PROBE2(selector_dispatch_done, key.fd, OP_READ);
 					}
 				}
 			}
@@ -486,7 +495,9 @@ handle_iteration(fd_selector s)
 					if (0 == item->handler->handle_write) {
 						assert(("OP_WRITE arrived but no handler. bug!" == 0));
 					} else {
+						PROBE2(selector_dispatch, item->fd, OP_WRITE);
 						item->handler->handle_write(&key);
+						PROBE2(selector_dispatch_done, key.fd, OP_WRITE);
 					}
 				}
 			}
@@ -500,8 +511,13 @@ handle_block_notifications(fd_selector s)
 	struct selector_key key = {
 		.s = s,
 	};
+	// tomamos la lista y soltamos el lock: un handler puede volver a
+	// notificar (por ejemplo, encolando otro trabajo que termina enseguida)
 	pthread_mutex_lock(&s->resolution_mutex);
 	struct blocking_job* j = s->resolution_jobs;
+	s->resolution_jobs = 0;
+	pthread_mutex_unlock(&s->resolution_mutex);
+
 	while (j != NULL) {
 		struct item* item = s->fds + j->fd;
 		if (ITEM_USED(item)) {
@@ -514,8 +530,6 @@ handle_block_notifications(fd_selector s)
 		j = j->next;
 		free(aux);
 	}
-	s->resolution_jobs = 0;
-	pthread_mutex_unlock(&s->resolution_mutex);
 }
 
 selector_status
@@ -557,6 +571,7 @@ selector_select(fd_selector s)
 	s->selector_thread = pthread_self();
 
 	int fds = pselect(s->max_fd + 1, &s->slave_r, &s->slave_w, 0, &s->slave_t, &emptyset);
+	PROBE2(selector_wakeup, fds, s->max_fd);
 	if (-1 == fds) {
 		switch (errno) {
 			case EAGAIN:
@@ -579,16 +594,28 @@ selector_select(fd_selector s)
 				ret = SELECTOR_IO;
 				goto finally;
 		}
-	} else {
+	}
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (fds != -1) {
 		handle_iteration(s);
 	}
 	if (ret == SELECTOR_SUCCESS) {
 		handle_block_notifications(s);
 	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	s->dispatch_ns = (uint64_t)(end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
 finally:
 	return ret;
 }
 
+uint64_t
+selector_dispatch_time(fd_selector s)
+{
+	return s->dispatch_ns;
+}
+
 int
 selector_fd_set_nio(const int fd)
 {
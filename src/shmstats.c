@@ -0,0 +1,145 @@
+/**
+ * shmstats.c - publica las métricas del servidor en memoria compartida
+ */
+#include "shmstats.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define READ_RETRIES 1000
+
+static struct shmstats* segment = NULL;
+static char segment_name[64];
+
+bool
+shmstats_open(const char* name)
+{
+	// si quedó un segmento de una ejecución anterior lo descartamos
+	shm_unlink(name);
+
+	const int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd == -1) {
+		return false;
+	}
+
+	if (ftruncate(fd, sizeof(struct shmstats)) == -1) {
+		close(fd);
+		shm_unlink(name);
+		return false;
+	}
+
+	void* p = mmap(NULL, sizeof(struct shmstats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		shm_unlink(name);
+		return false;
+	}
+
+	segment = p;
+	memset(segment, 0, sizeof(*segment));
+	segment->magic = SHMSTATS_MAGIC;
+	segment->version = SHMSTATS_VERSION;
+	segment->size = sizeof(struct shmstats);
+	segment->pid = getpid();
+
+	strncpy(segment_name, name, sizeof(segment_name) - 1);
+	shmstats_publish();
+	return true;
+}
+
+void
+shmstats_publish(void)
+{
+	if (segment == NULL) {
+		return;
+	}
+
+	// seq impar: escritura en curso
+	segment->seq++;
+	atomic_thread_fence(memory_order_release);
+
+	segment->published_at = metrics_now();
+	for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+		segment->counters[i] = metrics_counter(i);
+	}
+	for (unsigned i = 0; i < METRIC_GAUGES; i++) {
+		segment->gauges[i] = metrics_gauge(i);
+	}
+
+	atomic_thread_fence(memory_order_release);
+	segment->seq++;
+}
+
+void
+shmstats_release(void)
+{
+	if (segment != NULL) {
+		munmap(segment, sizeof(*segment));
+		segment = NULL;
+	}
+}
+
+void
+shmstats_close(void)
+{
+	if (segment != NULL) {
+		munmap(segment, sizeof(*segment));
+		shm_unlink(segment_name);
+		segment = NULL;
+	}
+}
+
+const struct shmstats*
+shmstats_attach(const char* name)
+{
+	const int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < offsetof(struct shmstats, seq)) {
+		close(fd);
+		return NULL;
+	}
+
+	void* p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		return NULL;
+	}
+
+	const struct shmstats* shm = p;
+	if (shm->magic != SHMSTATS_MAGIC || shm->version != SHMSTATS_VERSION || shm->size != sizeof(*shm) ||
+	    (size_t)st.st_size < sizeof(*shm)) {
+		munmap(p, st.st_size);
+		return NULL;
+	}
+
+	return shm;
+}
+
+bool
+shmstats_read(const struct shmstats* shm, struct shmstats* out)
+{
+	for (unsigned i = 0; i < READ_RETRIES; i++) {
+		const uint64_t before = shm->seq;
+		atomic_thread_fence(memory_order_acquire);
+		if (before & 1) {
+			continue;
+		}
+
+		memcpy(out, (const void*)shm, sizeof(*out));
+
+		atomic_thread_fence(memory_order_acquire);
+		if (shm->seq == before) {
+			return true;
+		}
+	}
+	return false;
+}
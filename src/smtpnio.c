@@ -1,15 +1,26 @@
 #include "smtpnio.h"
 
+#include "bufchain.h"
 #include "buffer.h"
+#include "commit.h"
 #include "data.h"
+#include "directory.h"
+#include "logger.h"
+#include "metrics.h"
+#include "probes.h"
 #include "rcpt_to_list.h"
+#include "relay.h"
 #include "request.h"
 #include "selector.h"
 #include "stm.h"
+#include "store.h"
+#include "tls.h"
 
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,34 +28,22 @@
 #include <strings.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
 #include <unistd.h>
 
-#define N(x)   (sizeof(x) / sizeof((x)[0]))
-#define DOMAIN "@smtpd.com"
+#define N(x) (sizeof(x) / sizeof((x)[0]))
+
+/**
+ * buffers de los comandos y sus respuestas: una línea de comando tiene a lo
+ * sumo 512 bytes (RFC 5321 4.5.3.1.4). El contenido del mail no pasa por
+ * acá sino por `data_chain', que sólo toma memoria mientras llega el DATA.
+ */
+#define COMMAND_BUFFER_SIZE 512
 
 /** obtiene el struct (smtp *) desde la llave de selección  */
 #define ATTACHMENT(key) ((struct smtp*)(key)->data)
 
-enum smtp_state
-{
-	GREETING_WRITE,
-	FAILED_CONNECTION_READ,
-	FAILED_CONNECTION_WRITE,
-	EHLO_READ,
-	EHLO_WRITE,
-	MAIL_FROM_READ,
-	MAIL_FROM_WRITE,
-	RCPT_TO_READ,
-	RCPT_TO_WRITE,
-	DATA_READ,
-	DATA_WRITE,
-	MAIL_INFO_READ,
-	MAIL_INFO_WRITE,
-	DONE,
-	ERROR
-};
-
 struct smtp
 {
 	/** información del cliente */
@@ -61,13 +60,40 @@ struct smtp
 	struct data_parser data_parser;
 
 	/** buffers */
-	uint8_t raw_buff_read[2048], raw_buff_write[2048], raw_buff_file[2048];
-	buffer read_buffer, write_buffer, file_buffer;
+	uint8_t raw_buff_read[COMMAND_BUFFER_SIZE], raw_buff_write[COMMAND_BUFFER_SIZE];
+	buffer read_buffer, write_buffer;
+
+	/**
+	 * contenido del DATA, leído de a varios bloques por evento (ver
+	 * `mail_info_readv'). Puede quedar lo que el cliente mandó después del
+	 * final, que se pasa a `read_buffer' antes de volver a leer del socket.
+	 */
+	struct bufchain data_chain;
 
 	bool transformation;
 
+	/** sesión TLS después de un STARTTLS, o NULL */
+	struct tls* tls;
+
 	char mailfrom[255];
-	struct rcpt_node* rcpt_list;
+	struct rcpt_set rcpts;
+	/** destinatarios de otros dominios (ver relay.h) */
+	struct rcpt_set relay_rcpts;
+
+	/** entrega durable del mail actual (ver commit.h) */
+	struct commit_job commit;
+
+	/** marcas de tiempo (ver metrics_now) para las métricas de latencia */
+	uint64_t accepted_at;
+	uint64_t command_at;
+	uint64_t data_started_at;
+	uint64_t data_done_at;
+	uint64_t data_size;
+
+	/** tamaño máximo de un mail, del listener que la aceptó */
+	uint64_t max_size;
+	/** el DATA en curso pasó `max_size': se lee hasta el final sin guardarlo */
+	bool oversize;
 };
 
 static int check_email_domain(const char* email);
@@ -80,6 +106,9 @@ static void request_read_init(const unsigned state, struct selector_key* key);
 static void data_buffer_init(const unsigned state, struct selector_key* key);
 
 static unsigned greeting_write(struct selector_key* key);
+static unsigned starttls_write(struct selector_key* key);
+static void tls_handshake_init(const unsigned state, struct selector_key* key);
+static unsigned tls_handshake_step(struct selector_key* key);
 static unsigned failed_connection_write(struct selector_key* key);
 static unsigned failed_connection_read_process(struct selector_key* key, struct smtp* state);
 static unsigned failed_connection_read(struct selector_key* key);
@@ -97,26 +126,131 @@ static unsigned data_read(struct selector_key* key);
 static unsigned data_write(struct selector_key* key);
 static unsigned mail_info_read_process(struct selector_key* key, struct smtp* state);
 static unsigned mail_info_read(struct selector_key* key);
+static void mail_commit_init(const unsigned state, struct selector_key* key);
+static unsigned mail_commit_block(struct selector_key* key);
 static unsigned mail_info_write(struct selector_key* key);
 
-static int historic_users = 0;
-static int current_users = 0;
-static int transferred_bytes = 0;
-static int mails_sent = 0;
 static bool transformations = false;
 static char* program;
 int max_user = 500;
+/** destinatarios por transacción, sumando locales y del relay */
+static unsigned max_rcpts = RCPT_MAX;
+static size_t data_high_water = BUFCHAIN_HIGH_WATER;
+/** dominio de los destinatarios locales, con el '@' */
+static char domain[256] = "@smtpd.com";
 
 static int
 check_email_domain(const char* email)
 {
 	const char* at_position = strchr(email, '@');
-	if (at_position == NULL || strcmp(at_position, DOMAIN) != 0) {
+	if (at_position == NULL || strcmp(at_position, domain) != 0) {
 		return 0;
 	}
 	return 1;
 }
 
+/**
+ * agrega un destinatario a los locales si es una casilla del directorio (o,
+ * sin directorio, de nuestro dominio), o a los del relay si es de otro
+ * dominio y hay un servidor al cual reenviarlo. Un repetido se acepta pero
+ * no se vuelve a agregar. Retorna NULL, o la respuesta si se rechaza.
+ */
+static const char*
+add_rcpt(struct smtp* state, const char* email)
+{
+	if (state->rcpts.count + state->relay_rcpts.count >= max_rcpts) {
+		return "452 Too many recipients\r\n";
+	}
+
+	enum directory_result r;
+	if (directory_enabled()) {
+		r = directory_lookup(email);
+	} else {
+		r = check_email_domain(email) ? DIRECTORY_LOCAL : DIRECTORY_FOREIGN;
+	}
+
+	struct rcpt_set* set;
+	if (r == DIRECTORY_LOCAL) {
+		set = &state->rcpts;
+	} else if (r == DIRECTORY_UNKNOWN) {
+		metrics_counter_add(METRIC_RCPT_UNKNOWN, 1);
+		return "550 Mailbox unavailable. The user specified does not exist\r\n";
+	} else if (relay_enabled() && strchr(email, '@') != NULL) {
+		set = &state->relay_rcpts;
+	} else {
+		return "550 Invalid domain. The domain specified does not exist\r\n";
+	}
+
+	switch (rcpt_set_add(set, email)) {
+		case RCPT_TOO_LONG:
+			return "553 Mailbox name not allowed\r\n";
+		case RCPT_NO_MEMORY:
+			return "452 Insufficient system storage\r\n";
+		default:
+			return NULL;
+	}
+}
+
+/** si un mail de `size' bytes pasa el límite de la sesión */
+static bool
+over_max_size(const struct smtp* state, const uint64_t size)
+{
+	return state->max_size > 0 && size > state->max_size;
+}
+
+/** RSET: descarta el remitente y los destinatarios de la transacción en curso */
+static unsigned
+reset_transaction(struct smtp* state, uint8_t* ptr)
+{
+	state->mailfrom[0] = 0;
+	rcpt_set_clear(&state->rcpts);
+	rcpt_set_clear(&state->relay_rcpts);
+
+	strcpy((char*)ptr, "250 Ok\r\n");
+	buffer_write_adv(&state->write_buffer, 8);
+	return MAIL_FROM_WRITE;
+}
+
+/**
+ * registra la latencia de la respuesta que se terminó de enviar: para los
+ * comandos se mide desde que empezamos a leerlos, y para el "250 queued"
+ * desde que recibimos el final del DATA.
+ */
+static void
+record_reply_latency(struct smtp* state, unsigned current_state)
+{
+	const uint64_t now = metrics_now();
+
+	if (current_state == MAIL_INFO_WRITE) {
+		metrics_histogram_record(METRIC_QUEUED_LATENCY, now - state->data_done_at);
+	} else if (state->command_at != 0) {
+		metrics_histogram_record(METRIC_COMMAND_LATENCY + state->request_parser.command, now - state->command_at);
+	}
+	state->command_at = 0;
+}
+
+/**
+ * recv y send con el cliente. Con TLS, en el sentido en que el kernel no
+ * cifra (ver tls.h) pasan por OpenSSL.
+ */
+static ssize_t
+session_recv(struct smtp* s, const int fd, void* buf, const size_t n)
+{
+	if (s->tls != NULL && !tls_ktls_recv(s->tls)) {
+		return tls_recv(s->tls, buf, n);
+	}
+	return recv(fd, buf, n, MSG_DONTWAIT);
+}
+
+static ssize_t
+session_send(struct smtp* s, const int fd, const void* buf, const size_t n)
+{
+	if (s->tls != NULL && !tls_ktls_send(s->tls)) {
+		return tls_send(s->tls, buf, n);
+	}
+	return send(fd, buf, n, MSG_NOSIGNAL);
+}
+
 static unsigned
 write_status(struct selector_key* key, unsigned current_state, unsigned next_state)
 {
@@ -127,17 +261,21 @@ write_status(struct selector_key* key, unsigned current_state, unsigned next_sta
 	buffer* wb = &state->write_buffer;
 
 	uint8_t* ptr = buffer_read_ptr(wb, &count);
-	ssize_t n = send(key->fd, ptr, count, MSG_NOSIGNAL);
+	ssize_t n = session_send(state, key->fd, ptr, count);
 
 	if (n > 0) {
+		metrics_counter_add(METRIC_BYTES_OUT, n);
 		buffer_read_adv(wb, n);
 		if (!buffer_can_read(wb)) {
+			record_reply_latency(state, current_state);
 			if (selector_set_interest_key(key, OP_READ) == SELECTOR_SUCCESS) {
 				ret = next_state;
 			} else {
 				ret = ERROR;
 			}
 		}
+	} else if (n == -1 && errno == EAGAIN) {
+		// TLS: OpenSSL todavía no pudo escribir el registro completo
 	} else {
 		ret = ERROR;
 	}
@@ -153,17 +291,29 @@ read_status(struct selector_key* key,
 	unsigned ret = current_state;
 	struct smtp* state = ATTACHMENT(key);
 
+	if (state->command_at == 0) {
+		state->command_at = metrics_now();
+	}
+
 	if (buffer_can_read(&state->read_buffer)) {
 		ret = read_process(key, state);
+	} else if (state->data_chain.length > 0) {
+		// lo que llegó detrás del final del DATA
+		size_t count;
+		uint8_t* ptr = buffer_write_ptr(&state->read_buffer, &count);
+		buffer_write_adv(&state->read_buffer, bufchain_read(&state->data_chain, ptr, count));
+		ret = read_process(key, state);
 	} else {
 		size_t count;
 		uint8_t* ptr = buffer_write_ptr(&state->read_buffer, &count);
-		ssize_t n = recv(key->fd, ptr, count, MSG_DONTWAIT);
-		transferred_bytes += n;
+		ssize_t n = session_recv(state, key->fd, ptr, count);
 
 		if (n > 0) {
+			metrics_counter_add(METRIC_BYTES_IN, n);
 			buffer_write_adv(&state->read_buffer, n);
 			ret = read_process(key, state);
+		} else if (n == -1 && errno == EAGAIN) {
+			// TLS: llegó sólo una parte del registro
 		} else {
 			ret = ERROR;
 		}
@@ -190,8 +340,10 @@ greeting_write(struct selector_key* key)
 	ssize_t n = send(key->fd, ptr, count, MSG_NOSIGNAL);
 
 	if (n > 0) {
+		metrics_counter_add(METRIC_BYTES_OUT, n);
 		buffer_read_adv(wb, n);
 		if (!buffer_can_read(wb)) {
+			metrics_histogram_record(METRIC_GREETING_LATENCY, metrics_now() - state->accepted_at);
 			if (selector_set_interest_key(key, OP_READ) == SELECTOR_SUCCESS) {
 				ret = EHLO_READ;
 			} else {
@@ -223,6 +375,7 @@ failed_connection_write(struct selector_key* key)
 	ssize_t n = send(key->fd, ptr, count, MSG_NOSIGNAL);
 
 	if (n > 0) {
+		metrics_counter_add(METRIC_BYTES_OUT, n);
 		buffer_read_adv(wb, n);
 		if (!buffer_can_read(wb)) {
 			if (selector_set_interest_key(key, OP_READ) == SELECTOR_SUCCESS) {
@@ -297,8 +450,12 @@ ehlo_read_process(struct selector_key* key, struct smtp* state)
 
 			if (state->request_parser.command == request_command_ehlo) {
 				ret = EHLO_WRITE;
-				char s[] = "250-localhost\r\n250-PIPELINING\r\n250 SIZE 10240000\r\n";
-				sprintf((char*)ptr, s, state->request_parser.request->domain);
+				const bool starttls = tls_enabled() && state->tls == NULL;
+				// SIZE 0 anuncia que no hay límite (RFC 1870)
+				sprintf((char*)ptr,
+				        "250-localhost\r\n250-PIPELINING\r\n%s250 SIZE %" PRIu64 "\r\n",
+				        starttls ? "250-STARTTLS\r\n" : "",
+				        state->max_size);
 				buffer_write_adv(&state->write_buffer, strlen((char*)ptr));
 			} else if (state->request_parser.command == request_command_helo) {
 				ret = EHLO_WRITE;
@@ -338,6 +495,50 @@ ehlo_write(struct selector_key* key)
 	return write_status(key, EHLO_WRITE, EHLO_READ);
 }
 
+static unsigned
+starttls_write(struct selector_key* key)
+{
+	return write_status(key, STARTTLS_WRITE, TLS_HANDSHAKE);
+}
+
+static void
+tls_handshake_init(const unsigned state, struct selector_key* key)
+{
+	struct smtp* s = ATTACHMENT(key);
+	// lo que el cliente mandó en claro detrás del STARTTLS se descarta (RFC 3207 5)
+	buffer_reset(&s->read_buffer);
+	bufchain_free(&s->data_chain);
+	s->tls = tls_new(key->fd);
+}
+
+/** avanza el handshake; se llama tanto al poder leer como al poder escribir */
+static unsigned
+tls_handshake_step(struct selector_key* key)
+{
+	struct smtp* s = ATTACHMENT(key);
+	const enum tls_result r = s->tls == NULL ? TLS_ERROR : tls_handshake(s->tls);
+
+	switch (r) {
+		case TLS_WANT_READ:
+			return selector_set_interest_key(key, OP_READ) == SELECTOR_SUCCESS ? TLS_HANDSHAKE : ERROR;
+		case TLS_WANT_WRITE:
+			return selector_set_interest_key(key, OP_WRITE) == SELECTOR_SUCCESS ? TLS_HANDSHAKE : ERROR;
+		case TLS_DONE:
+			metrics_counter_add(METRIC_TLS_HANDSHAKES, 1);
+			if (tls_ktls_send(s->tls) && tls_ktls_recv(s->tls)) {
+				metrics_counter_add(METRIC_TLS_KTLS, 1);
+			}
+			// el cliente vuelve a empezar con EHLO (RFC 3207 4.2)
+			s->mailfrom[0] = 0;
+			rcpt_set_clear(&s->rcpts);
+			rcpt_set_clear(&s->relay_rcpts);
+			return selector_set_interest_key(key, OP_READ) == SELECTOR_SUCCESS ? EHLO_READ : ERROR;
+		default:
+			metrics_counter_add(METRIC_TLS_FAILED, 1);
+			return ERROR;
+	}
+}
+
 static unsigned
 mail_from_read_process(struct selector_key* key, struct smtp* state)
 {
@@ -351,12 +552,21 @@ mail_from_read_process(struct selector_key* key, struct smtp* state)
 			size_t count;
 			uint8_t* ptr = buffer_write_ptr(&state->write_buffer, &count);
 
-			if (state->request_parser.command == request_command_mail) {
+			if (state->request_parser.command == request_command_mail &&
+			    over_max_size(state, state->request_parser.request->size)) {
+				// antes del DATA: no se llega a crear ningún archivo
+				ret = MAIL_FROM_WRITE;
+				metrics_counter_add(METRIC_SIZE_REJECTED, 1);
+				strcpy((char*)ptr, "552 Message size exceeds fixed maximum message size\r\n");
+				buffer_write_adv(&state->write_buffer, strlen((char*)ptr));
+			} else if (state->request_parser.command == request_command_mail) {
 				ret = MAIL_FROM_WRITE;
 				char s[] = "250 Mail from received - %s\r\n";
 				strcpy(state->mailfrom, state->request_parser.request->arg);
 				sprintf((char*)ptr, s, state->mailfrom);
 				buffer_write_adv(&state->write_buffer, strlen((char*)ptr));
+			} else if (state->request_parser.command == request_command_rset) {
+				ret = reset_transaction(state, ptr);
 			} else if (state->request_parser.command == request_command_quit) {
 				ret = DONE;
 				strcpy((char*)ptr, "221 Bye\r\n");
@@ -366,6 +576,18 @@ mail_from_read_process(struct selector_key* key, struct smtp* state)
 				ret = MAIL_FROM_WRITE;
 				strcpy((char*)ptr, "503 Bad sequence of commands. MAIL FROM command must precede RCPT TO command\r\n");
 				buffer_write_adv(&state->write_buffer, 78);
+			} else if (state->request_parser.command == request_command_starttls) {
+				if (!tls_enabled()) {
+					ret = MAIL_FROM_WRITE;
+					strcpy((char*)ptr, "502 Command not implemented\r\n");
+				} else if (state->tls != NULL) {
+					ret = MAIL_FROM_WRITE;
+					strcpy((char*)ptr, "503 Bad sequence of commands. TLS already active\r\n");
+				} else {
+					ret = STARTTLS_WRITE;
+					strcpy((char*)ptr, "220 Ready to start TLS\r\n");
+				}
+				buffer_write_adv(&state->write_buffer, strlen((char*)ptr));
 			} else {
 				ret = MAIL_FROM_WRITE;
 				strcpy((char*)ptr, "500 Syntax error. Expected: MAIL FROM:<email@domain>\r\n");
@@ -388,8 +610,9 @@ mail_from_read(struct selector_key* key)
 static unsigned
 mail_from_write(struct selector_key* key)
 {
-	struct request_parser* p = &ATTACHMENT(key)->request_parser;
-	if (p->command == request_command_mail)
+	const struct smtp* s = ATTACHMENT(key);
+	const struct request_parser* p = &s->request_parser;
+	if (p->command == request_command_mail && !over_max_size(s, p->request->size))
 		return write_status(key, MAIL_FROM_WRITE, RCPT_TO_READ);
 	return write_status(key, MAIL_FROM_WRITE, MAIL_FROM_READ);
 }
@@ -408,22 +631,18 @@ rcpt_to_read_process(struct selector_key* key, struct smtp* state)
 			uint8_t* ptr = buffer_write_ptr(&state->write_buffer, &count);
 
 			if (state->request_parser.command == request_command_rcpt) {
-				if (check_email_domain(state->request_parser.request->arg)) {
-					ret = RCPT_TO_WRITE;
+				const char* rejected = add_rcpt(state, state->request_parser.request->arg);
+				ret = RCPT_TO_WRITE;
+				if (rejected == NULL) {
 					char s[] = "250 Rcpt to received - %s\r\n";
-					if (state->rcpt_list == NULL) {
-						state->rcpt_list = create_rcpt_node(state->request_parser.request->arg);
-					} else {
-						add_rcpt_to_list(&state->rcpt_list, state->request_parser.request->arg);
-					}
 					sprintf((char*)ptr, s, state->request_parser.request->arg);
-					buffer_write_adv(&state->write_buffer, strlen((char*)ptr));
 				} else {
-					ret = RCPT_TO_WRITE;
-					strcpy((char*)ptr, "550 Invalid domain. The domain specified does not exist\r\n");
-					buffer_write_adv(&state->write_buffer, 57);
+					strcpy((char*)ptr, rejected);
 				}
+				buffer_write_adv(&state->write_buffer, strlen((char*)ptr));
 
+			} else if (state->request_parser.command == request_command_rset) {
+				ret = reset_transaction(state, ptr);
 			} else if (state->request_parser.command == request_command_quit) {
 				ret = DONE;
 				strcpy((char*)ptr, "221 Bye\r\n");
@@ -455,8 +674,8 @@ rcpt_to_read(struct selector_key* key)
 static unsigned
 rcpt_to_write(struct selector_key* key)
 {
-	struct request_parser* p = &ATTACHMENT(key)->request_parser;
-	if (p->command == request_command_rcpt && check_email_domain(p->request->arg))
+	const struct smtp* s = ATTACHMENT(key);
+	if (s->request_parser.command == request_command_rcpt && (s->rcpts.count > 0 || s->relay_rcpts.count > 0))
 		return write_status(key, RCPT_TO_WRITE, DATA_READ);
 	return write_status(key, RCPT_TO_WRITE, RCPT_TO_READ);
 }
@@ -479,7 +698,14 @@ data_read_process(struct selector_key* key, struct smtp* state)
 				strcpy((char*)ptr, "354 End data with <CR><LF>.<CR><LF>\r\n");
 				buffer_write_adv(&state->write_buffer, 37);
 
-				create_mails_files(state->rcpt_list, state->mailfrom, program, state->transformation);
+				state->commit.rcpts = state->rcpts.count > 0 ? &state->rcpts : NULL;
+				state->commit.relay_rcpts = state->relay_rcpts.count > 0 ? &state->relay_rcpts : NULL;
+				store_open(&state->commit, state->mailfrom, state->transformation ? program : NULL);
+				if (state->commit.relay_rcpts != NULL) {
+					relay_queue_open(&state->commit, state->mailfrom);
+				}
+			} else if (state->request_parser.command == request_command_rset) {
+				ret = reset_transaction(state, ptr);
 			} else if (state->request_parser.command == request_command_quit) {
 				ret = DONE;
 				strcpy((char*)ptr, "221 Bye\r\n");
@@ -487,9 +713,13 @@ data_read_process(struct selector_key* key, struct smtp* state)
 				write_status(key, DATA_READ, DONE);
 			} else if (state->request_parser.command == request_command_rcpt) {
 				ret = RCPT_TO_WRITE;
-				char s[] = "250 Rcpt to received - %s\r\n";
-				add_rcpt_to_list(&state->rcpt_list, state->request_parser.request->arg);
-				sprintf((char*)ptr, s, state->request_parser.request->arg);
+				const char* rejected = add_rcpt(state, state->request_parser.request->arg);
+				if (rejected == NULL) {
+					char s[] = "250 Rcpt to received - %s\r\n";
+					sprintf((char*)ptr, s, state->request_parser.request->arg);
+				} else {
+					strcpy((char*)ptr, rejected);
+				}
 				buffer_write_adv(&state->write_buffer, strlen((char*)ptr));
 
 			} else {
@@ -529,60 +759,225 @@ data_buffer_init(const unsigned state, struct selector_key* key)
 	struct smtp* s = ATTACHMENT(key);
 	struct data_parser* p = &s->data_parser;
 	data_parser_init(p);
+	s->data_size = 0;
+	s->oversize = false;
+	s->data_started_at = metrics_now();
+	PROBE1(data_start, key->fd);
 }
 
 static void
 mail_info_read_close(const unsigned state, struct selector_key* key)
 {
-	mails_sent++;
 	struct smtp* s = ATTACHMENT(key);
-	close_fds(s->rcpt_list);
-	free_rcpt_list(s->rcpt_list);
-	s->rcpt_list = NULL;
+	if (s->commit.ok) {
+		metrics_counter_add(METRIC_MAILS, 1);
+		metrics_counter_add(METRIC_STORE_BYTES, s->commit.stored);
+		metrics_counter_add(METRIC_STORE_BYTES_SAVED, s->commit.saved);
+	}
+	store_discard(&s->commit);
+	relay_queue_discard(&s->commit);
+	rcpt_set_clear(&s->rcpts);
+	rcpt_set_clear(&s->relay_rcpts);
+	s->commit.rcpts = s->commit.relay_rcpts = NULL;
+}
+
+/**
+ * suma `len' bytes al DATA en curso y retorna si hay que guardarlos. Al pasar
+ * el límite se descarta lo guardado hasta ahora y el resto se lee sin
+ * guardarlo: el cliente no escucha hasta mandar el final (RFC 1870 6.1), así
+ * que el 552 va después.
+ */
+static bool
+data_account(struct smtp* state, const size_t len)
+{
+	state->data_size += len;
+	if (state->oversize || !over_max_size(state, state->data_size)) {
+		return !state->oversize;
+	}
+	state->oversize = true;
+	metrics_counter_add(METRIC_SIZE_REJECTED, 1);
+	store_discard(&state->commit);
+	relay_queue_discard(&state->commit);
+	// sin destinatarios, las escrituras que siguen no hacen nada (ver store_write)
+	state->commit.rcpts = state->commit.relay_rcpts = NULL;
+	state->commit.ok = false;
+	return false;
 }
 
+/** terminó el DATA: `st' dice si fue por el final o por un error */
 static unsigned
-mail_info_read_process(struct selector_key* key, struct smtp* state)
+mail_info_done(struct selector_key* key, struct smtp* state, const enum data_state st)
 {
-	unsigned ret = MAIL_INFO_READ;
+	unsigned ret = ERROR;
+
+	state->data_done_at = metrics_now();
+	PROBE3(data_end, key->fd, state->data_size, st == data_done);
+	metrics_histogram_record(METRIC_DATA_SIZE, state->data_size);
+	if (state->data_done_at > state->data_started_at) {
+		metrics_histogram_record(METRIC_DATA_RATE,
+		                         state->data_size * 1000000000 / (state->data_done_at - state->data_started_at));
+	}
+
+	// TODO: PARSEAR LA INFO DEL MAIL
 
+	if (st == data_done && state->oversize) {
+		if (selector_set_interest_key(key, OP_WRITE) == SELECTOR_SUCCESS) {
+			size_t count;
+			uint8_t* ptr = buffer_write_ptr(&state->write_buffer, &count);
+			strcpy((char*)ptr, "552 Message size exceeds fixed maximum message size\r\n");
+			buffer_write_adv(&state->write_buffer, strlen((char*)ptr));
+			ret = MAIL_INFO_WRITE;
+		}
+	} else if (st == data_done && relay_queue_bare_newline(&state->commit)) {
+		store_discard(&state->commit);
+		relay_queue_discard(&state->commit);
+		state->commit.rcpts = state->commit.relay_rcpts = NULL;
+		state->commit.ok = false;
+		if (selector_set_interest_key(key, OP_WRITE) == SELECTOR_SUCCESS) {
+			size_t count;
+			uint8_t* ptr = buffer_write_ptr(&state->write_buffer, &count);
+			strcpy((char*)ptr, "550 Bare CR or LF not allowed in relayed mail\r\n");
+			buffer_write_adv(&state->write_buffer, strlen((char*)ptr));
+			ret = MAIL_INFO_WRITE;
+		}
+	} else if (st == data_done) {
+		// no escuchamos al cliente hasta que el mail llegue a disco
+		ret = selector_set_interest_key(key, OP_NOOP) == SELECTOR_SUCCESS ? MAIL_COMMIT : ERROR;
+	} else if (selector_set_interest_key(key, OP_WRITE) == SELECTOR_SUCCESS) {
+		size_t count;
+		uint8_t* ptr = buffer_write_ptr(&state->write_buffer, &count);
+
+		// TODO: capaz cambiar a mail from otra vez
+		ret = ERROR;
+		strcpy((char*)ptr, "554 Transaction failed\r\n");
+		buffer_write_adv(&state->write_buffer, 24);
+	}
+
+	return ret;
+}
+
+static unsigned
+mail_info_read_process(struct selector_key* key, struct smtp* state)
+{
 	struct smtp* s = ATTACHMENT(key);
 	buffer_reset(&s->data_parser.data_buffer);
 
 	int st = data_consume(&state->read_buffer, &state->data_parser);
 
-	write_to_files(s->rcpt_list, &s->data_parser);
+	const size_t len = s->data_parser.data_buffer.write - s->data_parser.data_buffer.data;
+	if (data_account(s, len)) {
+		store_write(&s->commit, s->data_parser.data_buffer.data, len);
+		relay_queue_write(&s->commit, s->data_parser.data_buffer.data, len);
+	}
 
-	if (data_is_done(st)) {
-		if (selector_set_interest_key(key, OP_WRITE) == SELECTOR_SUCCESS) {
-			size_t count;
-			uint8_t* ptr = buffer_write_ptr(&state->write_buffer, &count);
+	return data_is_done(st) ? mail_info_done(key, state, st) : MAIL_INFO_READ;
+}
 
-			// TODO: PARSEAR LA INFO DEL MAIL
+_Static_assert(BUFCHAIN_HEADROOM >= DATA_HEADROOM, "el parser del DATA escribe antes de cada bloque");
+_Static_assert(DATA_BUFFER_SIZE >= COMMAND_BUFFER_SIZE + DATA_HEADROOM, "data_consume recibe el buffer de comandos");
 
-			if (state->data_parser.state == data_done) {
-				ret = MAIL_INFO_WRITE;
-				char* message = "250 Ok: queued\r\n";
-				strcpy((char*)ptr, message);
-				buffer_write_adv(&state->write_buffer, strlen(message));
-			} else {
-				// TODO: capaz cambiar a mail from otra vez
-				ret = ERROR;
-				strcpy((char*)ptr, "554 Transaction failed\r\n");
-				buffer_write_adv(&state->write_buffer, 24);
-			}
-		} else {
-			ret = ERROR;
+/**
+ * lee el DATA de a varios bloques con un único readv, los filtra en el lugar
+ * y los pasa al almacenamiento con writev, sin copiarlos a `data_buffer'.
+ * Los bloques vuelven al pool en cada evento, así que una sesión sólo tiene
+ * memoria del pool mientras procesa una lectura; cuánto lee por vez lo
+ * ajusta la ventana de la cadena (ver bufchain.h).
+ *
+ * No se usa SO_RCVLOWAT para juntar más datos por evento: el final del DATA
+ * suele llegar en un segmento chico, y select no avisaría de él hasta que
+ * el cliente mande más, cosa que no hace hasta recibir la respuesta.
+ */
+static unsigned
+mail_info_readv(struct selector_key* key)
+{
+	struct smtp* s = ATTACHMENT(key);
+	struct bufchain* chain = &s->data_chain;
+
+	if (s->command_at == 0) {
+		s->command_at = metrics_now();
+	}
+	// si quedó algo de una lectura anterior, primero eso: puede no haber más
+	if (chain->length == 0) {
+		// con TLS sin kTLS, OpenSSL descifra directamente en los bloques
+		const ssize_t n = s->tls != NULL && !tls_ktls_recv(s->tls) ? bufchain_fill(chain, tls_readv, s->tls)
+		                                                           : bufchain_readv(chain, key->fd);
+		if (n == -1 && errno == EAGAIN) {
+			return MAIL_INFO_READ;
+		}
+		if (n <= 0) {
+			return ERROR;
 		}
+		metrics_counter_add(METRIC_BYTES_IN, n);
+		metrics_histogram_record(METRIC_DATA_READ, n);
 	}
 
-	return ret;
+	struct iovec iov[BUFCHAIN_HIGH_WATER / BUFCHAIN_BLOCK_SIZE];
+	int iovcnt = 0;
+	size_t consumed = 0;
+	enum data_state st = s->data_parser.state;
+	for (struct bufchain_block* b = chain->head; b != NULL && !data_is_done(st); b = b->next) {
+		if (iovcnt == N(iov)) {
+			store_writev(&s->commit, iov, iovcnt);
+			iovcnt = 0;
+		}
+		size_t len = b->end - b->start;
+		uint8_t* out;
+		size_t out_len;
+		st = data_consume_inplace(&s->data_parser, b->data + b->start, &len, &out, &out_len);
+		consumed += len;
+		if (out_len > 0 && data_account(s, out_len)) {
+			iov[iovcnt].iov_base = out;
+			iov[iovcnt++].iov_len = out_len;
+			relay_queue_write(&s->commit, out, out_len);
+		}
+	}
+	store_writev(&s->commit, iov, iovcnt);
+	bufchain_consume(chain, consumed);
+
+	return data_is_done(st) ? mail_info_done(key, s, st) : MAIL_INFO_READ;
 }
 
 static unsigned
 mail_info_read(struct selector_key* key)
 {
-	return read_status(key, MAIL_INFO_READ, mail_info_read_process);
+	struct smtp* s = ATTACHMENT(key);
+	if (buffer_can_read(&s->read_buffer)) {
+		// lo que llegó junto con el comando DATA
+		return read_status(key, MAIL_INFO_READ, mail_info_read_process);
+	}
+	return mail_info_readv(key);
+}
+
+static void
+mail_commit_init(const unsigned state, struct selector_key* key)
+{
+	struct smtp* s = ATTACHMENT(key);
+	store_close(&s->commit);
+
+	s->commit.selector = key->s;
+	s->commit.fd = key->fd;
+	commit_submit(&s->commit);
+}
+
+static unsigned
+mail_commit_block(struct selector_key* key)
+{
+	struct smtp* s = ATTACHMENT(key);
+	if (selector_set_interest_key(key, OP_WRITE) != SELECTOR_SUCCESS) {
+		return ERROR;
+	}
+
+	if (s->commit.ok) {
+		relay_submit(&s->commit);
+	}
+
+	size_t count;
+	uint8_t* ptr = buffer_write_ptr(&s->write_buffer, &count);
+	const char* message = s->commit.ok ? "250 Ok: queued\r\n" : "451 Requested action aborted: local error in processing\r\n";
+	strcpy((char*)ptr, message);
+	buffer_write_adv(&s->write_buffer, strlen(message));
+
+	return MAIL_INFO_WRITE;
 }
 
 static unsigned
@@ -614,6 +1009,16 @@ static const struct state_definition client_statbl[] = {
 	    .state = EHLO_WRITE,
 	    .on_write_ready = ehlo_write,
 	},
+	{
+	    .state = STARTTLS_WRITE,
+	    .on_write_ready = starttls_write,
+	},
+	{
+	    .state = TLS_HANDSHAKE,
+	    .on_arrival = tls_handshake_init,
+	    .on_read_ready = tls_handshake_step,
+	    .on_write_ready = tls_handshake_step,
+	},
 	{
 	    .state = MAIL_FROM_READ,
 	    .on_arrival = request_read_init,
@@ -646,6 +1051,11 @@ static const struct state_definition client_statbl[] = {
 	    .state = MAIL_INFO_READ,
 	    .on_read_ready = mail_info_read,
 	},
+	{
+	    .state = MAIL_COMMIT,
+	    .on_arrival = mail_commit_init,
+	    .on_block_ready = mail_commit_block,
+	},
 	{
 	    .state = MAIL_INFO_WRITE,
 	    .on_departure = mail_info_read_close,
@@ -661,12 +1071,14 @@ static const struct state_definition client_statbl[] = {
  */
 static void smtp_read(struct selector_key* key);
 static void smtp_write(struct selector_key* key);
+static void smtp_block(struct selector_key* key);
 static void smtp_close(struct selector_key* key);
 static void smtp_done(struct selector_key* key);
 
 static const struct fd_handler smtp_handler = {
 	.handle_read = smtp_read,
 	.handle_write = smtp_write,
+	.handle_block = smtp_block,
 	.handle_close = smtp_close,
 };
 
@@ -674,11 +1086,31 @@ static const struct fd_handler smtp_handler = {
  * handlers top level de la conexión pasiva.
  * son los que emiten los eventos a la maquina de estados.
  */
+
+/** mantiene la cantidad de sesiones en cada estado */
+static void
+track_state(const enum smtp_state from, const enum smtp_state to)
+{
+	if (from != to) {
+		metrics_gauge_add(METRIC_SESSIONS_IN_STATE + from, -1);
+		metrics_gauge_add(METRIC_SESSIONS_IN_STATE + to, 1);
+	}
+}
+
 static void
 smtp_read(struct selector_key* key)
 {
 	struct smtp* s = ATTACHMENT(key);
-	const enum smtp_state st = stm_handler_read(&s->stm, key);
+	enum smtp_state st;
+
+	do {
+		const enum smtp_state from = stm_state(&s->stm);
+		st = stm_handler_read(&s->stm, key);
+		track_state(from, st);
+		// con TLS sin kTLS, OpenSSL puede tener ya descifrado lo que sigue
+		// y el socket no va a volver a avisar
+	} while (st != ERROR && st != DONE && st != TLS_HANDSHAKE && s->stm.current->on_read_ready != NULL &&
+	         tls_pending(s->tls) > 0);
 
 	if (st == ERROR || st == DONE)
 		smtp_done(key);
@@ -687,37 +1119,86 @@ smtp_read(struct selector_key* key)
 static void
 smtp_write(struct selector_key* key)
 {
-	struct state_machine* stm = &ATTACHMENT(key)->stm;
+	struct smtp* s = ATTACHMENT(key);
+	struct state_machine* stm = &s->stm;
+	const enum smtp_state from = stm_state(stm);
 	const enum smtp_state st = stm_handler_write(stm, key);
+	track_state(from, st);
 
 	if (st == ERROR || st == DONE) {
 		smtp_done(key);
+	} else if (st != from && stm->current->on_read_ready != NULL &&
+	           (buffer_can_read(&s->read_buffer) || s->data_chain.length > 0 || tls_pending(s->tls) > 0)) {
+		// con PIPELINING el próximo comando pudo llegar junto con el anterior:
+		// ya está en el buffer y no va a haber otro evento de lectura
+		smtp_read(key);
 	}
 }
 
+static void
+smtp_block(struct selector_key* key)
+{
+	struct state_machine* stm = &ATTACHMENT(key)->stm;
+	const enum smtp_state from = stm_state(stm);
+	const enum smtp_state st = stm_handler_block(stm, key);
+	track_state(from, st);
+
+	if (st == ERROR || st == DONE) {
+		smtp_done(key);
+	}
+}
+
+/** contabilidad por estado de las sesiones del hilo (ver stm.h) */
+static _Thread_local struct stm_profile smtp_profile[SMTP_STATES];
+static _Thread_local bool smtp_profile_registered = false;
+
+static const char*
+smtp_state_name(const unsigned state)
+{
+	return metrics_gauge_name(METRIC_SESSIONS_IN_STATE + state) + strlen("sessions_");
+}
+
 static void
 smtp_destroy(struct smtp* s)
 {
-	free_rcpt_list(s->rcpt_list);
+	store_discard(&s->commit);
+	store_job_free(&s->commit);
+	relay_queue_discard(&s->commit);
+	rcpt_set_free(&s->rcpts);
+	rcpt_set_free(&s->relay_rcpts);
+	bufchain_free(&s->data_chain);
+	tls_free(s->tls);
 	free(s);
 }
 
 static void
 smtp_close(struct selector_key* key)
 {
-	smtp_destroy(ATTACHMENT(key));
+	struct smtp* s = ATTACHMENT(key);
+	metrics_gauge_add(METRIC_SESSIONS_IN_STATE + stm_state(&s->stm), -1);
+	metrics_gauge_add(METRIC_SESSION_BYTES, -(int64_t)sizeof(*s));
+	stm_profile_close(&s->stm);
+	smtp_destroy(s);
 }
 
 static void
 smtp_done(struct selector_key* key)
 {
 	if (key->fd != -1) {
-		if (selector_unregister_fd(key->s, key->fd) != SELECTOR_SUCCESS)
+		// se registra antes de desregistrar: eso libera la sesión
+		const struct smtp* s = ATTACHMENT(key);
+		metrics_gauge_add(METRIC_CURRENT_USERS, -1);
+		log_event(LOG_INFO,
+		          LOG_EVENT_CLOSE,
+		          &s->client_addr,
+		          key->fd,
+		          metrics_gauge(METRIC_CURRENT_USERS),
+		          (metrics_now() - s->accepted_at) / 1000000);
+
+		const int fd = key->fd;
+		if (selector_unregister_fd(key->s, fd) != SELECTOR_SUCCESS)
 			abort();
-		close(key->fd);
-		fprintf(stdout, "User diconnected\n");
-		fprintf(stdout, "Current users: %d\n", --current_users);
-		fprintf(stdout, "Historic users: %d\n\n", historic_users);
+		close(fd);
 	}
 }
 
@@ -744,37 +1225,57 @@ smtp_passive_accept(struct selector_key* key)
 	memset(state, 0, sizeof(*state));
 	memcpy(&state->client_addr, &client_addr, client_addr_len);
 	state->client_addr_len = client_addr_len;
-	state->rcpt_list = NULL;
+	state->accepted_at = metrics_now();
 
-	if (current_users < max_user) {
+	if (metrics_gauge(METRIC_CURRENT_USERS) < max_user) {
 		state->stm.initial = GREETING_WRITE;
 	} else {
 		state->stm.initial = FAILED_CONNECTION_WRITE;
+		metrics_counter_add(METRIC_REJECTED_USERS, 1);
 	}
 
-	program = (char*)key->data;
-	if (transformations && key->data != NULL) {
+	const struct smtp_listener* listener = key->data;
+	program = (char*)listener->program;
+	if (transformations && listener->program != NULL) {
 		state->transformation = true;
 	}
+	state->max_size = listener->max_size;
 
 	state->stm.max_state = ERROR;
 	state->stm.states = client_statbl;
 	stm_init(&state->stm);
+	if (!smtp_profile_registered) {
+		smtp_profile_registered = stm_profile_register("smtp", smtp_profile, SMTP_STATES, smtp_state_name);
+	}
+	stm_profile_attach(&state->stm, smtp_profile);
 
 	state->request_parser.request = &state->request;
 	request_parser_init(&state->request_parser);
 
 	data_parser_init(&state->data_parser);
+	bufchain_init(&state->data_chain, data_high_water);
 
 	buffer_init(&state->read_buffer, N(state->raw_buff_read), state->raw_buff_read);
 	buffer_init(&state->write_buffer, N(state->raw_buff_write), state->raw_buff_write);
 
-	fprintf(stdout, "New user connected\n");
-	fprintf(stdout, "Current users: %d\n", ++current_users);
-	fprintf(stdout, "Historic users: %d\n\n", ++historic_users);
-
 	if (selector_register(key->s, client, &smtp_handler, OP_WRITE, state) != SELECTOR_SUCCESS)
 		goto fail;
+
+	metrics_gauge_add(METRIC_CURRENT_USERS, 1);
+	PROBE2(smtp_accept, client, metrics_gauge(METRIC_CURRENT_USERS));
+	metrics_gauge_add(METRIC_SESSIONS_IN_STATE + state->stm.initial, 1);
+	metrics_gauge_add(METRIC_SESSION_BYTES, sizeof(*state));
+	metrics_counter_add(METRIC_HISTORIC_USERS, 1);
+	if (state->stm.initial == FAILED_CONNECTION_WRITE) {
+		log_event(LOG_WARN, LOG_EVENT_REJECT, &client_addr, client, metrics_gauge(METRIC_CURRENT_USERS), max_user);
+	} else {
+		log_event(LOG_INFO,
+		          LOG_EVENT_ACCEPT,
+		          &client_addr,
+		          client,
+		          metrics_gauge(METRIC_CURRENT_USERS),
+		          metrics_counter(METRIC_HISTORIC_USERS));
+	}
 	return;
 
 fail:
@@ -784,28 +1285,28 @@ fail:
 	smtp_destroy(state);
 }
 
-int
+uint64_t
 get_historic_users()
 {
-	return historic_users;
+	return metrics_counter(METRIC_HISTORIC_USERS);
 }
 
-int
+uint64_t
 get_current_users()
 {
-	return current_users;
+	return metrics_gauge(METRIC_CURRENT_USERS);
 }
 
-int
+uint64_t
 get_current_bytes()
 {
-	return transferred_bytes;
+	return metrics_counter(METRIC_BYTES_IN) + metrics_counter(METRIC_BYTES_OUT);
 }
 
-int
+uint64_t
 get_current_mails()
 {
-	return mails_sent;
+	return metrics_counter(METRIC_MAILS);
 }
 
 bool
@@ -820,12 +1321,30 @@ set_new_status(bool new_status)
 	transformations = new_status;
 }
 
+void
+set_max_rcpts(const unsigned n)
+{
+	max_rcpts = n;
+}
+
+void
+set_data_high_water(const size_t bytes)
+{
+	data_high_water = bytes;
+}
+
 void
 set_max_users(int n)
 {
 	max_user = n;
 }
 
+void
+set_local_domain(const char* d)
+{
+	snprintf(domain, sizeof(domain), "@%s", d);
+}
+
 int
 get_cant_max_users()
 {
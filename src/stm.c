@@ -4,10 +4,104 @@
  */
 #include "stm.h"
 
+#include "probes.h"
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #define N(x) (sizeof(x) / sizeof((x)[0]))
 
+/** máquinas (por hilo) que pueden registrar contadores */
+#define PROFILE_TABLES 8
+
+struct profile_table
+{
+	const char* machine;
+	struct stm_profile* profile;
+	unsigned count;
+	const char* (*name)(const unsigned state);
+};
+
+static struct profile_table tables[PROFILE_TABLES];
+static unsigned ntables = 0;
+
+#ifndef STM_NO_PROFILE
+static bool profiling = false;
+
+/** marca de inicio de un handler; `wall' en 0 si no se mide */
+struct profile_mark
+{
+	uint64_t wall;
+	uint64_t cpu;
+};
+
+static inline uint64_t
+clock_ns(const clockid_t id)
+{
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/** llegada al estado actual: cuenta la entrada y empieza a medir la permanencia */
+static inline void
+profile_arrive(struct state_machine* stm)
+{
+	if (profiling && stm->profile != NULL) {
+		stm->profile[stm->current->state].entries++;
+		stm->arrived_at = clock_ns(CLOCK_MONOTONIC);
+	}
+}
+
+/**
+ * salida del estado actual. `arrived_at' se limpia aunque se haya apagado la
+ * contabilidad, así al prenderla de nuevo no se suma una permanencia vieja.
+ */
+static inline void
+profile_depart(struct state_machine* stm)
+{
+	if (stm->arrived_at != 0) {
+		if (profiling) {
+			stm->profile[stm->current->state].dwell_ns += clock_ns(CLOCK_MONOTONIC) - stm->arrived_at;
+		}
+		stm->arrived_at = 0;
+	}
+}
+
+static inline void
+profile_begin(const struct state_machine* stm, struct profile_mark* m)
+{
+	m->wall = 0;
+	if (profiling && stm->profile != NULL) {
+		m->cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+		m->wall = clock_ns(CLOCK_MONOTONIC);
+	}
+}
+
+/** fin de un handler que se despachó en `state' */
+static inline void
+profile_end(const struct state_machine* stm, const unsigned state, const struct profile_mark* m)
+{
+	if (m->wall != 0) {
+		struct stm_profile* p = stm->profile + state;
+		p->events++;
+		p->wall_ns += clock_ns(CLOCK_MONOTONIC) - m->wall;
+		p->cpu_ns += clock_ns(CLOCK_THREAD_CPUTIME_ID) - m->cpu;
+	}
+}
+#else
+struct profile_mark
+{
+	char unused;
+};
+#define profile_arrive(stm)       ((void)0)
+#define profile_depart(stm)       ((void)0)
+#define profile_begin(stm, m)     ((void)(m))
+#define profile_end(stm, st, m)   ((void)(st))
+#endif
+
 void
 stm_init(struct state_machine* stm)
 {
@@ -30,6 +124,7 @@ handle_first(struct state_machine* stm, struct selector_key* key)
 {
 	if (stm->current == NULL) {
 		stm->current = stm->states + stm->initial;
+		profile_arrive(stm);
 		if (NULL != stm->current->on_arrival) {
 			stm->current->on_arrival(stm->current->state, key);
 		}
@@ -46,7 +141,10 @@ jump(struct state_machine* stm, unsigned next, struct selector_key* key)
 		if (stm->current != NULL && stm->current->on_departure != NULL) {
 			stm->current->on_departure(stm->current->state, key);
 		}
+		profile_depart(stm);
+		PROBE3(stm_jump, key->fd, stm->current == NULL ? stm->initial : stm->current->state, next);
 		stm->current = stm->states + next;
+		profile_arrive(stm);
 
 		if (NULL != stm->current->on_arrival) {
 			stm->current->on_arrival(stm->current->state, key);
@@ -61,8 +159,12 @@ stm_handler_read(struct state_machine* stm, struct selector_key* key)
 	if (stm->current->on_read_ready == 0) {
 		abort();
 	}
+	struct profile_mark mark;
+	const unsigned state = stm->current->state;
+	profile_begin(stm, &mark);
 	const unsigned int ret = stm->current->on_read_ready(key);
 	jump(stm, ret, key);
+	profile_end(stm, state, &mark);
 
 	return ret;
 }
@@ -74,8 +176,12 @@ stm_handler_write(struct state_machine* stm, struct selector_key* key)
 	if (stm->current->on_write_ready == 0) {
 		abort();
 	}
+	struct profile_mark mark;
+	const unsigned state = stm->current->state;
+	profile_begin(stm, &mark);
 	const unsigned int ret = stm->current->on_write_ready(key);
 	jump(stm, ret, key);
+	profile_end(stm, state, &mark);
 
 	return ret;
 }
@@ -87,8 +193,12 @@ stm_handler_block(struct state_machine* stm, struct selector_key* key)
 	if (stm->current->on_block_ready == 0) {
 		abort();
 	}
+	struct profile_mark mark;
+	const unsigned state = stm->current->state;
+	profile_begin(stm, &mark);
 	const unsigned int ret = stm->current->on_block_ready(key);
 	jump(stm, ret, key);
+	profile_end(stm, state, &mark);
 
 	return ret;
 }
@@ -99,6 +209,7 @@ stm_handler_close(struct state_machine* stm, struct selector_key* key)
 	if (stm->current != NULL && stm->current->on_departure != NULL) {
 		stm->current->on_departure(stm->current->state, key);
 	}
+	profile_depart(stm);
 }
 
 unsigned
@@ -110,3 +221,83 @@ stm_state(struct state_machine* stm)
 	}
 	return ret;
 }
+
+void
+stm_profile_close(struct state_machine* stm)
+{
+	profile_depart(stm);
+}
+
+bool
+stm_profile_enable(const bool on)
+{
+#ifndef STM_NO_PROFILE
+	profiling = on;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool
+stm_profile_enabled(void)
+{
+#ifndef STM_NO_PROFILE
+	return profiling;
+#else
+	return false;
+#endif
+}
+
+bool
+stm_profile_register(const char* machine,
+                     struct stm_profile* profile,
+                     const unsigned count,
+                     const char* (*name)(const unsigned state))
+{
+	if (ntables == N(tables)) {
+		return false;
+	}
+	tables[ntables++] = (struct profile_table){
+		.machine = machine,
+		.profile = profile,
+		.count = count,
+		.name = name,
+	};
+	return true;
+}
+
+void
+stm_profile_reset(void)
+{
+	for (unsigned i = 0; i < ntables; i++) {
+		memset(tables[i].profile, 0, tables[i].count * sizeof(*tables[i].profile));
+	}
+}
+
+size_t
+stm_profile_dump(char* buff, const size_t buffsize)
+{
+	size_t len = 0;
+	for (unsigned i = 0; i < ntables; i++) {
+		const struct profile_table* t = &tables[i];
+		for (unsigned j = 0; j < t->count; j++) {
+			const struct stm_profile* p = &t->profile[j];
+			const int n = snprintf(buff + len,
+			                       buffsize - len,
+			                       "state %s.%s entries=%llu events=%llu dwell_ns=%llu wall_ns=%llu cpu_ns=%llu\n",
+			                       t->machine,
+			                       t->name(j),
+			                       (unsigned long long)p->entries,
+			                       (unsigned long long)p->events,
+			                       (unsigned long long)p->dwell_ns,
+			                       (unsigned long long)p->wall_ns,
+			                       (unsigned long long)p->cpu_ns);
+			if (n < 0 || (size_t)n >= buffsize - len) {
+				return len;
+			}
+			len += n;
+		}
+	}
+	return len;
+}
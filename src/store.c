@@ -0,0 +1,202 @@
+/**
+ * store.c - almacenamiento de los mails recibidos
+ */
+#define _GNU_SOURCE
+#include "store.h"
+
+#include "timecache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+static const struct store* backends[] = {
+	&maildir_store,
+	&segment_store,
+	&dedup_store,
+};
+
+static const struct store* current = &maildir_store;
+
+static enum compress_format compress_format = COMPRESS_NONE;
+static int compress_level;
+
+bool
+store_init(const char* name)
+{
+	for (unsigned i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+		if (strcmp(backends[i]->name, name) == 0) {
+			current = backends[i];
+			return current->init == NULL || current->init();
+		}
+	}
+	return false;
+}
+
+const struct store*
+store_get(void)
+{
+	return current;
+}
+
+bool
+store_set_compression(const enum compress_format format, const int level)
+{
+	if (!compress_available(format)) {
+		return false;
+	}
+	compress_format = format;
+	compress_level = level;
+	return true;
+}
+
+/** salida del compresor: va directo al backend */
+static bool
+backend_sink(void* arg, const uint8_t* data, size_t len)
+{
+	struct commit_job* job = arg;
+	job->written += len;
+	current->write(job, data, len);
+	return true;
+}
+
+void
+store_open(struct commit_job* job, const char* mailfrom, const char* program)
+{
+	job->store_data = NULL;
+	job->size = job->written = job->stored = job->saved = 0;
+	job->compress_inline = false;
+
+	// sin destinatarios locales el mail sólo va a la cola del relay
+	if (job->rcpts == NULL) {
+		return;
+	}
+
+	char buff[512];
+	const char* from_line = NULL;
+	if (current->from_line) {
+		snprintf(buff, sizeof(buff), "From %s  %s\n", mailfrom, timecache_date());
+		from_line = buff;
+	}
+
+	// el compresor vive lo que la conexión. Si no hay memoria para crearlo
+	// el mail se guarda sin comprimir, que se puede leer igual
+	if (compress_format != COMPRESS_NONE && job->compressor == NULL) {
+		job->compressor = compressor_new(compress_format, compress_level);
+	}
+	if (job->compressor == NULL || program != NULL) {
+		current->open(job, from_line, program);
+		return;
+	}
+
+	current->open(job, NULL, NULL);
+	job->compress_inline = true;
+	compressor_begin(job->compressor, backend_sink, job);
+	if (from_line != NULL) {
+		compressor_write(job->compressor, (const uint8_t*)from_line, strlen(from_line), backend_sink, job);
+	}
+}
+
+void
+store_write(struct commit_job* job, const uint8_t* data, const size_t len)
+{
+	if (len == 0) {
+		return;
+	}
+	job->size += len;
+	if (job->rcpts == NULL) {
+		return;
+	}
+	if (job->compress_inline) {
+		compressor_write(job->compressor, data, len, backend_sink, job);
+	} else {
+		job->written += len;
+		current->write(job, data, len);
+	}
+}
+
+void
+store_writev(struct commit_job* job, const struct iovec* iov, const int iovcnt)
+{
+	if (job->compress_inline || current->writev == NULL) {
+		for (int i = 0; i < iovcnt; i++) {
+			store_write(job, iov[i].iov_base, iov[i].iov_len);
+		}
+		return;
+	}
+
+	size_t len = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		len += iov[i].iov_len;
+	}
+	job->size += len;
+	if (job->rcpts == NULL || len == 0) {
+		return;
+	}
+	job->written += len;
+	current->writev(job, iov, iovcnt);
+}
+
+void
+store_close(struct commit_job* job)
+{
+	if (job->compress_inline) {
+		compressor_finish(job->compressor, backend_sink, job);
+		job->compress_inline = false;
+	}
+	if (job->rcpts != NULL) {
+		current->close(job);
+	}
+}
+
+bool
+store_write_all(const int fd, const void* data, size_t len, off_t offset)
+{
+	const uint8_t* p = data;
+	while (len > 0) {
+		const ssize_t n = offset < 0 ? write(fd, p, len) : pwrite(fd, p, len, offset);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += n;
+		len -= n;
+		if (offset >= 0) {
+			offset += n;
+		}
+	}
+	return true;
+}
+
+void
+store_commit(struct commit_job* batch)
+{
+	current->commit(batch);
+
+	// los mails sólo para el relay dependen de `relay_queue_commit'
+	for (struct commit_job* job = batch; job != NULL; job = job->next) {
+		if (job->rcpts == NULL) {
+			job->ok = true;
+			job->stored = job->saved = 0;
+		}
+	}
+}
+
+void
+store_discard(struct commit_job* job)
+{
+	if (current->discard != NULL && job->rcpts != NULL) {
+		current->discard(job);
+	}
+	job->store_data = NULL;
+}
+
+void
+store_job_free(struct commit_job* job)
+{
+	compressor_free(job->compressor);
+	job->compressor = NULL;
+}
@@ -0,0 +1,552 @@
+/**
+ * store_dedup.c - Maildir con los cuerpos deduplicados
+ *
+ * El cuerpo de cada mail se escribe una única vez en mails/.blobs y cada
+ * destinatario recibe en su new/ un hard link al blob. Mientras se recibe el
+ * DATA se calcula un hash rápido (no criptográfico) del cuerpo; al hacer
+ * commit se busca un blob con el mismo hash y tamaño y, sólo si lo hay, se
+ * confirma que el contenido es el mismo comparando el SHA-256 de ambos. Así
+ * el mismo envío masivo repetido en muchas sesiones ocupa un único inodo, y
+ * los mails que no se repiten no pagan el SHA-256.
+ *
+ * Para que el contenido pueda repetirse entre sesiones no se agrega la línea
+ * "From " con el remitente y la fecha: se guarda el mail tal como llegó.
+ *
+ * Los blobs se llaman <hash>-<tamaño>-<n>. La tabla de blobs vive en memoria
+ * (sólo la usa el hilo de commit) y se reconstruye al iniciar leyendo el
+ * directorio. Un blob con un único link ya no está en ninguna casilla y se
+ * puede borrar.
+ */
+#define _GNU_SOURCE
+#include "store.h"
+
+#include "sha256.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define BLOBS_DIR "mails/.blobs"
+
+/** largo máximo de la ruta de un blob */
+#define BLOB_PATH_LENGTH 80
+
+#define HASH_P1 0x9E3779B97F4A7C15ULL
+#define HASH_P2 0xC2B2AE3D27D4EB4FULL
+
+/** hash de 64 bits que se calcula de a pedazos, sin importar cómo se corte la entrada */
+struct fast_hash
+{
+	uint64_t h;
+	uint64_t len;
+	uint8_t tail[8];
+	unsigned tail_len;
+};
+
+struct blob
+{
+	uint64_t hash;
+	uint64_t size;
+	unsigned seq;
+	bool sha_known;
+	uint8_t sha[SHA256_DIGEST_LENGTH];
+	struct blob* next;
+};
+
+/** mail en curso */
+struct dedup_mail
+{
+	/** el cuerpo, sin nombre (O_TMPFILE) o en `tmp_path' hasta publicarlo como blob */
+	int fd;
+	char tmp_path[BLOB_PATH_LENGTH];
+	struct fast_hash hash;
+	bool sha_known;
+	uint8_t sha[SHA256_DIGEST_LENGTH];
+	bool failed;
+
+	/** transformación: escribe en `fd', y el hash se calcula al hacer commit */
+	pid_t pid;
+	int pipe_fd;
+};
+
+static struct blob** buckets;
+static size_t nbuckets;
+static size_t nblobs;
+
+static uint8_t read_buff[64 * 1024];
+
+static inline uint64_t
+rotl(const uint64_t x, const int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline void
+fast_hash_word(struct fast_hash* f, const uint8_t* p)
+{
+	uint64_t w;
+	memcpy(&w, p, sizeof(w));
+	f->h ^= rotl(w * HASH_P2, 31) * HASH_P1;
+	f->h = rotl(f->h, 27) * HASH_P1 + 0x52dce729;
+}
+
+static void
+fast_hash_init(struct fast_hash* f)
+{
+	memset(f, 0, sizeof(*f));
+}
+
+static void
+fast_hash_update(struct fast_hash* f, const uint8_t* p, size_t len)
+{
+	f->len += len;
+	while (f->tail_len > 0 && len > 0) {
+		f->tail[f->tail_len++] = *p++;
+		len--;
+		if (f->tail_len == sizeof(f->tail)) {
+			fast_hash_word(f, f->tail);
+			f->tail_len = 0;
+		}
+	}
+	for (; len >= 8; p += 8, len -= 8) {
+		fast_hash_word(f, p);
+	}
+	memcpy(f->tail, p, len);
+	f->tail_len += len;
+}
+
+static uint64_t
+fast_hash_final(const struct fast_hash* f)
+{
+	struct fast_hash copy = *f;
+	if (copy.tail_len > 0) {
+		memset(copy.tail + copy.tail_len, 0, sizeof(copy.tail) - copy.tail_len);
+		fast_hash_word(&copy, copy.tail);
+	}
+	// mezcla final de MurmurHash3
+	uint64_t h = copy.h ^ copy.len;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static void
+blob_path(const struct blob* b, char path[BLOB_PATH_LENGTH])
+{
+	snprintf(path, BLOB_PATH_LENGTH, BLOBS_DIR "/%016" PRIx64 "-%" PRIu64 "-%u", b->hash, b->size, b->seq);
+}
+
+static bool
+table_grow(void)
+{
+	const size_t n = nbuckets == 0 ? 1024 : nbuckets * 2;
+	struct blob** grown = calloc(n, sizeof(*grown));
+	if (grown == NULL) {
+		return false;
+	}
+	for (size_t i = 0; i < nbuckets; i++) {
+		struct blob* b = buckets[i];
+		while (b != NULL) {
+			struct blob* next = b->next;
+			b->next = grown[b->hash & (n - 1)];
+			grown[b->hash & (n - 1)] = b;
+			b = next;
+		}
+	}
+	free(buckets);
+	buckets = grown;
+	nbuckets = n;
+	return true;
+}
+
+static struct blob*
+table_add(const uint64_t hash, const uint64_t size, const unsigned seq)
+{
+	if (nblobs >= nbuckets && !table_grow() && nbuckets == 0) {
+		return NULL;
+	}
+	struct blob* b = calloc(1, sizeof(*b));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->hash = hash;
+	b->size = size;
+	b->seq = seq;
+	b->next = buckets[hash & (nbuckets - 1)];
+	buckets[hash & (nbuckets - 1)] = b;
+	nblobs++;
+	return b;
+}
+
+static void
+table_remove(struct blob* b)
+{
+	for (struct blob** p = buckets + (b->hash & (nbuckets - 1)); *p != NULL; p = &(*p)->next) {
+		if (*p == b) {
+			*p = b->next;
+			free(b);
+			nblobs--;
+			return;
+		}
+	}
+}
+
+static void
+table_clear(void)
+{
+	for (size_t i = 0; i < nbuckets; i++) {
+		while (buckets[i] != NULL) {
+			struct blob* next = buckets[i]->next;
+			free(buckets[i]);
+			buckets[i] = next;
+		}
+	}
+	free(buckets);
+	buckets = NULL;
+	nbuckets = nblobs = 0;
+}
+
+/** calcula el SHA-256 de los primeros `size' bytes de `fd' */
+static bool
+sha_fd(const int fd, const uint64_t size, uint8_t sha[SHA256_DIGEST_LENGTH])
+{
+	struct sha256 ctx;
+	sha256_init(&ctx);
+
+	uint64_t offset = 0;
+	while (offset < size) {
+		const size_t want = size - offset < sizeof(read_buff) ? size - offset : sizeof(read_buff);
+		const ssize_t n = pread(fd, read_buff, want, offset);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return false;
+		}
+		sha256_update(&ctx, read_buff, n);
+		offset += n;
+	}
+	sha256_final(&ctx, sha);
+	return true;
+}
+
+static bool
+blob_sha(struct blob* b)
+{
+	if (b->sha_known) {
+		return true;
+	}
+	char path[BLOB_PATH_LENGTH];
+	blob_path(b, path);
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return false;
+	}
+	b->sha_known = sha_fd(fd, b->size, b->sha);
+	close(fd);
+	return b->sha_known;
+}
+
+/** busca un blob con el mismo contenido que `mail' */
+static struct blob*
+find_blob(struct dedup_mail* mail, const uint64_t hash, const uint64_t size)
+{
+	if (nbuckets == 0) {
+		return NULL;
+	}
+
+	struct blob* b = buckets[hash & (nbuckets - 1)];
+	while (b != NULL) {
+		struct blob* next = b->next;
+		if (b->hash == hash && b->size == size) {
+			// recién ahora hace falta el SHA-256
+			if (!mail->sha_known) {
+				mail->sha_known = sha_fd(mail->fd, size, mail->sha);
+				if (!mail->sha_known) {
+					return NULL;
+				}
+			}
+			if (!blob_sha(b)) {
+				// lo borraron: ya no sirve
+				table_remove(b);
+			} else if (memcmp(b->sha, mail->sha, SHA256_DIGEST_LENGTH) == 0) {
+				return b;
+			}
+		}
+		b = next;
+	}
+	return NULL;
+}
+
+/** publica el cuerpo de `mail' como un blob nuevo */
+static struct blob*
+publish_blob(struct dedup_mail* mail, const uint64_t hash, const uint64_t size)
+{
+	if (fdatasync(mail->fd) == -1) {
+		return NULL;
+	}
+
+	unsigned seq = 0;
+	for (struct blob* b = nbuckets == 0 ? NULL : buckets[hash & (nbuckets - 1)]; b != NULL; b = b->next) {
+		if (b->hash == hash && b->size == size && b->seq >= seq) {
+			seq = b->seq + 1;
+		}
+	}
+
+	struct blob candidate = { .hash = hash, .size = size, .seq = seq };
+	char path[BLOB_PATH_LENGTH];
+	while (true) {
+		blob_path(&candidate, path);
+		const bool ok = mail->tmp_path[0] == 0 ? publish_tmpfile(mail->fd, path) : link(mail->tmp_path, path) == 0;
+		if (ok) {
+			break;
+		}
+		if (errno != EEXIST) {
+			return NULL;
+		}
+		// un blob que no está en la tabla (por ejemplo, de otro proceso)
+		candidate.seq++;
+	}
+
+	// si no hay memoria el blob queda publicado, y se recupera al reiniciar
+	struct blob* b = table_add(hash, size, candidate.seq);
+	if (b != NULL && mail->sha_known) {
+		b->sha_known = true;
+		memcpy(b->sha, mail->sha, SHA256_DIGEST_LENGTH);
+	}
+	return b;
+}
+
+static void
+hash_file(struct dedup_mail* mail)
+{
+	struct stat st;
+	if (fstat(mail->fd, &st) == -1) {
+		mail->failed = true;
+		return;
+	}
+
+	fast_hash_init(&mail->hash);
+	off_t offset = 0;
+	while (offset < st.st_size) {
+		const ssize_t n = pread(mail->fd, read_buff, sizeof(read_buff), offset);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			mail->failed = true;
+			return;
+		}
+		fast_hash_update(&mail->hash, read_buff, n);
+		offset += n;
+	}
+}
+
+static bool
+deliver(struct commit_job* job)
+{
+	struct dedup_mail* mail = job->store_data;
+	if (mail == NULL) {
+		return false;
+	}
+	if (mail->pid > 0) {
+		int status;
+		while (waitpid(mail->pid, &status, 0) == -1 && errno == EINTR) {
+		}
+		mail->pid = -1;
+		if (!mail->failed) {
+			hash_file(mail);
+		}
+	}
+	if (mail->failed) {
+		return false;
+	}
+
+	const uint64_t size = mail->hash.len;
+	const uint64_t hash = fast_hash_final(&mail->hash);
+	struct blob* blob = find_blob(mail, hash, size);
+	bool published = false;
+
+	for (struct rcpt_node* r = job->rcpts->nodes; r < job->rcpts->nodes + job->rcpts->count; r++) {
+		maildir_unique_name(r->filename, sizeof(r->filename));
+		char path[400];
+		snprintf(path, sizeof(path), "mails/%s/new/%s", r->email, r->filename);
+
+		while (true) {
+			if (blob == NULL) {
+				blob = publish_blob(mail, hash, size);
+				if (blob == NULL) {
+					return false;
+				}
+				published = true;
+			}
+
+			char source[BLOB_PATH_LENGTH];
+			blob_path(blob, source);
+			if (link(source, path) == 0) {
+				break;
+			}
+			// el blob tiene tantos links como permite el sistema de archivos,
+			// o lo borraron: se empieza otro con este mail
+			if ((errno != EMLINK && errno != ENOENT) || published) {
+				return false;
+			}
+			table_remove(blob);
+			blob = NULL;
+		}
+	}
+
+	job->stored = published ? size : 0;
+	job->saved += size * job->rcpts->count - job->stored;
+	return true;
+}
+
+static bool
+dedup_init(void)
+{
+	if ((mkdir("mails", 0777) == -1 && errno != EEXIST) || (mkdir(BLOBS_DIR, 0777) == -1 && errno != EEXIST)) {
+		return false;
+	}
+
+	table_clear();
+	DIR* dir = opendir(BLOBS_DIR);
+	if (dir == NULL) {
+		return false;
+	}
+
+	bool ok = true;
+	struct dirent* e;
+	while (ok && (e = readdir(dir)) != NULL) {
+		uint64_t hash, size;
+		unsigned seq;
+		int n = 0;
+		if (strncmp(e->d_name, "tmp.", 4) == 0) {
+			// un mail que no se llegó a publicar
+			char path[BLOB_PATH_LENGTH + 256];
+			snprintf(path, sizeof(path), BLOBS_DIR "/%s", e->d_name);
+			unlink(path);
+		} else if (sscanf(e->d_name, "%16" SCNx64 "-%" SCNu64 "-%u%n", &hash, &size, &seq, &n) == 3 &&
+		           e->d_name[n] == 0) {
+			ok = table_add(hash, size, seq) != NULL;
+		}
+	}
+	closedir(dir);
+	return ok;
+}
+
+static void
+dedup_open(struct commit_job* job, const char* from_line, const char* program)
+{
+	for (struct rcpt_node* r = job->rcpts->nodes; r < job->rcpts->nodes + job->rcpts->count; r++) {
+		create_maildir(r->email);
+	}
+
+	struct dedup_mail* mail = calloc(1, sizeof(*mail));
+	if (mail == NULL) {
+		return;
+	}
+	mail->pid = -1;
+	mail->pipe_fd = -1;
+	fast_hash_init(&mail->hash);
+	job->store_data = mail;
+
+	mail->fd = open(BLOBS_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0666);
+	if (mail->fd == -1) {
+		snprintf(mail->tmp_path, sizeof(mail->tmp_path), BLOBS_DIR "/tmp.XXXXXX");
+		mail->fd = mkostemp(mail->tmp_path, O_CLOEXEC);
+		if (mail->fd == -1) {
+			mail->tmp_path[0] = 0;
+			mail->failed = true;
+			return;
+		}
+	}
+
+	if (program != NULL) {
+		mail->pid = spawn_transformation(program, mail->fd, &mail->pipe_fd, NULL, job->compressor);
+	}
+}
+
+static void
+dedup_write(struct commit_job* job, const uint8_t* data, const size_t len)
+{
+	struct dedup_mail* mail = job->store_data;
+	if (mail == NULL || mail->failed) {
+		return;
+	}
+
+	if (mail->pipe_fd != -1) {
+		mail->failed = !store_write_all(mail->pipe_fd, data, len, -1);
+	} else {
+		mail->failed = !store_write_all(mail->fd, data, len, -1);
+		fast_hash_update(&mail->hash, data, len);
+	}
+}
+
+static void
+dedup_close(struct commit_job* job)
+{
+	struct dedup_mail* mail = job->store_data;
+	if (mail != NULL && mail->pipe_fd != -1) {
+		// al cerrar el pipe la transformación termina de escribir
+		close(mail->pipe_fd);
+		mail->pipe_fd = -1;
+	}
+}
+
+static void
+dedup_commit(struct commit_job* batch)
+{
+	// el link en new/ apunta al inodo, así que alcanza con sincronizar el
+	// contenido del blob (publish_blob) y los directorios new/. Si se pierde
+	// la entrada en .blobs sólo se pierde la posibilidad de compartirlo.
+	for (struct commit_job* job = batch; job != NULL; job = job->next) {
+		job->ok = deliver(job);
+		if (!job->ok) {
+			job->stored = job->saved = 0;
+		}
+	}
+	maildir_sync_new_dirs(batch);
+}
+
+static void
+dedup_discard(struct commit_job* job)
+{
+	struct dedup_mail* mail = job->store_data;
+	if (mail == NULL) {
+		return;
+	}
+	if (mail->pipe_fd != -1) {
+		close(mail->pipe_fd);
+	}
+	if (mail->pid > 0) {
+		stop_transformation(mail->pid);
+	}
+	if (mail->fd != -1) {
+		close(mail->fd);
+	}
+	if (mail->tmp_path[0] != 0) {
+		unlink(mail->tmp_path);
+	}
+	free(mail);
+}
+
+const struct store dedup_store = {
+	.name = "dedup",
+	.single_writer = true,
+	.init = dedup_init,
+	.open = dedup_open,
+	.write = dedup_write,
+	.close = dedup_close,
+	.commit = dedup_commit,
+	.discard = dedup_discard,
+};
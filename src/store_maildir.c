@@ -0,0 +1,107 @@
+/**
+ * store_maildir.c - un archivo por mail y destinatario, al estilo Maildir
+ */
+#include "store.h"
+
+#include <string.h>
+
+/** directorios distintos que se recuerdan por lote; el resto se sincroniza siempre */
+#define MAILDIR_MAX_DIRS 1024
+
+static struct
+{
+	const char* email;
+	bool ok;
+} dirs[MAILDIR_MAX_DIRS];
+
+/** sincroniza el directorio new/ de `email' una única vez por lote */
+static bool
+sync_dir_once(const char* email, unsigned* n)
+{
+	for (unsigned i = 0; i < *n; i++) {
+		if (strcmp(dirs[i].email, email) == 0) {
+			return dirs[i].ok;
+		}
+	}
+
+	const bool ok = sync_new_dir(email);
+	if (*n < MAILDIR_MAX_DIRS) {
+		dirs[*n].email = email;
+		dirs[*n].ok = ok;
+		(*n)++;
+	}
+	return ok;
+}
+
+static void
+maildir_open(struct commit_job* job, const char* from_line, const char* program)
+{
+	create_mails_files(job->rcpts, from_line, program, job->compressor);
+}
+
+static void
+maildir_write(struct commit_job* job, const uint8_t* data, const size_t len)
+{
+	write_to_files(job->rcpts, data, len);
+}
+
+static void
+maildir_writev(struct commit_job* job, const struct iovec* iov, const int iovcnt)
+{
+	writev_to_files(job->rcpts, iov, iovcnt);
+}
+
+static void
+maildir_close(struct commit_job* job)
+{
+	close_fds(job->rcpts);
+}
+
+void
+maildir_sync_new_dirs(struct commit_job* batch)
+{
+	unsigned n = 0;
+	for (struct commit_job* job = batch; job != NULL; job = job->next) {
+		if (job->rcpts == NULL) {
+			continue;
+		}
+		for (struct rcpt_node* r = job->rcpts->nodes; r < job->rcpts->nodes + job->rcpts->count; r++) {
+			job->ok &= sync_dir_once(r->email, &n);
+		}
+	}
+}
+
+static void
+maildir_commit(struct commit_job* batch)
+{
+	// primero los archivos: cada rename sólo es durable después del fsync
+	// de su directorio, que se hace una vez para todo el lote
+	for (struct commit_job* job = batch; job != NULL; job = job->next) {
+		job->ok = job->rcpts != NULL && sync_files(job->rcpts);
+	}
+	maildir_sync_new_dirs(batch);
+
+	// una copia por destinatario
+	for (struct commit_job* job = batch; job != NULL; job = job->next) {
+		if (job->ok) {
+			job->stored += job->written * job->rcpts->count;
+		}
+	}
+}
+
+static void
+maildir_discard(struct commit_job* job)
+{
+	discard_files(job->rcpts);
+}
+
+const struct store maildir_store = {
+	.name = "maildir",
+	.from_line = true,
+	.open = maildir_open,
+	.write = maildir_write,
+	.writev = maildir_writev,
+	.close = maildir_close,
+	.commit = maildir_commit,
+	.discard = maildir_discard,
+};
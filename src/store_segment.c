@@ -0,0 +1,437 @@
+/**
+ * store_segment.c - mails en segmentos preasignados con un índice
+ *
+ * Cada mail se escribe una sola vez (aunque tenga varios destinatarios) al
+ * final del segmento actual, y por cada destinatario se agrega una entrada al
+ * índice. Un lote de commit es un pwrite por mail, un fdatasync del segmento,
+ * un write con todas las entradas y un fdatasync del índice: no se crean
+ * archivos ni entradas de directorio.
+ *
+ * El segmento se sincroniza antes que el índice, así que una entrada del
+ * índice siempre apunta a datos en disco. Lo que quede en el segmento sin
+ * entrada (un lote interrumpido) se sobreescribe al reiniciar.
+ *
+ * Hasta el commit el mail se guarda en memoria, salvo que pase
+ * SEGMENT_SPILL_SIZE: desde ahí (y siempre con una transformación) se escribe
+ * en un archivo sin nombre que el commit copia al segmento. Así la memoria de
+ * una sesión no depende del tamaño del mail.
+ */
+#define _GNU_SOURCE
+#include "store.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+_Static_assert(sizeof(struct segment_index_entry) == 64, "el índice es un formato en disco");
+
+/** bytes de un mail que se guardan en memoria hasta el commit */
+#define SEGMENT_SPILL_SIZE (256 * 1024)
+
+/** mail en curso */
+struct segment_mail
+{
+	/** el contenido: `len' bytes en `data' o, si no es -1, en `file_fd' */
+	uint8_t* data;
+	size_t len;
+	size_t cap;
+	int file_fd;
+	/** no se pudo guardar todo el contenido */
+	bool failed;
+
+	/** transformación: escribe en `file_fd' */
+	pid_t pid;
+	int pipe_fd;
+};
+
+/** el resto sólo lo usa quien hace commit (el hilo de commit) */
+static int index_fd = -1;
+static off_t index_size;
+
+static int segment_fd = -1;
+static uint32_t segment;
+static uint64_t segment_offset;
+
+static struct segment_index_entry* entries;
+static size_t entries_cap;
+
+static uint8_t copy_buff[64 * 1024];
+
+static bool
+reserve(struct segment_mail* mail, const size_t len)
+{
+	if (mail->len + len <= mail->cap) {
+		return true;
+	}
+
+	size_t cap = mail->cap == 0 ? 4096 : mail->cap;
+	while (cap < mail->len + len) {
+		cap *= 2;
+	}
+	uint8_t* data = realloc(mail->data, cap);
+	if (data == NULL) {
+		return false;
+	}
+	mail->data = data;
+	mail->cap = cap;
+	return true;
+}
+
+/** archivo sin nombre en el directorio de los segmentos, o -1 */
+static int
+open_tmpfile(void)
+{
+	int fd = open(SEGMENT_STORE_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd == -1) {
+		char path[] = SEGMENT_STORE_DIR "/tmp.XXXXXX";
+		fd = mkstemp(path);
+		if (fd != -1) {
+			unlink(path);
+		}
+	}
+	return fd;
+}
+
+/** pasa lo que está en memoria a un archivo, para seguir escribiendo ahí */
+static bool
+spill(struct segment_mail* mail)
+{
+	mail->file_fd = open_tmpfile();
+	if (mail->file_fd == -1 || !store_write_all(mail->file_fd, mail->data, mail->len, -1)) {
+		return false;
+	}
+	free(mail->data);
+	mail->data = NULL;
+	mail->cap = 0;
+	return true;
+}
+
+static bool
+append(struct segment_mail* mail, const uint8_t* data, const size_t len)
+{
+	if (!mail->failed && mail->file_fd == -1 && mail->len + len > SEGMENT_SPILL_SIZE && !spill(mail)) {
+		mail->failed = true;
+	}
+	if (mail->failed) {
+		return false;
+	}
+
+	if (mail->file_fd != -1) {
+		mail->failed = !store_write_all(mail->file_fd, data, len, -1);
+	} else if (reserve(mail, len)) {
+		memcpy(mail->data + mail->len, data, len);
+	} else {
+		mail->failed = true;
+	}
+	if (!mail->failed) {
+		mail->len += len;
+	}
+	return !mail->failed;
+}
+
+static int
+open_segment(const uint32_t n)
+{
+	char path[64];
+	snprintf(path, sizeof(path), SEGMENT_STORE_DIR "/segment.%06u", n);
+
+	const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+	if (fd == -1) {
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size < SEGMENT_SIZE) {
+		// reservar el espacio de una vez evita que cada lote tenga que
+		// actualizar los metadatos del archivo al crecer. Si el sistema de
+		// archivos no lo soporta, el segmento crece con cada escritura.
+		posix_fallocate(fd, 0, SEGMENT_SIZE);
+	}
+	return fd;
+}
+
+/** pasa al segmento siguiente, dejando el actual en disco */
+static bool
+roll_segment(void)
+{
+	const bool ok = fdatasync(segment_fd) == 0;
+	close(segment_fd);
+
+	segment++;
+	segment_offset = 0;
+	segment_fd = open_segment(segment);
+	return ok && segment_fd != -1;
+}
+
+static bool
+segment_init(void)
+{
+	if ((mkdir("mails", 0777) == -1 && errno != EEXIST) || (mkdir(SEGMENT_STORE_DIR, 0777) == -1 && errno != EEXIST)) {
+		return false;
+	}
+
+	if (index_fd != -1) {
+		close(index_fd);
+	}
+	if (segment_fd != -1) {
+		close(segment_fd);
+	}
+
+	index_fd = open(SEGMENT_STORE_DIR "/index", O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+	if (index_fd == -1) {
+		return false;
+	}
+
+	// una entrada a medio escribir (el servidor se cayó durante el commit)
+	// no cuenta
+	struct stat st;
+	if (fstat(index_fd, &st) == -1) {
+		return false;
+	}
+	index_size = st.st_size - st.st_size % sizeof(struct segment_index_entry);
+	if (index_size != st.st_size && ftruncate(index_fd, index_size) == -1) {
+		return false;
+	}
+
+	segment = 0;
+	segment_offset = 0;
+	if (index_size > 0) {
+		struct segment_index_entry last;
+		if (pread(index_fd, &last, sizeof(last), index_size - sizeof(last)) != sizeof(last)) {
+			return false;
+		}
+		segment = last.segment;
+		segment_offset = last.offset + last.length;
+	}
+
+	segment_fd = open_segment(segment);
+	return segment_fd != -1;
+}
+
+static void
+segment_open(struct commit_job* job, const char* from_line, const char* program)
+{
+	struct segment_mail* mail = calloc(1, sizeof(*mail));
+	if (mail == NULL) {
+		return;
+	}
+	mail->pid = -1;
+	mail->pipe_fd = -1;
+	mail->file_fd = -1;
+	job->store_data = mail;
+
+	if (program == NULL) {
+		if (from_line != NULL) {
+			append(mail, (const uint8_t*)from_line, strlen(from_line));
+		}
+	} else {
+		// la salida de la transformación va a un archivo sin nombre
+		mail->file_fd = open_tmpfile();
+		if (mail->file_fd == -1) {
+			mail->failed = true;
+			return;
+		}
+		mail->pid = spawn_transformation(program, mail->file_fd, &mail->pipe_fd, from_line, job->compressor);
+	}
+}
+
+static void
+segment_write(struct commit_job* job, const uint8_t* data, const size_t len)
+{
+	struct segment_mail* mail = job->store_data;
+	if (mail == NULL) {
+		return;
+	}
+
+	if (mail->pipe_fd != -1) {
+		if (!store_write_all(mail->pipe_fd, data, len, -1)) {
+			mail->failed = true;
+		}
+	} else {
+		append(mail, data, len);
+	}
+}
+
+static void
+segment_close(struct commit_job* job)
+{
+	struct segment_mail* mail = job->store_data;
+	if (mail != NULL && mail->pipe_fd != -1) {
+		// al cerrar el pipe la transformación termina de escribir
+		close(mail->pipe_fd);
+		mail->pipe_fd = -1;
+	}
+}
+
+/** espera a la transformación: su salida, en `file_fd', es el mail */
+static void
+collect_transformation(struct segment_mail* mail)
+{
+	int status;
+	while (waitpid(mail->pid, &status, 0) == -1 && errno == EINTR) {
+	}
+	mail->pid = -1;
+
+	struct stat st;
+	if (mail->failed || fstat(mail->file_fd, &st) == -1) {
+		mail->failed = true;
+		return;
+	}
+	mail->len = st.st_size;
+}
+
+/** copia los primeros `len' bytes de `fd' al segmento, en `offset' */
+static bool
+copy_to_segment(const int fd, const size_t len, const off_t offset)
+{
+	off64_t in = 0, out = offset;
+	while ((size_t)in < len) {
+		const ssize_t n = copy_file_range(fd, &in, segment_fd, &out, len - in, 0);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == 0) {
+			return false;
+		}
+		if (n == -1) {
+			// el kernel o el sistema de archivos no lo soportan: se copia a mano
+			break;
+		}
+	}
+	while ((size_t)in < len) {
+		const size_t chunk = len - in < sizeof(copy_buff) ? len - in : sizeof(copy_buff);
+		const ssize_t n = pread(fd, copy_buff, chunk, in);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0 || !store_write_all(segment_fd, copy_buff, n, out)) {
+			return false;
+		}
+		in += n;
+		out += n;
+	}
+	return true;
+}
+
+static bool
+reserve_entries(const size_t n)
+{
+	if (n <= entries_cap) {
+		return true;
+	}
+	size_t cap = entries_cap == 0 ? 256 : entries_cap;
+	while (cap < n) {
+		cap *= 2;
+	}
+	struct segment_index_entry* e = realloc(entries, cap * sizeof(*e));
+	if (e == NULL) {
+		return false;
+	}
+	entries = e;
+	entries_cap = cap;
+	return true;
+}
+
+static void
+segment_commit(struct commit_job* batch)
+{
+	size_t n = 0;
+	bool ok = segment_fd != -1;
+
+	for (struct commit_job* job = batch; job != NULL; job = job->next) {
+		struct segment_mail* mail = job->store_data;
+		job->ok = false;
+		if (!ok || mail == NULL) {
+			continue;
+		}
+		if (mail->pid > 0) {
+			collect_transformation(mail);
+		}
+		if (mail->failed) {
+			continue;
+		}
+
+		if (segment_offset > 0 && segment_offset + mail->len > SEGMENT_SIZE && !roll_segment()) {
+			// lo que ya se escribió en el segmento anterior puede no estar en disco
+			ok = false;
+			continue;
+		}
+		const bool written = mail->file_fd != -1 ? copy_to_segment(mail->file_fd, mail->len, segment_offset)
+		                                          : store_write_all(segment_fd, mail->data, mail->len, segment_offset);
+		if (!written) {
+			continue;
+		}
+
+		const size_t first = n;
+		for (struct rcpt_node* r = job->rcpts->nodes; r < job->rcpts->nodes + job->rcpts->count; r++) {
+			if (!reserve_entries(n + 1)) {
+				ok = false;
+				break;
+			}
+			struct segment_index_entry* e = entries + n++;
+			memset(e, 0, sizeof(*e));
+			strncpy(e->mailbox, r->email, sizeof(e->mailbox) - 1);
+			e->segment = segment;
+			e->offset = segment_offset;
+			e->length = mail->len;
+			e->flags = SEGMENT_FLAG_NEW;
+		}
+		segment_offset += mail->len;
+		job->ok = true;
+		job->stored = mail->len;
+		job->saved = n > first ? mail->len * (n - first - 1) : 0;
+	}
+
+	// el mensaje tiene que estar en disco antes que la entrada que lo apunta
+	const size_t size = n * sizeof(*entries);
+	ok = ok && (n == 0 || (fdatasync(segment_fd) == 0 && store_write_all(index_fd, entries, size, -1) && fdatasync(index_fd) == 0));
+	if (ok) {
+		index_size += size;
+	} else {
+		// no dejamos entradas de mails que no se confirmaron
+		if (ftruncate(index_fd, index_size) == -1) {
+			perror("Error truncating segment index");
+		}
+		for (struct commit_job* job = batch; job != NULL; job = job->next) {
+			job->ok = false;
+			job->stored = job->saved = 0;
+		}
+	}
+}
+
+static void
+segment_discard(struct commit_job* job)
+{
+	struct segment_mail* mail = job->store_data;
+	if (mail == NULL) {
+		return;
+	}
+	if (mail->pipe_fd != -1) {
+		close(mail->pipe_fd);
+	}
+	if (mail->pid > 0) {
+		stop_transformation(mail->pid);
+	}
+	if (mail->file_fd != -1) {
+		close(mail->file_fd);
+	}
+	free(mail->data);
+	free(mail);
+}
+
+const struct store segment_store = {
+	.name = "segment",
+	.single_writer = true,
+	.from_line = true,
+	.init = segment_init,
+	.open = segment_open,
+	.write = segment_write,
+	.close = segment_close,
+	.commit = segment_commit,
+	.discard = segment_discard,
+};
@@ -0,0 +1,55 @@
+/**
+ * timecache.c - hora actual cacheada por el event loop
+ */
+#include "timecache.h"
+
+#include <stdbool.h>
+
+static struct timespec now;
+static bool valid = false;
+
+static time_t date_sec = -1;
+static char date[32];
+
+void
+timecache_invalidate(void)
+{
+	valid = false;
+}
+
+static void
+update(void)
+{
+	if (!valid) {
+		// CLOCK_REALTIME se resuelve en el vDSO: no entra al kernel
+		clock_gettime(CLOCK_REALTIME, &now);
+		valid = true;
+	}
+}
+
+time_t
+timecache_sec(void)
+{
+	update();
+	return now.tv_sec;
+}
+
+long
+timecache_usec(void)
+{
+	update();
+	return now.tv_nsec / 1000;
+}
+
+const char*
+timecache_date(void)
+{
+	const time_t sec = timecache_sec();
+	if (sec != date_sec) {
+		struct tm tm;
+		localtime_r(&sec, &tm);
+		strftime(date, sizeof(date), "%a %b %d %H:%M:%S %Y", &tm);
+		date_sec = sec;
+	}
+	return date;
+}
@@ -0,0 +1,245 @@
+/**
+ * tls.c - STARTTLS (RFC 3207)
+ */
+#include "tls.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef HAVE_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+struct tls
+{
+	SSL* ssl;
+	bool ktls_send;
+	bool ktls_recv;
+};
+
+static SSL_CTX* ctx = NULL;
+
+bool
+tls_init(const char* cert, const char* key, const bool ktls)
+{
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (ctx == NULL || !SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION) ||
+	    SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 ||
+	    SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1) {
+		goto fail;
+	}
+	SSL_CTX_set_options(ctx, SSL_OP_NO_RENEGOTIATION | (ktls ? SSL_OP_ENABLE_KTLS : 0));
+	// write_status reintenta con lo que quede en el buffer, que se puede haber compactado
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+	return true;
+
+fail:
+	ERR_clear_error();
+	SSL_CTX_free(ctx);
+	ctx = NULL;
+	errno = EINVAL;
+	return false;
+}
+
+bool
+tls_enabled(void)
+{
+	return ctx != NULL;
+}
+
+struct tls*
+tls_new(const int fd)
+{
+	struct tls* t = calloc(1, sizeof(*t));
+	if (t == NULL) {
+		return NULL;
+	}
+	t->ssl = SSL_new(ctx);
+	if (t->ssl == NULL || SSL_set_fd(t->ssl, fd) != 1) {
+		tls_free(t);
+		return NULL;
+	}
+	SSL_set_accept_state(t->ssl);
+	return t;
+}
+
+enum tls_result
+tls_handshake(struct tls* t)
+{
+	const int ret = SSL_do_handshake(t->ssl);
+	if (ret == 1) {
+		t->ktls_send = BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+		t->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(t->ssl));
+		return TLS_DONE;
+	}
+	switch (SSL_get_error(t->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			return TLS_WANT_READ;
+		case SSL_ERROR_WANT_WRITE:
+			return TLS_WANT_WRITE;
+		default:
+			ERR_clear_error();
+			return TLS_ERROR;
+	}
+}
+
+/**
+ * traduce el resultado de SSL_read o SSL_write que no transfirió nada: -1
+ * con EAGAIN si hay que esperar al socket, 0 si el cliente cerró la sesión
+ */
+static ssize_t
+io_error(struct tls* t, const int ret)
+{
+	const int err = SSL_get_error(t->ssl, ret);
+	if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+		errno = EAGAIN;
+		return -1;
+	}
+	ERR_clear_error();
+	return err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+}
+
+bool
+tls_ktls_send(const struct tls* t)
+{
+	return t->ktls_send;
+}
+
+bool
+tls_ktls_recv(const struct tls* t)
+{
+	return t->ktls_recv;
+}
+
+ssize_t
+tls_recv(struct tls* t, void* buf, const size_t n)
+{
+	const int ret = SSL_read(t->ssl, buf, n);
+	return ret > 0 ? ret : io_error(t, ret);
+}
+
+ssize_t
+tls_send(struct tls* t, const void* buf, const size_t n)
+{
+	const int ret = SSL_write(t->ssl, buf, n);
+	return ret > 0 ? ret : io_error(t, ret);
+}
+
+ssize_t
+tls_readv(void* t, const struct iovec* iov, const int iovcnt)
+{
+	// SSL_read entrega de a un registro, así que hay que repetirlo
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		for (size_t done = 0; done < iov[i].iov_len;) {
+			const ssize_t n = tls_recv(t, (uint8_t*)iov[i].iov_base + done, iov[i].iov_len - done);
+			if (n <= 0) {
+				return total > 0 ? (ssize_t)total : n;
+			}
+			done += n;
+			total += n;
+		}
+	}
+	return total;
+}
+
+size_t
+tls_pending(const struct tls* t)
+{
+	return t == NULL ? 0 : SSL_pending(t->ssl);
+}
+
+void
+tls_free(struct tls* t)
+{
+	if (t != NULL) {
+		SSL_free(t->ssl);
+		free(t);
+	}
+}
+
+void
+tls_close(void)
+{
+	SSL_CTX_free(ctx);
+	ctx = NULL;
+}
+
+#else
+
+bool
+tls_init(const char* cert, const char* key, const bool ktls)
+{
+	errno = ENOTSUP;
+	return false;
+}
+
+bool
+tls_enabled(void)
+{
+	return false;
+}
+
+struct tls*
+tls_new(const int fd)
+{
+	return NULL;
+}
+
+enum tls_result
+tls_handshake(struct tls* t)
+{
+	return TLS_ERROR;
+}
+
+bool
+tls_ktls_send(const struct tls* t)
+{
+	return false;
+}
+
+bool
+tls_ktls_recv(const struct tls* t)
+{
+	return false;
+}
+
+ssize_t
+tls_recv(struct tls* t, void* buf, const size_t n)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t
+tls_send(struct tls* t, const void* buf, const size_t n)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+ssize_t
+tls_readv(void* t, const struct iovec* iov, const int iovcnt)
+{
+	errno = ENOTSUP;
+	return -1;
+}
+
+size_t
+tls_pending(const struct tls* t)
+{
+	return 0;
+}
+
+void
+tls_free(struct tls* t)
+{
+}
+
+void
+tls_close(void)
+{
+}
+
+#endif
@@ -1,25 +1,33 @@
+#define _GNU_SOURCE  // recvmmsg, sendmmsg
 #include "udpserver.h"
 
+#include "admin_protocol.h"
+#include "client_table.h"
+#include "directory.h"
+#include "metrics.h"
 #include "selector.h"
 #include "smtpnio.h"
+#include "stm.h"
 
 #include <arpa/inet.h>
+#include <ctype.h>
 #include <limits.h>
-#include <netdb.h>  // for getnameinfo
 #include <netinet/in.h>
-#include <netinet/tcp.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>     // for strncasecmp
 #include <sys/socket.h>  // socket
 #include <sys/types.h>   // socket
+#include <time.h>
 #include <unistd.h>
-#include <stdbool.h>
-#include <ctype.h>
 
-#define RESPONSE_SIZE 16
-#define BUFFER_SIZE   1024
+#define BUFFER_SIZE  1024
+#define METRICS_SIZE 8192
+
+/** cantidad máxima de datagramas que se procesan por cada despertar */
+#define BATCH_SIZE 32
 
 enum client_state
 {
@@ -30,204 +38,368 @@ enum client_state
 	STATE_AUTH_FAILED
 };
 
-typedef struct client
-{
-	struct sockaddr_storage client_addr;
-	socklen_t client_addr_len;
-	enum client_state state;
-	struct client* next;
-} client_t;
+typedef struct client_entry client_t;
 
-client_t *clients = NULL;
-const char *help = "HELP\n - Ingrese 'historico' para obtener el historico de usuarios conectados\n - Ingrese 'actual' para obtener los usuarios conectados ahora\n - Ingrese 'mail' para obtener la cantidad de mails enviados\n - Ingrese 'bytes' para obtener la cantidad de bytes transferidos\n - Ingrese 'status' para ver el estado de las transformaciones\n - Ingrese 'transon' para activar las transformaciones\n - Ingrese 'transoff' para desactivar las transformaciones\n - Ingrese 'cant' para obtener la maxima cantidad de usuarios\n";
+static struct client_table* clients = NULL;
+static uint8_t token[ADMIN_TOKEN_SIZE];
+const char* help =
+    "HELP\n - Ingrese 'historico' para obtener el historico de usuarios conectados\n - Ingrese 'actual' para obtener "
+    "los usuarios conectados ahora\n - Ingrese 'mail' para obtener la cantidad de mails enviados\n - Ingrese 'bytes' "
+    "para obtener la cantidad de bytes transferidos\n - Ingrese 'status' para ver el estado de las "
+    "transformaciones\n - Ingrese 'transon' para activar las transformaciones\n - Ingrese 'transoff' para desactivar "
+    "las transformaciones\n - Ingrese 'cant' para obtener la maxima cantidad de usuarios\n - Ingrese 'max <cant>' "
+    "para setear la maxima cantidad de usuarios\n - Ingrese 'metrics' para obtener todas las metricas del servidor\n - "
+    "Ingrese 'reload' para recargar el directorio de destinatarios\n - Ingrese 'states' para obtener el tiempo por estado "
+    "de las sesiones\n - Ingrese 'states on|off|reset' para activar, desactivar o reiniciar esa contabilidad\n";
 
-client_t*
-find_client(struct sockaddr_storage* client_addr, socklen_t client_addr_len)
+/**
+ * buffers de un lote de datagramas. Son estáticos para no alocar ni usar
+ * mucho stack en cada despertar.
+ */
+static uint8_t in_buffers[BATCH_SIZE][BUFFER_SIZE];
+static uint8_t out_buffers[BATCH_SIZE][METRICS_SIZE];
+static struct sockaddr_storage addrs[BATCH_SIZE];
+static struct iovec in_iov[BATCH_SIZE], out_iov[BATCH_SIZE];
+static struct mmsghdr in_msgs[BATCH_SIZE], out_msgs[BATCH_SIZE];
+
+bool
+udp_server_init(const size_t max_clients, const unsigned idle_timeout, const char* pass)
 {
-	client_t* current = clients;
-	while (current != NULL) {
-		if (current->client_addr_len == client_addr_len &&
-		    memcmp(&current->client_addr, client_addr, client_addr_len) == 0) {
-			return current;
-		}
-		current = current->next;
+	// truncarla dejaría pasar a quien conozca sólo el principio
+	if (strlen(pass) > sizeof(token)) {
+		return false;
 	}
-	return NULL;
+	memset(token, 0, sizeof(token));
+	memcpy(token, pass, strlen(pass));
+
+	client_table_destroy(clients);
+	clients = client_table_new(max_clients, idle_timeout);
+	return clients != NULL;
 }
 
 void
-add_client(struct sockaddr_storage* client_addr, socklen_t client_addr_len)
+udp_server_close(void)
 {
-	client_t* new_client = (client_t*)malloc(sizeof(client_t));
-	if (new_client == NULL) {
-		perror("malloc");
-		return;
-	}
-
-	memcpy(&new_client->client_addr, client_addr, client_addr_len);
-	new_client->client_addr_len = client_addr_len;
-	new_client->state = STATE_INIT;
-	new_client->next = clients;
-	clients = new_client;
+	client_table_destroy(clients);
+	clients = NULL;
 }
 
-void
-uint64_to_big_endian(uint64_t value, uint8_t* buffer)
+/** agrega `s' a la respuesta. Retorna la nueva longitud */
+static size_t
+reply(char* out, size_t len, const char* s)
 {
-	buffer[0] = (value >> 56) & 0xFF;
-	buffer[1] = (value >> 48) & 0xFF;
-	buffer[2] = (value >> 40) & 0xFF;
-	buffer[3] = (value >> 32) & 0xFF;
-	buffer[4] = (value >> 24) & 0xFF;
-	buffer[5] = (value >> 16) & 0xFF;
-	buffer[6] = (value >> 8) & 0xFF;
-	buffer[7] = value & 0xFF;
+	const int n = snprintf(out + len, METRICS_SIZE - len, "%s", s);
+	if (n < 0) {
+		return len;
+	}
+	return len + n >= METRICS_SIZE ? METRICS_SIZE - 1 : len + n;
 }
 
-void
-handle_authentication(client_t* client,
-                      char* buffer,
-                      ssize_t received,
-                      int fd,
-                      struct sockaddr_storage* client_addr,
-                      socklen_t client_addr_len)
+static size_t
+handle_authentication(client_t* client, char* buffer, ssize_t received, char* out)
 {
+	size_t len = 0;
 	buffer[strcspn(buffer, "\n")] = '\0';
 
 	if (client->state == STATE_WAIT_USERNAME) {
 		if (strncasecmp(buffer, "user", received) == 0) {
 			client->state = STATE_WAIT_PASSWORD;
-			const char* response = "Ingrese contraseña: ";
-			sendto(fd, response, strlen(response), 0, (struct sockaddr*)client_addr, client_addr_len);
+			len = reply(out, len, "Ingrese contraseña: ");
 		} else {
-			const char* response = "Usuario inexistente. Ingrese usuario: ";
-			sendto(fd, response, strlen(response), 0, (struct sockaddr*)client_addr, client_addr_len);
+			len = reply(out, len, "Usuario inexistente. Ingrese usuario: ");
 		}
 	} else if (client->state == STATE_WAIT_PASSWORD) {
 		if (strncasecmp(buffer, "user", received) == 0) {
 			client->state = STATE_AUTH_SUCCESS;
-			char* response = "Acceso concedido. Puede escribir los comandos.\n";
-			sendto(fd, response, strlen(response), 0, (struct sockaddr*)client_addr, client_addr_len);
+			len = reply(out, len, "Acceso concedido. Puede escribir los comandos.\n");
+			len = reply(out, len, help);
 		} else {
 			client->state = STATE_WAIT_USERNAME;
-			const char* response = "Contraseña incorrecta. Ingrese usuario: ";
-			sendto(fd, response, strlen(response), 0, (struct sockaddr*)client_addr, client_addr_len);
+			len = reply(out, len, "Contraseña incorrecta. Ingrese usuario: ");
 		}
 	}
+
+	return len;
 }
 
+bool
+is_number(const char* str)
+{
+	if (*str == '\0') {
+		return false;
+	}
+	while (*str) {
+		if (!isdigit((unsigned char)*str)) {
+			return false;
+		}
+		str++;
+	}
+	return true;
+}
 
-bool is_number(const char *str) {
-    while (*str) {
-        if (!isdigit(*str)) {
-            return false;
-        }
-        str++;
-    }
-    return true;
+/**
+ * contabilidad por estado de las máquinas (ver stm.h), precedida por el tiempo
+ * total de despacho del selector y el de CPU del proceso para comparar.
+ */
+static size_t
+states_dump(char* rta)
+{
+	const struct histogram* loop = metrics_histogram(METRIC_SELECTOR_LOOP);
+	struct timespec cpu;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+
+	const int n = snprintf(rta,
+	                       METRICS_SIZE,
+	                       "profiling %s\nselector loops=%llu dispatch_ns=%llu\nprocess cpu_ns=%llu\n",
+	                       stm_profile_enabled() ? "on" : "off",
+	                       (unsigned long long)loop->count,
+	                       (unsigned long long)loop->sum,
+	                       (unsigned long long)cpu.tv_sec * 1000000000ULL + (unsigned long long)cpu.tv_nsec);
+	if (n < 0 || n >= METRICS_SIZE) {
+		return 0;
+	}
+	return n + stm_profile_dump(rta + n, METRICS_SIZE - n);
 }
 
+/** atiende un comando del protocolo de texto. Retorna la longitud de la respuesta */
+static size_t
+text_request(client_t* client, char* buffer, ssize_t received, char* rta)
+{
+	if (client->state == STATE_INIT) {
+		client->state = STATE_WAIT_USERNAME;
+		return reply(rta, 0, "Ingrese usuario: ");
+	}
+
+	if (client->state == STATE_WAIT_USERNAME || client->state == STATE_WAIT_PASSWORD) {
+		return handle_authentication(client, buffer, received, rta);
+	}
+
+	if (client->state != STATE_AUTH_SUCCESS) {
+		return 0;
+	}
+
+	if (strcasecmp(buffer, "historico\n") == 0) {
+		snprintf(rta, BUFFER_SIZE, "Cantidad historica %llu\n\n", (unsigned long long)get_historic_users());
+	} else if (strcasecmp(buffer, "actual\n") == 0) {
+		snprintf(rta, BUFFER_SIZE, "Cantidad actual %llu\n\n", (unsigned long long)get_current_users());
+	} else if (strcasecmp(buffer, "bytes\n") == 0) {
+		snprintf(rta, BUFFER_SIZE, "Bytes transferidos %llu\n\n", (unsigned long long)get_current_bytes());
+	} else if (strcasecmp(buffer, "mail\n") == 0) {
+		snprintf(rta, BUFFER_SIZE, "Mails enviados %llu\n\n", (unsigned long long)get_current_mails());
+	} else if (strcasecmp(buffer, "cant\n") == 0) {
+		snprintf(rta, BUFFER_SIZE, "Cantidad maxima de usuarios %d\n\n", get_cant_max_users());
+	} else if (strcasecmp(buffer, "status\n") == 0) {
+		if (get_current_status()) {
+			snprintf(rta, BUFFER_SIZE, "Las transformaciones estan activadas\n\n");
+		} else {
+			snprintf(rta, BUFFER_SIZE, "Las transformaciones estan desactivadas\n\n");
+		}
+	} else if (strcasecmp(buffer, "transon\n") == 0) {
+		set_new_status(true);
+		snprintf(rta, BUFFER_SIZE, "Transformaciones activadas\n\n");
+	} else if (strcasecmp(buffer, "transoff\n") == 0) {
+		set_new_status(false);
+		snprintf(rta, BUFFER_SIZE, "Transformaciones desactivadas\n\n");
+	} else if (strcasecmp(buffer, "metrics\n") == 0) {
+		return metrics_dump(rta, METRICS_SIZE);
+	} else if (strcasecmp(buffer, "states\n") == 0) {
+		return states_dump(rta);
+	} else if (strcasecmp(buffer, "states on\n") == 0 || strcasecmp(buffer, "states off\n") == 0) {
+		const bool on = strcasecmp(buffer, "states on\n") == 0;
+		if (stm_profile_enable(on)) {
+			snprintf(rta, BUFFER_SIZE, "Contabilidad por estado %s\n\n", on ? "activada" : "desactivada");
+		} else {
+			snprintf(rta, BUFFER_SIZE, "Error: compilado sin contabilidad por estado\n\n");
+		}
+	} else if (strcasecmp(buffer, "states reset\n") == 0) {
+		stm_profile_reset();
+		snprintf(rta, BUFFER_SIZE, "Contabilidad por estado reiniciada\n\n");
+	} else if (strcasecmp(buffer, "reload\n") == 0) {
+		if (directory_reload()) {
+			snprintf(rta, BUFFER_SIZE, "Recargando el directorio\n\n");
+		} else {
+			snprintf(rta, BUFFER_SIZE, "Error: no hay directorio o ya se esta recargando\n\n");
+		}
+	} else if (strcasecmp(buffer, "help\n") == 0) {
+		snprintf(rta, BUFFER_SIZE, "%s\n\n", help);
+	} else if (strncasecmp(buffer, "max ", 4) == 0) {
+		char* number_str = &buffer[4];
+		number_str[strcspn(number_str, "\n")] = '\0';
+
+		if (is_number(number_str)) {
+			const int number = atoi(number_str);
+			set_max_users(number);
+			snprintf(rta, BUFFER_SIZE, "Nuevo número máximo de usuarios: %d\n\n", number);
+		} else {
+			snprintf(rta, BUFFER_SIZE, "Error: Argumento inválido\n\n");
+		}
+	} else {
+		snprintf(rta, BUFFER_SIZE, "Comando no reconocido\n %s", help);
+	}
+
+	return strlen(rta);
+}
+
+/** valor actual de la métrica `id' del protocolo binario */
+static bool
+metric_value(const uint16_t id, uint64_t* value)
+{
+	if (ADMIN_IS_HISTOGRAM(id)) {
+		const unsigned h = (id >> 3) & 0x1FF;
+		if (h >= METRIC_HISTOGRAMS) {
+			return false;
+		}
+		const struct histogram* hist = metrics_histogram(h);
+		switch (id & 0x7) {
+			case ADMIN_STAT_COUNT:
+				*value = hist->count;
+				break;
+			case ADMIN_STAT_P50:
+				*value = histogram_quantile(hist, 0.50);
+				break;
+			case ADMIN_STAT_P90:
+				*value = histogram_quantile(hist, 0.90);
+				break;
+			case ADMIN_STAT_P99:
+				*value = histogram_quantile(hist, 0.99);
+				break;
+			case ADMIN_STAT_P999:
+				*value = histogram_quantile(hist, 0.999);
+				break;
+			case ADMIN_STAT_MAX:
+				*value = hist->max;
+				break;
+			default:
+				return false;
+		}
+		return true;
+	}
+
+	const unsigned index = id & 0xFF;
+	switch (id >> 8) {
+		case ADMIN_CLASS_COUNTER:
+			if (index < METRIC_COUNTERS) {
+				*value = metrics_counter(index);
+				return true;
+			}
+			break;
+		case ADMIN_CLASS_GAUGE:
+			if (index < METRIC_GAUGES) {
+				*value = (uint64_t)metrics_gauge(index);
+				return true;
+			}
+			break;
+		case ADMIN_CLASS_CONFIG:
+			if (index == ADMIN_CONFIG_MAX_USERS) {
+				*value = get_cant_max_users();
+				return true;
+			} else if (index == ADMIN_CONFIG_TRANSFORMATIONS) {
+				*value = get_current_status();
+				return true;
+			}
+			break;
+	}
+	return false;
+}
+
+/** atiende un pedido del protocolo binario. Retorna la longitud de la respuesta */
+static size_t
+binary_request(const uint8_t* data, const size_t len, uint8_t* out)
+{
+	struct admin_request req;
+	struct admin_response res;
+	memset(&res, 0, sizeof(res));
+
+	res.status = admin_request_parse(data, len, &req);
+	res.version = ADMIN_VERSION;
+	res.id = req.id;
+
+	if (res.status == ADMIN_OK) {
+		// comparación en tiempo constante del token
+		uint8_t diff = 0;
+		for (unsigned i = 0; i < ADMIN_TOKEN_SIZE; i++) {
+			diff |= req.token[i] ^ token[i];
+		}
+		if (diff != 0) {
+			res.status = ADMIN_AUTH_FAILED;
+		}
+	}
+
+	if (res.status == ADMIN_OK) {
+		res.count = req.count;
+		for (unsigned i = 0; i < req.count; i++) {
+			res.values[i].metric = req.metrics[i];
+			res.values[i].status = metric_value(req.metrics[i], &res.values[i].value) ? ADMIN_OK : ADMIN_UNKNOWN_METRIC;
+		}
+	}
+
+	return admin_response_build(&res, out, METRICS_SIZE);
+}
 
 // Manejador de lectura para el socket UDP
 void
 udp_read_handler(struct selector_key* key)
 {
-	char buffer[BUFFER_SIZE];
-	struct sockaddr_storage client_addr;
-	socklen_t client_addr_len = sizeof(client_addr);
-	ssize_t received =
-	    recvfrom(key->fd, buffer, sizeof(buffer) - 1, 0, (struct sockaddr*)&client_addr, &client_addr_len);
+	for (unsigned i = 0; i < BATCH_SIZE; i++) {
+		in_iov[i].iov_base = in_buffers[i];
+		in_iov[i].iov_len = BUFFER_SIZE - 1;
+		memset(&in_msgs[i].msg_hdr, 0, sizeof(in_msgs[i].msg_hdr));
+		in_msgs[i].msg_hdr.msg_iov = &in_iov[i];
+		in_msgs[i].msg_hdr.msg_iovlen = 1;
+		in_msgs[i].msg_hdr.msg_name = &addrs[i];
+		in_msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+	}
+
+	// drenamos de una sola vez la ráfaga de datagramas que haya disponible
+	const int received = recvmmsg(key->fd, in_msgs, BATCH_SIZE, MSG_DONTWAIT, NULL);
 	if (received < 0) {
-		perror("recvfrom");
+		perror("recvmmsg");
 		return;
 	}
-	buffer[received] = '\0';
 
-	client_t* client = find_client(&client_addr, client_addr_len);
-	if (client == NULL) {
-		add_client(&client_addr, client_addr_len);
-		client = find_client(&client_addr, client_addr_len);
-	}
+	const uint64_t now = metrics_now() / 1000000000ULL;
+	unsigned replies = 0;
 
-	if (client->state == STATE_INIT) {
-		client->state = STATE_WAIT_USERNAME;
-		const char* response = "Ingrese usuario: ";
-		sendto(key->fd, response, strlen(response), 0, (struct sockaddr*)&client_addr, client_addr_len);
-		return;
-	}
+	for (int i = 0; i < received; i++) {
+		const size_t len = in_msgs[i].msg_len;
+		const socklen_t addr_len = in_msgs[i].msg_hdr.msg_namelen;
+		uint8_t* out = out_buffers[replies];
+		size_t out_len;
 
-	if (client->state == STATE_WAIT_USERNAME || client->state == STATE_WAIT_PASSWORD) {
-		handle_authentication(client, buffer, received, key->fd, &client_addr, client_addr_len);
+		if (admin_is_binary(in_buffers[i], len)) {
+			out_len = binary_request(in_buffers[i], len, out);
+		} else {
+			in_buffers[i][len] = '\0';
 
-		if (client->state == STATE_AUTH_SUCCESS) {
-			sendto(key->fd, help, strlen(help), 0, (struct sockaddr*)&client_addr, client_addr_len);
+			// una entrada nueva (o expirada) arranca en STATE_INIT
+			client_t* client = client_table_get(clients, &addrs[i], addr_len, now);
+			if (client == NULL) {
+				continue;
+			}
+			out_len = text_request(client, (char*)in_buffers[i], len, (char*)out);
+		}
+
+		if (out_len > 0) {
+			out_iov[replies].iov_base = out;
+			out_iov[replies].iov_len = out_len;
+			memset(&out_msgs[replies].msg_hdr, 0, sizeof(out_msgs[replies].msg_hdr));
+			out_msgs[replies].msg_hdr.msg_iov = &out_iov[replies];
+			out_msgs[replies].msg_hdr.msg_iovlen = 1;
+			out_msgs[replies].msg_hdr.msg_name = &addrs[i];
+			out_msgs[replies].msg_hdr.msg_namelen = addr_len;
+			replies++;
 		}
-		return;
 	}
 
-    if (client->state == STATE_AUTH_SUCCESS) {
-        uint64_t cantidad=0;
-        char rta[BUFFER_SIZE];
-
-        if (strcasecmp(buffer, "historico\n") == 0) {
-            cantidad = get_historic_users();
-            snprintf(rta, BUFFER_SIZE, "Cantidad historica %ld\n\n", cantidad);
-        } else if (strcasecmp(buffer, "actual\n") == 0) {
-            cantidad = get_current_users();
-            snprintf(rta, BUFFER_SIZE, "Cantidad actual %ld\n\n", cantidad);
-        }else if (strcasecmp(buffer, "bytes\n") == 0) {
-            cantidad = get_current_bytes();
-            snprintf(rta, BUFFER_SIZE, "Bytes transferidos %ld\n\n", cantidad);
-        }else if (strcasecmp(buffer, "mail\n") == 0) {
-            cantidad = get_current_mails();
-            snprintf(rta, BUFFER_SIZE, "Mails enviados %ld\n\n", cantidad);
-        }else if (strcasecmp(buffer, "cant\n") == 0) {
-            cantidad = get_cant_max_users();
-            snprintf(rta, BUFFER_SIZE, "Cantidad maxima de usuarios %ld\n\n", cantidad);
-        }else if (strcasecmp(buffer, "status\n") == 0) {
-            bool status = get_current_status();
-            if(status){
-                snprintf(rta, BUFFER_SIZE, "Las transformaciones estan activadas\n\n");
-            }else{
-                snprintf(rta, BUFFER_SIZE, "Las transformaciones estan desactivadas\n\n");
-            }
-        }else if (strcasecmp(buffer, "transon\n") == 0) {
-            set_new_status(true);
-            snprintf(rta, BUFFER_SIZE, "Transformaciones activadas\n\n");
-        }else if (strcasecmp(buffer, "transoff\n") == 0) {
-            set_new_status(false);
-            snprintf(rta, BUFFER_SIZE, "Transformaciones desactivadas\n\n");
-        }else if (strcasecmp(buffer, "help\n") == 0) {
-            snprintf(rta, BUFFER_SIZE, "%s\n\n", help);
-            if ((buffer[0] == 'm' || buffer[0] == 'M') &&
-                (buffer[1] == 'a' || buffer[1] == 'A') &&
-                (buffer[2] == 'x' || buffer[2] == 'X') &&
-                (buffer[3] == ' ')) {
-
-                char *number_str = &buffer[4];
-                number_str[strcspn(number_str, "\n")] = '\0';
-                int number;
-
-                if (is_number(number_str)) {
-                    number = atoi(number_str);
-                    if (number >= 0) {
-                        set_max_users(number);
-                        snprintf(rta, BUFFER_SIZE, "Nuevo número máximo de usuarios: %d\n\n", number);
-                    } else {
-                        snprintf(rta, BUFFER_SIZE, "Error: Argumento inválido\n\n");
-                    }
-                } else {
-                    snprintf(rta, BUFFER_SIZE, "Error: Argumento inválido\n\n");
-                }
-            } else {
-                snprintf(rta, BUFFER_SIZE, "Comando no reconocido\n %s", help);
-            }
-        }
-
-        ssize_t sent = sendto(key->fd, rta, strlen(rta), 0, (struct sockaddr *)&client_addr, client_addr_len);
-        if (sent < 0) {
-            perror("sendto");
-            return;
-        }
-    }
+	unsigned sent = 0;
+	while (sent < replies) {
+		const int n = sendmmsg(key->fd, out_msgs + sent, replies - sent, MSG_DONTWAIT);
+		if (n < 0) {
+			// descartamos la respuesta que falló y seguimos con el resto del lote
+			perror("sendmmsg");
+			sent++;
+		} else {
+			sent += n;
+		}
+	}
 }
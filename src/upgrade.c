@@ -0,0 +1,340 @@
+/**
+ * upgrade.c - reemplazo del binario sin dejar de atender
+ */
+#define _GNU_SOURCE  // execvpe, close_range, MSG_CMSG_CLOEXEC
+#include "upgrade.h"
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define HANDOFF_MAGIC   0x534d5550  // "SMUP"
+#define HANDOFF_VERSION 1
+
+/** el aviso del proceso nuevo */
+#define READY_BYTE 'R'
+
+/** fd del socketpair en el proceso nuevo (ver UPGRADE_ENV) */
+#define CHILD_FD 3
+
+/**
+ * lo que el proceso viejo le manda al nuevo al lanzarlo (junto con los
+ * sockets) y al salir
+ */
+struct handoff
+{
+	uint32_t magic;
+	uint32_t version;
+	/** si no coincide con METRIC_COUNTERS, los contadores no se trasladan */
+	uint32_t counters;
+	uint32_t reserved;
+	uint64_t counter[METRIC_COUNTERS];
+};
+
+extern char** environ;
+
+/** socketpair con el otro proceso, o -1 */
+static int channel = -1;
+
+/* proceso viejo */
+static pid_t child = -1;
+static enum upgrade_status status = UPGRADE_IDLE;
+
+/* proceso nuevo */
+static bool parent_running = false;
+/** contadores ya sumados, para sumar al final sólo lo que pasó durante el drenaje */
+static uint64_t inherited[METRIC_COUNTERS];
+
+static void
+handoff_fill(struct handoff* h)
+{
+	memset(h, 0, sizeof(*h));
+	h->magic = HANDOFF_MAGIC;
+	h->version = HANDOFF_VERSION;
+	h->counters = METRIC_COUNTERS;
+	for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+		h->counter[i] = metrics_counter(i);
+	}
+}
+
+static void
+handoff_apply(const struct handoff* h)
+{
+	if (h->magic != HANDOFF_MAGIC || h->version != HANDOFF_VERSION || h->counters != METRIC_COUNTERS) {
+		return;
+	}
+	for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+		if (h->counter[i] > inherited[i]) {
+			metrics_counter_add(i, h->counter[i] - inherited[i]);
+			inherited[i] = h->counter[i];
+		}
+	}
+}
+
+/* proceso nuevo ----------------------------------------------------------- */
+
+bool
+upgrade_inherit(int* server, int* mng_server)
+{
+	*server = *mng_server = -1;
+	const char* env = getenv(UPGRADE_ENV);
+	if (env == NULL) {
+		return false;
+	}
+	channel = atoi(env);
+	unsetenv(UPGRADE_ENV);
+	fcntl(channel, F_SETFD, FD_CLOEXEC);
+
+	struct handoff h;
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	struct iovec iov = { .iov_base = &h, .iov_len = sizeof(h) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	const ssize_t n = recvmsg(channel, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+
+	const struct cmsghdr* c = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (c == NULL || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS ||
+	    c->cmsg_len != CMSG_LEN(2 * sizeof(int))) {
+		goto fail;
+	}
+	int fds[2];
+	memcpy(fds, CMSG_DATA(c), sizeof(fds));
+	if (n != (ssize_t)sizeof(h)) {
+		close(fds[0]);
+		close(fds[1]);
+		goto fail;
+	}
+
+	*server = fds[0];
+	*mng_server = fds[1];
+	handoff_apply(&h);
+	parent_running = true;
+	return true;
+
+fail:
+	close(channel);
+	channel = -1;
+	return false;
+}
+
+/** el proceso viejo mandó sus contadores finales, o salió */
+static void
+parent_read(struct selector_key* key)
+{
+	struct handoff h;
+	const ssize_t n = recv(key->fd, &h, sizeof(h), MSG_WAITALL);
+	if (n == (ssize_t)sizeof(h)) {
+		handoff_apply(&h);
+		return;
+	}
+	selector_unregister_fd(key->s, key->fd);
+	close(key->fd);
+	channel = -1;
+	parent_running = false;
+}
+
+static const struct fd_handler parent_handler = {
+	.handle_read = parent_read,
+};
+
+bool
+upgrade_ready(fd_selector s)
+{
+	if (channel == -1) {
+		return true;
+	}
+	const char ready = READY_BYTE;
+	if (send(channel, &ready, 1, MSG_NOSIGNAL) != 1 ||
+	    selector_register(s, channel, &parent_handler, OP_READ, NULL) != SELECTOR_SUCCESS) {
+		// sin aviso el viejo sigue atendiendo; este proceso igual puede hacerlo
+		close(channel);
+		channel = -1;
+		parent_running = false;
+		return false;
+	}
+	return true;
+}
+
+bool
+upgrade_parent_running(void)
+{
+	return parent_running;
+}
+
+/* proceso viejo ----------------------------------------------------------- */
+
+/** el proceso nuevo avisó que atiende, o terminó sin hacerlo */
+static void
+child_read(struct selector_key* key)
+{
+	char c;
+	const ssize_t n = recv(key->fd, &c, 1, 0);
+	selector_unregister_fd(key->s, key->fd);
+	if (n == 1 && c == READY_BYTE) {
+		status = UPGRADE_READY;
+		return;
+	}
+	close(key->fd);
+	channel = -1;
+	status = UPGRADE_FAILED;
+	// el socket se cierra un instante antes de que el proceso sea recolectable;
+	// si cerró el socket sin terminar, lo termina
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+}
+
+static const struct fd_handler child_handler = {
+	.handle_read = child_read,
+};
+
+/** el entorno actual más UPGRADE_ENV. Se arma antes del fork */
+static char**
+child_environment(char* var)
+{
+	size_t n = 0;
+	while (environ[n] != NULL) {
+		n++;
+	}
+	char** env = malloc((n + 2) * sizeof(*env));
+	if (env == NULL) {
+		return NULL;
+	}
+	size_t j = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (strncmp(environ[i], UPGRADE_ENV "=", sizeof(UPGRADE_ENV)) != 0) {
+			env[j++] = environ[i];
+		}
+	}
+	env[j++] = var;
+	env[j] = NULL;
+	return env;
+}
+
+bool
+upgrade_start(fd_selector s, char** argv, const int server, const int mng_server)
+{
+	if (status != UPGRADE_IDLE) {
+		errno = EBUSY;
+		return false;
+	}
+
+	char var[32];
+	snprintf(var, sizeof(var), UPGRADE_ENV "=%d", CHILD_FD);
+	char** env = child_environment(var);
+	int sv[2] = { -1, -1 };
+	if (env == NULL || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		goto fail;
+	}
+
+	child = fork();
+	if (child == -1) {
+		goto fail;
+	}
+	if (child == 0) {
+		// sólo llamadas async-signal-safe hasta el exec: hay otros hilos.
+		// Las conexiones de este proceso no se heredan, sólo CHILD_FD.
+		if (sv[1] == CHILD_FD) {
+			fcntl(CHILD_FD, F_SETFD, 0);
+		} else if (dup2(sv[1], CHILD_FD) == -1) {
+			_exit(127);
+		}
+		close_range(CHILD_FD + 1, ~0U, 0);
+		execvpe(argv[0], argv, env);
+		_exit(127);
+	}
+	close(sv[1]);
+	sv[1] = -1;
+	free(env);
+	env = NULL;
+
+	struct handoff h;
+	handoff_fill(&h);
+	const int fds[2] = { server, mng_server };
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(fds))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct iovec iov = { .iov_base = &h, .iov_len = sizeof(h) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control.buf,
+		.msg_controllen = sizeof(control.buf),
+	};
+	struct cmsghdr* c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+
+	// si el exec falló, el send falla o el proceso nuevo lo descarta y
+	// child_read ve el cierre
+	if (sendmsg(sv[0], &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(h) ||
+	    selector_register(s, sv[0], &child_handler, OP_READ, NULL) != SELECTOR_SUCCESS) {
+		kill(child, SIGTERM);
+		waitpid(child, NULL, 0);
+		goto fail;
+	}
+	channel = sv[0];
+	status = UPGRADE_STARTING;
+	return true;
+
+fail:
+	if (sv[0] != -1) {
+		close(sv[0]);
+	}
+	if (sv[1] != -1) {
+		close(sv[1]);
+	}
+	free(env);
+	child = -1;
+	return false;
+}
+
+enum upgrade_status
+upgrade_poll(void)
+{
+	const enum upgrade_status ret = status;
+	if (status == UPGRADE_FAILED) {
+		status = UPGRADE_IDLE;
+	}
+	return ret;
+}
+
+pid_t
+upgrade_child(void)
+{
+	return child;
+}
+
+void
+upgrade_finish(void)
+{
+	if (channel == -1 || status != UPGRADE_READY) {
+		return;
+	}
+	struct handoff h;
+	handoff_fill(&h);
+	send(channel, &h, sizeof(h), MSG_NOSIGNAL);
+	close(channel);
+	channel = -1;
+}
@@ -0,0 +1,119 @@
+#include "admin_protocol.h"
+#include "metrics.h"
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+START_TEST(test_admin_request_roundtrip)
+{
+	struct admin_request req, parsed;
+	memset(&req, 0, sizeof(req));
+	req.version = ADMIN_VERSION;
+	memcpy(req.token, "secretpa", ADMIN_TOKEN_SIZE);
+	req.id = 0xCAFEBABE;
+	req.count = 3;
+	req.metrics[0] = ADMIN_METRIC(ADMIN_CLASS_COUNTER, METRIC_MAILS);
+	req.metrics[1] = ADMIN_METRIC(ADMIN_CLASS_GAUGE, METRIC_CURRENT_USERS);
+	req.metrics[2] = ADMIN_HISTOGRAM_METRIC(METRIC_DATA_SIZE, ADMIN_STAT_P99);
+
+	uint8_t buff[ADMIN_REQUEST_MAX];
+	const size_t n = admin_request_build(&req, buff, sizeof(buff));
+	ck_assert_uint_eq(ADMIN_REQUEST_HEADER + 3 * 2, n);
+	ck_assert(admin_is_binary(buff, n));
+
+	ck_assert_int_eq(ADMIN_OK, admin_request_parse(buff, n, &parsed));
+	ck_assert_uint_eq(req.id, parsed.id);
+	ck_assert_uint_eq(3, parsed.count);
+	ck_assert(memcmp(req.token, parsed.token, ADMIN_TOKEN_SIZE) == 0);
+	ck_assert(memcmp(req.metrics, parsed.metrics, 3 * sizeof(req.metrics[0])) == 0);
+
+	// truncado o con bytes de más
+	ck_assert_int_eq(ADMIN_BAD_REQUEST, admin_request_parse(buff, n - 1, &parsed));
+	ck_assert_int_eq(ADMIN_BAD_REQUEST, admin_request_parse(buff, n + 1, &parsed));
+
+	// otra versión: se informa conservando el id para poder responder
+	buff[1] = ADMIN_VERSION + 1;
+	ck_assert_int_eq(ADMIN_BAD_VERSION, admin_request_parse(buff, n, &parsed));
+	ck_assert_uint_eq(req.id, parsed.id);
+}
+END_TEST
+
+START_TEST(test_admin_response_roundtrip)
+{
+	struct admin_response res, parsed;
+	memset(&res, 0, sizeof(res));
+	res.version = ADMIN_VERSION;
+	res.status = ADMIN_OK;
+	res.id = 42;
+	res.count = 2;
+	res.values[0].metric = ADMIN_METRIC(ADMIN_CLASS_COUNTER, METRIC_BYTES_IN);
+	res.values[0].value = UINT64_MAX - 1;
+	res.values[1].metric = 0x0FFF;
+	res.values[1].status = ADMIN_UNKNOWN_METRIC;
+
+	uint8_t buff[ADMIN_RESPONSE_MAX];
+	const size_t n = admin_response_build(&res, buff, sizeof(buff));
+	ck_assert_uint_eq(ADMIN_RESPONSE_HEADER + 2 * ADMIN_ENTRY_SIZE, n);
+
+	ck_assert(admin_response_parse(buff, n, &parsed));
+	ck_assert_uint_eq(42, parsed.id);
+	ck_assert_uint_eq(2, parsed.count);
+	ck_assert_uint_eq(UINT64_MAX - 1, parsed.values[0].value);
+	ck_assert_uint_eq(ADMIN_UNKNOWN_METRIC, parsed.values[1].status);
+
+	ck_assert(!admin_response_parse(buff, n - 1, &parsed));
+	ck_assert_uint_eq(0, admin_response_build(&res, buff, n - 1));
+}
+END_TEST
+
+START_TEST(test_admin_metric_names)
+{
+	char name[128];
+	uint16_t id;
+
+	for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+		ck_assert(admin_metric_name(ADMIN_METRIC(ADMIN_CLASS_COUNTER, i), name, sizeof(name)));
+		ck_assert(admin_metric_id(name, &id));
+		ck_assert_uint_eq(ADMIN_METRIC(ADMIN_CLASS_COUNTER, i), id);
+	}
+	for (unsigned i = 0; i < METRIC_HISTOGRAMS; i++) {
+		ck_assert(admin_metric_name(ADMIN_HISTOGRAM_METRIC(i, ADMIN_STAT_P999), name, sizeof(name)));
+		ck_assert(admin_metric_id(name, &id));
+		ck_assert_uint_eq(ADMIN_HISTOGRAM_METRIC(i, ADMIN_STAT_P999), id);
+	}
+
+	ck_assert(admin_metric_id("max_users", &id));
+	ck_assert_uint_eq(ADMIN_METRIC(ADMIN_CLASS_CONFIG, ADMIN_CONFIG_MAX_USERS), id);
+
+	ck_assert(!admin_metric_id("nope", &id));
+	ck_assert(!admin_metric_id("nope:p99", &id));
+	ck_assert(!admin_metric_name(ADMIN_METRIC(ADMIN_CLASS_COUNTER, METRIC_COUNTERS), name, sizeof(name)));
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("admin_protocol");
+	TCase* tc = tcase_create("admin_protocol");
+
+	tcase_add_test(tc, test_admin_request_roundtrip);
+	tcase_add_test(tc, test_admin_response_roundtrip);
+	tcase_add_test(tc, test_admin_metric_names);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,174 @@
+#include "bufchain.h"
+
+#include <check.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static int fds[2];
+static uint8_t data[4 * BUFCHAIN_BLOCK_SIZE];
+
+static void
+setup(void)
+{
+	ck_assert_int_eq(0, pipe(fds));
+	for (size_t i = 0; i < sizeof(data); i++) {
+		data[i] = i * 7;
+	}
+}
+
+static void
+teardown(void)
+{
+	close(fds[0]);
+	close(fds[1]);
+}
+
+START_TEST(test_readv)
+{
+	struct bufchain c;
+	bufchain_init(&c, 4 * BUFCHAIN_BLOCK_SIZE);
+	c.window = 4;
+
+	// varios bloques en una sola lectura
+	const size_t n = 2 * BUFCHAIN_BLOCK_SIZE + 100;
+	ck_assert_int_eq(n, write(fds[1], data, n));
+	ck_assert_int_eq(n, bufchain_readv(&c, fds[0]));
+	ck_assert_uint_eq(n, c.length);
+	ck_assert_uint_eq(3, c.blocks);
+
+	struct iovec iov[8];
+	const int iovcnt = bufchain_iov(&c, iov, 8);
+	ck_assert_int_eq(3, iovcnt);
+	size_t offset = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		ck_assert(memcmp(data + offset, iov[i].iov_base, iov[i].iov_len) == 0);
+		offset += iov[i].iov_len;
+	}
+	ck_assert_uint_eq(n, offset);
+
+	// la siguiente lectura sigue en el espacio libre del último bloque
+	ck_assert_int_eq(50, write(fds[1], data + n, 50));
+	ck_assert_int_eq(50, bufchain_readv(&c, fds[0]));
+	ck_assert_uint_eq(3, c.blocks);
+
+	uint8_t out[sizeof(data)];
+	ck_assert_uint_eq(n + 50, bufchain_read(&c, out, sizeof(out)));
+	ck_assert(memcmp(data, out, n + 50) == 0);
+	ck_assert_uint_eq(0, c.length);
+	ck_assert_uint_eq(0, c.blocks);
+	bufchain_free(&c);
+}
+END_TEST
+
+START_TEST(test_high_water)
+{
+	struct bufchain c;
+	bufchain_init(&c, BUFCHAIN_BLOCK_SIZE + 1);
+	ck_assert_uint_eq(2, c.max_blocks);
+	c.window = 2;
+
+	ck_assert_int_eq(sizeof(data), write(fds[1], data, sizeof(data)));
+	ck_assert_int_eq(2 * BUFCHAIN_BLOCK_SIZE - 2 * BUFCHAIN_HEADROOM, bufchain_readv(&c, fds[0]));
+	ck_assert_int_eq(-1, bufchain_readv(&c, fds[0]));
+	ck_assert_int_eq(ENOBUFS, errno);
+
+	// al consumir el primer bloque hay lugar para otro
+	bufchain_consume(&c, BUFCHAIN_BLOCK_SIZE - BUFCHAIN_HEADROOM);
+	ck_assert_uint_eq(1, c.blocks);
+	ck_assert_int_eq(BUFCHAIN_BLOCK_SIZE - BUFCHAIN_HEADROOM, bufchain_readv(&c, fds[0]));
+	bufchain_free(&c);
+}
+END_TEST
+
+START_TEST(test_window)
+{
+	struct bufchain c;
+	bufchain_init(&c, 4 * BUFCHAIN_BLOCK_SIZE);
+	ck_assert_uint_eq(1, c.window);
+
+	// cada lectura que llena la ventana la duplica, hasta el high-water mark
+	const unsigned windows[] = { 1, 2, 4, 4 };
+	for (unsigned i = 0; i < 4; i++) {
+		const size_t offered = windows[i] * (BUFCHAIN_BLOCK_SIZE - BUFCHAIN_HEADROOM);
+		ck_assert_int_eq(offered, write(fds[1], data, offered));
+		ck_assert_int_eq(offered, bufchain_readv(&c, fds[0]));
+		bufchain_consume(&c, offered);
+	}
+	ck_assert_uint_eq(4, c.window);
+
+	// y las lecturas chicas la achican
+	ck_assert_int_eq(100, write(fds[1], data, 100));
+	ck_assert_int_eq(100, bufchain_readv(&c, fds[0]));
+	ck_assert_uint_eq(2, c.window);
+	bufchain_free(&c);
+}
+END_TEST
+
+START_TEST(test_writev)
+{
+	struct bufchain c;
+	bufchain_init(&c, BUFCHAIN_HIGH_WATER);
+	c.window = 2;
+	ck_assert_int_eq(30000, write(fds[1], data, 30000));
+	ck_assert_int_eq(30000, bufchain_readv(&c, fds[0]));
+
+	bufchain_consume(&c, 10);
+	ck_assert_int_eq(30000 - 10, bufchain_writev(&c, fds[1]));
+	ck_assert_uint_eq(0, c.length);
+
+	uint8_t out[30000];
+	ck_assert_int_eq(30000 - 10, read(fds[0], out, sizeof(out)));
+	ck_assert(memcmp(data + 10, out, 30000 - 10) == 0);
+	bufchain_free(&c);
+}
+END_TEST
+
+START_TEST(test_pool)
+{
+	struct bufchain c;
+	bufchain_init(&c, BUFCHAIN_HIGH_WATER);
+	ck_assert_int_eq(100, write(fds[1], data, 100));
+	ck_assert_int_eq(100, bufchain_readv(&c, fds[0]));
+	bufchain_free(&c);
+
+	// los bloques que no se usan vuelven al pool y se reutilizan
+	const size_t blocks = bufchain_pool_blocks();
+	for (unsigned i = 0; i < 100; i++) {
+		ck_assert_int_eq(100, write(fds[1], data, 100));
+		ck_assert_int_eq(100, bufchain_readv(&c, fds[0]));
+		bufchain_free(&c);
+	}
+	ck_assert_uint_eq(blocks, bufchain_pool_blocks());
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("bufchain");
+	TCase* tc = tcase_create("bufchain");
+
+	tcase_add_checked_fixture(tc, setup, teardown);
+	tcase_add_test(tc, test_readv);
+	tcase_add_test(tc, test_high_water);
+	tcase_add_test(tc, test_window);
+	tcase_add_test(tc, test_writev);
+	tcase_add_test(tc, test_pool);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,8 +1,9 @@
+#define _GNU_SOURCE
+#include "buffer.h"
+
 #include <check.h>
 #include <stdlib.h>
-
-// asi se puede probar las funciones internas
-#include "../src/buffer.c"
+#include <string.h>
 
 #define N(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -98,6 +99,70 @@ START_TEST(test_buffer_misc)
 }
 END_TEST
 
+START_TEST(test_buffer_mirrored)
+{
+	struct buffer buf;
+	buffer* b = &buf;
+	ck_assert(buffer_init_mirrored(b, 100));
+	const size_t n = b->mirror;
+	ck_assert_uint_ge(n, 100);
+
+	size_t wbytes = 0, rbytes = 0;
+	uint8_t* ptr = buffer_write_ptr(b, &wbytes);
+	ck_assert_uint_eq(n, wbytes);
+	memset(ptr, 'a', n - 10);
+	buffer_write_adv(b, n - 10);
+	buffer_read_adv(b, n - 20);
+
+	// todo el espacio libre es contiguo y da la vuelta, sin compactar
+	ptr = buffer_write_ptr(b, &wbytes);
+	ck_assert_uint_eq(n - 10, wbytes);
+	ck_assert_ptr_eq(b->data + n - 10, ptr);
+	for (size_t i = 0; i < 30; i++) {
+		ptr[i] = 'A' + i % 26;
+	}
+	buffer_write_adv(b, 30);
+
+	// lo escrito después del final aparece al principio
+	ck_assert_uint_eq('K', b->data[0]);
+
+	ptr = buffer_read_ptr(b, &rbytes);
+	ck_assert_uint_eq(40, rbytes);
+	ck_assert_ptr_eq(b->data + n - 20, ptr);
+	ck_assert_uint_eq('a', ptr[9]);
+	ck_assert_uint_eq('A', ptr[10]);
+	ck_assert_uint_eq('D', ptr[39]);
+
+	// al pasar el final los punteros vuelven a la primera copia
+	buffer_read_adv(b, 25);
+	ptr = buffer_read_ptr(b, &rbytes);
+	ck_assert_uint_eq(15, rbytes);
+	ck_assert_ptr_eq(b->data + 5, ptr);
+	ck_assert_uint_eq('P', *ptr);
+	buffer_write_ptr(b, &wbytes);
+	ck_assert_uint_eq(n - 15, wbytes);
+
+	buffer_compact(b);
+	ck_assert_ptr_eq(b->data + 5, buffer_read_ptr(b, &rbytes));
+
+	buffer_read_adv(b, rbytes);
+	ck_assert_int_eq(false, buffer_can_read(b));
+	ck_assert_ptr_eq(b->data, buffer_write_ptr(b, &wbytes));
+	ck_assert_uint_eq(n, wbytes);
+
+	// lleno
+	memset(buffer_write_ptr(b, &wbytes), 'z', n);
+	buffer_write_adv(b, n);
+	ck_assert_int_eq(false, buffer_can_write(b));
+	ck_assert_uint_eq('z', buffer_read(b));
+	buffer_write_ptr(b, &wbytes);
+	ck_assert_uint_eq(1, wbytes);
+
+	buffer_free_mirrored(b);
+	ck_assert_ptr_eq(NULL, b->data);
+}
+END_TEST
+
 Suite*
 suite(void)
 {
@@ -105,6 +170,7 @@ suite(void)
 	TCase* tc = tcase_create("buffer");
 
 	tcase_add_test(tc, test_buffer_misc);
+	tcase_add_test(tc, test_buffer_mirrored);
 	suite_add_tcase(s, tc);
 
 	return s;
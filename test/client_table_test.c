@@ -0,0 +1,186 @@
+#include "client_table.h"
+
+#include <check.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** dirección de un cliente distinto por cada `id' */
+static socklen_t
+client_addr(struct sockaddr_storage* addr, const unsigned id)
+{
+	memset(addr, 0, sizeof(*addr));
+	struct sockaddr_in* in = (struct sockaddr_in*)addr;
+	in->sin_family = AF_INET;
+	in->sin_addr.s_addr = htonl(0x0a000000 | (id >> 16));
+	in->sin_port = htons(id & 0xffff);
+	return sizeof(*in);
+}
+
+static struct client_entry*
+get(struct client_table* t, const unsigned id, const uint64_t now)
+{
+	struct sockaddr_storage addr;
+	const socklen_t len = client_addr(&addr, id);
+	return client_table_get(t, &addr, len, now);
+}
+
+static struct client_entry*
+find(struct client_table* t, const unsigned id, const uint64_t now)
+{
+	struct sockaddr_storage addr;
+	const socklen_t len = client_addr(&addr, id);
+	return client_table_find(t, &addr, len, now);
+}
+
+START_TEST(test_client_table_get)
+{
+	struct client_table* t = client_table_new(4, 0);
+	ck_assert_ptr_ne(NULL, t);
+
+	struct client_entry* e = get(t, 1, 0);
+	ck_assert_ptr_ne(NULL, e);
+	ck_assert_uint_eq(0, e->state);
+	e->state = 7;
+
+	// el mismo cliente conserva su sesión; otro tiene una nueva
+	ck_assert_uint_eq(7, get(t, 1, 1)->state);
+	ck_assert_uint_eq(0, get(t, 2, 1)->state);
+	ck_assert_uint_eq(2, client_table_size(t));
+
+	ck_assert_ptr_eq(NULL, find(t, 3, 1));
+	ck_assert_uint_eq(2, client_table_size(t));
+	ck_assert_uint_eq(0, client_table_evictions(t));
+
+	client_table_destroy(t);
+}
+END_TEST
+
+START_TEST(test_client_table_idle_expiry)
+{
+	struct client_table* t = client_table_new(4, 10);
+
+	get(t, 1, 0)->state = 1;
+	get(t, 2, 5)->state = 2;
+
+	ck_assert_ptr_ne(NULL, find(t, 1, 9));
+	// a los 10 segundos sin actividad la sesión se descarta
+	ck_assert_ptr_eq(NULL, find(t, 1, 10));
+	ck_assert_uint_eq(1, client_table_size(t));
+	ck_assert_uint_eq(1, client_table_evictions(t));
+	ck_assert_uint_eq(2, find(t, 2, 10)->state);
+
+	// usarla la mantiene viva
+	get(t, 2, 12);
+	ck_assert_ptr_ne(NULL, find(t, 2, 21));
+
+	// si vuelve, empieza de cero
+	ck_assert_uint_eq(0, get(t, 1, 22)->state);
+	ck_assert_ptr_eq(NULL, find(t, 2, 22));
+	ck_assert_uint_eq(1, client_table_size(t));
+
+	client_table_destroy(t);
+
+	// sin timeout no expiran
+	t = client_table_new(4, 0);
+	get(t, 1, 0);
+	ck_assert_ptr_ne(NULL, find(t, 1, UINT64_MAX));
+	client_table_destroy(t);
+}
+END_TEST
+
+START_TEST(test_client_table_lru_eviction)
+{
+	struct client_table* t = client_table_new(3, 0);
+
+	get(t, 1, 0)->state = 1;
+	get(t, 2, 1)->state = 2;
+	get(t, 3, 2)->state = 3;
+	// 1 pasa a ser la más reciente: la más vieja es 2
+	get(t, 1, 3);
+
+	get(t, 4, 4)->state = 4;
+	ck_assert_uint_eq(3, client_table_size(t));
+	ck_assert_uint_eq(1, client_table_evictions(t));
+	ck_assert_ptr_eq(NULL, find(t, 2, 4));
+	ck_assert_uint_eq(1, find(t, 1, 4)->state);
+	ck_assert_uint_eq(3, find(t, 3, 4)->state);
+	ck_assert_uint_eq(4, find(t, 4, 4)->state);
+
+	// find no cambia el orden: la siguiente en salir es 3
+	get(t, 5, 5);
+	ck_assert_ptr_eq(NULL, find(t, 3, 5));
+	ck_assert_ptr_ne(NULL, find(t, 1, 5));
+
+	client_table_destroy(t);
+}
+END_TEST
+
+START_TEST(test_client_table_churn)
+{
+	// muchos clientes en una tabla chica: se sacan nodos de cualquier
+	// posición de las cadenas y se reutilizan
+	const unsigned capacity = 8, clients = 100000;
+	struct client_table* t = client_table_new(capacity, 0);
+
+	for (unsigned id = 0; id < clients; id++) {
+		get(t, id, id)->state = id;
+	}
+	ck_assert_uint_eq(capacity, client_table_size(t));
+	ck_assert_uint_eq(clients - capacity, client_table_evictions(t));
+
+	for (unsigned id = 0; id < clients; id++) {
+		const struct client_entry* e = find(t, id, clients);
+		if (id < clients - capacity) {
+			ck_assert_ptr_eq(NULL, e);
+		} else {
+			ck_assert_ptr_ne(NULL, e);
+			ck_assert_uint_eq(id, e->state);
+		}
+	}
+
+	client_table_destroy(t);
+}
+END_TEST
+
+START_TEST(test_client_table_invalid)
+{
+	ck_assert_ptr_eq(NULL, client_table_new(0, 0));
+
+	struct client_table* t = client_table_new(1, 0);
+	struct sockaddr_storage addr;
+	client_addr(&addr, 1);
+	ck_assert_ptr_eq(NULL, client_table_get(t, &addr, sizeof(addr) + 1, 0));
+	ck_assert_uint_eq(0, client_table_size(t));
+	client_table_destroy(t);
+
+	client_table_destroy(NULL);
+}
+END_TEST
+
+Suite*
+client_table_suite(void)
+{
+	Suite* s = suite_create("client_table");
+	TCase* tc = tcase_create("client_table");
+
+	tcase_add_test(tc, test_client_table_get);
+	tcase_add_test(tc, test_client_table_idle_expiry);
+	tcase_add_test(tc, test_client_table_lru_eviction);
+	tcase_add_test(tc, test_client_table_churn);
+	tcase_add_test(tc, test_client_table_invalid);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(client_table_suite());
+
+	srunner_run_all(sr, CK_NORMAL);
+	const int number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
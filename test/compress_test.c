@@ -0,0 +1,147 @@
+#include "compress.h"
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+static struct
+{
+	uint8_t data[64 * 1024];
+	size_t len;
+} out;
+
+static bool
+out_sink(void* arg, const uint8_t* data, size_t len)
+{
+	if (out.len + len > sizeof(out.data)) {
+		return false;
+	}
+	memcpy(out.data + out.len, data, len);
+	out.len += len;
+	return true;
+}
+
+/** comprime `data' como un mail, de a pedazos de `chunk' bytes */
+static void
+compress_mail(struct compressor* c, const char* data, const size_t chunk)
+{
+	out.len = 0;
+	ck_assert(compressor_begin(c, out_sink, NULL));
+	for (size_t i = 0, len = strlen(data); i < len; i += chunk) {
+		const size_t n = len - i < chunk ? len - i : chunk;
+		ck_assert(compressor_write(c, (const uint8_t*)data + i, n, out_sink, NULL));
+	}
+	ck_assert(compressor_finish(c, out_sink, NULL));
+}
+
+/** descomprime `out' después del header, como lo haría `zcat' */
+static const char*
+gunzip(void)
+{
+	static char buff[64 * 1024];
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	ck_assert_int_eq(Z_OK, inflateInit2(&zs, 15 + 16));
+	zs.next_in = out.data + COMPRESS_HEADER_LENGTH;
+	zs.avail_in = out.len - COMPRESS_HEADER_LENGTH;
+	zs.next_out = (Bytef*)buff;
+	zs.avail_out = sizeof(buff) - 1;
+	ck_assert_int_eq(Z_STREAM_END, inflate(&zs, Z_FINISH));
+	buff[zs.total_out] = 0;
+	inflateEnd(&zs);
+	return buff;
+}
+
+START_TEST(test_compress_parse)
+{
+	enum compress_format format;
+	int level;
+
+	ck_assert(compress_parse("zlib", &format, &level));
+	ck_assert_int_eq(COMPRESS_ZLIB, format);
+	ck_assert_int_eq(6, level);
+	ck_assert(compress_parse("zlib:9", &format, &level));
+	ck_assert_int_eq(9, level);
+	ck_assert(compress_parse("zstd:19", &format, &level));
+	ck_assert_int_eq(COMPRESS_ZSTD, format);
+	ck_assert_int_eq(19, level);
+	ck_assert(compress_parse("none", &format, &level));
+	ck_assert_int_eq(COMPRESS_NONE, format);
+
+	ck_assert(!compress_parse("zlib:10", &format, &level));
+	ck_assert(!compress_parse("zlib:", &format, &level));
+	ck_assert(!compress_parse("zlib:3x", &format, &level));
+	ck_assert(!compress_parse("zlibx", &format, &level));
+	ck_assert(!compress_parse("lz4", &format, &level));
+}
+END_TEST
+
+START_TEST(test_compress_zlib_roundtrip)
+{
+	struct compressor* c = compressor_new(COMPRESS_ZLIB, 6);
+	ck_assert_ptr_ne(NULL, c);
+
+	static char mail[32 * 1024];
+	for (size_t i = 0; i + 1 < sizeof(mail); i++) {
+		mail[i] = "Subject: hola\r\n"[i % 15];
+	}
+
+	compress_mail(c, mail, 1000);
+	ck_assert_uint_lt(out.len, strlen(mail) / 10);
+
+	enum compress_format format;
+	int level;
+	ck_assert(compress_header_parse(out.data, out.len, &format, &level));
+	ck_assert_int_eq(COMPRESS_ZLIB, format);
+	ck_assert_int_eq(6, level);
+	ck_assert_str_eq(mail, gunzip());
+
+	// el mismo compresor sirve para el mail siguiente, y no arrastra estado
+	compress_mail(c, "From a@smtpd.com\nchau\r\n", 3);
+	ck_assert_str_eq("From a@smtpd.com\nchau\r\n", gunzip());
+	compressor_free(c);
+}
+END_TEST
+
+START_TEST(test_compress_header)
+{
+	enum compress_format format;
+	int level;
+	const uint8_t plain[] = "From a@smtpd.com  Mon Jan  1 00:00:00 2024\n";
+	ck_assert(!compress_header_parse(plain, sizeof(plain), &format, &level));
+	ck_assert(!compress_header_parse((const uint8_t*)"\x89SMZ", 4, &format, &level));
+
+	// el compresor de un formato que no está en el binario no se crea
+	ck_assert_ptr_eq(NULL, compressor_new(COMPRESS_NONE, 0));
+	if (!compress_available(COMPRESS_ZSTD)) {
+		ck_assert_ptr_eq(NULL, compressor_new(COMPRESS_ZSTD, 3));
+	}
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("compress");
+	TCase* tc = tcase_create("compress");
+
+	tcase_add_test(tc, test_compress_parse);
+	tcase_add_test(tc, test_compress_zlib_roundtrip);
+	tcase_add_test(tc, test_compress_header);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
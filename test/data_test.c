@@ -0,0 +1,108 @@
+#include "data.h"
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N(x) (sizeof(x) / sizeof((x)[0]))
+
+/** el contenido con `data_consume', de a un byte por vez */
+static size_t
+consume(const char* in, uint8_t* out)
+{
+	struct data_parser p;
+	data_parser_init(&p);
+	size_t n = 0;
+	for (const char* c = in; *c != 0 && !data_is_done(p.state); c++) {
+		buffer_reset(&p.data_buffer);
+		buffer b;
+		buffer_init(&b, 1, (uint8_t*)c);
+		buffer_write_adv(&b, 1);
+		data_consume(&b, &p);
+		const size_t len = p.data_buffer.write - p.data_buffer.data;
+		memcpy(out + n, p.data_buffer.data, len);
+		n += len;
+	}
+	return n;
+}
+
+/** el contenido con `data_consume_inplace', en bloques de `block' bytes */
+static size_t
+consume_inplace(const char* in, const size_t block, uint8_t* out, size_t* consumed)
+{
+	struct data_parser p;
+	data_parser_init(&p);
+	uint8_t raw[DATA_HEADROOM + 64];
+	size_t n = 0;
+	*consumed = 0;
+	for (size_t i = 0; i < strlen(in) && !data_is_done(p.state); i += block) {
+		size_t len = strlen(in) - i < block ? strlen(in) - i : block;
+		memcpy(raw + DATA_HEADROOM, in + i, len);
+		uint8_t* o;
+		size_t o_len;
+		data_consume_inplace(&p, raw + DATA_HEADROOM, &len, &o, &o_len);
+		ck_assert(o >= raw);
+		memcpy(out + n, o, o_len);
+		n += o_len;
+		*consumed += len;
+	}
+	return n;
+}
+
+static const char* mails[] = {
+	"hola\r\n.\r\n",
+	"Subject: x\r\n\r\nuna\r\nlinea\r\n..con punto\r\n.\r\nRSET\r\n",
+	"\r\r\n.\n\r\n.x\r\n.\rx\r\n.\r\r\n.\r\n",
+	".empieza con punto\r\n.\r\n",
+	"sin final\r\n.",
+};
+
+START_TEST(test_inplace)
+{
+	for (unsigned m = 0; m < N(mails); m++) {
+		uint8_t expected[256], out[256];
+		const size_t n = consume(mails[m], expected);
+		for (size_t block = 1; block <= 64; block++) {
+			size_t consumed;
+			ck_assert_uint_eq(n, consume_inplace(mails[m], block, out, &consumed));
+			ck_assert(memcmp(expected, out, n) == 0);
+		}
+	}
+}
+END_TEST
+
+START_TEST(test_inplace_leftover)
+{
+	uint8_t out[256];
+	size_t consumed;
+	const char* mail = mails[1];
+	consume_inplace(mail, 64, out, &consumed);
+	// lo que sigue al final no se consume
+	ck_assert_str_eq("RSET\r\n", mail + consumed);
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("data");
+	TCase* tc = tcase_create("data");
+
+	tcase_add_test(tc, test_inplace);
+	tcase_add_test(tc, test_inplace_leftover);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,129 @@
+#include "directory.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char path[] = "/tmp/directory_test.XXXXXX";
+
+/** escribe `content' en un archivo temporal y retorna su nombre */
+static const char*
+write_file(const char* content)
+{
+	strcpy(path, "/tmp/directory_test.XXXXXX");
+	const int fd = mkstemp(path);
+	ck_assert_int_ne(-1, fd);
+	ck_assert_int_eq(strlen(content), write(fd, content, strlen(content)));
+	close(fd);
+	return path;
+}
+
+static void
+teardown(void)
+{
+	unlink(path);
+}
+
+START_TEST(test_find)
+{
+	struct directory* d = directory_load(write_file("juan@smtpd.com\nana@otro.com\r\n"));
+	ck_assert_ptr_ne(NULL, d);
+	ck_assert_uint_eq(2, directory_size(d));
+
+	ck_assert_int_eq(DIRECTORY_LOCAL, directory_find(d, "juan@smtpd.com"));
+	ck_assert_int_eq(DIRECTORY_LOCAL, directory_find(d, "ana@otro.com"));
+	ck_assert_int_eq(DIRECTORY_UNKNOWN, directory_find(d, "pedro@smtpd.com"));
+	ck_assert_int_eq(DIRECTORY_UNKNOWN, directory_find(d, "juan@otro.com"));
+	ck_assert_int_eq(DIRECTORY_FOREIGN, directory_find(d, "juan@remoto.com"));
+	ck_assert_int_eq(DIRECTORY_FOREIGN, directory_find(d, "juan"));
+	directory_free(d);
+}
+END_TEST
+
+START_TEST(test_case)
+{
+	struct directory* d = directory_load(write_file("Juan@SMTPD.com\n"));
+	ck_assert_ptr_ne(NULL, d);
+	ck_assert_int_eq(DIRECTORY_LOCAL, directory_find(d, "juan@smtpd.com"));
+	ck_assert_int_eq(DIRECTORY_LOCAL, directory_find(d, "JUAN@smtpd.COM"));
+	ck_assert_int_eq(DIRECTORY_UNKNOWN, directory_find(d, "ana@Smtpd.Com"));
+	directory_free(d);
+}
+END_TEST
+
+START_TEST(test_invalid_lines)
+{
+	struct directory* d = directory_load(write_file("# casillas\n\n   \nsin-arroba\n@smtpd.com\njuan@\n"
+	                                                "  juan@smtpd.com  \njuan@smtpd.com\na b@smtpd.com\nana@smtpd.com"));
+	ck_assert_ptr_ne(NULL, d);
+	// los repetidos cuentan una vez y la última línea no necesita '\n'
+	ck_assert_uint_eq(2, directory_size(d));
+	ck_assert_int_eq(DIRECTORY_LOCAL, directory_find(d, "juan@smtpd.com"));
+	ck_assert_int_eq(DIRECTORY_LOCAL, directory_find(d, "ana@smtpd.com"));
+	ck_assert_int_eq(DIRECTORY_UNKNOWN, directory_find(d, "sin-arroba@smtpd.com"));
+	directory_free(d);
+}
+END_TEST
+
+START_TEST(test_many)
+{
+	const unsigned n = 100000;
+	char* content = malloc(n * 32);
+	ck_assert_ptr_ne(NULL, content);
+	size_t len = 0;
+	for (unsigned i = 0; i < n; i++) {
+		len += sprintf(content + len, "user%u@dominio%u.com\n", i, i % 100);
+	}
+	struct directory* d = directory_load(write_file(content));
+	free(content);
+	ck_assert_ptr_ne(NULL, d);
+	ck_assert_uint_eq(n, directory_size(d));
+
+	char email[64];
+	for (unsigned i = 0; i < n; i += 7) {
+		snprintf(email, sizeof(email), "user%u@dominio%u.com", i, i % 100);
+		ck_assert_int_eq(DIRECTORY_LOCAL, directory_find(d, email));
+		snprintf(email, sizeof(email), "user%u@dominio%u.com", i, (i + 1) % 100);
+		ck_assert_int_eq(DIRECTORY_UNKNOWN, directory_find(d, email));
+	}
+	ck_assert_int_eq(DIRECTORY_FOREIGN, directory_find(d, "user1@dominio100.com"));
+	directory_free(d);
+}
+END_TEST
+
+START_TEST(test_missing)
+{
+	ck_assert_ptr_eq(NULL, directory_load("/tmp/directory_test.no-existe"));
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("directory");
+	TCase* tc = tcase_create("directory");
+
+	tcase_add_checked_fixture(tc, NULL, teardown);
+	tcase_add_test(tc, test_find);
+	tcase_add_test(tc, test_case);
+	tcase_add_test(tc, test_invalid_lines);
+	tcase_add_test(tc, test_many);
+	tcase_add_test(tc, test_missing);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,91 @@
+#include "histogram.h"
+
+#include <check.h>
+#include <stdlib.h>
+
+START_TEST(test_histogram_buckets)
+{
+	// los valores chicos se guardan de forma exacta
+	for (uint64_t v = 0; v < HISTOGRAM_SUB_COUNT; v++) {
+		ck_assert_uint_eq(v, histogram_bucket(v));
+		ck_assert_uint_eq(v, histogram_bucket_upper(histogram_bucket(v)));
+	}
+
+	// cada valor cae en un bucket cuyo límite superior lo contiene
+	const uint64_t values[] = { 8, 9, 15, 16, 17, 1000, 123456789, UINT64_MAX / 3, UINT64_MAX };
+	for (unsigned i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+		const unsigned b = histogram_bucket(values[i]);
+		ck_assert_uint_lt(b, HISTOGRAM_BUCKETS);
+		ck_assert_uint_ge(histogram_bucket_upper(b), values[i]);
+		if (b > 0) {
+			ck_assert_uint_lt(histogram_bucket_upper(b - 1), values[i]);
+		}
+	}
+	ck_assert_uint_eq(HISTOGRAM_BUCKETS - 1, histogram_bucket(UINT64_MAX));
+}
+END_TEST
+
+START_TEST(test_histogram_quantile)
+{
+	struct histogram h;
+	histogram_reset(&h);
+	ck_assert_uint_eq(0, histogram_quantile(&h, 0.5));
+
+	for (uint64_t v = 1; v <= 1000; v++) {
+		histogram_record(&h, v);
+	}
+	ck_assert_uint_eq(1000, h.count);
+	ck_assert_uint_eq(1, h.min);
+	ck_assert_uint_eq(1000, h.max);
+
+	// error relativo acotado por la cantidad de sub-buckets
+	const uint64_t p50 = histogram_quantile(&h, 0.5);
+	ck_assert_uint_ge(p50, 500);
+	ck_assert_uint_le(p50, 500 + 500 / HISTOGRAM_SUB_COUNT);
+	ck_assert_uint_eq(1000, histogram_quantile(&h, 1.0));
+	ck_assert_uint_eq(1, histogram_quantile(&h, 0.0));
+}
+END_TEST
+
+START_TEST(test_histogram_merge)
+{
+	struct histogram a, b;
+	histogram_reset(&a);
+	histogram_reset(&b);
+
+	histogram_record(&a, 10);
+	histogram_record(&b, 20000);
+	histogram_merge(&a, &b);
+
+	ck_assert_uint_eq(2, a.count);
+	ck_assert_uint_eq(10, a.min);
+	ck_assert_uint_eq(20000, a.max);
+	ck_assert_uint_eq(20010, a.sum);
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("histogram");
+	TCase* tc = tcase_create("histogram");
+
+	tcase_add_test(tc, test_histogram_buckets);
+	tcase_add_test(tc, test_histogram_quantile);
+	tcase_add_test(tc, test_histogram_merge);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
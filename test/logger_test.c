@@ -0,0 +1,94 @@
+#include "logger.h"
+
+#include <check.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static struct sockaddr_storage
+client(void)
+{
+	struct sockaddr_storage ss;
+	memset(&ss, 0, sizeof(ss));
+	struct sockaddr_in* addr = (struct sockaddr_in*)&ss;
+	addr->sin_family = AF_INET;
+	addr->sin_addr.s_addr = htonl(0x7F000001);
+	addr->sin_port = htons(40000);
+	return ss;
+}
+
+/** registra los eventos con `level' y retorna lo escrito por el logger */
+static char*
+run(const enum log_level level)
+{
+	static char buff[4096];
+	int fds[2];
+	ck_assert_int_eq(0, pipe(fds));
+
+	const struct sockaddr_storage addr = client();
+	ck_assert(logger_init(level, fds[1]));
+	log_event(LOG_INFO, LOG_EVENT_ACCEPT, &addr, 7, 1, 42);
+	log_event(LOG_WARN, LOG_EVENT_REJECT, &addr, 8, 500, 500);
+	log_event(LOG_INFO, LOG_EVENT_CLOSE, NULL, 7, 0, 12);
+	logger_close();
+	close(fds[1]);
+
+	ssize_t n, used = 0;
+	while ((n = read(fds[0], buff + used, sizeof(buff) - 1 - used)) > 0) {
+		used += n;
+	}
+	buff[used] = 0;
+	close(fds[0]);
+	return buff;
+}
+
+START_TEST(test_logger_format)
+{
+	const char* out = run(LOG_INFO);
+	ck_assert_ptr_ne(NULL, strstr(out, " INFO accept client=127.0.0.1:40000 fd=7 current=1 historic=42\n"));
+	ck_assert_ptr_ne(NULL, strstr(out, " WARN reject client=127.0.0.1:40000 fd=8 current=500 max=500\n"));
+	ck_assert_ptr_ne(NULL, strstr(out, " INFO close client=- fd=7 current=0 duration_ms=12\n"));
+	ck_assert_uint_eq(0, logger_dropped());
+}
+END_TEST
+
+START_TEST(test_logger_level)
+{
+	const char* out = run(LOG_WARN);
+	ck_assert_ptr_eq(NULL, strstr(out, "accept"));
+	ck_assert_ptr_ne(NULL, strstr(out, "reject"));
+
+	enum log_level level;
+	ck_assert(logger_level_parse("debug", &level));
+	ck_assert_int_eq(LOG_DEBUG, level);
+	ck_assert(logger_level_parse("OFF", &level));
+	ck_assert_int_eq(LOG_OFF, level);
+	ck_assert(!logger_level_parse("verbose", &level));
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("logger");
+	TCase* tc = tcase_create("logger");
+
+	tcase_add_test(tc, test_logger_format);
+	tcase_add_test(tc, test_logger_level);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
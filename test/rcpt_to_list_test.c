@@ -0,0 +1,101 @@
+#include "rcpt_to_list.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+START_TEST(test_add)
+{
+	struct rcpt_set set = { 0 };
+	ck_assert_int_eq(RCPT_ADDED, rcpt_set_add(&set, "a@smtpd.com"));
+	ck_assert_int_eq(RCPT_ADDED, rcpt_set_add(&set, "b@smtpd.com"));
+	ck_assert_int_eq(RCPT_DUPLICATE, rcpt_set_add(&set, "a@smtpd.com"));
+	ck_assert_uint_eq(2, set.count);
+
+	// en el orden en que se agregaron
+	ck_assert_str_eq("a@smtpd.com", set.nodes[0].email);
+	ck_assert_str_eq("b@smtpd.com", set.nodes[1].email);
+	ck_assert_int_eq(-1, set.nodes[0].file_fd);
+	ck_assert_int_eq(-1, set.nodes[0].sync_fd);
+	rcpt_set_free(&set);
+	ck_assert_uint_eq(0, set.count);
+}
+END_TEST
+
+START_TEST(test_many)
+{
+	struct rcpt_set set = { 0 };
+	char email[MAX_EMAIL_LENGTH];
+	for (unsigned i = 0; i < 1000; i++) {
+		snprintf(email, sizeof(email), "user%u@smtpd.com", i);
+		ck_assert_int_eq(RCPT_ADDED, rcpt_set_add(&set, email));
+	}
+	for (unsigned i = 0; i < 1000; i++) {
+		snprintf(email, sizeof(email), "user%u@smtpd.com", i);
+		ck_assert_int_eq(RCPT_DUPLICATE, rcpt_set_add(&set, email));
+		ck_assert_str_eq(email, set.nodes[i].email);
+	}
+	ck_assert_uint_eq(1000, set.count);
+	rcpt_set_free(&set);
+}
+END_TEST
+
+START_TEST(test_clear)
+{
+	struct rcpt_set set = { 0 };
+	char email[MAX_EMAIL_LENGTH];
+	for (unsigned i = 0; i < 200; i++) {
+		snprintf(email, sizeof(email), "user%u@smtpd.com", i);
+		rcpt_set_add(&set, email);
+	}
+	const struct rcpt_node* nodes = set.nodes;
+	rcpt_set_clear(&set);
+	ck_assert_uint_eq(0, set.count);
+
+	// la próxima transacción reutiliza la memoria
+	ck_assert_int_eq(RCPT_ADDED, rcpt_set_add(&set, "user0@smtpd.com"));
+	ck_assert_ptr_eq(nodes, set.nodes);
+	ck_assert_uint_eq(1, set.count);
+	rcpt_set_free(&set);
+}
+END_TEST
+
+START_TEST(test_too_long)
+{
+	struct rcpt_set set = { 0 };
+	char email[MAX_EMAIL_LENGTH + 1];
+	memset(email, 'a', MAX_EMAIL_LENGTH);
+	email[MAX_EMAIL_LENGTH] = 0;
+	ck_assert_int_eq(RCPT_TOO_LONG, rcpt_set_add(&set, email));
+	ck_assert_uint_eq(0, set.count);
+	rcpt_set_free(&set);
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("rcpt_to_list");
+	TCase* tc = tcase_create("rcpt_set");
+
+	tcase_add_test(tc, test_add);
+	tcase_add_test(tc, test_many);
+	tcase_add_test(tc, test_clear);
+	tcase_add_test(tc, test_too_long);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include "relay.h"
+
+#include "rcpt_to_list.h"
+
+#include <check.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static char dir[] = "/tmp/relay_queue_test.XXXXXX";
+
+static void
+setup(void)
+{
+	ck_assert_ptr_ne(NULL, mkdtemp(dir));
+	ck_assert_int_eq(0, chdir(dir));
+}
+
+static void
+teardown(void)
+{
+	if (chdir("/") == 0) {
+		char cmd[64];
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		system(cmd);
+	}
+	strcpy(dir, "/tmp/relay_queue_test.XXXXXX");
+}
+
+/** encola un mail con `body' para los destinatarios separados por coma */
+static void
+enqueue(char* rcpts, const char* body, char* name)
+{
+	struct commit_job job;
+	memset(&job, 0, sizeof(job));
+	struct rcpt_set set = { 0 };
+	for (char* email = strtok(rcpts, ","); email != NULL; email = strtok(NULL, ",")) {
+		rcpt_set_add(&set, email);
+	}
+	job.relay_rcpts = &set;
+
+	job.ok = true;
+	relay_queue_open(&job, "from@smtpd.com");
+	relay_queue_write(&job, (const uint8_t*)body, strlen(body));
+	relay_queue_commit(&job);
+	ck_assert(job.ok);
+	ck_assert_ptr_ne(NULL, relay_queue_name(&job));
+	strcpy(name, relay_queue_name(&job));
+
+	relay_queue_discard(&job);
+	rcpt_set_free(&set);
+}
+
+START_TEST(test_queue_load)
+{
+	char name[MAILDIR_NAME_LENGTH];
+	char rcpts[] = "a@uno.com,b@dos.com";
+	const char* body = "Subject: hola\r\n\r\nmundo";
+	enqueue(rcpts, body, name);
+
+	struct relay_envelope env;
+	ck_assert(relay_queue_load(name, &env));
+	ck_assert_str_eq("from@smtpd.com", env.mailfrom);
+	ck_assert_uint_eq(2, env.nrcpts);
+	ck_assert_int_eq(RELAY_RCPT_PENDING, env.rcpts[0].status);
+	ck_assert_int_eq(RELAY_RCPT_PENDING, env.rcpts[1].status);
+	ck_assert_int_eq(strlen(body), env.size - env.body);
+
+	char buff[64] = { 0 };
+	ck_assert_int_eq(strlen(body), pread(env.fd, buff, sizeof(buff), env.body));
+	ck_assert_str_eq(body, buff);
+	relay_queue_release(&env);
+}
+END_TEST
+
+START_TEST(test_queue_mark)
+{
+	char name[MAILDIR_NAME_LENGTH];
+	char rcpts[] = "a@uno.com,b@dos.com,c@tres.com";
+	enqueue(rcpts, "cuerpo", name);
+
+	struct relay_envelope env;
+	ck_assert(relay_queue_load(name, &env));
+	ck_assert_uint_eq(3, env.nrcpts);
+	char resolved[MAX_EMAIL_LENGTH];
+	strcpy(resolved, env.rcpts[1].email);
+	env.rcpts[1].status = RELAY_RCPT_DONE;
+	env.rcpts[2].status = RELAY_RCPT_ACCEPTED;
+	relay_queue_mark(&env);
+	relay_queue_release(&env);
+
+	// sólo el entregado queda resuelto: el aceptado se vuelve a intentar
+	ck_assert(relay_queue_load(name, &env));
+	ck_assert_uint_eq(3, env.nrcpts);
+	for (unsigned i = 0; i < env.nrcpts; i++) {
+		const bool done = strcmp(resolved, env.rcpts[i].email) == 0;
+		ck_assert_int_eq(done ? RELAY_RCPT_DONE : RELAY_RCPT_PENDING, env.rcpts[i].status);
+	}
+	relay_queue_release(&env);
+}
+END_TEST
+
+/** escribe `parts' (terminado en NULL) y retorna si el mail se rechaza por un CR o LF suelto */
+static bool
+bare_newline(const char** parts)
+{
+	struct commit_job job;
+	memset(&job, 0, sizeof(job));
+	struct rcpt_set set = { 0 };
+	rcpt_set_add(&set, "a@uno.com");
+	job.relay_rcpts = &set;
+
+	job.ok = true;
+	relay_queue_open(&job, "from@smtpd.com");
+	for (; *parts != NULL; parts++) {
+		relay_queue_write(&job, (const uint8_t*)*parts, strlen(*parts));
+	}
+	const bool bare = relay_queue_bare_newline(&job);
+	relay_queue_commit(&job);
+	// un mail rechazado no llega a la cola
+	ck_assert(bare ? !job.ok : job.ok);
+
+	relay_queue_discard(&job);
+	rcpt_set_free(&set);
+	return bare;
+}
+
+START_TEST(test_queue_bare_newline)
+{
+	ck_assert(!bare_newline((const char*[]){ "Subject: hola\r\n\r\nmundo\r\n..punto", NULL }));
+	// un CRLF partido entre dos escrituras
+	ck_assert(!bare_newline((const char*[]){ "linea\r", "\nlinea", NULL }));
+
+	// el servidor siguiente podría tomarlos como el final del DATA
+	ck_assert(bare_newline((const char*[]){ "hola\n.\nMAIL FROM:<x@y.com>\r\n", NULL }));
+	ck_assert(bare_newline((const char*[]){ "hola\r\n.\nRCPT TO:<x@y.com>", NULL }));
+	ck_assert(bare_newline((const char*[]){ "hola\r", "\n.\n", NULL }));
+	ck_assert(bare_newline((const char*[]){ "\n.\r\n", NULL }));
+	ck_assert(bare_newline((const char*[]){ "hola\r.\r\n", NULL }));
+	ck_assert(bare_newline((const char*[]){ "hola", "\r", NULL }));
+}
+END_TEST
+
+START_TEST(test_queue_missing)
+{
+	struct relay_envelope env;
+	ck_assert(!relay_queue_load("no-existe", &env));
+	ck_assert_int_eq(-1, env.fd);
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("relay_queue");
+	TCase* tc = tcase_create("queue");
+
+	tcase_add_checked_fixture(tc, setup, teardown);
+	tcase_add_test(tc, test_queue_load);
+	tcase_add_test(tc, test_queue_mark);
+	tcase_add_test(tc, test_queue_bare_newline);
+	tcase_add_test(tc, test_queue_missing);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -44,6 +44,65 @@ START_TEST(test_mail_from)
 }
 END_TEST
 
+START_TEST(test_mail_from_size)
+{
+	struct request request;
+	struct request_parser parser = {
+		.request = &request,
+	};
+	request_parser_init(&parser);
+	uint8_t data[] = "MAIL FROM:<a@b.com> BODY=8BITMIME size=10240\r\n";
+	buffer b;
+	buffer_init(&b, N(data) - 1, data);
+	buffer_write_adv(&b, N(data) - 1);
+	bool errored = false;
+	enum request_state st = request_consume(&b, &parser, &errored);
+
+	ck_assert_uint_eq(false, errored);
+	ck_assert_uint_eq(request_done, st);
+	ck_assert_uint_eq(request_command_mail, parser.command);
+	ck_assert_str_eq("a@b.com", request.arg);
+	ck_assert_uint_eq(10240, request.size);
+}
+END_TEST
+
+START_TEST(test_mail_from_size_overflow)
+{
+	struct request request;
+	struct request_parser parser = {
+		.request = &request,
+	};
+	request_parser_init(&parser);
+	uint8_t data[] = "MAIL FROM:<a@b.com> SIZE=99999999999999999999999\r\n";
+	buffer b;
+	buffer_init(&b, N(data) - 1, data);
+	buffer_write_adv(&b, N(data) - 1);
+	enum request_state st = request_consume(&b, &parser, NULL);
+
+	ck_assert_uint_eq(request_done, st);
+	ck_assert_uint_eq(request_command_mail, parser.command);
+	ck_assert(request.size == UINT64_MAX);
+}
+END_TEST
+
+START_TEST(test_mail_from_size_invalid)
+{
+	struct request request;
+	struct request_parser parser = {
+		.request = &request,
+	};
+	request_parser_init(&parser);
+	uint8_t data[] = "MAIL FROM:<a@b.com> SIZE=12k\r\n";
+	buffer b;
+	buffer_init(&b, N(data) - 1, data);
+	buffer_write_adv(&b, N(data) - 1);
+	enum request_state st = request_consume(&b, &parser, NULL);
+
+	ck_assert_uint_eq(request_done, st);
+	ck_assert_uint_eq(request_command_unknown, parser.command);
+}
+END_TEST
+
 START_TEST(test_verb_mult)
 {
 	struct request request;
@@ -80,6 +139,25 @@ START_TEST(test_rcpt_to)
 }
 END_TEST
 
+START_TEST(test_rset)
+{
+	struct request request;
+	struct request_parser parser = {
+		.request = &request,
+	};
+	request_parser_init(&parser);
+	uint8_t data[] = { 'R', 'S', 'E', 'T', '\r', '\n' };
+	buffer b;
+	FIXBUF(b, data);
+	bool errored = false;
+	enum request_state st = request_consume(&b, &parser, &errored);
+
+	ck_assert_uint_eq(false, errored);
+	ck_assert_uint_eq(request_done, st);
+	ck_assert_uint_eq(request_command_rset, parser.command);
+}
+END_TEST
+
 START_TEST(test_invalid)
 {
 	struct request request;
@@ -98,6 +176,25 @@ START_TEST(test_invalid)
 }
 END_TEST
 
+START_TEST(test_starttls)
+{
+	struct request request;
+	struct request_parser parser = {
+		.request = &request,
+	};
+	request_parser_init(&parser);
+	uint8_t data[] = { 'S', 't', 'A', 'r', 'T', 't', 'L', 's', '\r', '\n' };
+	buffer b;
+	FIXBUF(b, data);
+	bool errored = false;
+	enum request_state st = request_consume(&b, &parser, &errored);
+
+	ck_assert_uint_eq(false, errored);
+	ck_assert_uint_eq(request_done, st);
+	ck_assert_uint_eq(request_command_starttls, parser.command);
+}
+END_TEST
+
 Suite*
 request_suite(void)
 {
@@ -111,8 +208,13 @@ request_suite(void)
 
 	tcase_add_test(tc, test_data);
 	tcase_add_test(tc, test_mail_from);
+	tcase_add_test(tc, test_mail_from_size);
+	tcase_add_test(tc, test_mail_from_size_overflow);
+	tcase_add_test(tc, test_mail_from_size_invalid);
 	tcase_add_test(tc, test_verb_mult);
 	tcase_add_test(tc, test_rcpt_to);
+	tcase_add_test(tc, test_rset);
+	tcase_add_test(tc, test_starttls);
 	tcase_add_test(tc, test_invalid);
 
 	suite_add_tcase(s, tc);
@@ -0,0 +1,81 @@
+#include "sha256.h"
+
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char*
+hex(const uint8_t digest[SHA256_DIGEST_LENGTH])
+{
+	static char buff[SHA256_DIGEST_LENGTH * 2 + 1];
+	for (unsigned i = 0; i < SHA256_DIGEST_LENGTH; i++) {
+		sprintf(buff + i * 2, "%02x", digest[i]);
+	}
+	return buff;
+}
+
+static const char*
+digest(const char* data)
+{
+	struct sha256 ctx;
+	uint8_t out[SHA256_DIGEST_LENGTH];
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, strlen(data));
+	sha256_final(&ctx, out);
+	return hex(out);
+}
+
+START_TEST(test_sha256_vectors)
+{
+	// FIPS 180-4, ejemplos de SHA-256
+	ck_assert_str_eq("e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855", digest(""));
+	ck_assert_str_eq("ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad", digest("abc"));
+	ck_assert_str_eq("248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+	                 digest("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq"));
+}
+END_TEST
+
+START_TEST(test_sha256_incremental)
+{
+	// un millón de 'a', en pedazos que no coinciden con los bloques
+	static char a[1000000];
+	memset(a, 'a', sizeof(a));
+
+	struct sha256 ctx;
+	uint8_t out[SHA256_DIGEST_LENGTH];
+	sha256_init(&ctx);
+	for (size_t i = 0; i < sizeof(a);) {
+		const size_t n = sizeof(a) - i < 997 ? sizeof(a) - i : 997;
+		sha256_update(&ctx, a + i, n);
+		i += n;
+	}
+	sha256_final(&ctx, out);
+	ck_assert_str_eq("cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", hex(out));
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("sha256");
+	TCase* tc = tcase_create("sha256");
+
+	tcase_add_test(tc, test_sha256_vectors);
+	tcase_add_test(tc, test_sha256_incremental);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+#include "store.h"
+
+#include <check.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static char dir[] = "/tmp/store_test.XXXXXX";
+
+/** bytes escritos por el último `deliver' */
+static uint64_t last_stored;
+
+static void
+setup(void)
+{
+	ck_assert_ptr_ne(NULL, mkdtemp(dir));
+	ck_assert_int_eq(0, chdir(dir));
+}
+
+static void
+teardown(void)
+{
+	if (chdir("/") == 0) {
+		char cmd[64];
+		snprintf(cmd, sizeof(cmd), "rm -rf %s", dir);
+		system(cmd);
+	}
+	strcpy(dir, "/tmp/store_test.XXXXXX");
+}
+
+/** entrega un mail con `body' a los destinatarios separados por coma */
+static bool
+deliver(char* rcpts, const char* body)
+{
+	struct commit_job job;
+	memset(&job, 0, sizeof(job));
+	struct rcpt_set set = { 0 };
+	for (char* email = strtok(rcpts, ","); email != NULL; email = strtok(NULL, ",")) {
+		rcpt_set_add(&set, email);
+	}
+	job.rcpts = &set;
+
+	store_open(&job, "from@smtpd.com", NULL);
+	store_write(&job, (const uint8_t*)body, strlen(body));
+	store_close(&job);
+	store_commit(&job);
+
+	const bool ok = job.ok;
+	last_stored = job.stored;
+	store_discard(&job);
+	store_job_free(&job);
+	rcpt_set_free(&set);
+	return ok;
+}
+
+static size_t
+read_index(struct segment_index_entry* entries, const size_t max)
+{
+	const int fd = open(SEGMENT_STORE_DIR "/index", O_RDONLY);
+	ck_assert_int_ne(-1, fd);
+	const ssize_t n = read(fd, entries, max * sizeof(*entries));
+	close(fd);
+	return n / sizeof(*entries);
+}
+
+/** el mensaje de `e', sin la línea "From " que agrega el servidor */
+static const char*
+read_message(const struct segment_index_entry* e)
+{
+	static char buff[1024];
+	char path[64];
+	snprintf(path, sizeof(path), SEGMENT_STORE_DIR "/segment.%06u", e->segment);
+
+	const int fd = open(path, O_RDONLY);
+	ck_assert_int_ne(-1, fd);
+	ck_assert_int_eq(e->length, pread(fd, buff, e->length, e->offset));
+	close(fd);
+	buff[e->length] = 0;
+
+	ck_assert(strncmp(buff, "From from@smtpd.com  ", 21) == 0);
+	return strchr(buff, '\n') + 1;
+}
+
+START_TEST(test_segment_commit)
+{
+	ck_assert(store_init("segment"));
+	ck_assert_str_eq("segment", store_get()->name);
+
+	char first[] = "a@smtpd.com,b@smtpd.com";
+	char second[] = "c@smtpd.com";
+	ck_assert(deliver(first, "Subject: uno\r\n\r\nhola\r\n"));
+	ck_assert(deliver(second, "Subject: dos\r\n\r\nchau\r\n"));
+
+	struct segment_index_entry entries[8];
+	ck_assert_uint_eq(3, read_index(entries, 8));
+
+	// los destinatarios de un mail comparten el mensaje, en el orden del RCPT TO
+	ck_assert_str_eq("a@smtpd.com", entries[0].mailbox);
+	ck_assert_str_eq("b@smtpd.com", entries[1].mailbox);
+	ck_assert_uint_eq(entries[0].offset, entries[1].offset);
+	ck_assert_uint_eq(0, entries[0].offset);
+	ck_assert_str_eq("Subject: uno\r\n\r\nhola\r\n", read_message(entries));
+
+	ck_assert_str_eq("c@smtpd.com", entries[2].mailbox);
+	ck_assert_uint_eq(entries[0].offset + entries[0].length, entries[2].offset);
+	ck_assert_uint_eq(SEGMENT_FLAG_NEW, entries[2].flags);
+	ck_assert_str_eq("Subject: dos\r\n\r\nchau\r\n", read_message(entries + 2));
+}
+END_TEST
+
+START_TEST(test_segment_recovery)
+{
+	ck_assert(store_init("segment"));
+	char first[] = "a@smtpd.com";
+	ck_assert(deliver(first, "uno\r\n"));
+
+	// una entrada a medio escribir al final del índice
+	const int fd = open(SEGMENT_STORE_DIR "/index", O_WRONLY | O_APPEND);
+	ck_assert_int_eq(10, write(fd, "0123456789", 10));
+	close(fd);
+
+	ck_assert(store_init("segment"));
+	char second[] = "b@smtpd.com";
+	ck_assert(deliver(second, "dos\r\n"));
+
+	struct segment_index_entry entries[8];
+	ck_assert_uint_eq(2, read_index(entries, 8));
+	ck_assert_str_eq("b@smtpd.com", entries[1].mailbox);
+	ck_assert_uint_eq(entries[0].offset + entries[0].length, entries[1].offset);
+	ck_assert_str_eq("uno\r\n", read_message(entries));
+	ck_assert_str_eq("dos\r\n", read_message(entries + 1));
+}
+END_TEST
+
+START_TEST(test_segment_compressed)
+{
+	ck_assert(store_set_compression(COMPRESS_ZLIB, 9));
+	ck_assert(store_init("segment"));
+	char rcpts[] = "a@smtpd.com";
+	ck_assert(deliver(rcpts, "Subject: uno\r\n\r\nhola hola hola hola hola hola hola\r\n"));
+	ck_assert(store_set_compression(COMPRESS_NONE, 0));
+
+	// el header, y la línea "From " va dentro de lo comprimido
+	struct segment_index_entry e;
+	ck_assert_uint_eq(1, read_index(&e, 1));
+	ck_assert_uint_eq(e.length, last_stored);
+
+	uint8_t header[COMPRESS_HEADER_LENGTH];
+	const int fd = open(SEGMENT_STORE_DIR "/segment.000000", O_RDONLY);
+	ck_assert_int_eq(sizeof(header), pread(fd, header, sizeof(header), e.offset));
+	close(fd);
+
+	enum compress_format format;
+	int level;
+	ck_assert(compress_header_parse(header, sizeof(header), &format, &level));
+	ck_assert_int_eq(COMPRESS_ZLIB, format);
+	ck_assert_int_eq(9, level);
+}
+END_TEST
+
+START_TEST(test_dedup_links)
+{
+	ck_assert(store_init("dedup"));
+
+	char first[] = "a@smtpd.com,b@smtpd.com";
+	char second[] = "c@smtpd.com";
+	char third[] = "a@smtpd.com";
+	ck_assert(deliver(first, "Subject: masivo\r\n\r\nhola\r\n"));
+	ck_assert(deliver(second, "Subject: masivo\r\n\r\nhola\r\n"));
+	ck_assert(deliver(third, "Subject: otro\r\n\r\nhola\r\n"));
+
+	// dos cuerpos distintos, y el primero con tres links además del blob
+	unsigned blobs = 0, links = 0;
+	DIR* blobs_dir = opendir("mails/.blobs");
+	ck_assert_ptr_ne(NULL, blobs_dir);
+	struct dirent* e;
+	while ((e = readdir(blobs_dir)) != NULL) {
+		if (e->d_name[0] != '.') {
+			char path[300];
+			snprintf(path, sizeof(path), "mails/.blobs/%s", e->d_name);
+			struct stat st;
+			ck_assert_int_eq(0, stat(path, &st));
+			blobs++;
+			links += st.st_nlink - 1;
+		}
+	}
+	closedir(blobs_dir);
+	ck_assert_uint_eq(2, blobs);
+	ck_assert_uint_eq(4, links);
+
+	// la tabla se reconstruye desde el directorio
+	ck_assert(store_init("dedup"));
+	char fourth[] = "d@smtpd.com";
+	ck_assert(deliver(fourth, "Subject: otro\r\n\r\nhola\r\n"));
+	ck_assert_uint_eq(0, last_stored);
+}
+END_TEST
+
+Suite*
+suite(void)
+{
+	Suite* s = suite_create("store");
+	TCase* tc = tcase_create("segment");
+
+	tcase_add_checked_fixture(tc, setup, teardown);
+	tcase_add_test(tc, test_segment_commit);
+	tcase_add_test(tc, test_segment_recovery);
+	tcase_add_test(tc, test_segment_compressed);
+	suite_add_tcase(s, tc);
+
+	tc = tcase_create("dedup");
+	tcase_add_checked_fixture(tc, setup, teardown);
+	tcase_add_test(tc, test_dedup_links);
+	suite_add_tcase(s, tc);
+
+	return s;
+}
+
+int
+main(void)
+{
+	SRunner* sr = srunner_create(suite());
+	int number_failed;
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
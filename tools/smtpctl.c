@@ -0,0 +1,226 @@
+/**
+ * smtpctl.c - cliente del protocolo binario de supervisión
+ *
+ * Pide en un único datagrama todas las métricas indicadas y las imprime, una
+ * por línea, como "<nombre> <valor>".
+ */
+#include "admin_protocol.h"
+#include "metrics.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RETRIES 3
+
+static void
+usage(const char* progname)
+{
+	fprintf(stderr,
+	        "Usage: %s [OPTION]... [METRIC]...\n"
+	        "\n"
+	        "   -h               Imprime la ayuda y termina.\n"
+	        "   -H <host>        Servidor (por defecto localhost).\n"
+	        "   -P <port>        Puerto de supervision (por defecto 6969).\n"
+	        "   -t <token>       Token de administracion, de 8 caracteres (ver -u de smtpd).\n"
+	        "   -l               Lista las metricas disponibles y termina.\n"
+	        "\n"
+	        "Sin METRIC se piden todos los contadores y gauges. Los histogramas se\n"
+	        "piden como <nombre>:<count|p50|p90|p99|p999|max>.\n"
+	        "\n",
+	        progname);
+	exit(1);
+}
+
+static void
+list_metrics(void)
+{
+	char name[128];
+	for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+		admin_metric_name(ADMIN_METRIC(ADMIN_CLASS_COUNTER, i), name, sizeof(name));
+		printf("%s\n", name);
+	}
+	for (unsigned i = 0; i < METRIC_GAUGES; i++) {
+		admin_metric_name(ADMIN_METRIC(ADMIN_CLASS_GAUGE, i), name, sizeof(name));
+		printf("%s\n", name);
+	}
+	for (unsigned i = 0; i < METRIC_HISTOGRAMS; i++) {
+		for (unsigned st = 0; st < ADMIN_STATS; st++) {
+			admin_metric_name(ADMIN_HISTOGRAM_METRIC(i, st), name, sizeof(name));
+			printf("%s\n", name);
+		}
+	}
+	for (unsigned i = 0; i < ADMIN_CONFIGS; i++) {
+		admin_metric_name(ADMIN_METRIC(ADMIN_CLASS_CONFIG, i), name, sizeof(name));
+		printf("%s\n", name);
+	}
+}
+
+static int
+connect_to(const char* host, const char* port)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_DGRAM,
+	};
+	struct addrinfo* res;
+
+	const int err = getaddrinfo(host, port, &hints, &res);
+	if (err != 0) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo* ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd == -1) {
+		perror("unable to connect");
+	}
+	return fd;
+}
+
+int
+main(int argc, char** argv)
+{
+	const char* host = "localhost";
+	const char* port = "6969";
+	const char* token = "secretpa";
+
+	int c;
+	while ((c = getopt(argc, argv, "hH:P:t:l")) != -1) {
+		switch (c) {
+			case 'H':
+				host = optarg;
+				break;
+			case 'P':
+				port = optarg;
+				break;
+			case 't':
+				// el mismo límite que -u de smtpd: no se trunca
+				if (strlen(optarg) != ADMIN_TOKEN_SIZE) {
+					fprintf(stderr, "token should have %d characters\n", ADMIN_TOKEN_SIZE);
+					return 1;
+				}
+				token = optarg;
+				break;
+			case 'l':
+				list_metrics();
+				return 0;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	struct admin_request req;
+	memset(&req, 0, sizeof(req));
+	req.version = ADMIN_VERSION;
+	memcpy(req.token, token, ADMIN_TOKEN_SIZE);
+
+	srand(time(NULL) ^ getpid());
+	req.id = (uint32_t)rand();
+
+	if (optind == argc) {
+		for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+			req.metrics[req.count++] = ADMIN_METRIC(ADMIN_CLASS_COUNTER, i);
+		}
+		for (unsigned i = 0; i < METRIC_GAUGES && req.count < ADMIN_MAX_METRICS; i++) {
+			req.metrics[req.count++] = ADMIN_METRIC(ADMIN_CLASS_GAUGE, i);
+		}
+	} else {
+		if (argc - optind > ADMIN_MAX_METRICS) {
+			fprintf(stderr, "at most %d metrics per request\n", ADMIN_MAX_METRICS);
+			return 1;
+		}
+		for (int i = optind; i < argc; i++) {
+			if (!admin_metric_id(argv[i], &req.metrics[req.count++])) {
+				fprintf(stderr, "unknown metric: %s\n", argv[i]);
+				return 1;
+			}
+		}
+	}
+
+	uint8_t out[ADMIN_REQUEST_MAX], in[ADMIN_RESPONSE_MAX];
+	const size_t out_len = admin_request_build(&req, out, sizeof(out));
+
+	const int fd = connect_to(host, port);
+	if (fd == -1) {
+		return 1;
+	}
+
+	struct timeval timeout = { .tv_sec = 1 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	struct admin_response res;
+	bool answered = false;
+	for (unsigned attempt = 0; attempt < RETRIES && !answered; attempt++) {
+		if (send(fd, out, out_len, 0) < 0) {
+			perror("send");
+			return 1;
+		}
+
+		ssize_t n;
+		while ((n = recv(fd, in, sizeof(in), 0)) >= 0) {
+			// descartamos respuestas de pedidos anteriores
+			if (admin_response_parse(in, n, &res) && res.id == req.id) {
+				answered = true;
+				break;
+			}
+		}
+	}
+	close(fd);
+
+	if (!answered) {
+		fprintf(stderr, "no response from %s:%s\n", host, port);
+		return 1;
+	}
+
+	switch (res.status) {
+		case ADMIN_OK:
+			break;
+		case ADMIN_AUTH_FAILED:
+			fprintf(stderr, "authentication failed\n");
+			return 1;
+		case ADMIN_BAD_VERSION:
+			fprintf(stderr, "server does not support protocol version %d\n", ADMIN_VERSION);
+			return 1;
+		default:
+			fprintf(stderr, "request rejected (status %d)\n", res.status);
+			return 1;
+	}
+
+	char name[128];
+	for (unsigned i = 0; i < res.count; i++) {
+		if (!admin_metric_name(res.values[i].metric, name, sizeof(name))) {
+			snprintf(name, sizeof(name), "0x%04x", res.values[i].metric);
+		}
+		if (res.values[i].status != ADMIN_OK) {
+			printf("%s unknown\n", name);
+		} else if ((res.values[i].metric >> 8) == ADMIN_CLASS_GAUGE) {
+			printf("%s %lld\n", name, (long long)(int64_t)res.values[i].value);
+		} else {
+			printf("%s %llu\n", name, (unsigned long long)res.values[i].value);
+		}
+	}
+
+	return 0;
+}
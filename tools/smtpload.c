@@ -0,0 +1,697 @@
+/**
+ * smtpload.c - generador de carga SMTP
+ *
+ * Abre N conexiones concurrentes repartidas entre varios hilos, y en cada una
+ * hace M transacciones (MAIL FROM, RCPT TO, DATA) con la cantidad de
+ * destinatarios y el tamaño de cuerpo pedidos, y al final un QUIT. Con -P
+ * manda MAIL FROM, los RCPT TO y el DATA juntos (PIPELINING, RFC 2920).
+ *
+ * Cada hilo tiene su propio selector y sus propios histogramas, que se
+ * juntan al terminar. Como el selector usa select(2), un hilo maneja a lo
+ * sumo FD_SETSIZE conexiones: para más, usar más hilos.
+ *
+ * Una conexión que no recibe ni manda nada durante -T segundos se cierra y
+ * se cuenta como timeout (por ejemplo, si el servidor descartó la conexión
+ * con su cola de accept llena y el cliente quedó esperando el saludo).
+ *
+ * Reporta conexiones, mails y bytes por segundo, y los percentiles de la
+ * latencia de cada fase (desde que se terminó de mandar el comando hasta que
+ * llegó su respuesta), como texto o como JSON.
+ */
+#define _GNU_SOURCE
+#include "buffer.h"
+#include "histogram.h"
+#include "selector.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_BUFFER_SIZE 4096
+#define LINE_SIZE        320
+
+/** respuesta que espera una conexión */
+enum phase
+{
+	PHASE_CONNECT,
+	PHASE_GREETING,
+	PHASE_EHLO,
+	PHASE_MAIL,
+	PHASE_RCPT,
+	PHASE_DATA,
+	PHASE_BODY,
+	PHASE_QUIT,
+	PHASES,
+};
+
+static const char* phase_names[PHASES] = {
+	"connect", "greeting", "ehlo", "mail", "rcpt", "data", "body", "quit",
+};
+
+/** código de respuesta esperado en cada fase */
+static const int phase_codes[PHASES] = { 0, 220, 250, 250, 250, 354, 250, 221 };
+
+struct options
+{
+	const char* host;
+	const char* port;
+	unsigned connections;
+	unsigned transactions;
+	unsigned rcpts;
+	size_t body_size;
+	unsigned threads;
+	bool pipelining;
+	bool json;
+	const char* domain;
+	unsigned timeout;
+};
+
+static struct options opts;
+
+static struct addrinfo* addr;
+
+/** el cuerpo, con el terminador, compartido por todas las conexiones */
+static uint8_t* body;
+static size_t body_length;
+
+struct stats
+{
+	uint64_t connections;
+	uint64_t messages;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t timeouts;
+	struct histogram phases[PHASES];
+};
+
+struct worker
+{
+	pthread_t thread;
+	fd_selector selector;
+	unsigned first, count;
+	unsigned active;
+	/** conexiones abiertas, por `id - first'; para los timeouts */
+	struct conn** conns;
+	uint64_t checked_at;
+	struct stats stats;
+};
+
+struct conn
+{
+	struct worker* w;
+	unsigned id;
+	int fd;
+	/** último evento de la conexión */
+	uint64_t active_at;
+	enum phase phase;
+	/** transacciones terminadas y destinatario cuya respuesta se espera */
+	unsigned transactions;
+	unsigned rcpt;
+	/** cuándo se terminó de mandar lo último; de ahí se miden las respuestas */
+	uint64_t sent_at;
+	bool finished;
+	/** bytes del cuerpo por mandar, a partir de `body_sent' */
+	bool sending_body;
+	size_t body_sent;
+	buffer rb, wb;
+	uint8_t* rdata;
+	uint8_t* wdata;
+};
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void
+usage(const char* progname)
+{
+	fprintf(stderr,
+	        "Usage: %s [OPTION]...\n"
+	        "\n"
+	        "   -h               Imprime la ayuda y termina.\n"
+	        "   -H <host>        Servidor (por defecto localhost).\n"
+	        "   -p <port>        Puerto SMTP (por defecto 1209).\n"
+	        "   -c <n>           Conexiones concurrentes (10).\n"
+	        "   -m <n>           Transacciones por conexion (10).\n"
+	        "   -r <n>           Destinatarios por mail (1).\n"
+	        "   -s <bytes>       Tamaño del cuerpo de cada mail (1024).\n"
+	        "   -t <n>           Hilos (1).\n"
+	        "   -d <domain>      Dominio de los destinatarios (smtpd.com).\n"
+	        "   -P               Manda MAIL FROM, RCPT TO y DATA juntos (PIPELINING).\n"
+	        "   -T <s>           Segundos sin actividad para abandonar una conexion (10).\n"
+	        "   -j               Imprime el resultado como JSON.\n"
+	        "\n",
+	        progname);
+	exit(1);
+}
+
+static unsigned
+number(const char* s, const unsigned min)
+{
+	char* end;
+	errno = 0;
+	const unsigned long n = strtoul(s, &end, 10);
+	if (end == s || *end != '\0' || errno == ERANGE || n < min || n > UINT32_MAX) {
+		fprintf(stderr, "expected a number >= %u: %s\n", min, s);
+		exit(1);
+	}
+	return n;
+}
+
+/**
+ * líneas de 'x' de hasta 80 bytes con su CRLF, y el terminador. El cuerpo
+ * tiene al menos un CRLF, así que `size' se lleva a 2 como mínimo.
+ */
+static void
+build_body(size_t size)
+{
+	size = size < 2 ? 2 : size;
+	body_length = size + 3;
+	body = malloc(body_length);
+	if (body == NULL) {
+		perror("malloc");
+		exit(1);
+	}
+	for (size_t pos = 0; pos < size;) {
+		size_t line = size - pos < 80 ? size - pos : 80;
+		// que no quede un último byte suelto
+		if (size - pos - line == 1) {
+			line--;
+		}
+		memset(body + pos, 'x', line - 2);
+		memcpy(body + pos + line - 2, "\r\n", 2);
+		pos += line;
+	}
+	memcpy(body + size, ".\r\n", 3);
+}
+
+/** agrega un comando a lo que hay que mandar */
+static void
+queue(struct conn* c, const char* fmt, ...)
+{
+	size_t n;
+	char* ptr = (char*)buffer_write_ptr(&c->wb, &n);
+	va_list ap;
+	va_start(ap, fmt);
+	const int len = vsnprintf(ptr, n, fmt, ap);
+	va_end(ap);
+	if (len > 0 && (size_t)len < n) {
+		buffer_write_adv(&c->wb, len);
+	}
+}
+
+static void
+queue_rcpt(struct conn* c, const unsigned i)
+{
+	queue(c, "RCPT TO:<load%u@%s>\r\n", i, opts.domain);
+}
+
+static void
+start_transaction(struct conn* c)
+{
+	queue(c, "MAIL FROM:<smtpload@smtpload.test>\r\n");
+	if (opts.pipelining) {
+		for (unsigned i = 0; i < opts.rcpts; i++) {
+			queue_rcpt(c, i);
+		}
+		queue(c, "DATA\r\n");
+	}
+	c->phase = PHASE_MAIL;
+	c->rcpt = 0;
+}
+
+/** procesa una respuesta a la fase actual. Retorna false si no era la esperada */
+static bool
+reply(struct conn* c, const int code)
+{
+	const uint64_t t = now();
+	struct stats* stats = &c->w->stats;
+	if (code != phase_codes[c->phase] && !(c->phase == PHASE_RCPT && code == 251)) {
+		return false;
+	}
+	histogram_record(&stats->phases[c->phase], t - c->sent_at);
+
+	switch (c->phase) {
+		case PHASE_GREETING:
+			queue(c, "EHLO smtpload\r\n");
+			c->phase = PHASE_EHLO;
+			break;
+		case PHASE_EHLO:
+			start_transaction(c);
+			break;
+		case PHASE_MAIL:
+			if (!opts.pipelining) {
+				queue_rcpt(c, 0);
+			}
+			c->phase = PHASE_RCPT;
+			break;
+		case PHASE_RCPT:
+			if (++c->rcpt < opts.rcpts) {
+				if (!opts.pipelining) {
+					queue_rcpt(c, c->rcpt);
+				}
+			} else {
+				if (!opts.pipelining) {
+					queue(c, "DATA\r\n");
+				}
+				c->phase = PHASE_DATA;
+			}
+			break;
+		case PHASE_DATA:
+			c->sending_body = true;
+			c->body_sent = 0;
+			c->phase = PHASE_BODY;
+			break;
+		case PHASE_BODY:
+			stats->messages++;
+			stats->bytes += body_length;
+			if (++c->transactions < opts.transactions) {
+				start_transaction(c);
+			} else {
+				queue(c, "QUIT\r\n");
+				c->phase = PHASE_QUIT;
+			}
+			break;
+		case PHASE_QUIT:
+			stats->connections++;
+			c->finished = true;
+			break;
+		default:
+			return false;
+	}
+	return true;
+}
+
+static void
+conn_done(struct selector_key* key, const bool ok)
+{
+	struct conn* c = key->data;
+	if (!ok) {
+		c->w->stats.errors++;
+	}
+	selector_unregister_fd(key->s, key->fd);
+}
+
+/** manda lo pendiente y ajusta el interés */
+static void
+conn_flush(struct selector_key* key)
+{
+	struct conn* c = key->data;
+	size_t n;
+	uint8_t* ptr;
+
+	while ((ptr = buffer_read_ptr(&c->wb, &n)), n > 0) {
+		const ssize_t sent = send(key->fd, ptr, n, MSG_NOSIGNAL);
+		if (sent <= 0) {
+			goto wait;
+		}
+		buffer_read_adv(&c->wb, sent);
+	}
+	buffer_reset(&c->wb);
+	while (c->sending_body) {
+		const ssize_t sent = send(key->fd, body + c->body_sent, body_length - c->body_sent, MSG_NOSIGNAL);
+		if (sent <= 0) {
+			goto wait;
+		}
+		c->body_sent += sent;
+		if (c->body_sent == body_length) {
+			c->sending_body = false;
+		}
+	}
+	// todo mandado: desde acá se miden las respuestas. En pipelining las del
+	// grupo se miden todas desde que se mandó el grupo completo
+	c->sent_at = now();
+	selector_set_interest_key(key, OP_READ);
+	return;
+
+wait:
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		conn_done(key, false);
+		return;
+	}
+	selector_set_interest_key(key, OP_READ | OP_WRITE);
+}
+
+static void
+conn_read(struct selector_key* key)
+{
+	struct conn* c = key->data;
+	size_t n;
+	uint8_t* ptr = buffer_write_ptr(&c->rb, &n);
+	const ssize_t count = recv(key->fd, ptr, n, 0);
+	c->active_at = now();
+	if (count <= 0) {
+		conn_done(key, false);
+		return;
+	}
+	buffer_write_adv(&c->rb, count);
+
+	const bool was_waiting = buffer_can_read(&c->wb) || c->sending_body;
+	uint8_t* line;
+	uint8_t* end;
+	while ((line = buffer_read_ptr(&c->rb, &n)), (end = memchr(line, '\n', n)) != NULL) {
+		const size_t len = end + 1 - line;
+		// las líneas "250-..." son parte de una respuesta de varias líneas
+		if (len >= 4 && line[3] != '-') {
+			const int code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+			if (!reply(c, code)) {
+				conn_done(key, false);
+				return;
+			}
+			if (c->finished) {
+				conn_done(key, true);
+				return;
+			}
+		}
+		buffer_read_adv(&c->rb, len);
+	}
+	buffer_compact(&c->rb);
+	if (!buffer_can_write(&c->rb)) {
+		fprintf(stderr, "reply line too long\n");
+		conn_done(key, false);
+		return;
+	}
+	if (!was_waiting && (buffer_can_read(&c->wb) || c->sending_body)) {
+		conn_flush(key);
+	}
+}
+
+static void
+conn_write(struct selector_key* key)
+{
+	struct conn* c = key->data;
+	c->active_at = now();
+	if (c->phase == PHASE_CONNECT) {
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if (getsockopt(key->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+			conn_done(key, false);
+			return;
+		}
+		const uint64_t t = now();
+		histogram_record(&c->w->stats.phases[PHASE_CONNECT], t - c->sent_at);
+		c->sent_at = t;
+		c->phase = PHASE_GREETING;
+		selector_set_interest_key(key, OP_READ);
+		return;
+	}
+	conn_flush(key);
+}
+
+static void
+conn_close(struct selector_key* key)
+{
+	struct conn* c = key->data;
+	close(key->fd);
+	c->w->active--;
+	c->w->conns[c->id - c->w->first] = NULL;
+	free(c->rdata);
+	free(c->wdata);
+	free(c);
+}
+
+static const struct fd_handler conn_handler = {
+	.handle_read = conn_read,
+	.handle_write = conn_write,
+	.handle_close = conn_close,
+};
+
+static bool
+conn_open(struct worker* w, const unsigned id)
+{
+	struct conn* c = calloc(1, sizeof(*c));
+	const size_t wsize = (opts.pipelining ? opts.rcpts + 3 : 3) * LINE_SIZE;
+	if (c == NULL || (c->rdata = malloc(READ_BUFFER_SIZE)) == NULL || (c->wdata = malloc(wsize)) == NULL) {
+		goto fail;
+	}
+	buffer_init(&c->rb, READ_BUFFER_SIZE, c->rdata);
+	buffer_init(&c->wb, wsize, c->wdata);
+	c->w = w;
+	c->id = id;
+	c->phase = PHASE_CONNECT;
+
+	const int fd = socket(addr->ai_family, SOCK_STREAM, 0);
+	if (fd == -1) {
+		goto fail;
+	}
+	if (selector_fd_set_nio(fd) == -1 || (connect(fd, addr->ai_addr, addr->ai_addrlen) == -1 && errno != EINPROGRESS)) {
+		close(fd);
+		goto fail;
+	}
+	c->fd = fd;
+	c->sent_at = c->active_at = now();
+	if (selector_register(w->selector, fd, &conn_handler, OP_WRITE, c) != SELECTOR_SUCCESS) {
+		close(fd);
+		goto fail;
+	}
+	w->conns[id - w->first] = c;
+	w->active++;
+	return true;
+
+fail:
+	if (c != NULL) {
+		free(c->rdata);
+		free(c->wdata);
+		free(c);
+	}
+	w->stats.errors++;
+	return false;
+}
+
+/** cierra las conexiones inactivas; se revisa a lo sumo una vez por segundo */
+static void
+worker_expire(struct worker* w)
+{
+	const uint64_t t = now();
+	if (t - w->checked_at < 1000000000ULL) {
+		return;
+	}
+	w->checked_at = t;
+	for (unsigned i = 0; i < w->count; i++) {
+		struct conn* c = w->conns[i];
+		if (c != NULL && t - c->active_at > opts.timeout * 1000000000ULL) {
+			w->stats.errors++;
+			w->stats.timeouts++;
+			selector_unregister_fd(w->selector, c->fd);
+		}
+	}
+}
+
+static void*
+worker_run(void* arg)
+{
+	struct worker* w = arg;
+	w->checked_at = now();
+	for (unsigned i = 0; i < w->count; i++) {
+		conn_open(w, w->first + i);
+	}
+	while (w->active > 0) {
+		if (selector_select(w->selector) != SELECTOR_SUCCESS && errno != EINTR) {
+			perror("selector_select");
+			break;
+		}
+		worker_expire(w);
+	}
+	return NULL;
+}
+
+static void
+report(const struct stats* total, const double elapsed)
+{
+	const uint64_t q[] = { 50, 99, 999 };
+	const double qs[] = { 0.5, 0.99, 0.999 };
+
+	if (opts.json) {
+		printf("{\"connections\":%llu,\"connections_per_s\":%.1f,\"messages\":%llu,\"messages_per_s\":%.1f,"
+		       "\"bytes\":%llu,\"bytes_per_s\":%.1f,\"errors\":%llu,\"timeouts\":%llu,\"elapsed_s\":%.3f,\"pipelining\":%s,"
+		       "\"phases\":{",
+		       (unsigned long long)total->connections,
+		       total->connections / elapsed,
+		       (unsigned long long)total->messages,
+		       total->messages / elapsed,
+		       (unsigned long long)total->bytes,
+		       total->bytes / elapsed,
+		       (unsigned long long)total->errors,
+		       (unsigned long long)total->timeouts,
+		       elapsed,
+		       opts.pipelining ? "true" : "false");
+		for (unsigned i = 0; i < PHASES; i++) {
+			const struct histogram* h = &total->phases[i];
+			printf("%s\"%s\":{\"count\":%llu", i == 0 ? "" : ",", phase_names[i], (unsigned long long)h->count);
+			for (unsigned j = 0; j < 3; j++) {
+				printf(",\"p%llu_us\":%.1f", (unsigned long long)q[j], histogram_quantile(h, qs[j]) / 1000.0);
+			}
+			printf("}");
+		}
+		printf("}}\n");
+		return;
+	}
+
+	printf("connections  %10llu  %12.1f/s\n", (unsigned long long)total->connections, total->connections / elapsed);
+	printf("messages     %10llu  %12.1f/s\n", (unsigned long long)total->messages, total->messages / elapsed);
+	printf("bytes        %10llu  %12.1f/s\n", (unsigned long long)total->bytes, total->bytes / elapsed);
+	printf("errors       %10llu  (%llu timeouts)\n",
+	       (unsigned long long)total->errors,
+	       (unsigned long long)total->timeouts);
+	printf("elapsed      %10.3f s\n\n", elapsed);
+	printf("%-10s %10s %12s %12s %12s\n", "phase", "count", "p50 (us)", "p99 (us)", "p999 (us)");
+	for (unsigned i = 0; i < PHASES; i++) {
+		const struct histogram* h = &total->phases[i];
+		printf("%-10s %10llu %12.1f %12.1f %12.1f\n",
+		       phase_names[i],
+		       (unsigned long long)h->count,
+		       histogram_quantile(h, 0.5) / 1000.0,
+		       histogram_quantile(h, 0.99) / 1000.0,
+		       histogram_quantile(h, 0.999) / 1000.0);
+	}
+}
+
+int
+main(int argc, char** argv)
+{
+	opts = (struct options){
+		.host = "localhost",
+		.port = "1209",
+		.connections = 10,
+		.transactions = 10,
+		.rcpts = 1,
+		.body_size = 1024,
+		.threads = 1,
+		.domain = "smtpd.com",
+		.timeout = 10,
+	};
+
+	int c;
+	while ((c = getopt(argc, argv, "hH:p:c:m:r:s:t:d:T:Pj")) != -1) {
+		switch (c) {
+			case 'H':
+				opts.host = optarg;
+				break;
+			case 'p':
+				opts.port = optarg;
+				break;
+			case 'c':
+				opts.connections = number(optarg, 1);
+				break;
+			case 'm':
+				opts.transactions = number(optarg, 1);
+				break;
+			case 'r':
+				opts.rcpts = number(optarg, 1);
+				break;
+			case 's':
+				opts.body_size = number(optarg, 0);
+				break;
+			case 't':
+				opts.threads = number(optarg, 1);
+				break;
+			case 'd':
+				opts.domain = optarg;
+				break;
+			case 'T':
+				opts.timeout = number(optarg, 1);
+				break;
+			case 'P':
+				opts.pipelining = true;
+				break;
+			case 'j':
+				opts.json = true;
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (opts.threads > opts.connections) {
+		opts.threads = opts.connections;
+	}
+	if ((opts.connections + opts.threads - 1) / opts.threads > FD_SETSIZE - 16) {
+		fprintf(stderr, "at most %d connections per thread, use more threads (-t)\n", FD_SETSIZE - 16);
+		return 1;
+	}
+
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	const int err = getaddrinfo(opts.host, opts.port, &hints, &addr);
+	if (err != 0) {
+		fprintf(stderr, "%s: %s\n", opts.host, gai_strerror(err));
+		return 1;
+	}
+	build_body(opts.body_size);
+
+	const struct selector_init conf = {
+		.signal = SIGALRM,
+		.select_timeout = { .tv_sec = 1 },
+	};
+	if (selector_init(&conf) != SELECTOR_SUCCESS) {
+		perror("selector_init");
+		return 1;
+	}
+
+	struct worker* workers = calloc(opts.threads, sizeof(*workers));
+	if (workers == NULL) {
+		perror("calloc");
+		return 1;
+	}
+	const uint64_t start = now();
+	for (unsigned i = 0, first = 0; i < opts.threads; i++) {
+		struct worker* w = workers + i;
+		w->first = first;
+		w->count = opts.connections / opts.threads + (i < opts.connections % opts.threads);
+		first += w->count;
+		for (unsigned p = 0; p < PHASES; p++) {
+			histogram_reset(&w->stats.phases[p]);
+		}
+		w->selector = selector_new(w->count + 16);
+		w->conns = calloc(w->count, sizeof(*w->conns));
+		if (w->selector == NULL || w->conns == NULL || pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+			perror("unable to start worker");
+			return 1;
+		}
+	}
+
+	struct stats total;
+	memset(&total, 0, sizeof(total));
+	for (unsigned p = 0; p < PHASES; p++) {
+		histogram_reset(&total.phases[p]);
+	}
+	for (unsigned i = 0; i < opts.threads; i++) {
+		struct worker* w = workers + i;
+		pthread_join(w->thread, NULL);
+		total.connections += w->stats.connections;
+		total.messages += w->stats.messages;
+		total.bytes += w->stats.bytes;
+		total.errors += w->stats.errors;
+		total.timeouts += w->stats.timeouts;
+		for (unsigned p = 0; p < PHASES; p++) {
+			histogram_merge(&total.phases[p], &w->stats.phases[p]);
+		}
+		selector_destroy(w->selector);
+		free(w->conns);
+	}
+	const double elapsed = (now() - start) / 1e9;
+
+	report(&total, elapsed);
+
+	selector_close();
+	freeaddrinfo(addr);
+	free(workers);
+	free(body);
+	return total.errors == 0 ? 0 : 2;
+}
@@ -0,0 +1,124 @@
+/**
+ * smtpstat.c - lee las métricas que publica smtpd en memoria compartida
+ *
+ * No habla con el servidor: mapea el segmento en modo lectura y lo imprime,
+ * por lo que se puede consultar con alta frecuencia sin costo para smtpd.
+ */
+#include "shmstats.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static void
+usage(const char* progname)
+{
+	fprintf(stderr,
+	        "Usage: %s [OPTION]...\n"
+	        "\n"
+	        "   -h               Imprime la ayuda y termina.\n"
+	        "   -n <name>        Nombre del segmento (por defecto " SHMSTATS_NAME_FMT ").\n"
+	        "   -p <SMTP port>   Puerto SMTP del servidor a consultar (por defecto 1209).\n"
+	        "   -i <ms>          Intervalo entre lecturas. Sin intervalo se lee una vez.\n"
+	        "   -c <count>       Cantidad de lecturas (por defecto infinitas si hay intervalo).\n"
+	        "\n",
+	        progname,
+	        1209u);
+	exit(1);
+}
+
+static long
+number(const char* s)
+{
+	char* end = 0;
+	const long n = strtol(s, &end, 10);
+	if (end == s || *end != '\0' || n < 0 || ((n == LONG_MAX) && errno == ERANGE)) {
+		fprintf(stderr, "invalid number: %s\n", s);
+		exit(1);
+	}
+	return n;
+}
+
+static void
+print(const struct shmstats* s)
+{
+	printf("pid %u\n", s->pid);
+	printf("published_at %llu\n", (unsigned long long)s->published_at);
+	for (unsigned i = 0; i < METRIC_COUNTERS; i++) {
+		printf("counter %s %llu\n", metrics_counter_name(i), (unsigned long long)s->counters[i]);
+	}
+	for (unsigned i = 0; i < METRIC_GAUGES; i++) {
+		printf("gauge %s %lld\n", metrics_gauge_name(i), (long long)s->gauges[i]);
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+int
+main(int argc, char** argv)
+{
+	char name[64];
+	long interval = 0, count = -1;
+	unsigned port = 1209;
+	const char* custom_name = NULL;
+
+	int c;
+	while ((c = getopt(argc, argv, "hn:p:i:c:")) != -1) {
+		switch (c) {
+			case 'n':
+				custom_name = optarg;
+				break;
+			case 'p':
+				port = number(optarg);
+				break;
+			case 'i':
+				interval = number(optarg);
+				break;
+			case 'c':
+				count = number(optarg);
+				break;
+			case 'h':
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (custom_name != NULL) {
+		snprintf(name, sizeof(name), "%s", custom_name);
+	} else {
+		snprintf(name, sizeof(name), SHMSTATS_NAME_FMT, port);
+	}
+
+	const struct shmstats* shm = shmstats_attach(name);
+	if (shm == NULL) {
+		fprintf(stderr, "unable to attach to %s: %s\n", name, errno ? strerror(errno) : "incompatible layout");
+		return 1;
+	}
+
+	if (interval == 0 && count < 0) {
+		count = 1;
+	}
+
+	const struct timespec pause = {
+		.tv_sec = interval / 1000,
+		.tv_nsec = (interval % 1000) * 1000000,
+	};
+
+	struct shmstats snapshot;
+	for (long i = 0; count < 0 || i < count; i++) {
+		if (!shmstats_read(shm, &snapshot)) {
+			fprintf(stderr, "unable to get a consistent snapshot\n");
+			return 1;
+		}
+		print(&snapshot);
+		if (interval > 0) {
+			nanosleep(&pause, NULL);
+		}
+	}
+
+	return 0;
+}